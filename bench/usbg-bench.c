@@ -0,0 +1,938 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/**
+ * @file usbg-bench.c
+ * @brief Benchmark of init, create, import, export and teardown
+ * @details Synthetic tree of N gadgets, each with F functions, C configs
+ * and B bindings in each config, is generated using the in-memory
+ * simulator and optionally copied to a real directory (e.g. on tmpfs).
+ * Each phase prints one JSON object per line with its duration, number
+ * of I/O operations done through the backend and peak RSS of process
+ * together with its growth during the phase. Import of
+ * scheme with bindings by label is measured separately, as it does not
+ * depend on libconfig.
+ */
+
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <usbg/usbg.h>
+
+#define SIM_CONFIGFS "/sys/kernel/config"
+#define BENCH_UDC "bench.udc"
+
+enum io_op {
+	IO_READ_ATTR,
+	IO_WRITE_ATTR,
+	IO_MKDIR,
+	IO_RMDIR,
+	IO_UNLINK,
+	IO_SYMLINK,
+	IO_READLINK,
+	IO_LIST_DIR,
+	IO_CHECK_DIR,
+	IO_OPEN_ATTR,
+	IO_OP_MAX,
+};
+
+static const char *io_op_names[] = {
+	"read_attr",
+	"write_attr",
+	"mkdir",
+	"rmdir",
+	"unlink",
+	"symlink",
+	"readlink",
+	"list_dir",
+	"check_dir",
+	"open_attr",
+};
+
+/* Backend which counts operations and passes them to the real one */
+struct counting_io {
+	const usbg_io_backend *io;
+	void *ctx;
+	uint64_t ops[IO_OP_MAX];
+};
+
+struct bench_params {
+	const char *backend;
+	const char *dir;
+	int gadgets;
+	int functions;
+	int configs;
+	int bindings;
+	int luns;
+	int iterations;
+};
+
+struct bench {
+	struct bench_params p;
+	struct counting_io cnt;
+	usbg_io_backend io;
+	usbg_init_opts opts;
+	usbg_sim *sim;
+	char configfs[PATH_MAX];
+	char sysfs[PATH_MAX];
+	char *scheme;
+	size_t scheme_len;
+};
+
+#define CNT(c) ((struct counting_io *)(c))
+
+static int cnt_read_attr(void *c, const char *path, char *buf, size_t len)
+{
+	CNT(c)->ops[IO_READ_ATTR]++;
+	return CNT(c)->io->read_attr(CNT(c)->ctx, path, buf, len);
+}
+
+static int cnt_write_attr(void *c, const char *path, const char *buf)
+{
+	CNT(c)->ops[IO_WRITE_ATTR]++;
+	return CNT(c)->io->write_attr(CNT(c)->ctx, path, buf);
+}
+
+static int cnt_mkdir(void *c, const char *path, mode_t mode)
+{
+	CNT(c)->ops[IO_MKDIR]++;
+	return CNT(c)->io->mkdir(CNT(c)->ctx, path, mode);
+}
+
+static int cnt_rmdir(void *c, const char *path)
+{
+	CNT(c)->ops[IO_RMDIR]++;
+	return CNT(c)->io->rmdir(CNT(c)->ctx, path);
+}
+
+static int cnt_unlink(void *c, const char *path)
+{
+	CNT(c)->ops[IO_UNLINK]++;
+	return CNT(c)->io->unlink(CNT(c)->ctx, path);
+}
+
+static int cnt_symlink(void *c, const char *target, const char *path)
+{
+	CNT(c)->ops[IO_SYMLINK]++;
+	return CNT(c)->io->symlink(CNT(c)->ctx, target, path);
+}
+
+static ssize_t cnt_readlink(void *c, const char *path, char *buf, size_t len)
+{
+	CNT(c)->ops[IO_READLINK]++;
+	return CNT(c)->io->readlink(CNT(c)->ctx, path, buf, len);
+}
+
+static int cnt_list_dir(void *c, const char *path, struct dirent ***namelist,
+			usbg_dir_filter filter, usbg_dir_compar compar)
+{
+	CNT(c)->ops[IO_LIST_DIR]++;
+	return CNT(c)->io->list_dir(CNT(c)->ctx, path, namelist, filter,
+				    compar);
+}
+
+static int cnt_check_dir(void *c, const char *path)
+{
+	CNT(c)->ops[IO_CHECK_DIR]++;
+	return CNT(c)->io->check_dir(CNT(c)->ctx, path);
+}
+
+static int cnt_open_attr(void *c, const char *path)
+{
+	CNT(c)->ops[IO_OPEN_ATTR]++;
+	return CNT(c)->io->open_attr(CNT(c)->ctx, path);
+}
+
+static void bench_set_backend(struct bench *b, const usbg_io_backend *io,
+			      void *ctx)
+{
+	b->cnt.io = io;
+	b->cnt.ctx = ctx;
+	b->io = (usbg_io_backend) {
+		.read_attr = cnt_read_attr,
+		.write_attr = cnt_write_attr,
+		.mkdir = cnt_mkdir,
+		.rmdir = cnt_rmdir,
+		.unlink = cnt_unlink,
+		.symlink = cnt_symlink,
+		.readlink = cnt_readlink,
+		.list_dir = cnt_list_dir,
+		.check_dir = cnt_check_dir,
+		.open_attr = io->open_attr ? cnt_open_attr : NULL,
+	};
+	b->opts.io = &b->io;
+	b->opts.io_ctx = &b->cnt;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Peak of whole process, it never decreases */
+static long peak_rss_kb(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static void print_header(struct bench *b, const char *phase)
+{
+	printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"gadgets\":%d,"
+	       "\"functions\":%d,\"configs\":%d,\"bindings\":%d,\"luns\":%d",
+	       phase, b->p.backend, b->p.gadgets, b->p.functions,
+	       b->p.configs, b->p.bindings, b->p.luns);
+}
+
+static void report_skip(struct bench *b, const char *phase,
+			const char *reason)
+{
+	print_header(b, phase);
+	printf(",\"skipped\":\"%s\"}\n", reason);
+	fflush(stdout);
+}
+
+static void report(struct bench *b, const char *phase, int iterations,
+		   uint64_t ns, const uint64_t *ops, long start_rss_kb)
+{
+	double sec = ns / 1e9;
+	uint64_t total = 0;
+	long rss_kb = peak_rss_kb();
+	int i;
+
+	print_header(b, phase);
+	printf(",\"iterations\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.2f",
+	       iterations, sec, sec > 0 ? iterations / sec : 0.0);
+
+	printf(",\"io_ops\":{");
+	for (i = 0; i < IO_OP_MAX; ++i) {
+		printf("%s\"%s\":%llu", i ? "," : "", io_op_names[i],
+		       (unsigned long long)ops[i]);
+		total += ops[i];
+	}
+	/* Phases below earlier peak don't raise it and report 0 growth */
+	printf("},\"io_ops_total\":%llu,\"process_peak_rss_kb\":%ld,"
+	       "\"peak_rss_growth_kb\":%ld}\n",
+	       (unsigned long long)total, rss_kb, rss_kb - start_rss_kb);
+	fflush(stdout);
+}
+
+struct phase {
+	uint64_t start;
+	uint64_t ops[IO_OP_MAX];
+	long rss_kb;
+};
+
+static void phase_start(struct bench *b, struct phase *ph)
+{
+	memcpy(ph->ops, b->cnt.ops, sizeof(ph->ops));
+	ph->rss_kb = peak_rss_kb();
+	ph->start = now_ns();
+}
+
+static void phase_end(struct bench *b, struct phase *ph, const char *name,
+		      int iterations)
+{
+	uint64_t ns = now_ns() - ph->start;
+	int i;
+
+	for (i = 0; i < IO_OP_MAX; ++i)
+		ph->ops[i] = b->cnt.ops[i] - ph->ops[i];
+
+	report(b, name, iterations, ns, ph->ops, ph->rss_kb);
+}
+
+static int check(int ret, const char *what)
+{
+	if (ret != USBG_SUCCESS)
+		fprintf(stderr, "%s: %s : %s\n", what, usbg_error_name(ret),
+			usbg_strerror(ret));
+	return ret;
+}
+
+static int create_function(usbg_gadget *g, int idx, int nluns,
+			   usbg_function **f)
+{
+	usbg_f_ms_lun_attrs *luns[nluns > 0 ? nluns : 1];
+	usbg_f_ms_lun_attrs lun_attrs[nluns > 0 ? nluns : 1];
+	char files[nluns > 0 ? nluns : 1][32];
+	usbg_function_attrs f_attrs;
+	char instance[32];
+	int i;
+
+	sprintf(instance, "f%d", idx);
+	switch (idx % 3) {
+	case 0:
+		return usbg_create_function(g, F_ACM, instance, NULL, f);
+	case 1:
+		return usbg_create_function(g, F_ECM, instance, NULL, f);
+	default:
+		break;
+	}
+
+	for (i = 0; i < nluns; ++i) {
+		sprintf(files[i], "/lun%d.img", i);
+		lun_attrs[i] = (usbg_f_ms_lun_attrs) {
+			.id = i,
+			.removable = true,
+			.filename = files[i],
+		};
+		luns[i] = &lun_attrs[i];
+	}
+
+	f_attrs.header.attrs_type = USBG_F_ATTRS_MS;
+	f_attrs.attrs.ms.stall = false;
+	f_attrs.attrs.ms.nluns = nluns;
+	f_attrs.attrs.ms.luns = luns;
+
+	return usbg_create_function(g, F_MASS_STORAGE, instance,
+				    nluns > 0 ? &f_attrs : NULL, f);
+}
+
+static int create_gadget(struct bench *b, usbg_state *s, const char *name,
+			 usbg_gadget **out)
+{
+	usbg_gadget_strs g_strs = {"0", "libusbg", "bench"};
+	usbg_config_strs c_strs = {"bench"};
+	usbg_function *funcs[b->p.functions > 0 ? b->p.functions : 1];
+	usbg_gadget *g;
+	usbg_config *c;
+	char bname[32];
+	int i, j, ret;
+
+	ret = usbg_create_gadget_vid_pid(s, name, 0x1d6b, 0x0104, &g);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_set_gadget_strs(g, LANG_US_ENG, &g_strs);
+	if (check(ret, "create gadget"))
+		return ret;
+
+	for (i = 0; i < b->p.functions; ++i) {
+		ret = create_function(g, i, b->p.luns, &funcs[i]);
+		if (check(ret, "create function"))
+			return ret;
+	}
+
+	for (i = 0; i < b->p.configs; ++i) {
+		ret = usbg_create_config(g, i + 1, "c", NULL, &c_strs, &c);
+		if (check(ret, "create config"))
+			return ret;
+
+		for (j = 0; j < b->p.bindings && j < b->p.functions; ++j) {
+			sprintf(bname, "b%d", j);
+			ret = usbg_add_config_function(c, bname, funcs[j]);
+			if (check(ret, "add binding"))
+				return ret;
+		}
+	}
+
+	*out = g;
+	return USBG_SUCCESS;
+}
+
+static int generate_tree(struct bench *b)
+{
+	usbg_state *s;
+	usbg_gadget *g;
+	char name[32];
+	int i, ret;
+
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &b->opts, &s);
+	if (check(ret, "init"))
+		return ret;
+
+	for (i = 0; i < b->p.gadgets && ret == USBG_SUCCESS; ++i) {
+		sprintf(name, "g%d", i);
+		ret = create_gadget(b, s, name, &g);
+	}
+
+	usbg_cleanup(s);
+	return ret;
+}
+
+/*
+ * Copy simulated tree to real directory. Attributes are single line
+ * so reading only the first line of each one is enough.
+ */
+static int copy_tree(struct bench *b, const char *src, const char *dst)
+{
+	const usbg_io_backend *io = b->cnt.io;
+	void *ctx = b->cnt.ctx;
+	struct dirent **dent;
+	char spath[PATH_MAX], dpath[PATH_MAX];
+	char buf[PATH_MAX];
+	size_t prefix = strlen(SIM_CONFIGFS);
+	ssize_t len;
+	FILE *fp;
+	int i, n, ret = 0;
+
+	n = io->list_dir(ctx, src, &dent, NULL, NULL);
+	if (n < 0)
+		return n;
+
+	for (i = 0; i < n; ++i) {
+		const char *name = dent[i]->d_name;
+
+		if (ret || !strcmp(name, ".") || !strcmp(name, ".."))
+			goto next;
+
+		snprintf(spath, sizeof(spath), "%s/%s", src, name);
+		snprintf(dpath, sizeof(dpath), "%s/%s", dst, name);
+
+		switch (dent[i]->d_type) {
+		case DT_DIR:
+			if (mkdir(dpath, 0755) && errno != EEXIST)
+				ret = -errno;
+			else
+				ret = copy_tree(b, spath, dpath);
+			break;
+
+		case DT_LNK:
+			len = io->readlink(ctx, spath, buf, sizeof(buf) - 1);
+			if (len < 0) {
+				ret = len;
+				break;
+			}
+			buf[len] = '\0';
+			/* Links point into simulated configfs */
+			if (snprintf(spath, sizeof(spath), "%s%s", b->configfs,
+				     buf + prefix) >= sizeof(spath))
+				ret = -ENAMETOOLONG;
+			else if (symlink(spath, dpath))
+				ret = -errno;
+			break;
+
+		default:
+			if (io->read_attr(ctx, spath, buf, sizeof(buf)) < 0)
+				buf[0] = '\0';
+			fp = fopen(dpath, "w");
+			if (!fp) {
+				ret = -errno;
+				break;
+			}
+			fputs(buf, fp);
+			fclose(fp);
+			break;
+		}
+next:
+		free(dent[i]);
+	}
+	free(dent);
+
+	return ret;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int flag,
+		    struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* Fake sysfs with a single UDC next to the copied configfs tree */
+static int setup_tmpfs_udc(struct bench *b)
+{
+	static const char *const dirs[] = {
+		"/sys", "/sys/class", "/sys/class/udc",
+		"/sys/class/udc/" BENCH_UDC,
+	};
+	char path[PATH_MAX];
+	FILE *fp;
+	size_t i;
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+		if (snprintf(path, sizeof(path), "%s%s", b->configfs,
+			     dirs[i]) >= sizeof(path))
+			goto too_long;
+		if (mkdir(path, 0755)) {
+			perror("mkdir");
+			return -errno;
+		}
+	}
+
+	if (snprintf(path, sizeof(path), "%s%s/state", b->configfs,
+		     dirs[i - 1]) >= sizeof(path))
+		goto too_long;
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror("fopen");
+		return -errno;
+	}
+	fputs("configured\n", fp);
+	fclose(fp);
+
+	if (snprintf(b->sysfs, sizeof(b->sysfs), "%s/sys", b->configfs) >=
+	    sizeof(b->sysfs))
+		goto too_long;
+	b->opts.sysfs_path = b->sysfs;
+	return 0;
+
+too_long:
+	fprintf(stderr, "%s: %s\n", b->configfs, strerror(ENAMETOOLONG));
+	return -ENAMETOOLONG;
+}
+
+static int setup_tmpfs(struct bench *b)
+{
+	usbg_init_opts sim_opts;
+	char dir[PATH_MAX];
+	int ret;
+
+	snprintf(dir, sizeof(dir), "%s/usbg-bench.XXXXXX", b->p.dir);
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return -errno;
+	}
+	strcpy(b->configfs, dir);
+
+	strcat(dir, "/usb_gadget");
+	if (mkdir(dir, 0755)) {
+		perror("mkdir");
+		return -errno;
+	}
+
+	usbg_sim_get_init_opts(b->sim, &sim_opts);
+	bench_set_backend(b, sim_opts.io, sim_opts.io_ctx);
+	ret = generate_tree(b);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = copy_tree(b, SIM_CONFIGFS "/usb_gadget", dir);
+	if (ret) {
+		fprintf(stderr, "copy tree: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	ret = setup_tmpfs_udc(b);
+	if (ret)
+		return ret;
+
+	/* From now on measure only the real file system */
+	bench_set_backend(b, usbg_get_default_io_backend(), NULL);
+	memset(b->cnt.ops, 0, sizeof(b->cnt.ops));
+	return 0;
+}
+
+static int bench_init(struct bench *b)
+{
+	struct phase ph;
+	usbg_state *s;
+	int i, ret;
+
+	phase_start(b, &ph);
+	ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+	if (check(ret, "init"))
+		return ret;
+	phase_end(b, &ph, "init", 1);
+	usbg_cleanup(s);
+
+	/* There is no refresh, a rescan means dropping state and parsing
+	 * the whole tree again */
+	phase_start(b, &ph);
+	for (i = 0; i < b->p.iterations; ++i) {
+		ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+		if (check(ret, "rescan"))
+			return ret;
+		usbg_cleanup(s);
+	}
+	phase_end(b, &ph, "rescan", b->p.iterations);
+
+	return USBG_SUCCESS;
+}
+
+static int bench_create_rm(struct bench *b)
+{
+	struct phase ph;
+	usbg_state *s;
+	usbg_gadget *g;
+	int i, ret;
+
+	if (!b->sim) {
+		report_skip(b, "create_rm", "needs configfs semantics");
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+	if (check(ret, "init"))
+		return ret;
+
+	phase_start(b, &ph);
+	for (i = 0; i < b->p.iterations; ++i) {
+		ret = create_gadget(b, s, "bench", &g);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		ret = usbg_rm_gadget(g);
+		if (check(ret, "rm gadget"))
+			break;
+	}
+	if (ret == USBG_SUCCESS)
+		phase_end(b, &ph, "create_rm", b->p.iterations);
+
+	usbg_cleanup(s);
+	return ret;
+}
+
+static int bench_export(struct bench *b)
+{
+	struct phase ph;
+	usbg_state *s;
+	usbg_gadget *g;
+	FILE *stream;
+	int i, ret;
+
+	ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+	if (check(ret, "init"))
+		return ret;
+
+	g = usbg_get_first_gadget(s);
+	if (!g) {
+		report_skip(b, "export", "no gadgets");
+		goto out;
+	}
+
+	phase_start(b, &ph);
+	for (i = 0; i < b->p.iterations; ++i) {
+		free(b->scheme);
+		b->scheme = NULL;
+		stream = open_memstream(&b->scheme, &b->scheme_len);
+		if (!stream) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		ret = usbg_export_gadget(g, stream);
+		fclose(stream);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	if (ret == USBG_ERROR_NOT_SUPPORTED) {
+		report_skip(b, "export", "gadget schemes not supported");
+		free(b->scheme);
+		b->scheme = NULL;
+		ret = USBG_SUCCESS;
+	} else if (!check(ret, "export")) {
+		phase_end(b, &ph, "export", b->p.iterations);
+	}
+
+out:
+	usbg_cleanup(s);
+	return ret;
+}
+
+static int bench_import(struct bench *b)
+{
+	struct phase ph;
+	usbg_state *s;
+	usbg_gadget *g;
+	FILE *stream;
+	int i, ret;
+
+	if (!b->scheme) {
+		report_skip(b, "import", "no exported scheme");
+		return USBG_SUCCESS;
+	}
+
+	if (!b->sim) {
+		report_skip(b, "import", "needs configfs semantics");
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+	if (check(ret, "init"))
+		return ret;
+
+	phase_start(b, &ph);
+	for (i = 0; i < b->p.iterations; ++i) {
+		stream = fmemopen(b->scheme, b->scheme_len, "r");
+		if (!stream) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		ret = usbg_import_gadget(s, stream, "imported", &g);
+		fclose(stream);
+		if (check(ret, "import"))
+			break;
+
+		ret = usbg_rm_gadget(g);
+		if (check(ret, "rm gadget"))
+			break;
+	}
+	if (ret == USBG_SUCCESS)
+		phase_end(b, &ph, "import_rm", b->p.iterations);
+
+	usbg_cleanup(s);
+	return ret;
+}
+
+/*
+ * Scheme in which each config binds functions by their labels, so
+ * resolution of labels dominates when there are many functions.
+ */
+static char *label_scheme(struct bench *b, size_t *len)
+{
+	char *scheme = NULL;
+	FILE *stream;
+	int i, j;
+
+	stream = open_memstream(&scheme, len);
+	if (!stream)
+		return NULL;
+
+	fprintf(stream, "{\"functions\": {");
+	for (i = 0; i < b->p.functions; ++i)
+		fprintf(stream, "%s\"l%d\": {\"instance\": \"f%d\","
+			" \"type\": \"acm\"}", i ? ", " : "", i, i);
+
+	fprintf(stream, "}, \"configs\": [");
+	for (i = 0; i < b->p.configs; ++i) {
+		fprintf(stream, "%s{\"id\": %d, \"name\": \"c\","
+			" \"functions\": [", i ? ", " : "", i + 1);
+		for (j = 0; j < b->p.bindings && j < b->p.functions; ++j)
+			fprintf(stream, "%s\"l%d\"", j ? ", " : "", j);
+		fprintf(stream, "]}");
+	}
+	fprintf(stream, "]}");
+
+	if (fclose(stream)) {
+		free(scheme);
+		return NULL;
+	}
+
+	return scheme;
+}
+
+static int bench_import_labels(struct bench *b)
+{
+	struct phase ph;
+	usbg_state *s;
+	usbg_gadget *g;
+	FILE *stream;
+	char *scheme;
+	size_t len;
+	int i, ret;
+
+	if (!b->sim) {
+		report_skip(b, "import_labels", "needs configfs semantics");
+		return USBG_SUCCESS;
+	}
+
+	if (b->p.configs > 255) {
+		report_skip(b, "import_labels", "too many configs");
+		return USBG_SUCCESS;
+	}
+
+	scheme = label_scheme(b, &len);
+	if (!scheme)
+		return check(USBG_ERROR_NO_MEM, "label scheme");
+
+	ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+	if (check(ret, "init"))
+		goto out;
+
+	phase_start(b, &ph);
+	for (i = 0; i < b->p.iterations; ++i) {
+		stream = fmemopen(scheme, len, "r");
+		if (!stream) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		ret = usbg_import_gadget_json(s, stream, "labels", &g);
+		fclose(stream);
+		if (check(ret, "import labels"))
+			break;
+
+		ret = usbg_rm_gadget(g);
+		if (check(ret, "rm gadget"))
+			break;
+	}
+	if (ret == USBG_SUCCESS)
+		phase_end(b, &ph, "import_labels_rm", b->p.iterations);
+
+	usbg_cleanup(s);
+out:
+	free(scheme);
+	return ret;
+}
+
+static int bench_teardown(struct bench *b)
+{
+	struct phase ph;
+	usbg_state *s;
+	usbg_gadget *g;
+	int ret;
+
+	if (!b->sim) {
+		report_skip(b, "teardown", "needs configfs semantics");
+		return USBG_SUCCESS;
+	}
+
+	ret = usbg_init_with_opts(b->configfs, &b->opts, &s);
+	if (check(ret, "init"))
+		return ret;
+
+	phase_start(b, &ph);
+	while ((g = usbg_get_first_gadget(s)) != NULL) {
+		ret = usbg_rm_gadget(g);
+		if (check(ret, "rm gadget"))
+			break;
+	}
+	if (ret == USBG_SUCCESS)
+		phase_end(b, &ph, "teardown", 1);
+
+	usbg_cleanup(s);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -B, --backend sim|tmpfs  where the tree lives (default sim)\n"
+		"  -d, --dir DIR            directory for tmpfs backend "
+		"(default /dev/shm)\n"
+		"  -g, --gadgets N          number of gadgets (default 16)\n"
+		"  -f, --functions N        functions per gadget (default 4)\n"
+		"  -c, --configs N          configs per gadget (default 2)\n"
+		"  -b, --bindings N         bindings per config (default 2)\n"
+		"  -l, --luns N             luns per mass storage (default 4)\n"
+		"  -r, --iterations N       repetitions of each phase "
+		"(default 10)\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{ "backend", required_argument, NULL, 'B' },
+		{ "dir", required_argument, NULL, 'd' },
+		{ "gadgets", required_argument, NULL, 'g' },
+		{ "functions", required_argument, NULL, 'f' },
+		{ "configs", required_argument, NULL, 'c' },
+		{ "bindings", required_argument, NULL, 'b' },
+		{ "luns", required_argument, NULL, 'l' },
+		{ "iterations", required_argument, NULL, 'r' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct bench b = {
+		.p = {
+			.backend = "sim",
+			.dir = "/dev/shm",
+			.gadgets = 16,
+			.functions = 4,
+			.configs = 2,
+			.bindings = 2,
+			.luns = 4,
+			.iterations = 10,
+		},
+	};
+	usbg_init_opts sim_opts;
+	bool tmpfs;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "B:d:g:f:c:b:l:r:h", long_opts,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'B':
+			b.p.backend = optarg;
+			break;
+		case 'd':
+			b.p.dir = optarg;
+			break;
+		case 'g':
+			b.p.gadgets = atoi(optarg);
+			break;
+		case 'f':
+			b.p.functions = atoi(optarg);
+			break;
+		case 'c':
+			b.p.configs = atoi(optarg);
+			break;
+		case 'b':
+			b.p.bindings = atoi(optarg);
+			break;
+		case 'l':
+			b.p.luns = atoi(optarg);
+			break;
+		case 'r':
+			b.p.iterations = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	tmpfs = !strcmp(b.p.backend, "tmpfs");
+	if ((!tmpfs && strcmp(b.p.backend, "sim")) || b.p.gadgets < 0 ||
+	    b.p.functions < 0 || b.p.configs < 0 || b.p.bindings < 0 ||
+	    b.p.luns < 0 || b.p.luns > 16 || b.p.iterations <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &b.sim);
+	if (check(ret, "simulator"))
+		return 1;
+	usbg_sim_add_udc(b.sim, BENCH_UDC);
+
+	if (tmpfs) {
+		ret = setup_tmpfs(&b);
+		usbg_sim_destroy(b.sim);
+		b.sim = NULL;
+		if (ret)
+			goto out;
+	} else {
+		strcpy(b.configfs, SIM_CONFIGFS);
+		usbg_sim_get_init_opts(b.sim, &sim_opts);
+		bench_set_backend(&b, sim_opts.io, sim_opts.io_ctx);
+
+		ret = generate_tree(&b);
+		if (ret)
+			goto out;
+	}
+
+	ret = bench_init(&b);
+	if (!ret)
+		ret = bench_create_rm(&b);
+	if (!ret)
+		ret = bench_export(&b);
+	if (!ret)
+		ret = bench_import(&b);
+	if (!ret)
+		ret = bench_import_labels(&b);
+	if (!ret)
+		ret = bench_teardown(&b);
+
+out:
+	if (tmpfs && b.configfs[0])
+		nftw(b.configfs, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	free(b.scheme);
+	usbg_sim_destroy(b.sim);
+	return ret ? 1 : 0;
+}
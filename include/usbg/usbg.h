@@ -19,6 +19,7 @@
 
 #include <dirent.h>
 #include <sys/queue.h>
+#include <sys/types.h>
 #include <netinet/ether.h>
 #include <stdint.h>
 #include <limits.h>
@@ -60,6 +61,18 @@ extern "C" {
  */
 #define USBG_RM_RECURSE 1
 
+/**
+ * @brief Default directory of lock files used by process locks
+ */
+#define USBG_LOCK_DIR "/run/libusbg"
+
+/**
+ * @brief Option for usbg_process_lock_*() functions.
+ * @details Fail with USBG_ERROR_BUSY instead of waiting
+ * for other process to release the lock.
+ */
+#define USBG_PROCESS_LOCK_NONBLOCK 1
+
 /*
  * Internal structures
  */
@@ -69,6 +82,8 @@ struct usbg_config;
 struct usbg_function;
 struct usbg_binding;
 struct usbg_udc;
+struct usbg_sim;
+struct usbg_process_lock;
 
 /**
  * @brief State of the gadget devices in the system
@@ -100,6 +115,17 @@ typedef struct usbg_binding usbg_binding;
  */
 typedef struct usbg_udc usbg_udc;
 
+/**
+ * @brief In-memory simulator of configfs, see usbg_sim_create()
+ */
+typedef struct usbg_sim usbg_sim;
+
+/**
+ * @brief Advisory lock shared with other processes, see
+ * usbg_process_lock_gadget()
+ */
+typedef struct usbg_process_lock usbg_process_lock;
+
 /**
  * @typedef usbg_gadget_attr
  * @brief Gadget attributes which can be set using
@@ -164,6 +190,263 @@ typedef struct
 	char configuration[USBG_MAX_STR_LENGTH];
 } usbg_config_strs;
 
+/**
+ * @typedef usbg_udc_state
+ * @brief States of USB device controller as reported in its
+ * sysfs state attribute
+ */
+typedef enum
+{
+	USBG_UDC_STATE_MIN = 0,
+	USBG_UDC_STATE_NOT_ATTACHED = USBG_UDC_STATE_MIN,
+	USBG_UDC_STATE_ATTACHED,
+	USBG_UDC_STATE_POWERED,
+	USBG_UDC_STATE_RECONNECTING,
+	USBG_UDC_STATE_UNAUTHENTICATED,
+	USBG_UDC_STATE_DEFAULT,
+	USBG_UDC_STATE_ADDRESSED,
+	USBG_UDC_STATE_CONFIGURED,
+	USBG_UDC_STATE_SUSPENDED,
+	USBG_UDC_STATE_MAX,
+} usbg_udc_state;
+
+/**
+ * @typedef usbg_bind_phase
+ * @brief Milestones of gadget enumeration observed after enabling it
+ */
+typedef enum
+{
+	USBG_BIND_PHASE_MIN = 0,
+	/* write to UDC file has finished */
+	USBG_BIND_PHASE_ENABLED = USBG_BIND_PHASE_MIN,
+	USBG_BIND_PHASE_ATTACHED,
+	USBG_BIND_PHASE_ADDRESSED,
+	USBG_BIND_PHASE_CONFIGURED,
+	USBG_BIND_PHASE_MAX,
+} usbg_bind_phase;
+
+/**
+ * @typedef usbg_bind_timings
+ * @brief Time of each bind phase measured from the start of UDC write
+ */
+typedef struct
+{
+	/* in nanoseconds, valid only if phase is set in reached */
+	uint64_t ns[USBG_BIND_PHASE_MAX];
+	/* bit mask of (1 << usbg_bind_phase) */
+	unsigned int reached;
+} usbg_bind_timings;
+
+/**
+ * @brief Number of buckets in latency histogram
+ */
+#define USBG_HIST_BUCKETS 64
+
+/**
+ * @typedef usbg_hist
+ * @brief Log2 histogram of nanosecond latencies
+ * @details Bucket i counts values v for which 2^i <= v < 2^(i + 1),
+ * zero is counted in bucket 0.
+ */
+typedef struct
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[USBG_HIST_BUCKETS];
+} usbg_hist;
+
+/**
+ * @typedef usbg_bind_stats
+ * @brief Bind phase latencies aggregated over many bind cycles
+ */
+typedef struct
+{
+	uint64_t cycles;
+	/* cycles which didn't reach configured state */
+	uint64_t incomplete;
+	usbg_hist phase[USBG_BIND_PHASE_MAX];
+} usbg_bind_stats;
+
+/**
+ * @typedef usbg_io_op
+ * @brief Kinds of configfs and sysfs operations done by library
+ */
+typedef enum
+{
+	USBG_IO_OP_MIN = 0,
+	USBG_IO_OP_READ_ATTR = USBG_IO_OP_MIN,
+	USBG_IO_OP_WRITE_ATTR,
+	USBG_IO_OP_MKDIR,
+	USBG_IO_OP_RMDIR,
+	USBG_IO_OP_UNLINK,
+	USBG_IO_OP_SYMLINK,
+	USBG_IO_OP_READLINK,
+	/* directory scan */
+	USBG_IO_OP_LIST_DIR,
+	USBG_IO_OP_CHECK_DIR,
+	USBG_IO_OP_MAX,
+} usbg_io_op;
+
+/**
+ * @typedef usbg_stats_site
+ * @brief Part of API on behalf of which operation has been done
+ * @details When API calls are nested (e.g. import creates functions)
+ * operation is accounted to the outermost one. Modifying operations
+ * done outside of any other site are accounted as set, remaining ones
+ * (getters, UDC state) as other.
+ */
+typedef enum
+{
+	USBG_STATS_SITE_MIN = 0,
+	USBG_STATS_SITE_OTHER = USBG_STATS_SITE_MIN,
+	USBG_STATS_SITE_PARSE,
+	USBG_STATS_SITE_CREATE,
+	USBG_STATS_SITE_SET,
+	USBG_STATS_SITE_RM,
+	USBG_STATS_SITE_IMPORT,
+	USBG_STATS_SITE_EXPORT,
+	USBG_STATS_SITE_MAX,
+} usbg_stats_site;
+
+/**
+ * @typedef usbg_io_op_stats
+ * @brief Statistics of single kind of operation from single site
+ */
+typedef struct
+{
+	/* number of calls is latency.count */
+	uint64_t errors;
+	usbg_hist latency;
+} usbg_io_op_stats;
+
+/**
+ * @typedef usbg_stats
+ * @brief Operation statistics gathered by usbg_state
+ */
+typedef struct
+{
+	usbg_io_op_stats op[USBG_STATS_SITE_MAX][USBG_IO_OP_MAX];
+} usbg_stats;
+
+/**
+ * @typedef usbg_trace_point
+ * @brief Moment of operation reported to trace callback
+ */
+typedef enum
+{
+	USBG_TRACE_BEGIN = 0,
+	USBG_TRACE_END,
+} usbg_trace_point;
+
+/**
+ * @typedef usbg_trace_event
+ * @brief Modification of configfs (or sysfs) done by library
+ * @details Only mkdir, rmdir, symlink, unlink and attribute writes
+ * are traced.
+ */
+typedef struct
+{
+	usbg_trace_point point;
+	usbg_io_op op;
+	/* API call on behalf of which operation is done */
+	usbg_stats_site site;
+	/* relative to configfs or sysfs root, e.g. usb_gadget/g1/UDC */
+	const char *path;
+	/* value written or symlink target, NULL for other operations */
+	const char *value;
+	/* negative errno, valid only at USBG_TRACE_END */
+	int ret;
+	/* duration of operation, valid only at USBG_TRACE_END */
+	uint64_t elapsed_ns;
+} usbg_trace_event;
+
+/**
+ * @brief Callback invoked before and after each traced operation
+ * @param s State which does the operation
+ * @param ev Operation, valid only until callback returns
+ * @param ctx User data passed to usbg_set_trace_callback()
+ */
+typedef void (*usbg_trace_cb)(usbg_state *s, const usbg_trace_event *ev,
+			      void *ctx);
+
+/**
+ * @brief Callback notified about each bind phase reached
+ * @param g Gadget which is being enabled
+ * @param phase Phase which has been just reached
+ * @param ns Time since start of UDC write in nanoseconds
+ * @param data User data passed to usbg_enable_gadget_wait()
+ */
+typedef void (*usbg_bind_cb)(usbg_gadget *g, usbg_bind_phase phase,
+			     uint64_t ns, void *data);
+
+/**
+ * @brief Filter of directory entries, same as used by scandir()
+ */
+typedef int (*usbg_dir_filter)(const struct dirent *);
+
+/**
+ * @brief Comparator of directory entries, same as used by scandir()
+ */
+typedef int (*usbg_dir_compar)(const struct dirent **,
+			       const struct dirent **);
+
+/**
+ * @typedef usbg_io_backend
+ * @brief Operations used by library to access configfs and sysfs
+ * @details Each operation gets ctx given in usbg_init_opts and full path
+ * to file or directory. All of them return 0 (or number of bytes/entries)
+ * on success and negative errno value on failure.
+ */
+typedef struct usbg_io_backend
+{
+	/* read first line of attribute, at most len - 1 bytes */
+	int (*read_attr)(void *ctx, const char *path, char *buf, size_t len);
+	int (*write_attr)(void *ctx, const char *path, const char *buf);
+	int (*mkdir)(void *ctx, const char *path, mode_t mode);
+	int (*rmdir)(void *ctx, const char *path);
+	int (*unlink)(void *ctx, const char *path);
+	int (*symlink)(void *ctx, const char *target, const char *path);
+	/* same as readlink(), result is not null terminated */
+	ssize_t (*readlink)(void *ctx, const char *path, char *buf,
+			    size_t len);
+	/* same as scandir(), entries are released using free() */
+	int (*list_dir)(void *ctx, const char *path,
+			struct dirent ***namelist, usbg_dir_filter filter,
+			usbg_dir_compar compar);
+	/* check if directory exists and can be opened */
+	int (*check_dir)(void *ctx, const char *path);
+	/* open attribute for reading with pread() and polling for POLLPRI
+	 * as sysfs attributes are, returns descriptor closed by library;
+	 * optional, if NULL library re-reads attribute after sleeping */
+	int (*open_attr)(void *ctx, const char *path);
+} usbg_io_backend;
+
+/**
+ * @typedef usbg_init_opts
+ * @brief Additional options for usbg_init_with_opts()
+ * @details Zero initialized structure gives the same behavior as usbg_init()
+ */
+typedef struct
+{
+	/* NULL means default backend which uses libc directly */
+	const usbg_io_backend *io;
+	void *io_ctx;
+	/* root of sysfs used for UDC discovery, NULL means "/sys" */
+	const char *sysfs_path;
+	/* gather usbg_stats starting from initial parse */
+	bool stats;
+	/* protect gadget tree with reader/writer lock,
+	 * see usbg_read_lock() for details */
+	bool thread_safe;
+	/* take process lock of gadget in each call which modifies it,
+	 * see usbg_process_lock_gadget() for details */
+	bool process_lock;
+	/* directory of lock files, NULL means USBG_LOCK_DIR */
+	const char *lock_dir;
+} usbg_init_opts;
+
 /**
  * @typedef usbg_function_type
  * @brief Supported USB function types
@@ -246,6 +529,28 @@ typedef struct {
 	usbg_f_ms_lun_attrs **luns;
 } usbg_f_ms_attrs;
 
+/**
+ * @brief Flag for usbg_ms_lun_swap_media() to eject current medium
+ * even if host has prevented its removal.
+ * @details Requires forced_eject attribute in kernel, on older kernels
+ * new medium is simply written to file attribute.
+ */
+#define USBG_MS_SWAP_FORCE_EJECT 1
+
+/**
+ * @typedef usbg_ms_lun_swap
+ * @brief Single medium change for usbg_ms_lun_swap_media_batch()
+ */
+typedef struct {
+	int lun;
+	/* NULL or empty string to just eject medium */
+	const char *path;
+	int flags;
+	/* filled by library */
+	int ret;
+	uint64_t latency_ns;
+} usbg_ms_lun_swap;
+
 /**
  * @typedef usbg_f_midi_attrs
  * @brief Attributes for the MIDI function
@@ -312,6 +617,7 @@ typedef enum  {
 	USBG_ERROR_MISSING_TAG = -12,
 	USBG_ERROR_INVALID_TYPE = -13,
 	USBG_ERROR_INVALID_VALUE = -14,
+	USBG_ERROR_TIMEOUT = -15,
 	USBG_ERROR_OTHER_ERROR = -99
 } usbg_error;
 
@@ -329,6 +635,75 @@ extern const char *usbg_error_name(usbg_error e);
  */
 extern const char *usbg_strerror(usbg_error e);
 
+/* Logging */
+
+/**
+ * @typedef usbg_log_level
+ * @brief Severity of log messages, values match syslog priorities
+ */
+typedef enum {
+	USBG_LOG_ERR = 3,
+	USBG_LOG_WARNING = 4,
+	USBG_LOG_INFO = 6,
+	USBG_LOG_DEBUG = 7,
+} usbg_log_level;
+
+/**
+ * @typedef usbg_log_record
+ * @brief Single message emitted by library
+ */
+typedef struct {
+	usbg_log_level level;
+	const char *file;
+	int line;
+	const char *func;
+	/* formatted message without trailing new line */
+	const char *msg;
+	/* messages from the same call site dropped by rate limit
+	 * since previous delivered one */
+	unsigned int suppressed;
+} usbg_log_record;
+
+/**
+ * @brief Callback which receives library log messages
+ * @param rec Message, valid only until callback returns
+ * @param data User data passed to usbg_set_log_callback()
+ */
+typedef void (*usbg_log_cb)(const usbg_log_record *rec, void *data);
+
+/**
+ * @brief Route library log messages to given callback
+ * @details Callback may be called concurrently from many threads.
+ * @param cb Callback or NULL to restore default one printing to stderr
+ * @param data User data passed to callback
+ */
+extern void usbg_set_log_callback(usbg_log_cb cb, void *data);
+
+/**
+ * @brief Set the least severe level of messages which are emitted
+ * @details Messages less severe than USBG_LOG_COMPILE_LEVEL given at
+ * build time are never emitted. Default level is USBG_LOG_ERR.
+ * @param level Log level
+ */
+extern void usbg_set_log_level(usbg_log_level level);
+
+/**
+ * @brief Get the least severe level of messages which are emitted
+ * @return Current log level
+ */
+extern usbg_log_level usbg_get_log_level(void);
+
+/**
+ * @brief Limit number of messages emitted from each call site
+ * @details At most burst messages from single place in library are
+ * emitted in each interval, remaining ones are counted and reported
+ * in usbg_log_record.suppressed of the next emitted message.
+ * @param burst Number of messages per interval, 0 disables limit
+ * @param interval_ms Length of interval in milliseconds
+ */
+extern void usbg_set_log_rate_limit(unsigned int burst,
+				    unsigned int interval_ms);
+
 /* Library init and cleanup */
 
 /**
@@ -339,12 +714,166 @@ extern const char *usbg_strerror(usbg_error e);
  */
 extern int usbg_init(const char *configfs_path, usbg_state **state);
 
+/**
+ * @brief Initialize the libusbg library state with additional options
+ * @param configfs_path Path to the mounted configfs filesystem
+ * @param opts Options of initialization, may be NULL
+ * @param state Double pointer to be filled with state
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_init_with_opts(const char *configfs_path,
+			       const usbg_init_opts *opts,
+			       usbg_state **state);
+
+/**
+ * @brief Get I/O backend used by default
+ * @details Useful for backends which wrap the default one
+ * @return Pointer to default backend
+ */
+extern const usbg_io_backend *usbg_get_default_io_backend(void);
+
+/**
+ * @brief Create in-memory simulator of usb_gadget configfs
+ * @details Simulator emulates configfs mounted at configfs_path and
+ * UDC class directory in sysfs. It can be used by usbg_init_with_opts()
+ * with options filled by usbg_sim_get_init_opts() to test and benchmark
+ * the library without kernel support.
+ * @param configfs_path Path at which configfs should be simulated
+ * @param sim Pointer to be filled with pointer to simulator
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_sim_create(const char *configfs_path, usbg_sim **sim);
+
+/**
+ * @brief Destroy simulator and all its content
+ * @details All states using this simulator have to be cleaned up before.
+ * @param sim Pointer to simulator
+ */
+extern void usbg_sim_destroy(usbg_sim *sim);
+
+/**
+ * @brief Fill init options so that library uses given simulator
+ * @param sim Pointer to simulator
+ * @param opts Options to be filled
+ */
+extern void usbg_sim_get_init_opts(usbg_sim *sim, usbg_init_opts *opts);
+
+/**
+ * @brief Add UDC to simulated sysfs
+ * @details UDC becomes visible for states initialized after this call.
+ * @param sim Pointer to simulator
+ * @param name Name of new UDC
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_sim_add_udc(usbg_sim *sim, const char *name);
+
+/**
+ * @brief Set state of simulated UDC
+ * @details Simulated host enumerates each device immediately so UDC
+ * becomes configured on bind. This allows to simulate other states.
+ * @param sim Pointer to simulator
+ * @param name Name of UDC
+ * @param state New state of UDC
+ * @return 0 on success, usbg_error on error
+ */
+extern int usbg_sim_set_udc_state(usbg_sim *sim, const char *name,
+				  usbg_udc_state state);
+
 /**
  * @brief Clean up the libusbg library state
  * @param s Pointer to state
  */
 extern void usbg_cleanup(usbg_state *s);
 
+/**
+ * @brief Take shared lock of state initialized in thread safe mode
+ * @details In thread safe mode lookups (usbg_get_gadget() etc.) take this
+ * lock shared, as does export, while calls which modify the state
+ * (create, rm, import, enable and disable gadget, setting mass storage
+ * attributes and swapping media) take it exclusively. Object
+ * returned by library stays valid only as long as nobody removes it,
+ * so hold this lock while iterating using usbg_get_first_*() and
+ * usbg_get_next_*() or using returned objects concurrently with
+ * removals. Lock may be taken recursively. Functions which take it
+ * exclusively fail with USBG_ERROR_BUSY when called by thread which
+ * holds it and usbg_get_gadget_udc() or usbg_get_udc_gadget() return
+ * binding known to library without checking it in configfs.
+ * In default mode this function does nothing.
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_read_lock(usbg_state *s);
+
+/**
+ * @brief Release lock taken by usbg_read_lock()
+ * @param s Pointer to state
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_read_unlock(usbg_state *s);
+
+/**
+ * @brief Get immutable snapshot of gadgets, configs, functions and UDCs
+ * @details Snapshot is a read only copy of state which may be iterated
+ * using usbg_get_first_*() and usbg_get_next_*() without any locks,
+ * while state itself is being modified. Attributes are still read from
+ * configfs and all modifications of snapshot fail. Snapshot is shared
+ * by readers until state changes. The first call after a change builds
+ * a new snapshot, so in thread safe mode only this call may wait for
+ * a writer. Outdated snapshot is freed when its last reader releases it.
+ * @param s Pointer to state
+ * @param snap Pointer to be filled with snapshot
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_snapshot_acquire(usbg_state *s, usbg_state **snap);
+
+/**
+ * @brief Release snapshot got from usbg_snapshot_acquire()
+ * @details Snapshot may be released even after cleanup of its state.
+ * @param snap Pointer to snapshot
+ */
+extern void usbg_snapshot_release(usbg_state *snap);
+
+/**
+ * @brief Take advisory lock of gadget shared with other processes
+ * @details Lock is a flock() of file in lock directory, so daemons which
+ * manage different gadgets may work in parallel. Gadget lock also holds
+ * the whole state lock shared. If state has been initialized with
+ * process_lock option, calls which create, remove, enable or disable
+ * objects of gadget take its lock automatically. Locks are held by
+ * process, so taking the same lock again only increases its counter.
+ * Gadget doesn't need to exist. Locks still held are released by
+ * usbg_cleanup().
+ * @param s Pointer to state
+ * @param name Name of gadget
+ * @param flags 0 or USBG_PROCESS_LOCK_NONBLOCK
+ * @param lock Pointer to be filled with lock
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_process_lock_gadget(usbg_state *s, const char *name,
+				    int flags, usbg_process_lock **lock);
+
+/**
+ * @brief Take advisory lock of all gadgets shared with other processes
+ * @details Waits until no other process holds any gadget lock. Fails
+ * with USBG_ERROR_BUSY if this state holds only gadget locks, as shared
+ * flock() cannot be upgraded atomically. Gadget locks may be taken while
+ * holding the state lock, which is downgraded to shared when it is
+ * released before them.
+ * @param s Pointer to state
+ * @param flags 0 or USBG_PROCESS_LOCK_NONBLOCK
+ * @param lock Pointer to be filled with lock
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_process_lock_state(usbg_state *s, int flags,
+				   usbg_process_lock **lock);
+
+/**
+ * @brief Release lock taken by usbg_process_lock_gadget() or
+ * usbg_process_lock_state()
+ * @param lock Pointer to lock
+ */
+extern void usbg_process_unlock(usbg_process_lock *lock);
+
 /**
  * @brief Get ConfigFS path
  * @param s Pointer to state
@@ -355,6 +884,15 @@ extern void usbg_cleanup(usbg_state *s);
  */
 extern const char *usbg_get_configfs_path(usbg_state *s);
 
+/**
+ * @brief Get sysfs path used for UDC discovery
+ * @param s Pointer to state
+ * @return Path to sysfs or NULL if error occurred
+ * @warning Returned buffer should not be edited!
+ * Returned string is valid as long as passed usbg_state is valid.
+ */
+extern const char *usbg_get_sysfs_path(usbg_state *s);
+
 /**
  * @brief Get ConfigFS path length
  * @param s Pointer to state
@@ -937,6 +1475,125 @@ extern int usbg_enable_gadget(usbg_gadget *g, usbg_udc *udc);
  */
 extern int usbg_disable_gadget(usbg_gadget *g);
 
+/**
+ * @brief Enable a USB gadget device and wait until host configures it
+ * @details UDC state attribute is watched using poll() and re-read
+ * periodically, so kernel notifications and stand-in files both work.
+ * @param g Pointer to gadget
+ * @param udc where gadget should be assigned.
+ *  If NULL, default one (first) is used.
+ * @param timeout_ms How long to wait for configured state,
+ *  negative value means no timeout
+ * @param t Place where timings should be stored, may be NULL
+ * @param cb Callback called when each phase is reached, may be NULL
+ * @param data User data passed to callback
+ * @return 0 on success, USBG_ERROR_TIMEOUT if gadget has been enabled
+ * but not configured in given time or usbg_error if error occurred.
+ */
+extern int usbg_enable_gadget_wait(usbg_gadget *g, usbg_udc *udc,
+				   int timeout_ms, usbg_bind_timings *t,
+				   usbg_bind_cb cb, void *data);
+
+/**
+ * @brief Get current state of USB device controller
+ * @param u Pointer to udc
+ * @return usbg_udc_state (0 or above) or
+ *  usbg_error (below 0) if error occurred
+ */
+extern int usbg_get_udc_state(usbg_udc *u);
+
+/**
+ * @brief Get name of given UDC state
+ * @param state UDC state
+ * @return Name of state as used in sysfs or NULL if state is invalid
+ */
+extern const char *usbg_get_udc_state_str(usbg_udc_state state);
+
+/**
+ * @brief Lookup UDC state code
+ * @param name Name of state as used in sysfs
+ * @return usbg_udc_state (0 or above) or
+ *  usbg_error (below 0) if error occurred
+ */
+extern int usbg_lookup_udc_state(const char *name);
+
+/**
+ * @brief Add value to latency histogram
+ * @param h Pointer to histogram
+ * @param ns Value to be added
+ */
+extern void usbg_hist_add(usbg_hist *h, uint64_t ns);
+
+/**
+ * @brief Estimate percentile of values gathered in histogram
+ * @param h Pointer to histogram
+ * @param percent Percentile to be estimated (0 - 100)
+ * @return Upper bound of bucket which contains given percentile
+ * or 0 if histogram is empty
+ */
+extern uint64_t usbg_hist_percentile(const usbg_hist *h, double percent);
+
+/**
+ * @brief Add timings of single bind cycle to aggregated statistics
+ * @param st Pointer to statistics
+ * @param t Timings of bind cycle
+ */
+extern void usbg_bind_stats_add(usbg_bind_stats *st,
+				const usbg_bind_timings *t);
+
+/**
+ * @brief Reset aggregated bind statistics
+ * @param st Pointer to statistics
+ */
+extern void usbg_bind_stats_reset(usbg_bind_stats *st);
+
+/**
+ * @brief Start or stop gathering operation statistics
+ * @param s Pointer to state
+ * @param enable True to start, false to stop and drop gathered statistics
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_enable_stats(usbg_state *s, bool enable);
+
+/**
+ * @brief Get operation statistics gathered so far
+ * @param s Pointer to state
+ * @param st Where statistics should be stored
+ * @return 0 on success, USBG_ERROR_NOT_FOUND if statistics are
+ * not enabled or other usbg_error if error occurred
+ */
+extern int usbg_get_stats(usbg_state *s, usbg_stats *st);
+
+/**
+ * @brief Zero operation statistics without disabling them
+ * @param s Pointer to state
+ */
+extern void usbg_reset_stats(usbg_state *s);
+
+/**
+ * @brief Install callback tracing each modification done by library
+ * @param s Pointer to state
+ * @param cb Callback or NULL to stop tracing
+ * @param ctx User data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_set_trace_callback(usbg_state *s, usbg_trace_cb cb,
+				   void *ctx);
+
+/**
+ * @brief Get name of given operation kind
+ * @param op Operation kind
+ * @return Name of operation or NULL if op is invalid
+ */
+extern const char *usbg_get_io_op_str(usbg_io_op op);
+
+/**
+ * @brief Get name of given statistics site
+ * @param site Statistics site
+ * @return Name of site or NULL if site is invalid
+ */
+extern const char *usbg_get_stats_site_str(usbg_stats_site site);
+
 /**
  * @brief Get name of udc
  * @param u Pointer to udc
@@ -1001,6 +1658,10 @@ extern int usbg_get_function_attrs(usbg_function *f,
 
 /**
  * @brief Set attributes of given function
+ * @details For mass storage functions whose luns are known to the
+ * library (after usbg_get_function_attrs() or previous successful set)
+ * only missing or extra luns are created or removed and only attributes
+ * which differ from their current values are written.
  * @param f Pointer to function
  * @param f_attrs Attributes to be set
  * @return 0 on success, usbg_error if error occurred
@@ -1032,6 +1693,32 @@ extern int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *addr);
  */
 extern int usbg_set_net_qmult(usbg_function *f, int qmult);
 
+/**
+ * @brief Change medium of mass storage lun
+ * @details Only the file attribute of given lun is written
+ * (preceded by forced_eject if requested), all other lun attributes
+ * are left untouched.
+ * @param f Pointer to mass storage function
+ * @param lun Number of lun
+ * @param path Path to new backing file, NULL or empty to eject medium
+ * @param flags Bitwise or of USBG_MS_SWAP_* flags
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_ms_lun_swap_media(usbg_function *f, int lun,
+				  const char *path, int flags);
+
+/**
+ * @brief Change medium of many mass storage luns
+ * @details Each swap is done independently, its result and duration
+ * are stored in ret and latency_ns fields.
+ * @param f Pointer to mass storage function
+ * @param swaps Array of swaps to be done
+ * @param n Number of elements in swaps array
+ * @return 0 if all swaps succeeded, otherwise error of first failed one
+ */
+extern int usbg_ms_lun_swap_media_batch(usbg_function *f,
+					usbg_ms_lun_swap *swaps, int n);
+
 /**
  * @def usbg_for_each_gadget(g, s)
  * Iterates over each gadget
@@ -1178,6 +1865,38 @@ extern int usbg_export_config(usbg_config *c, FILE *stream);
  */
 extern int usbg_export_gadget(usbg_gadget *g, FILE *stream);
 
+/**
+ * @brief Exports usb function to file without building configuration tree
+ * @details Output is the same as of usbg_export_function() but it is
+ * written while walking the function, so memory usage does not depend on
+ * its size. Available also when library is built without libconfig.
+ * @param f Pointer to function to be exported
+ * @param stream where function should be saved
+ * @return 0 on success, usbg_error otherwise. On error content written
+ * to stream so far is incomplete.
+ */
+extern int usbg_export_function_streaming(usbg_function *f, FILE *stream);
+
+/**
+ * @brief Exports configuration to file without building configuration tree
+ * @details Streaming counterpart of usbg_export_config()
+ * @param c Pointer to configuration to be exported
+ * @param stream where configuration should be saved
+ * @return 0 on success, usbg_error otherwise. On error content written
+ * to stream so far is incomplete.
+ */
+extern int usbg_export_config_streaming(usbg_config *c, FILE *stream);
+
+/**
+ * @brief Exports whole gadget to file without building configuration tree
+ * @details Streaming counterpart of usbg_export_gadget()
+ * @param g Pointer to gadget to be exported
+ * @param stream where gadget should be saved
+ * @return 0 on success, usbg_error otherwise. On error content written
+ * to stream so far is incomplete.
+ */
+extern int usbg_export_gadget_streaming(usbg_gadget *g, FILE *stream);
+
 /**
  * @brief Imports usb function from file and adds it to given gadget
  * @param g Gadget where function should be placed
@@ -1255,6 +1974,509 @@ extern const char *usbg_get_gadget_import_error_text(usbg_state *s);
  */
 extern int usbg_get_gadget_import_error_line(usbg_state *s);
 
+/* Binary gadget schemes */
+
+/**
+ * @typedef usbg_scheme_format
+ * @brief Formats in which gadget scheme may be stored
+ */
+typedef enum {
+	USBG_SCHEME_FORMAT_MIN = 0,
+	/* text format described in doc/gadget_schemes.txt */
+	USBG_SCHEME_LIBCONFIG = USBG_SCHEME_FORMAT_MIN,
+	/* compact versioned binary format */
+	USBG_SCHEME_BIN,
+	/* JSON document with the same structure as text format */
+	USBG_SCHEME_JSON,
+	USBG_SCHEME_FORMAT_MAX,
+} usbg_scheme_format;
+
+/**
+ * @brief Exports whole gadget to file in binary format
+ * @details Binary scheme contains the same data as usbg_export_gadget()
+ * but it is parsed without any text processing, so it is suitable for
+ * importing gadgets during boot.
+ * @param g Pointer to gadget to be exported
+ * @param stream where gadget should be saved
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_gadget_bin(usbg_gadget *g, FILE *stream);
+
+/**
+ * @brief Imports whole gadget from file in binary format
+ * @param s current state of library
+ * @param stream from which gadget should be imported
+ * @param name of new gadget
+ * @param g place for pointer to imported gadget
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise. USBG_ERROR_INVALID_FORMAT
+ * is returned for truncated scheme or unsupported major version.
+ */
+extern int usbg_import_gadget_bin(usbg_state *s, FILE *stream,
+				  const char *name, usbg_gadget **g);
+
+/**
+ * @brief Converts gadget scheme between formats without creating gadget
+ * @details Library parses text format itself, so all formats may be
+ * converted also when it is built without libconfig.
+ * @param in stream with source scheme
+ * @param in_format format of source scheme
+ * @param out stream where converted scheme should be written
+ * @param out_format format of converted scheme
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_convert_gadget_scheme(FILE *in, usbg_scheme_format in_format,
+				      FILE *out,
+				      usbg_scheme_format out_format);
+
+/**
+ * @brief Checks if gadget scheme may be imported without touching configfs
+ * @details Function types and attribute types, ranges of values,
+ * duplicated names, references from configurations to functions and
+ * lengths of resulting paths are checked. The same checks are done by
+ * each gadget import before the first directory is created.
+ * @param s current state of library
+ * @param stream with gadget scheme
+ * @param format of gadget scheme
+ * @param name which would be used for new gadget
+ * @return 0 if gadget may be imported, usbg_error otherwise.
+ * USBG_ERROR_EXIST is returned if gadget already exists,
+ * USBG_ERROR_NOT_FOUND if bound function is not defined.
+ */
+extern int usbg_validate_gadget_scheme(usbg_state *s, FILE *stream,
+				       usbg_scheme_format format,
+				       const char *name);
+
+/* JSON gadget schemes */
+
+/**
+ * @brief Exports usb function to file in JSON format
+ * @details Document has the same structure and tag names as the one
+ * created by usbg_export_function(). It is available also when library
+ * is built without libconfig.
+ * @param f Pointer to function to be exported
+ * @param stream where function should be saved
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_function_json(usbg_function *f, FILE *stream);
+
+/**
+ * @brief Exports configuration to file in JSON format
+ * @param c Pointer to configuration to be exported
+ * @param stream where configuration should be saved
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_config_json(usbg_config *c, FILE *stream);
+
+/**
+ * @brief Exports whole gadget to file in JSON format
+ * @param g Pointer to gadget to be exported
+ * @param stream where gadget should be saved
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_gadget_json(usbg_gadget *g, FILE *stream);
+
+/**
+ * @brief Imports usb function from file in JSON format
+ * @param g gadget where function should be placed
+ * @param stream from which function should be imported
+ * @param instance name which should be used for new function
+ * @param f place for pointer to imported function
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_import_function_json(usbg_gadget *g, FILE *stream,
+				     const char *instance, usbg_function **f);
+
+/**
+ * @brief Imports configuration from file in JSON format
+ * @param g gadget where configuration should be placed
+ * @param stream from which configuration should be imported
+ * @param id which should be used for new configuration
+ * @param c place for pointer to imported configuration
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_import_config_json(usbg_gadget *g, FILE *stream, int id,
+				   usbg_config **c);
+
+/**
+ * @brief Imports whole gadget from file in JSON format
+ * @param s current state of library
+ * @param stream from which gadget should be imported
+ * @param name of new gadget
+ * @param g place for pointer to imported gadget
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise. USBG_ERROR_INVALID_FORMAT
+ * is returned for malformed document, USBG_ERROR_MISSING_TAG if some
+ * mandatory member is missing.
+ */
+extern int usbg_import_gadget_json(usbg_state *s, FILE *stream,
+				   const char *name, usbg_gadget **g);
+
+/* Whole state schemes */
+
+/**
+ * @brief Flag for usbg_import_state() to enable each imported gadget
+ * on UDC recorded in scheme.
+ * @details Gadgets are enabled when all of them have been created.
+ */
+#define USBG_IMPORT_STATE_ENABLE 1
+
+/**
+ * @brief Exports all gadgets with their UDC assignments to one document
+ * @details Document contains list of gadgets, each of them with its name,
+ * name of UDC if gadget is enabled and the same data as gadget scheme
+ * of given format.
+ * @param s current state of library
+ * @param stream where state should be saved
+ * @param format of document
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_state(usbg_state *s, FILE *stream,
+			     usbg_scheme_format format);
+
+/**
+ * @brief Imports all gadgets from document created by usbg_export_state()
+ * @details Either all gadgets are imported or none of them, gadgets
+ * which have been already created are removed on error.
+ * @param s current state of library
+ * @param stream from which gadgets should be imported
+ * @param format of document
+ * @param flags 0 or USBG_IMPORT_STATE_ENABLE
+ * @return 0 on success, usbg_error otherwise. USBG_ERROR_EXIST is
+ * returned if gadget with the same name already exists,
+ * USBG_ERROR_NOT_FOUND if recorded UDC is not available.
+ */
+extern int usbg_import_state(usbg_state *s, FILE *stream,
+			     usbg_scheme_format format, int flags);
+
+/* Memory buffer schemes */
+
+/**
+ * @brief Exports usb function to newly allocated buffer
+ * @details Buffer contains the same document as the one written to file
+ * by export function of given format. Text documents are terminated by
+ * '\0' which is not counted in length.
+ * @param f Pointer to function to be exported
+ * @param buf place for pointer to buffer which should be released
+ * by caller using free()
+ * @param len place for length of document
+ * @param format of document
+ * @return 0 on success, usbg_error otherwise. USBG_ERROR_NOT_SUPPORTED
+ * is returned for format without function documents (binary one).
+ */
+extern int usbg_export_function_buf(usbg_function *f, char **buf,
+				    size_t *len, usbg_scheme_format format);
+
+/**
+ * @brief Exports configuration to newly allocated buffer
+ * @param c Pointer to configuration to be exported
+ * @param buf place for pointer to buffer which should be released
+ * by caller using free()
+ * @param len place for length of document
+ * @param format of document
+ * @return 0 on success, usbg_error otherwise. USBG_ERROR_NOT_SUPPORTED
+ * is returned for format without config documents (binary one).
+ */
+extern int usbg_export_config_buf(usbg_config *c, char **buf, size_t *len,
+				  usbg_scheme_format format);
+
+/**
+ * @brief Exports whole gadget to newly allocated buffer
+ * @param g Pointer to gadget to be exported
+ * @param buf place for pointer to buffer which should be released
+ * by caller using free()
+ * @param len place for length of document
+ * @param format of document
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_export_gadget_buf(usbg_gadget *g, char **buf, size_t *len,
+				  usbg_scheme_format format);
+
+/**
+ * @brief Imports usb function from document in memory
+ * @details Buffer does not have to be terminated by '\0'. Errors of
+ * text parsers are not available through usbg_get_func_import_error_*().
+ * @param g gadget where function should be placed
+ * @param buf with document
+ * @param len length of document
+ * @param format of document
+ * @param instance name of new function
+ * @param f place for pointer to imported function
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_import_function_buf(usbg_gadget *g, const char *buf,
+				    size_t len, usbg_scheme_format format,
+				    const char *instance, usbg_function **f);
+
+/**
+ * @brief Imports configuration from document in memory
+ * @param g gadget where config should be placed
+ * @param buf with document
+ * @param len length of document
+ * @param format of document
+ * @param id of new configuration
+ * @param c place for pointer to imported configuration
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_import_config_buf(usbg_gadget *g, const char *buf,
+				  size_t len, usbg_scheme_format format,
+				  int id, usbg_config **c);
+
+/**
+ * @brief Imports whole gadget from document in memory
+ * @param s current state of library
+ * @param buf with document
+ * @param len length of document
+ * @param format of document
+ * @param name of new gadget
+ * @param g place for pointer to imported gadget
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_import_gadget_buf(usbg_state *s, const char *buf,
+				  size_t len, usbg_scheme_format format,
+				  const char *name, usbg_gadget **g);
+
+/* Compiled gadget schemes */
+
+/**
+ * @brief Compiles gadget scheme into list of configfs operations
+ * @details Gadget is created in private simulator and each mkdir,
+ * attribute write and symlink done by the library is recorded, so
+ * nothing is done in configfs. Created list may be executed by
+ * usbg_replay_gadget() without any parsing or validation.
+ * @param in stream with gadget scheme
+ * @param format of gadget scheme
+ * @param name of gadget to be created by the list
+ * @param udc name of UDC on which gadget should be enabled at the end,
+ * NULL to leave gadget disabled
+ * @param out stream where list should be saved
+ * @return 0 on success, usbg_error otherwise
+ */
+extern int usbg_compile_gadget_scheme(FILE *in, usbg_scheme_format format,
+				      const char *name, const char *udc,
+				      FILE *out);
+
+/**
+ * @brief Creates gadget by executing list of configfs operations
+ * @details When default I/O backend is used, operations are done using
+ * syscalls relative to configfs directory and they are neither traced
+ * nor accounted per operation. Directories and symlinks which have been
+ * created are removed on error.
+ * @param s current state of library
+ * @param stream with list created by usbg_compile_gadget_scheme()
+ * @param g place for pointer to created gadget
+ * if NULL this param will be ignored.
+ * @return 0 on success, usbg_error otherwise. USBG_ERROR_INVALID_FORMAT
+ * is returned for damaged list or unsupported major version.
+ */
+extern int usbg_replay_gadget(usbg_state *s, FILE *stream, usbg_gadget **g);
+
+/* Asynchronous API */
+
+/**
+ * @brief Queue of requests executed by worker thread
+ */
+typedef struct usbg_async usbg_async;
+
+/**
+ * @typedef usbg_async_op
+ * @brief Operations which may be executed asynchronously
+ */
+typedef enum {
+	USBG_ASYNC_OP_MIN = 0,
+	USBG_ASYNC_INIT = USBG_ASYNC_OP_MIN,
+	USBG_ASYNC_CREATE_GADGET,
+	USBG_ASYNC_SET_GADGET_ATTRS,
+	USBG_ASYNC_SET_CONFIG_ATTRS,
+	USBG_ASYNC_SET_FUNCTION_ATTRS,
+	USBG_ASYNC_ENABLE_GADGET,
+	USBG_ASYNC_DISABLE_GADGET,
+	USBG_ASYNC_RM_GADGET,
+	USBG_ASYNC_IMPORT_GADGET,
+	USBG_ASYNC_OP_MAX,
+} usbg_async_op;
+
+/**
+ * @typedef usbg_async_result
+ * @brief Result of asynchronous request passed to completion callback
+ */
+typedef struct {
+	usbg_async_op op;
+	/* return value of synchronous variant of the call */
+	int ret;
+	/* new state, set only by USBG_ASYNC_INIT */
+	usbg_state *state;
+	/* new gadget, set only by USBG_ASYNC_CREATE_GADGET and
+	 * USBG_ASYNC_IMPORT_GADGET */
+	usbg_gadget *gadget;
+} usbg_async_result;
+
+/**
+ * @brief Completion callback of asynchronous request
+ * @param res Result of request
+ * @param data Data passed when request has been queued
+ */
+typedef void (*usbg_async_cb)(const usbg_async_result *res, void *data);
+
+/**
+ * @brief Create queue of asynchronous requests with its worker thread
+ * @details Requests are executed in order of queueing by single worker
+ * thread. Completion callbacks are called from usbg_async_dispatch() in
+ * thread of the caller, which should do it when fd returned by
+ * usbg_async_get_fd() becomes readable. Objects and structures passed by
+ * pointer have to stay valid until completion. State used by requests
+ * may be used concurrently only if it has been initialized in thread
+ * safe mode.
+ * @param a Pointer to be filled with queue
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_create(usbg_async **a);
+
+/**
+ * @brief Destroy queue of asynchronous requests
+ * @details Waits until all queued requests are executed and calls their
+ * completion callbacks.
+ * @param a Pointer to queue
+ */
+extern void usbg_async_destroy(usbg_async *a);
+
+/**
+ * @brief Get file descriptor which becomes readable on completion
+ * @param a Pointer to queue
+ * @return Event file descriptor or usbg_error if error occurred
+ */
+extern int usbg_async_get_fd(usbg_async *a);
+
+/**
+ * @brief Call completion callbacks of all finished requests
+ * @param a Pointer to queue
+ * @return Number of completed requests or usbg_error if error occurred
+ */
+extern int usbg_async_dispatch(usbg_async *a);
+
+/**
+ * @brief Queue usbg_init_with_opts()
+ * @param a Pointer to queue
+ * @param configfs_path Path to the mounted configfs filesystem
+ * @param opts Options, copied while queueing, may be NULL
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_init(usbg_async *a, const char *configfs_path,
+			   const usbg_init_opts *opts, usbg_async_cb cb,
+			   void *data);
+
+/**
+ * @brief Queue usbg_create_gadget()
+ * @param a Pointer to queue
+ * @param s Pointer to state
+ * @param name Name of the gadget
+ * @param g_attrs Gadget attributes to be set, may be NULL
+ * @param g_strs Gadget strings to be set, may be NULL
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_create_gadget(usbg_async *a, usbg_state *s,
+				    const char *name,
+				    const usbg_gadget_attrs *g_attrs,
+				    const usbg_gadget_strs *g_strs,
+				    usbg_async_cb cb, void *data);
+
+/**
+ * @brief Queue usbg_set_gadget_attrs()
+ * @param a Pointer to queue
+ * @param g Pointer to gadget
+ * @param g_attrs Gadget attributes to be set
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_set_gadget_attrs(usbg_async *a, usbg_gadget *g,
+				       const usbg_gadget_attrs *g_attrs,
+				       usbg_async_cb cb, void *data);
+
+/**
+ * @brief Queue usbg_set_config_attrs()
+ * @param a Pointer to queue
+ * @param c Pointer to configuration
+ * @param c_attrs Configuration attributes to be set
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_set_config_attrs(usbg_async *a, usbg_config *c,
+				       const usbg_config_attrs *c_attrs,
+				       usbg_async_cb cb, void *data);
+
+/**
+ * @brief Queue usbg_set_function_attrs()
+ * @param a Pointer to queue
+ * @param f Pointer to function
+ * @param f_attrs Function attributes to be set
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_set_function_attrs(usbg_async *a, usbg_function *f,
+					 const usbg_function_attrs *f_attrs,
+					 usbg_async_cb cb, void *data);
+
+/**
+ * @brief Queue usbg_enable_gadget()
+ * @param a Pointer to queue
+ * @param g Pointer to gadget
+ * @param udc Pointer to UDC, DEFAULT_UDC means the first one
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_enable_gadget(usbg_async *a, usbg_gadget *g,
+				    usbg_udc *udc, usbg_async_cb cb,
+				    void *data);
+
+/**
+ * @brief Queue usbg_disable_gadget()
+ * @param a Pointer to queue
+ * @param g Pointer to gadget
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_disable_gadget(usbg_async *a, usbg_gadget *g,
+				     usbg_async_cb cb, void *data);
+
+/**
+ * @brief Queue usbg_rm_gadget()
+ * @param a Pointer to queue
+ * @param g Pointer to gadget
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_rm_gadget(usbg_async *a, usbg_gadget *g,
+				usbg_async_cb cb, void *data);
+
+/**
+ * @brief Queue usbg_import_gadget()
+ * @param a Pointer to queue
+ * @param s Pointer to state
+ * @param stream Stream from which gadget should be imported
+ * @param name Name of the new gadget
+ * @param cb Completion callback
+ * @param data Data passed to callback
+ * @return 0 on success, usbg_error if error occurred
+ */
+extern int usbg_async_import_gadget(usbg_async *a, usbg_state *s,
+				    FILE *stream, const char *name,
+				    usbg_async_cb cb, void *data);
+
 /**
  * @}
  */
@@ -14,14 +14,34 @@
 #define USBG_INTERNAL_H
 
 #include <sys/queue.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <usbg/usbg.h>
 
-#ifdef HAS_LIBCONFIG
+#ifdef HAS_GADGET_SCHEMES
 #include <libconfig.h>
+
+/* Last failed import, whole document is kept for error text and line */
+typedef config_t usbg_failed_import;
+
+static inline void usbg_free_failed_import(usbg_failed_import *failed)
+{
+	if (failed)
+		config_destroy(failed);
+	free(failed);
+}
 #else
-	typedef struct _should_not_be_used config_t;
-	void config_destroy(config_t *config);
+/* Last failed import, built-in parser keeps only error text and line */
+typedef struct usbg_text_error {
+	const char *text;
+	int line;
+} usbg_failed_import;
+
+static inline void usbg_free_failed_import(usbg_failed_import *failed)
+{
+	free(failed);
+}
 #endif
 
 /**
@@ -43,10 +63,45 @@ struct usbg_state
 {
 	char *path;
 	char *configfs_path;
+	char *sysfs_path;
+	char *udc_class_path;
 
 	TAILQ_HEAD(ghead, usbg_gadget) gadgets;
 	TAILQ_HEAD(uhead, usbg_udc) udcs;
-	config_t *last_failed_import;
+	usbg_failed_import *last_failed_import;
+
+	const usbg_io_backend *io;
+	void *io_ctx;
+
+	/* NULL if statistics are disabled */
+	usbg_stats *stats;
+	/* taken while updating stats in thread safe mode */
+	pthread_mutex_t stats_lock;
+
+	/* NULL if tracing is disabled */
+	usbg_trace_cb trace_cb;
+	void *trace_ctx;
+
+	/* lock and per thread lock depth and mode, used only in thread
+	 * safe mode */
+	bool thread_safe;
+	pthread_rwlock_t lock;
+	pthread_key_t lock_depth;
+
+	/* bumped on each change of objects tree, read without lock */
+	unsigned long generation;
+	/* snapshot of the last reader, taken under snap_lock */
+	usbg_state *snap;
+	pthread_mutex_t snap_lock;
+	/* set in snapshots, which are never modified */
+	bool read_only;
+	int refs;
+
+	/* process locks held by this state */
+	char *lock_dir;
+	bool process_lock;
+	TAILQ_HEAD(plhead, usbg_process_lock) plocks;
+	pthread_mutex_t plock_mutex;
 };
 
 struct usbg_gadget
@@ -58,7 +113,7 @@ struct usbg_gadget
 	TAILQ_HEAD(chead, usbg_config) configs;
 	TAILQ_HEAD(fhead, usbg_function) functions;
 	usbg_state *parent;
-	config_t *last_failed_import;
+	usbg_failed_import *last_failed_import;
 	usbg_udc *udc;
 };
 
@@ -88,6 +143,12 @@ struct usbg_function
 	char *label;
 	usbg_function_type type;
 	usbg_rm_function_callback rm_callback;
+	/*
+	 * Number of luns of mass storage function last set by library,
+	 * -1 if unknown. Values of attributes are never cached as kernel
+	 * clears file on eject and other processes may change them.
+	 */
+	int ms_nluns;
 };
 
 struct usbg_binding
@@ -100,6 +161,21 @@ struct usbg_binding
 	char *path;
 };
 
+/* flock() of lock file, shared by all users in process */
+struct usbg_process_lock
+{
+	TAILQ_ENTRY(usbg_process_lock) plnode;
+	usbg_state *parent;
+
+	/* NULL for the whole state */
+	char *name;
+	int fd;
+	int refs;
+	/* references which need the lock exclusively */
+	int ex_refs;
+	bool exclusive;
+};
+
 struct usbg_udc
 {
 	TAILQ_ENTRY(usbg_udc) unode;
@@ -123,17 +199,41 @@ struct usbg_udc
 			__attribute__ ((unused));			\
 	}
 
-#define ERROR(msg, ...) do {\
-                        fprintf(stderr, "%s()  "msg" \n", \
-                                __func__, ##__VA_ARGS__);\
-                        fflush(stderr);\
-                    } while (0)
+/* Messages less severe than this are compiled out */
+#ifndef USBG_LOG_COMPILE_LEVEL
+#define USBG_LOG_COMPILE_LEVEL USBG_LOG_DEBUG
+#endif
+
+/* Rate limit state of single call site */
+struct usbg_log_site {
+	uint64_t window_start;
+	unsigned int generation;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+extern usbg_log_level usbg_log_threshold;
 
-#define ERRORNO(msg, ...) do {\
-                        fprintf(stderr, "%s()  %s: "msg" \n", \
-                                __func__, strerror(errno), ##__VA_ARGS__);\
-                        fflush(stderr);\
-                    } while (0)
+void usbg_log(struct usbg_log_site *site, usbg_log_level level,
+	      const char *file, int line, const char *func,
+	      const char *fmt, ...) __attribute__ ((format (printf, 6, 7)));
+
+#define USBG_LOG(level, msg, ...) do {					\
+		static struct usbg_log_site __usbg_log_site;		\
+		if ((level) <= USBG_LOG_COMPILE_LEVEL &&		\
+		    (level) <= __atomic_load_n(&usbg_log_threshold,	\
+					       __ATOMIC_RELAXED))	\
+			usbg_log(&__usbg_log_site, level, __FILE__,	\
+				 __LINE__, __func__, msg,		\
+				 ##__VA_ARGS__);			\
+	} while (0)
+
+#define ERROR(msg, ...) USBG_LOG(USBG_LOG_ERR, msg, ##__VA_ARGS__)
+#define ERRORNO(msg, ...) USBG_LOG(USBG_LOG_ERR, "%s: " msg,		\
+				   strerror(errno), ##__VA_ARGS__)
+#define WARN(msg, ...) USBG_LOG(USBG_LOG_WARNING, msg, ##__VA_ARGS__)
+#define INFO(msg, ...) USBG_LOG(USBG_LOG_INFO, msg, ##__VA_ARGS__)
+#define DEBUG(msg, ...) USBG_LOG(USBG_LOG_DEBUG, msg, ##__VA_ARGS__)
 
 /* Insert in string order */
 #define INSERT_TAILQ_STRING_ORDER(HeadPtr, HeadType, NameField, ToInsert, NodeField) \
@@ -149,6 +249,7 @@ struct usbg_udc
 				if (strcmp((ToInsert)->NameField, _cur->NameField) > 0) \
 					continue; \
 				TAILQ_INSERT_BEFORE(_cur, (ToInsert), NodeField); \
+				break; \
 			} \
 		} \
 	} while (0)
@@ -157,6 +258,23 @@ struct usbg_udc
 #define CONFIGS_DIR "configs"
 #define FUNCTIONS_DIR "functions"
 #define GADGETS_DIR "usb_gadget"
+#define SYSFS_DIR "/sys"
+#define UDC_CLASS_DIR "class/udc"
+
+/* Tags used in gadget schemes */
+#define USBG_NAME_TAG "name"
+#define USBG_ATTRS_TAG "attrs"
+#define USBG_STRINGS_TAG "strings"
+#define USBG_FUNCTIONS_TAG "functions"
+#define USBG_CONFIGS_TAG "configs"
+#define USBG_LANG_TAG "lang"
+#define USBG_TYPE_TAG "type"
+#define USBG_INSTANCE_TAG "instance"
+#define USBG_ID_TAG "id"
+#define USBG_FUNCTION_TAG "function"
+#define USBG_GADGETS_TAG "gadgets"
+#define USBG_UDC_TAG "udc"
+#define USBG_TAB_WIDTH 4
 
 static inline int file_select(const struct dirent *dent)
 {
@@ -166,8 +284,108 @@ static inline int file_select(const struct dirent *dent)
 		return 1;
 }
 
+static inline int generate_function_label(usbg_function *f, char *buf, int size)
+{
+	return snprintf(buf, size, "%s_%s",
+			 usbg_get_function_type_str(f->type), f->instance);
+
+}
+
+/*
+ * Luns of mass storage function sorted by their id.
+ * Each directory name is parsed only once when index is built.
+ */
+struct usbg_lun_index
+{
+	int nluns;
+	struct usbg_lun_entry {
+		int id;
+		char name[USBG_MAX_NAME_LENGTH];
+	} *luns;
+};
+
+int usbg_lun_index_build(usbg_state *s, const char *path,
+			 struct usbg_lun_index *idx);
+
+void usbg_lun_index_free(struct usbg_lun_index *idx);
+
 int usbg_translate_error(int error);
 
+/*
+ * Parse gadget created in configfs behind the library and add it
+ * to state. Called with exclusive lock held.
+ */
+int usbg_parse_new_gadget(usbg_state *s, const char *name, usbg_gadget **g);
+
+/* Dispatch to I/O backend of state, return negative errno on failure */
+int usbg_io_read_attr(usbg_state *s, const char *path, char *buf, size_t len);
+int usbg_io_write_attr(usbg_state *s, const char *path, const char *buf);
+int usbg_io_mkdir(usbg_state *s, const char *path, mode_t mode);
+int usbg_io_rmdir(usbg_state *s, const char *path);
+int usbg_io_unlink(usbg_state *s, const char *path);
+int usbg_io_symlink(usbg_state *s, const char *target, const char *path);
+ssize_t usbg_io_readlink(usbg_state *s, const char *path,
+			 char *buf, size_t len);
+int usbg_io_list_dir(usbg_state *s, const char *path,
+		     struct dirent ***namelist, usbg_dir_filter filter,
+		     usbg_dir_compar compar);
+int usbg_io_check_dir(usbg_state *s, const char *path);
+
+/* Watched attribute has to be read before each wait */
+void usbg_io_watch_attr(usbg_state *s, const char *path, int *fd);
+void usbg_io_unwatch_attr(usbg_state *s, int fd);
+int usbg_io_read_watched_attr(usbg_state *s, int fd, const char *path,
+			      char *buf, size_t len);
+int usbg_io_wait_watched_attr(usbg_state *s, int fd, int timeout_ms);
+
+/* Site of API call being executed by current thread */
+extern __thread usbg_stats_site usbg_stats_cur_site;
+
+/*
+ * Account operations done until usbg_stats_leave() to given site
+ * unless some outer API call has already chosen one.
+ */
+static inline usbg_stats_site usbg_stats_enter(usbg_state *s,
+					       usbg_stats_site site)
+{
+	usbg_stats_site prev = usbg_stats_cur_site;
+
+	if (prev == USBG_STATS_SITE_OTHER)
+		usbg_stats_cur_site = site;
+
+	return prev;
+}
+
+static inline void usbg_stats_leave(usbg_state *s, usbg_stats_site prev)
+{
+	usbg_stats_cur_site = prev;
+}
+
+uint64_t usbg_now_ns(void);
+
+/*
+ * No-ops unless state has been initialized in thread safe mode.
+ * Exclusive lock fails with USBG_ERROR_BUSY if calling thread holds
+ * the lock only shared.
+ */
+int usbg_lock_init(usbg_state *s);
+void usbg_lock_destroy(usbg_state *s);
+void usbg_lock_shared(usbg_state *s);
+int usbg_lock_exclusive(usbg_state *s) __attribute__ ((warn_unused_result));
+void usbg_unlock(usbg_state *s);
+
+int usbg_process_lock_init(usbg_state *s, const usbg_init_opts *opts);
+void usbg_process_lock_destroy(usbg_state *s);
+/* Take lock of gadget if state has been initialized with process_lock */
+int usbg_process_lock_auto(usbg_state *s, const char *name,
+			   usbg_process_lock **lock);
+
+/* Tree of objects has changed, snapshot taken so far is outdated */
+static inline void usbg_state_changed(usbg_state *s)
+{
+	__atomic_add_fetch(&s->generation, 1, __ATOMIC_RELEASE);
+}
+
 char *usbg_ether_ntoa_r(const struct ether_addr *addr, char *buf);
 
 #endif /* USBG_INTERNAL_H */
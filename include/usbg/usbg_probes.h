@@ -0,0 +1,55 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef USBG_PROBES_H
+#define USBG_PROBES_H
+
+/**
+ * @file include/usbg/usbg_probes.h
+ * @brief USDT probes of provider libusbg
+ * @details Probes are compiled in only when library has been configured
+ * with --enable-usdt, otherwise they expand to nothing. Available probes
+ * (arguments in parentheses):
+ * - read_buf(path, value, ret), write_buf(path, value, ret)
+ * - parse_state_start(configfs_path), parse_state_done(ret)
+ * - parse_udcs_done(ret)
+ * - parse_gadget_start(name), parse_gadget_done(name, ret)
+ * - parse_functions_done(gadget, ret), parse_configs_done(gadget, ret)
+ * - enable_gadget_start(gadget, udc), enable_gadget_done(gadget, ret)
+ * - disable_gadget_start(gadget), disable_gadget_done(gadget, ret)
+ * - import_{gadget,function}_start(name),
+ *   import_{gadget,function}_done(name, ret),
+ *   import_config_start(id), import_config_done(id, ret)
+ * - export_{gadget,config,function}_start(name),
+ *   export_{gadget,config,function}_done(name, ret)
+ * - {import,export}_state_start(configfs_path),
+ *   {import,export}_state_done(ret)
+ *
+ * For example: bpftrace -e 'usdt:libusbg.so:libusbg:write_buf
+ * { printf("%s\n", str(arg0)); }'
+ */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define USBG_PROBE0(name) DTRACE_PROBE(libusbg, name)
+#define USBG_PROBE1(name, a) DTRACE_PROBE1(libusbg, name, a)
+#define USBG_PROBE2(name, a, b) DTRACE_PROBE2(libusbg, name, a, b)
+#define USBG_PROBE3(name, a, b, c) DTRACE_PROBE3(libusbg, name, a, b, c)
+#else
+#define USBG_PROBE0(name) do {} while (0)
+#define USBG_PROBE1(name, a) do {} while (0)
+#define USBG_PROBE2(name, a, b) do {} while (0)
+#define USBG_PROBE3(name, a, b, c) do {} while (0)
+#endif /* HAVE_USDT */
+
+#endif /* USBG_PROBES_H */
@@ -0,0 +1,273 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef USBG_SCHEMES_H
+#define USBG_SCHEMES_H
+
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file include/usbg/usbg_schemes.h
+ * @brief Format independent model of gadget schemes
+ * @details Each scheme format is only parsed into or written from this
+ * model, gadgets are created from it in one place. All strings and
+ * arrays are owned by the model and released by usbg_scheme_free_*().
+ * Optional values are marked in masks, missing ones are left to kernel
+ * defaults when gadget is created.
+ */
+
+/* Bits of usbg_scheme_function.mask */
+#define USBG_SCHEME_F_ATTRS		(1 << 0)
+#define USBG_SCHEME_F_PORT_NUM		(1 << 1)
+#define USBG_SCHEME_F_DEV_ADDR		(1 << 2)
+#define USBG_SCHEME_F_HOST_ADDR		(1 << 3)
+#define USBG_SCHEME_F_QMULT		(1 << 4)
+
+/* Bits of usbg_scheme_config.attrs_mask */
+#define USBG_SCHEME_C_BM_ATTRIBUTES	(1 << 0)
+#define USBG_SCHEME_C_B_MAX_POWER	(1 << 1)
+
+struct usbg_scheme_function {
+	/* NULL for function defined inline in binding */
+	char *label;
+	usbg_function_type type;
+	char *instance;
+	unsigned mask;
+	/*
+	 * Valid if USBG_SCHEME_F_ATTRS is set, net attributes only if
+	 * also their own bits are set. Read only ones are never imported.
+	 */
+	usbg_function_attrs attrs;
+};
+
+struct usbg_scheme_binding {
+	/* NULL means name of target function */
+	char *name;
+	/* Exactly one of label and function is set */
+	char *label;
+	struct usbg_scheme_function *function;
+};
+
+struct usbg_scheme_config_strs {
+	int lang;
+	usbg_config_strs strs;
+};
+
+struct usbg_scheme_config {
+	int id;
+	char *label;
+	unsigned attrs_mask;
+	int bmAttributes;
+	int bMaxPower;
+	int nstrs;
+	struct usbg_scheme_config_strs *strs;
+	int nbindings;
+	struct usbg_scheme_binding *bindings;
+};
+
+struct usbg_scheme_gadget_strs {
+	int lang;
+	usbg_gadget_strs strs;
+};
+
+struct usbg_scheme_gadget {
+	/* bit mask of (1 << usbg_gadget_attr) */
+	unsigned attrs_mask;
+	int attrs[USBG_GADGET_ATTR_MAX];
+	int nstrs;
+	struct usbg_scheme_gadget_strs *strs;
+	int nfunctions;
+	struct usbg_scheme_function *functions;
+	int nconfigs;
+	struct usbg_scheme_config *configs;
+};
+
+struct usbg_scheme_state_gadget {
+	char *name;
+	/* NULL if gadget is not enabled */
+	char *udc;
+	struct usbg_scheme_gadget gadget;
+};
+
+/* All gadgets of state in one document */
+struct usbg_scheme_state {
+	int ngadgets;
+	struct usbg_scheme_state_gadget *gadgets;
+};
+
+/*
+ * Output of scheme writers. Data is written to stdio stream if it is
+ * set, otherwise to buffer growing in memory which is kept terminated
+ * by '\0'. Errors are remembered as usbg_error and reported at the
+ * end.
+ */
+struct usbg_scheme_out {
+	FILE *stream;
+	char *data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+void usbg_scheme_out_write(struct usbg_scheme_out *out, const void *data,
+			   size_t len);
+void usbg_scheme_out_putc(struct usbg_scheme_out *out, char c);
+void usbg_scheme_out_printf(struct usbg_scheme_out *out, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Append new zeroed element to array of n elements of given size.
+ * Pointers to previous elements are no longer valid after this call.
+ */
+void *usbg_scheme_append(void **array, int *n, size_t size);
+
+#define usbg_scheme_new(array, n) \
+	((typeof(array))usbg_scheme_append((void **)&(array), &(n), \
+					   sizeof(*(array))))
+
+void usbg_scheme_free_function(struct usbg_scheme_function *sf);
+void usbg_scheme_free_config(struct usbg_scheme_config *sc);
+void usbg_scheme_free_gadget(struct usbg_scheme_gadget *sg);
+void usbg_scheme_free_state(struct usbg_scheme_state *ss);
+
+/*
+ * Read current state of objects, called with lock held. Model of
+ * function and config has to be released by caller also on error.
+ */
+int usbg_scheme_read_function(usbg_function *f,
+			      struct usbg_scheme_function *sf);
+int usbg_scheme_read_config(usbg_config *c, struct usbg_scheme_config *sc);
+int usbg_scheme_read_gadget(usbg_gadget *g, struct usbg_scheme_gadget *sg);
+int usbg_scheme_read_state(usbg_state *s, struct usbg_scheme_state *ss);
+
+/*
+ * Check whole gadget scheme without touching configfs: types, ranges,
+ * duplicates, references to functions and lengths of paths. Gadget
+ * must not exist yet. Called with lock held.
+ */
+int usbg_scheme_validate_gadget(usbg_state *s,
+				const struct usbg_scheme_gadget *sg,
+				const char *name);
+
+/*
+ * Create objects described by scheme. Objects which have been created
+ * are removed on error. Called with exclusive lock held.
+ */
+int usbg_scheme_create_function(usbg_gadget *g,
+				const struct usbg_scheme_function *sf,
+				const char *instance, usbg_function **f);
+int usbg_scheme_create_config(usbg_gadget *g,
+			      const struct usbg_scheme_config *sc,
+			      int id, usbg_config **c);
+int usbg_scheme_create_gadget(usbg_state *s,
+			      const struct usbg_scheme_gadget *sg,
+			      const char *name, usbg_gadget **g);
+/*
+ * Gadget and all gadgets of state are validated before anything is
+ * created. All gadgets are created before any of them is enabled. On
+ * error all of them are disabled and removed.
+ */
+int usbg_scheme_create_state(usbg_state *s,
+			     const struct usbg_scheme_state *ss, int flags);
+
+/*
+ * Parse and write whole gadget or state scheme in given format.
+ * Model is released by parser on error.
+ */
+int usbg_scheme_parse_gadget(FILE *stream, usbg_scheme_format format,
+			     struct usbg_scheme_gadget *sg);
+int usbg_scheme_parse_gadget_libconfig(FILE *stream,
+				       struct usbg_scheme_gadget *sg);
+int usbg_scheme_write_gadget_libconfig(const struct usbg_scheme_gadget *sg,
+				       FILE *stream);
+int usbg_scheme_parse_gadget_bin(FILE *stream, struct usbg_scheme_gadget *sg);
+int usbg_scheme_write_gadget_bin(const struct usbg_scheme_gadget *sg,
+				 FILE *stream);
+int usbg_scheme_parse_gadget_json(FILE *stream, struct usbg_scheme_gadget *sg);
+int usbg_scheme_write_gadget_json(const struct usbg_scheme_gadget *sg,
+				  FILE *stream);
+int usbg_scheme_parse_state_libconfig(FILE *stream,
+				      struct usbg_scheme_state *ss);
+int usbg_scheme_write_state_libconfig(const struct usbg_scheme_state *ss,
+				      FILE *stream);
+int usbg_scheme_parse_state_bin(FILE *stream, struct usbg_scheme_state *ss);
+int usbg_scheme_write_state_bin(const struct usbg_scheme_state *ss,
+				FILE *stream);
+int usbg_scheme_parse_state_json(FILE *stream, struct usbg_scheme_state *ss);
+int usbg_scheme_write_state_json(const struct usbg_scheme_state *ss,
+				 FILE *stream);
+
+/*
+ * Parse scheme of function, config or gadget directly from memory.
+ * Model is released by parser on error.
+ */
+int usbg_scheme_parse_function_libconfig_buf(const char *buf, size_t len,
+					     struct usbg_scheme_function *sf);
+int usbg_scheme_parse_config_libconfig_buf(const char *buf, size_t len,
+					   struct usbg_scheme_config *sc);
+int usbg_scheme_parse_gadget_libconfig_buf(const char *buf, size_t len,
+					   struct usbg_scheme_gadget *sg);
+int usbg_scheme_parse_gadget_bin_buf(const char *buf, size_t len,
+				     struct usbg_scheme_gadget *sg);
+int usbg_scheme_parse_function_json_buf(const char *buf, size_t len,
+					struct usbg_scheme_function *sf);
+int usbg_scheme_parse_config_json_buf(const char *buf, size_t len,
+				      struct usbg_scheme_config *sc);
+int usbg_scheme_parse_gadget_json_buf(const char *buf, size_t len,
+				      struct usbg_scheme_gadget *sg);
+
+/* Kinds of scheme documents */
+enum usbg_scheme_doc {
+	USBG_SCHEME_DOC_FUNCTION,
+	USBG_SCHEME_DOC_CONFIG,
+	USBG_SCHEME_DOC_GADGET,
+	USBG_SCHEME_DOC_STATE,
+};
+
+/*
+ * Built-in parser of text schemes used when library is built without
+ * libconfig. Document is read from stream if it is set, otherwise from
+ * buffer. Model is released on error and line of error is stored in
+ * line if it is not NULL.
+ */
+int usbg_scheme_parse_text(FILE *stream, const char *buf, size_t len,
+			   enum usbg_scheme_doc doc, void *scheme, int *line);
+
+/* Entry points of built-in parser, used in place of libconfig ones */
+int usbg_scheme_parse_gadget_text(FILE *stream, struct usbg_scheme_gadget *sg);
+int usbg_scheme_parse_state_text(FILE *stream, struct usbg_scheme_state *ss);
+int usbg_scheme_parse_function_text_buf(const char *buf, size_t len,
+					struct usbg_scheme_function *sf);
+int usbg_scheme_parse_config_text_buf(const char *buf, size_t len,
+				      struct usbg_scheme_config *sc);
+int usbg_scheme_parse_gadget_text_buf(const char *buf, size_t len,
+				      struct usbg_scheme_gadget *sg);
+
+/*
+ * Export function, config or gadget in given format. Lock is taken
+ * only for reading of the object, not for writing of output.
+ */
+int usbg_scheme_export_function_libconfig(usbg_function *f,
+					  struct usbg_scheme_out *out);
+int usbg_scheme_export_config_libconfig(usbg_config *c,
+					struct usbg_scheme_out *out);
+int usbg_scheme_export_gadget_libconfig(usbg_gadget *g,
+					struct usbg_scheme_out *out);
+int usbg_scheme_export_gadget_bin(usbg_gadget *g, struct usbg_scheme_out *out);
+int usbg_scheme_export_function_json(usbg_function *f,
+				     struct usbg_scheme_out *out);
+int usbg_scheme_export_config_json(usbg_config *c,
+				   struct usbg_scheme_out *out);
+int usbg_scheme_export_gadget_json(usbg_gadget *g,
+				   struct usbg_scheme_out *out);
+
+#endif /* USBG_SCHEMES_H */
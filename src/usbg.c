@@ -27,7 +27,9 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <time.h>
 #include "usbg/usbg_internal.h"
+#include "usbg/usbg_probes.h"
 
 /**
  * @file usbg.c
@@ -70,6 +72,25 @@ const char *gadget_attr_names[] =
 
 ARRAY_SIZE_SENTINEL(gadget_attr_names, USBG_GADGET_ATTR_MAX);
 
+/**
+ * @var udc_state_names
+ * @brief Name strings of UDC states as reported by kernel
+ */
+const char *udc_state_names[] =
+{
+	"not attached",
+	"attached",
+	"powered",
+	"reconnecting",
+	"unauthenticated",
+	"default",
+	"addressed",
+	"configured",
+	"suspended",
+};
+
+ARRAY_SIZE_SENTINEL(udc_state_names, USBG_UDC_STATE_MAX);
+
 int usbg_translate_error(int error)
 {
 	int ret;
@@ -161,6 +182,9 @@ const char *usbg_error_name(usbg_error e)
 	case USBG_ERROR_INVALID_VALUE:
 		ret = "USBG_ERROR_INVALID_VALUE";
 		break;
+	case USBG_ERROR_TIMEOUT:
+		ret = "USBG_ERROR_TIMEOUT";
+		break;
 	case USBG_ERROR_OTHER_ERROR:
 		ret = "USBG_ERROR_OTHER_ERROR";
 		break;
@@ -219,6 +243,9 @@ const char *usbg_strerror(usbg_error e)
 	case USBG_ERROR_INVALID_VALUE:
 		ret = "Incorrect value provided as attribute.";
 		break;
+	case USBG_ERROR_TIMEOUT:
+		ret = "Timeout expired";
+		break;
 	case USBG_ERROR_OTHER_ERROR:
 		ret = "Other error";
 		break;
@@ -286,6 +313,29 @@ const char *usbg_get_function_type_str(usbg_function_type type)
 		function_names[type] : NULL;
 }
 
+int usbg_lookup_udc_state(const char *name)
+{
+	int i = USBG_UDC_STATE_MIN;
+
+	if (!name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	do {
+		if (!strcmp(name, udc_state_names[i]))
+			return i;
+		i++;
+	} while (i != USBG_UDC_STATE_MAX);
+
+	return USBG_ERROR_NOT_FOUND;
+}
+
+const char *usbg_get_udc_state_str(usbg_udc_state state)
+{
+	return state >= USBG_UDC_STATE_MIN &&
+		state < USBG_UDC_STATE_MAX ?
+		udc_state_names[state] : NULL;
+}
+
 int usbg_lookup_gadget_attr(const char *name)
 {
 	int i = USBG_GADGET_ATTR_MIN;
@@ -384,12 +434,10 @@ static int bindings_select(const struct dirent *dent)
 		return 0;
 }
 
-static int usbg_read_buf(const char *path, const char *name, const char *file,
-			 char *buf)
+static int usbg_read_buf(usbg_state *s, const char *path, const char *name,
+			 const char *file, char *buf)
 {
 	char p[USBG_MAX_PATH_LENGTH];
-	FILE *fp;
-	char *ret_ptr;
 	int nmb;
 	int ret = USBG_SUCCESS;
 
@@ -399,37 +447,27 @@ static int usbg_read_buf(const char *path, const char *name, const char *file,
 		goto out;
 	}
 
-	fp = fopen(p, "r");
-	if (!fp) {
-		/* Set error correctly */
-		ret = usbg_translate_error(errno);
-		goto out;
-	}
-
-	ret_ptr = fgets(buf, USBG_MAX_STR_LENGTH, fp);
-	if (!ret_ptr) {
-		/* File is empty */
-		if (feof(fp))
-			buf[0] = '\0';
-		/* Error occurred */
-		else
-			ret = USBG_ERROR_IO;
+	nmb = usbg_io_read_attr(s, p, buf, USBG_MAX_STR_LENGTH);
+	USBG_PROBE3(read_buf, p, buf, nmb);
+	if (nmb < 0) {
+		/* Optional attributes are probed this way so it's not
+		 * worth more than debug message */
+		DEBUG("%s: %s\n", p, strerror(-nmb));
+		ret = usbg_translate_error(-nmb);
 	}
 
-	fclose(fp);
-
 out:
 	return ret;
 }
 
-static int usbg_read_int(const char *path, const char *name, const char *file,
-			 int base, int *dest)
+static int usbg_read_int(usbg_state *s, const char *path, const char *name,
+			 const char *file, int base, int *dest)
 {
 	char buf[USBG_MAX_STR_LENGTH];
 	char *pos;
 	int ret;
 
-	ret = usbg_read_buf(path, name, file, buf);
+	ret = usbg_read_buf(s, path, name, file, buf);
 	if (ret == USBG_SUCCESS) {
 		*dest = strtol(buf, &pos, base);
 		if (!pos)
@@ -439,16 +477,16 @@ static int usbg_read_int(const char *path, const char *name, const char *file,
 	return ret;
 }
 
-#define usbg_read_dec(p, n, f, d)	usbg_read_int(p, n, f, 10, d)
-#define usbg_read_hex(p, n, f, d)	usbg_read_int(p, n, f, 16, d)
+#define usbg_read_dec(s, p, n, f, d)	usbg_read_int(s, p, n, f, 10, d)
+#define usbg_read_hex(s, p, n, f, d)	usbg_read_int(s, p, n, f, 16, d)
 
-static int usbg_read_bool(const char *path, const char *name, const char *file,
-			  bool *dest)
+static int usbg_read_bool(usbg_state *s, const char *path, const char *name,
+			  const char *file, bool *dest)
 {
 	int buf;
 	int ret;
 
-	ret = usbg_read_dec(path, name, file, &buf);
+	ret = usbg_read_dec(s, path, name, file, &buf);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -457,13 +495,13 @@ out:
 	return ret;
 }
 
-static int usbg_read_string(const char *path, const char *name,
+static int usbg_read_string(usbg_state *s, const char *path, const char *name,
 			    const char *file, char *buf)
 {
 	char *p = NULL;
 	int ret;
 
-	ret = usbg_read_buf(path, name, file, buf);
+	ret = usbg_read_buf(s, path, name, file, buf);
 	/* Check whether read was successful */
 	if (ret == USBG_SUCCESS) {
 		if ((p = strchr(buf, '\n')) != NULL)
@@ -476,14 +514,15 @@ static int usbg_read_string(const char *path, const char *name,
 	return ret;
 }
 
-static int usbg_read_string_alloc(const char *path, const char *name,
-			       const char *file, const char **dest)
+static int usbg_read_string_alloc(usbg_state *s, const char *path,
+				  const char *name, const char *file,
+				  const char **dest)
 {
 	char buf[USBG_MAX_FILE_SIZE];
 	char *new_buf = NULL;
 	int ret = USBG_SUCCESS;
 
-	ret = usbg_read_string(path, name, file, buf);
+	ret = usbg_read_string(s, path, name, file, buf);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -498,29 +537,20 @@ out:
 	return ret;
 }
 
-static int usbg_write_buf(const char *path, const char *name, const char *file,
-			  const char *buf)
+static int usbg_write_buf(usbg_state *s, const char *path, const char *name,
+			  const char *file, const char *buf)
 {
 	char p[USBG_MAX_PATH_LENGTH];
-	FILE *fp;
 	int nmb;
 	int ret = USBG_SUCCESS;
 
 	nmb = snprintf(p, sizeof(p), "%s/%s/%s", path, name, file);
 	if (nmb < sizeof(p)) {
-		fp = fopen(p, "w");
-		if (fp) {
-			fputs(buf, fp);
-			fflush(fp);
-
-			ret = ferror(fp);
-			if (ret)
-				ret = usbg_translate_error(errno);
-
-			fclose(fp);
-		} else {
-			/* Set error correctly */
-			ret = usbg_translate_error(errno);
+		nmb = usbg_io_write_attr(s, p, buf);
+		USBG_PROBE3(write_buf, p, buf, nmb);
+		if (nmb < 0) {
+			DEBUG("%s: %s\n", p, strerror(-nmb));
+			ret = usbg_translate_error(-nmb);
 		}
 	} else {
 		ret = USBG_ERROR_PATH_TOO_LONG;
@@ -529,28 +559,31 @@ static int usbg_write_buf(const char *path, const char *name, const char *file,
 	return ret;
 }
 
-static int usbg_write_int(const char *path, const char *name, const char *file,
-			  int value, const char *str)
+static int usbg_write_int(usbg_state *s, const char *path, const char *name,
+			  const char *file, int value, const char *str)
 {
 	char buf[USBG_MAX_STR_LENGTH];
 	int nmb;
 
 	nmb = snprintf(buf, USBG_MAX_STR_LENGTH, str, value);
 	return nmb < USBG_MAX_STR_LENGTH ?
-			usbg_write_buf(path, name, file, buf)
+			usbg_write_buf(s, path, name, file, buf)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
-#define usbg_write_dec(p, n, f, v)	usbg_write_int(p, n, f, v, "%d\n")
-#define usbg_write_hex(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%x\n")
-#define usbg_write_hex16(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%04x\n")
-#define usbg_write_hex8(p, n, f, v)	usbg_write_int(p, n, f, v, "0x%02x\n")
-#define usbg_write_bool(p, n, f, v)	usbg_write_dec(p, n, f, !!v)
+#define usbg_write_dec(s, p, n, f, v)	usbg_write_int(s, p, n, f, v, "%d\n")
+#define usbg_write_hex(s, p, n, f, v)	usbg_write_int(s, p, n, f, v, "0x%x\n")
+#define usbg_write_hex16(s, p, n, f, v) \
+	usbg_write_int(s, p, n, f, v, "0x%04x\n")
+#define usbg_write_hex8(s, p, n, f, v) \
+	usbg_write_int(s, p, n, f, v, "0x%02x\n")
+#define usbg_write_bool(s, p, n, f, v)	usbg_write_dec(s, p, n, f, !!v)
 
-static inline int usbg_write_string(const char *path, const char *name,
-				    const char *file, const char *buf)
+static inline int usbg_write_string(usbg_state *s, const char *path,
+				    const char *name, const char *file,
+				    const char *buf)
 {
-	return usbg_write_buf(path, name, file, buf);
+	return usbg_write_buf(s, path, name, file, buf);
 }
 
 static inline void usbg_free_binding(usbg_binding *b)
@@ -587,10 +620,7 @@ static void usbg_free_gadget(usbg_gadget *g)
 	usbg_config *c;
 	usbg_function *f;
 
-	if (g->last_failed_import) {
-		config_destroy(g->last_failed_import);
-		free(g->last_failed_import);
-	}
+	usbg_free_failed_import(g->last_failed_import);
 
 	while (!TAILQ_EMPTY(&g->configs)) {
 		c = TAILQ_FIRST(&g->configs);
@@ -631,13 +661,18 @@ static void usbg_free_state(usbg_state *s)
 		usbg_free_udc(u);
 	}
 
-	if (s->last_failed_import) {
-		config_destroy(s->last_failed_import);
-		free(s->last_failed_import);
-	}
+	usbg_free_failed_import(s->last_failed_import);
 
 	free(s->path);
 	free(s->configfs_path);
+	free(s->sysfs_path);
+	free(s->udc_class_path);
+	free(s->stats);
+	usbg_lock_destroy(s);
+	if (s->snap)
+		usbg_snapshot_release(s->snap);
+	pthread_mutex_destroy(&s->snap_lock);
+	usbg_process_lock_destroy(s);
 	free(s);
 }
 
@@ -734,6 +769,7 @@ static usbg_function *usbg_allocate_function(const char *path,
 	f->path = strdup(path);
 	f->parent = parent;
 	f->type = type;
+	f->ms_nluns = -1;
 
 	/* only composed functions (with subdirs) require this callback */
 	switch (usbg_lookup_function_attrs_type(type)) {
@@ -798,7 +834,7 @@ static usbg_udc *usbg_allocate_udc(usbg_state *parent, const char *name)
 	return u;
 }
 
-static int ubsg_rm_file(const char *path, const char *name)
+static int ubsg_rm_file(usbg_state *s, const char *path, const char *name)
 {
 	int ret = USBG_SUCCESS;
 	int nmb;
@@ -806,9 +842,9 @@ static int ubsg_rm_file(const char *path, const char *name)
 
 	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
 	if (nmb < sizeof(buf)) {
-		nmb = unlink(buf);
+		nmb = usbg_io_unlink(s, buf);
 		if (nmb != 0)
-			ret = usbg_translate_error(errno);
+			ret = usbg_translate_error(-nmb);
 	} else {
 		ret = USBG_ERROR_PATH_TOO_LONG;
 	}
@@ -816,7 +852,7 @@ static int ubsg_rm_file(const char *path, const char *name)
 	return ret;
 }
 
-static int usbg_rm_dir(const char *path, const char *name)
+static int usbg_rm_dir(usbg_state *s, const char *path, const char *name)
 {
 	int ret = USBG_SUCCESS;
 	int nmb;
@@ -824,9 +860,9 @@ static int usbg_rm_dir(const char *path, const char *name)
 
 	nmb = snprintf(buf, sizeof(buf), "%s/%s", path, name);
 	if (nmb < sizeof(buf)) {
-		nmb = rmdir(buf);
+		nmb = usbg_io_rmdir(s, buf);
 		if (nmb != 0)
-			ret = usbg_translate_error(errno);
+			ret = usbg_translate_error(-nmb);
 	} else {
 		ret = USBG_ERROR_PATH_TOO_LONG;
 	}
@@ -834,23 +870,23 @@ static int usbg_rm_dir(const char *path, const char *name)
 	return ret;
 }
 
-static int usbg_rm_all_dirs(const char *path)
+static int usbg_rm_all_dirs(usbg_state *s, const char *path)
 {
 	int ret = USBG_SUCCESS;
 	int n, i;
 	struct dirent **dent;
 
-	n = scandir(path, &dent, file_select, alphasort);
+	n = usbg_io_list_dir(s, path, &dent, file_select, alphasort);
 	if (n >= 0) {
 		for (i = 0; i < n; ++i) {
 			if (ret == USBG_SUCCESS)
-				ret = usbg_rm_dir(path, dent[i]->d_name);
+				ret = usbg_rm_dir(s, path, dent[i]->d_name);
 
 			free(dent[i]);
 		}
 		free(dent);
 	} else {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-n);
 	}
 
 	return ret;
@@ -873,7 +909,8 @@ static int usbg_parse_function_net_attrs(usbg_function *f,
 	char str_addr[USBG_MAX_STR_LENGTH];
 	int ret;
 
-	ret = usbg_read_string(f->path, f->name, "dev_addr", str_addr);
+	ret = usbg_read_string(f->parent->parent, f->path, f->name, "dev_addr",
+			       str_addr);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -885,7 +922,8 @@ static int usbg_parse_function_net_attrs(usbg_function *f,
 		goto out;
 	}
 
-	ret = usbg_read_string(f->path, f->name, "host_addr", str_addr);
+	ret = usbg_read_string(f->parent->parent, f->path, f->name, "host_addr",
+			       str_addr);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -897,88 +935,124 @@ static int usbg_parse_function_net_attrs(usbg_function *f,
 		goto out;
 	}
 
-	ret = usbg_read_dec(f->path, f->name, "qmult", &(f_net_attrs->qmult));
+	ret = usbg_read_dec(f->parent->parent, f->path, f->name, "qmult",
+			    &(f_net_attrs->qmult));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_string_alloc(f->path, f->name, "ifname",
+	ret = usbg_read_string_alloc(f->parent->parent, f->path, f->name,
+				     "ifname",
 				     &(f_net_attrs->ifname));
 out:
 	return ret;
 }
 
-static int usbg_parse_function_ms_lun_attrs(const char *path, const char *lun,
+static int usbg_parse_function_ms_lun_attrs(usbg_state *s, const char *path,
+					    const struct usbg_lun_entry *lun,
 					    usbg_f_ms_lun_attrs *lun_attrs)
 {
 	int ret;
 
 	memset(lun_attrs, 0, sizeof(*lun_attrs));
+	lun_attrs->id = lun->id;
 
-	ret = sscanf(lun, "lun.%d", &lun_attrs->id);
-	if (ret != 1)
-		goto out;
-
-	ret = usbg_read_bool(path, lun, "cdrom", &(lun_attrs->cdrom));
+	ret = usbg_read_bool(s, path, lun->name, "cdrom", &(lun_attrs->cdrom));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_bool(path, lun, "ro", &(lun_attrs->ro));
+	ret = usbg_read_bool(s, path, lun->name, "ro", &(lun_attrs->ro));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_bool(path, lun, "nofua", &(lun_attrs->nofua));
+	ret = usbg_read_bool(s, path, lun->name, "nofua", &(lun_attrs->nofua));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_bool(path, lun, "removable", &(lun_attrs->removable));
+	ret = usbg_read_bool(s, path, lun->name, "removable",
+			     &(lun_attrs->removable));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_string_alloc(path, lun, "file",
+	ret = usbg_read_string_alloc(s, path, lun->name, "file",
 				     &(lun_attrs->filename));
 
 out:
 	return ret;
 }
 
-static inline int lun_select(const struct dirent *dent)
+/* Accept only lun.<id> names, id itself is parsed later only once */
+static int lun_select(const struct dirent *dent)
 {
-	int ret;
-	int id;
+	const char *c;
 
-	ret = file_select(dent);
-	if (!ret)
-		goto out;
+	if (strncmp(dent->d_name, "lun.", 4) != 0)
+		return 0;
 
-	ret = sscanf(dent->d_name, "lun.%d", &id);
-out:
-	return ret;
+	c = dent->d_name + 4;
+	if (!isdigit(*c) || strlen(dent->d_name) >= USBG_MAX_NAME_LENGTH)
+		return 0;
+
+	while (isdigit(*c))
+		++c;
+
+	return *c == '\0';
 }
 
-static inline int lun_sort(const struct dirent **d1, const struct dirent **d2)
+static int lun_entry_cmp(const void *a, const void *b)
 {
-	int ret;
-	int id1, id2;
+	const struct usbg_lun_entry *l1 = a;
+	const struct usbg_lun_entry *l2 = b;
 
-	ret = sscanf((*d1)->d_name, "lun.%d", &id1);
-	if (ret != 1)
-		goto err;
+	return l1->id < l2->id ? -1 : l1->id > l2->id;
+}
 
-	ret = sscanf((*d2)->d_name, "lun.%d", &id2);
-	if (ret != 1)
-		goto err;
+int usbg_lun_index_build(usbg_state *s, const char *path,
+			 struct usbg_lun_index *idx)
+{
+	struct dirent **dent;
+	struct usbg_lun_entry *lun;
+	int i, nmb;
+	int ret = USBG_SUCCESS;
 
-	if (id1 < id2)
-		ret = 1;
+	idx->nluns = 0;
+	idx->luns = NULL;
 
-	return id1 < id2 ? -1 : id1 > id2;
-err:
-	/*
-	 * This should not happened because dentries has been
-	 * already checked by lun_select function. This
-	 * error procedure is just in case.
-	 */
-	return -1;
+	nmb = usbg_io_list_dir(s, path, &dent, lun_select, NULL);
+	if (nmb < 0) {
+		ret = usbg_translate_error(-nmb);
+		goto out;
+	}
+
+	if (nmb > 0) {
+		idx->luns = malloc(nmb * sizeof(*idx->luns));
+		if (!idx->luns)
+			ret = USBG_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < nmb; ++i) {
+		if (ret == USBG_SUCCESS) {
+			lun = &idx->luns[idx->nluns++];
+			lun->id = strtol(dent[i]->d_name + 4, NULL, 10);
+			strcpy(lun->name, dent[i]->d_name);
+		}
+		free(dent[i]);
+	}
+	free(dent);
+
+	if (ret == USBG_SUCCESS)
+		qsort(idx->luns, idx->nluns, sizeof(*idx->luns),
+		      lun_entry_cmp);
+	else
+		usbg_lun_index_free(idx);
+out:
+	return ret;
+}
+
+void usbg_lun_index_free(struct usbg_lun_index *idx)
+{
+	free(idx->luns);
+	idx->luns = NULL;
+	idx->nluns = 0;
 }
 
 static int usbg_parse_function_ms_attrs(usbg_function *f,
@@ -986,13 +1060,13 @@ static int usbg_parse_function_ms_attrs(usbg_function *f,
 {
 	int ret;
 	int nmb;
-	int i = 0;
+	int i;
 	char fpath[USBG_MAX_PATH_LENGTH];
 	usbg_f_ms_lun_attrs *lun_attrs;
 	usbg_f_ms_lun_attrs **luns;
-	struct dirent **dent;
+	struct usbg_lun_index idx;
 
-	ret = usbg_read_bool(f->path, f->name, "stall",
+	ret = usbg_read_bool(f->parent->parent, f->path, f->name, "stall",
 			     &(f_ms_attrs->stall));
 	if (ret != USBG_SUCCESS)
 		goto out;
@@ -1005,29 +1079,28 @@ static int usbg_parse_function_ms_attrs(usbg_function *f,
 		goto out;
 	}
 
-	nmb = scandir(fpath, &dent, lun_select, lun_sort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+	ret = usbg_lun_index_build(f->parent->parent, fpath, &idx);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	luns = calloc(nmb + 1, sizeof(*luns));
+	luns = calloc(idx.nluns + 1, sizeof(*luns));
 	if (!luns) {
 		ret = USBG_ERROR_NO_MEM;
-		goto err;
+		goto err_free_index;
 	}
 
 	f_ms_attrs->luns = luns;
-	f_ms_attrs->nluns = nmb;
+	f_ms_attrs->nluns = idx.nluns;
 
-	for (i = 0; i < nmb; i++) {
+	for (i = 0; i < idx.nluns; i++) {
 		lun_attrs = malloc(sizeof(*lun_attrs));
 		if (!lun_attrs) {
 			ret = USBG_ERROR_NO_MEM;
 			goto err;
 		}
 
-		ret = usbg_parse_function_ms_lun_attrs(fpath, dent[i]->d_name,
+		ret = usbg_parse_function_ms_lun_attrs(f->parent->parent, fpath,
+						       &idx.luns[i],
 						       lun_attrs);
 		if (ret != USBG_SUCCESS) {
 			free(lun_attrs);
@@ -1035,22 +1108,17 @@ static int usbg_parse_function_ms_attrs(usbg_function *f,
 		}
 
 		luns[i] = lun_attrs;
-		free(dent[i]);
 	}
-	free(dent);
 
+	usbg_lun_index_free(&idx);
 	return USBG_SUCCESS;
 
 err:
-	while (i < nmb) {
-		free(dent[i]);
-		++i;
-	}
-	free(dent);
-
 	usbg_cleanup_function_attrs(
 		container_of((usbg_f_attrs *)f_ms_attrs,
 			     usbg_function_attrs, attrs));
+err_free_index:
+	usbg_lun_index_free(&idx);
 out:
 	return ret;
 }
@@ -1060,27 +1128,33 @@ static int usbg_parse_function_midi_attrs(usbg_function *f,
 {
 	int ret;
 
-	ret = usbg_read_dec(f->path, f->name, "index", &(attrs->index));
+	ret = usbg_read_dec(f->parent->parent, f->path, f->name, "index",
+			    &(attrs->index));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_string_alloc(f->path, f->name, "id", &(attrs->id));
+	ret = usbg_read_string_alloc(f->parent->parent, f->path, f->name, "id",
+				     &(attrs->id));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_dec(f->path, f->name, "in_ports", (int*)&(attrs->in_ports));
+	ret = usbg_read_dec(f->parent->parent, f->path, f->name, "in_ports",
+			    (int*)&(attrs->in_ports));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_dec(f->path, f->name, "out_ports", (int*)&(attrs->out_ports));
+	ret = usbg_read_dec(f->parent->parent, f->path, f->name, "out_ports",
+			    (int*)&(attrs->out_ports));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_dec(f->path, f->name, "buflen", (int*)&(attrs->buflen));
+	ret = usbg_read_dec(f->parent->parent, f->path, f->name, "buflen",
+			    (int*)&(attrs->buflen));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_read_dec(f->path, f->name, "qlen", (int*)&(attrs->qlen));
+	ret = usbg_read_dec(f->parent->parent, f->path, f->name, "qlen",
+			    (int*)&(attrs->qlen));
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -1103,7 +1177,8 @@ static int usbg_parse_function_attrs(usbg_function *f,
 	switch (attrs_type) {
 	case USBG_F_ATTRS_SERIAL:
 		f_attrs->header.attrs_type = USBG_F_ATTRS_SERIAL;
-		ret = usbg_read_dec(f->path, f->name, "port_num",
+		ret = usbg_read_dec(f->parent->parent, f->path, f->name,
+				    "port_num",
 				&(f_attrs->attrs.serial.port_num));
 		break;
 
@@ -1114,7 +1189,8 @@ static int usbg_parse_function_attrs(usbg_function *f,
 
 	case USBG_F_ATTRS_PHONET:
 		f_attrs->header.attrs_type = USBG_F_ATTRS_PHONET;
-		ret = usbg_read_string_alloc(f->path, f->name, "ifname",
+		ret = usbg_read_string_alloc(f->parent->parent, f->path,
+					     f->name, "ifname",
 					     &(f_attrs->attrs.phonet.ifname));
 		break;
 
@@ -1166,9 +1242,9 @@ static int usbg_parse_functions(const char *path, usbg_gadget *g)
 		goto out;
 	}
 
-	n = scandir(fpath, &dent, file_select, alphasort);
+	n = usbg_io_list_dir(g->parent, fpath, &dent, file_select, alphasort);
 	if (n < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-n);
 		goto out;
 	}
 
@@ -1192,19 +1268,20 @@ static int usbg_parse_functions(const char *path, usbg_gadget *g)
 	free(dent);
 
 out:
+	USBG_PROBE2(parse_functions_done, g->name, ret);
 	return ret;
 }
 
-static int usbg_parse_config_attrs(const char *path, const char *name,
-		usbg_config_attrs *c_attrs)
+static int usbg_parse_config_attrs(usbg_state *s, const char *path,
+				   const char *name, usbg_config_attrs *c_attrs)
 {
 	int buf, ret;
 
-	ret = usbg_read_dec(path, name, "MaxPower", &buf);
+	ret = usbg_read_dec(s, path, name, "MaxPower", &buf);
 	if (ret == USBG_SUCCESS) {
 		c_attrs->bMaxPower = (uint8_t)buf;
 
-		ret = usbg_read_hex(path, name, "bmAttributes", &buf);
+		ret = usbg_read_hex(s, path, name, "bmAttributes", &buf);
 		if (ret == USBG_SUCCESS)
 			c_attrs->bmAttributes = (uint8_t)buf;
 	}
@@ -1212,10 +1289,10 @@ static int usbg_parse_config_attrs(const char *path, const char *name,
 	return ret;
 }
 
-static int usbg_parse_config_strs(const char *path, const char *name,
-		int lang, usbg_config_strs *c_strs)
+static int usbg_parse_config_strs(usbg_state *s, const char *path,
+				  const char *name, int lang,
+				  usbg_config_strs *c_strs)
 {
-	DIR *dir;
 	int ret;
 	int nmb;
 	char spath[USBG_MAX_PATH_LENGTH];
@@ -1224,14 +1301,12 @@ static int usbg_parse_config_strs(const char *path, const char *name,
 			STRINGS_DIR, lang);
 	if (nmb < sizeof(spath)) {
 		/* Check if directory exist */
-		dir = opendir(spath);
-		if (dir) {
-			closedir(dir);
-			ret = usbg_read_string(spath, "", "configuration",
+		nmb = usbg_io_check_dir(s, spath);
+		if (nmb == 0)
+			ret = usbg_read_string(s, spath, "", "configuration",
 					c_strs->configuration);
-		} else {
-			ret = usbg_translate_error(errno);
-		}
+		else
+			ret = usbg_translate_error(-nmb);
 	} else {
 		ret = USBG_ERROR_PATH_TOO_LONG;
 	}
@@ -1250,9 +1325,10 @@ static int usbg_parse_config_binding(usbg_config *c, char *bpath, int path_size)
 	usbg_function *f;
 	usbg_binding *b;
 
-	nmb = readlink(bpath, target, sizeof(target) - 1 );
+	nmb = usbg_io_readlink(c->parent->parent, bpath, target,
+			       sizeof(target) - 1);
 	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-nmb);
 		goto out;
 	}
 
@@ -1302,9 +1378,10 @@ static int usbg_parse_config_bindings(usbg_config *c)
 		goto out;
 	}
 
-	n = scandir(bpath, &dent, bindings_select, alphasort);
+	n = usbg_io_list_dir(c->parent->parent, bpath, &dent, bindings_select,
+			     alphasort);
 	if (n < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-n);
 		goto out;
 	}
 
@@ -1367,9 +1444,9 @@ static int usbg_parse_configs(const char *path, usbg_gadget *g)
 		goto out;
 	}
 
-	n = scandir(cpath, &dent, file_select, alphasort);
+	n = usbg_io_list_dir(g->parent, cpath, &dent, file_select, alphasort);
 	if (n < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-n);
 		goto out;
 	}
 
@@ -1382,59 +1459,60 @@ static int usbg_parse_configs(const char *path, usbg_gadget *g)
 	free(dent);
 
 out:
+	USBG_PROBE2(parse_configs_done, g->name, ret);
 	return ret;
 }
 
-static int usbg_parse_gadget_attrs(const char *path, const char *name,
-		usbg_gadget_attrs *g_attrs)
+static int usbg_parse_gadget_attrs(usbg_state *s, const char *path,
+				   const char *name, usbg_gadget_attrs *g_attrs)
 {
 	int buf, ret;
 
 	/* Actual attributes */
 
-	ret = usbg_read_hex(path, name, "bcdUSB", &buf);
+	ret = usbg_read_hex(s, path, name, "bcdUSB", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->bcdUSB = (uint16_t) buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bDeviceClass", &buf);
+	ret = usbg_read_hex(s, path, name, "bDeviceClass", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->bDeviceClass = (uint8_t)buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bDeviceSubClass", &buf);
+	ret = usbg_read_hex(s, path, name, "bDeviceSubClass", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->bDeviceSubClass = (uint8_t)buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bDeviceProtocol", &buf);
+	ret = usbg_read_hex(s, path, name, "bDeviceProtocol", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->bDeviceProtocol = (uint8_t) buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bMaxPacketSize0", &buf);
+	ret = usbg_read_hex(s, path, name, "bMaxPacketSize0", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->bMaxPacketSize0 = (uint8_t) buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "idVendor", &buf);
+	ret = usbg_read_hex(s, path, name, "idVendor", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->idVendor = (uint16_t) buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "idProduct", &buf);
+	ret = usbg_read_hex(s, path, name, "idProduct", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->idProduct = (uint16_t) buf;
 	else
 		goto out;
 
-	ret = usbg_read_hex(path, name, "bcdDevice", &buf);
+	ret = usbg_read_hex(s, path, name, "bcdDevice", &buf);
 	if (ret == USBG_SUCCESS)
 		g_attrs->bcdDevice = (uint16_t) buf;
 	else
@@ -1444,12 +1522,12 @@ out:
 	return ret;
 }
 
-static int usbg_parse_gadget_strs(const char *path, const char *name, int lang,
-		usbg_gadget_strs *g_strs)
+static int usbg_parse_gadget_strs(usbg_state *s, const char *path,
+				  const char *name, int lang,
+				  usbg_gadget_strs *g_strs)
 {
 	int ret;
 	int nmb;
-	DIR *dir;
 	char spath[USBG_MAX_PATH_LENGTH];
 
 	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s/0x%x", path, name,
@@ -1460,22 +1538,24 @@ static int usbg_parse_gadget_strs(const char *path, const char *name, int lang,
 	}
 
 	/* Check if directory exist */
-	dir = opendir(spath);
-	if (dir) {
-		closedir(dir);
-		ret = usbg_read_string(spath, "", "serialnumber", g_strs->str_ser);
+	nmb = usbg_io_check_dir(s, spath);
+	if (nmb == 0) {
+		ret = usbg_read_string(s, spath, "", "serialnumber",
+				       g_strs->str_ser);
 		if (ret != USBG_SUCCESS)
 			goto out;
 
-		ret = usbg_read_string(spath, "", "manufacturer", g_strs->str_mnf);
+		ret = usbg_read_string(s, spath, "", "manufacturer",
+				       g_strs->str_mnf);
 		if (ret != USBG_SUCCESS)
 			goto out;
 
-		ret = usbg_read_string(spath, "", "product", g_strs->str_prd);
+		ret = usbg_read_string(s, spath, "", "product",
+				       g_strs->str_prd);
 		if (ret != USBG_SUCCESS)
 			goto out;
 	} else {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-nmb);
 	}
 
 out:
@@ -1487,8 +1567,9 @@ static inline int usbg_parse_gadget(usbg_gadget *g)
 	int ret;
 	char buf[USBG_MAX_STR_LENGTH];
 
+	USBG_PROBE1(parse_gadget_start, g->name);
 	/* UDC bound to, if any */
-	ret = usbg_read_string(g->path, g->name, "UDC", buf);
+	ret = usbg_read_string(g->parent, g->path, g->name, "UDC", buf);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -1502,6 +1583,7 @@ static inline int usbg_parse_gadget(usbg_gadget *g)
 
 	ret = usbg_parse_configs(g->path, g);
 out:
+	USBG_PROBE2(parse_gadget_done, g->name, ret);
 	return ret;
 }
 
@@ -1512,7 +1594,7 @@ static int usbg_parse_gadgets(const char *path, usbg_state *s)
 	int ret = USBG_SUCCESS;
 	struct dirent **dent;
 
-	n = scandir(path, &dent, file_select, alphasort);
+	n = usbg_io_list_dir(s, path, &dent, file_select, alphasort);
 	if (n >= 0) {
 		for (i = 0; i < n; i++) {
 			/* Check if earlier gadgets
@@ -1534,12 +1616,34 @@ static int usbg_parse_gadgets(const char *path, usbg_state *s)
 		}
 		free(dent);
 	} else {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-n);
 	}
 
 	return ret;
 }
 
+int usbg_parse_new_gadget(usbg_state *s, const char *name, usbg_gadget **g)
+{
+	usbg_gadget *newg;
+	int ret;
+
+	newg = usbg_allocate_gadget(s->path, name, s);
+	if (!newg)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_parse_gadget(newg);
+	if (ret != USBG_SUCCESS) {
+		usbg_free_gadget(newg);
+		return ret;
+	}
+
+	INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name, newg, gnode);
+	usbg_state_changed(s);
+	*g = newg;
+
+	return USBG_SUCCESS;
+}
+
 static int usbg_parse_udcs(usbg_state *s)
 {
 	usbg_udc *u;
@@ -1547,9 +1651,10 @@ static int usbg_parse_udcs(usbg_state *s)
 	int ret = USBG_SUCCESS;
 	struct dirent **dent;
 
-	n = scandir("/sys/class/udc", &dent, file_select, alphasort);
+	n = usbg_io_list_dir(s, s->udc_class_path, &dent, file_select,
+			     alphasort);
 	if (n < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-n);
 		goto out;
 	}
 
@@ -1570,7 +1675,8 @@ out:
 	return ret;
 }
 
-static usbg_state *usbg_allocate_state(const char *configfs_path, char *path)
+static usbg_state *usbg_allocate_state(const char *configfs_path, char *path,
+		const usbg_init_opts *opts)
 {
 	usbg_state *s;
 
@@ -1582,14 +1688,60 @@ static usbg_state *usbg_allocate_state(const char *configfs_path, char *path)
 	if (!s->configfs_path)
 		goto cpath_failed;
 
+	s->sysfs_path = strdup(opts && opts->sysfs_path ?
+			       opts->sysfs_path : SYSFS_DIR);
+	if (!s->sysfs_path)
+		goto spath_failed;
+
+	if (asprintf(&s->udc_class_path, "%s/" UDC_CLASS_DIR,
+		     s->sysfs_path) < 0)
+		goto udc_path_failed;
+
 	/* State takes the ownership of path and should free it */
 	s->path = path;
 	s->last_failed_import = NULL;
+	s->io = opts && opts->io ? opts->io : usbg_get_default_io_backend();
+	s->io_ctx = opts && opts->io ? opts->io_ctx : NULL;
+	s->stats = NULL;
+	s->trace_cb = NULL;
+	s->trace_ctx = NULL;
+	s->thread_safe = false;
+	s->generation = 0;
+	s->snap = NULL;
+	s->read_only = false;
+	s->refs = 0;
+	if (pthread_mutex_init(&s->snap_lock, NULL))
+		goto snap_lock_failed;
+
+	if (usbg_process_lock_init(s, opts) != USBG_SUCCESS)
+		goto process_lock_failed;
+
+	if (opts && opts->stats) {
+		s->stats = calloc(1, sizeof(*s->stats));
+		if (!s->stats)
+			goto stats_failed;
+	}
+
+	if (opts && opts->thread_safe && usbg_lock_init(s) != USBG_SUCCESS)
+		goto lock_failed;
+
 	TAILQ_INIT(&s->gadgets);
 	TAILQ_INIT(&s->udcs);
 
 	return s;
 
+lock_failed:
+	free(s->stats);
+stats_failed:
+	usbg_process_lock_destroy(s);
+process_lock_failed:
+	pthread_mutex_destroy(&s->snap_lock);
+snap_lock_failed:
+	free(s->udc_class_path);
+udc_path_failed:
+	free(s->sysfs_path);
+spath_failed:
+	free(s->configfs_path);
 cpath_failed:
 	free(s);
 err:
@@ -1602,17 +1754,22 @@ static int usbg_parse_state(usbg_state *s)
 
 	/*
 	 * USBG_ERROR_NOT_FOUND is returned if we are running on machine where
-	 * there is no udc support in kernel (no /sys/class/udc dir).
+	 * there is no udc support in kernel (no class/udc dir in sysfs).
 	 * This check allows to run library on such machine or if we don't
 	 * have rights to read this directory.
 	 * User will be able to finish init function and manage gadgets but
 	 * wont be able to bind it as there is no UDC.
 	 */
+	USBG_PROBE1(parse_state_start, s->configfs_path);
 	ret = usbg_parse_udcs(s);
+	USBG_PROBE1(parse_udcs_done, ret);
 	if (ret != USBG_SUCCESS && ret != USBG_ERROR_NOT_FOUND &&
 		ret != USBG_ERROR_NO_ACCESS) {
 		ERROR("Unable to parse udcs");
 		goto out;
+	} else if (ret != USBG_SUCCESS) {
+		INFO("no udcs in %s: %s\n", s->udc_class_path,
+		     usbg_strerror(ret));
 	}
 
 	ret = usbg_parse_gadgets(s->path, s);
@@ -1620,6 +1777,7 @@ static int usbg_parse_state(usbg_state *s)
 		ERROR("unable to parse %s\n", s->path);
 
 out:
+	USBG_PROBE1(parse_state_done, ret);
 	return ret;
 }
 
@@ -1627,35 +1785,57 @@ out:
  * User API
  */
 
+/* Only open_attr is optional, all other operations are required */
+static bool usbg_io_backend_valid(const usbg_io_backend *io)
+{
+	return io->read_attr && io->write_attr && io->mkdir && io->rmdir &&
+		io->unlink && io->symlink && io->readlink && io->list_dir &&
+		io->check_dir;
+}
+
 int usbg_init(const char *configfs_path, usbg_state **state)
+{
+	return usbg_init_with_opts(configfs_path, NULL, state);
+}
+
+int usbg_init_with_opts(const char *configfs_path, const usbg_init_opts *opts,
+		usbg_state **state)
 {
 	int ret = USBG_SUCCESS;
-	DIR *dir;
+	usbg_stats_site site;
 	char *path;
 	usbg_state *s;
 
+	if (!configfs_path || !state)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (opts && opts->io && !usbg_io_backend_valid(opts->io))
+		return USBG_ERROR_INVALID_PARAM;
+
 	ret = asprintf(&path, "%s/" GADGETS_DIR, configfs_path);
 	if (ret < 0)
 		return USBG_ERROR_NO_MEM;
 	else
 		ret = USBG_SUCCESS;
 
-	/* Check if directory exist */
-	dir = opendir(path);
-	if (!dir) {
-		ERRORNO("couldn't init gadget state\n");
-		ret = usbg_translate_error(errno);
-		goto err;
-	}
-
-	closedir(dir);
-	s = usbg_allocate_state(configfs_path, path);
+	s = usbg_allocate_state(configfs_path, path, opts);
 	if (!s) {
 		ret = USBG_ERROR_NO_MEM;
 		goto err;
 	}
 
+	site = usbg_stats_enter(s, USBG_STATS_SITE_PARSE);
+	/* Check if directory exist */
+	ret = usbg_io_check_dir(s, path);
+	if (ret < 0) {
+		ERROR("couldn't init gadget state: %s\n", strerror(-ret));
+		ret = usbg_translate_error(-ret);
+		usbg_free_state(s);
+		goto out;
+	}
+
 	ret = usbg_parse_state(s);
+	usbg_stats_leave(s, site);
 	if (ret != USBG_SUCCESS) {
 		ERROR("couldn't init gadget state\n");
 		usbg_free_state(s);
@@ -1674,7 +1854,207 @@ out:
 
 void usbg_cleanup(usbg_state *s)
 {
-	usbg_free_state(s);
+	if (s && s->read_only)
+		usbg_snapshot_release(s);
+	else
+		usbg_free_state(s);
+}
+
+static inline void usbg_snap_lock(usbg_state *s)
+{
+	if (s->thread_safe)
+		pthread_mutex_lock(&s->snap_lock);
+}
+
+static inline void usbg_snap_unlock(usbg_state *s)
+{
+	if (s->thread_safe)
+		pthread_mutex_unlock(&s->snap_lock);
+}
+
+static int usbg_copy_gadget(usbg_state *snap, usbg_gadget *g)
+{
+	usbg_gadget *ng;
+	usbg_function *f, *nf;
+	usbg_config *c, *nc;
+	usbg_binding *b, *nb;
+
+	ng = usbg_allocate_gadget(g->path, g->name, snap);
+	if (!ng)
+		return USBG_ERROR_NO_MEM;
+	TAILQ_INSERT_TAIL(&snap->gadgets, ng, gnode);
+
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		nf = usbg_allocate_function(f->path, f->type, f->instance, ng);
+		if (!nf)
+			return USBG_ERROR_NO_MEM;
+		TAILQ_INSERT_TAIL(&ng->functions, nf, fnode);
+
+		if (f->label) {
+			nf->label = strdup(f->label);
+			if (!nf->label)
+				return USBG_ERROR_NO_MEM;
+		}
+	}
+
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		nc = usbg_allocate_config(c->path, c->label, c->id, ng);
+		if (!nc)
+			return USBG_ERROR_NO_MEM;
+		TAILQ_INSERT_TAIL(&ng->configs, nc, cnode);
+
+		TAILQ_FOREACH(b, &c->bindings, bnode) {
+			nb = usbg_allocate_binding(b->path, b->name, nc);
+			if (!nb)
+				return USBG_ERROR_NO_MEM;
+			TAILQ_INSERT_TAIL(&nc->bindings, nb, bnode);
+
+			nb->target = usbg_get_function(ng, b->target->type,
+						       b->target->instance);
+		}
+	}
+
+	if (g->udc) {
+		ng->udc = usbg_get_udc(snap, g->udc->name);
+		if (ng->udc)
+			ng->udc->gadget = ng;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Deep copy of objects tree, attributes are still read from configfs */
+static int usbg_copy_state(usbg_state *s, usbg_state **snap)
+{
+	usbg_init_opts opts = {
+		.io = s->io,
+		.io_ctx = s->io_ctx,
+		.sysfs_path = s->sysfs_path,
+	};
+	usbg_state *ns;
+	usbg_gadget *g;
+	usbg_udc *u, *nu;
+	char *path;
+	int ret = USBG_ERROR_NO_MEM;
+
+	path = strdup(s->path);
+	if (!path)
+		goto out;
+
+	ns = usbg_allocate_state(s->configfs_path, path, &opts);
+	if (!ns) {
+		free(path);
+		goto out;
+	}
+
+	ns->read_only = true;
+	ns->refs = 1;
+	ns->generation = s->generation;
+
+	TAILQ_FOREACH(u, &s->udcs, unode) {
+		nu = usbg_allocate_udc(ns, u->name);
+		if (!nu)
+			goto err;
+		TAILQ_INSERT_TAIL(&ns->udcs, nu, unode);
+	}
+
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		ret = usbg_copy_gadget(ns, g);
+		if (ret != USBG_SUCCESS)
+			goto err;
+	}
+
+	*snap = ns;
+	return USBG_SUCCESS;
+
+err:
+	usbg_free_state(ns);
+out:
+	return ret;
+}
+
+/*
+ * Replace snapshot of state with a new one and take reference of it for
+ * the caller. Called with lock held, possibly by many readers at once.
+ */
+static int usbg_snapshot_publish(usbg_state *s, usbg_state **snap)
+{
+	usbg_state *old, *ns = NULL;
+	int ret;
+
+	usbg_snap_lock(s);
+	old = s->snap;
+	/* Other reader may have been first */
+	if (old && old->generation == s->generation) {
+		__atomic_add_fetch(&old->refs, 1, __ATOMIC_RELAXED);
+		usbg_snap_unlock(s);
+		*snap = old;
+		return USBG_SUCCESS;
+	}
+	usbg_snap_unlock(s);
+
+	/* On failure drop outdated snapshot, the next reader will retry */
+	ret = usbg_copy_state(s, &ns);
+	if (ret == USBG_SUCCESS)
+		ns->refs = 2;
+
+	usbg_snap_lock(s);
+	old = s->snap;
+	s->snap = ns;
+	usbg_snap_unlock(s);
+
+	if (old)
+		usbg_snapshot_release(old);
+
+	if (ret == USBG_SUCCESS)
+		*snap = ns;
+
+	return ret;
+}
+
+int usbg_snapshot_acquire(usbg_state *s, usbg_state **snap)
+{
+	usbg_state *cur;
+	int ret;
+
+	if (!s || !snap)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (s->read_only) {
+		__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+		*snap = s;
+		return USBG_SUCCESS;
+	}
+
+	/*
+	 * Snapshot is built lazily by the first reader after a change,
+	 * so writers don't pay for copying the tree on each change.
+	 */
+	usbg_snap_lock(s);
+	cur = s->snap;
+	if (cur && cur->generation ==
+	    __atomic_load_n(&s->generation, __ATOMIC_ACQUIRE)) {
+		__atomic_add_fetch(&cur->refs, 1, __ATOMIC_RELAXED);
+		usbg_snap_unlock(s);
+		*snap = cur;
+		return USBG_SUCCESS;
+	}
+	usbg_snap_unlock(s);
+
+	usbg_lock_shared(s);
+	ret = usbg_snapshot_publish(s, snap);
+	usbg_unlock(s);
+
+	return ret;
+}
+
+void usbg_snapshot_release(usbg_state *snap)
+{
+	if (!snap || !snap->read_only)
+		return;
+
+	if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		usbg_free_state(snap);
 }
 
 const char *usbg_get_configfs_path(usbg_state *s)
@@ -1682,6 +2062,11 @@ const char *usbg_get_configfs_path(usbg_state *s)
 	return s ? s->configfs_path : NULL;
 }
 
+const char *usbg_get_sysfs_path(usbg_state *s)
+{
+	return s ? s->sysfs_path : NULL;
+}
+
 size_t usbg_get_configfs_path_len(usbg_state *s)
 {
 	return s ? strlen(s->configfs_path) : USBG_ERROR_INVALID_PARAM;
@@ -1702,11 +2087,13 @@ usbg_gadget *usbg_get_gadget(usbg_state *s, const char *name)
 {
 	usbg_gadget *g;
 
+	usbg_lock_shared(s);
 	TAILQ_FOREACH(g, &s->gadgets, gnode)
 		if (!strcmp(g->name, name))
-			return g;
+			break;
+	usbg_unlock(s);
 
-	return NULL;
+	return g;
 }
 
 usbg_function *usbg_get_function(usbg_gadget *g,
@@ -1714,9 +2101,11 @@ usbg_function *usbg_get_function(usbg_gadget *g,
 {
 	usbg_function *f = NULL;
 
+	usbg_lock_shared(g->parent);
 	TAILQ_FOREACH(f, &g->functions, fnode)
 		if (f->type == type && (!strcmp(f->instance, instance)))
 			break;
+	usbg_unlock(g->parent);
 
 	return f;
 }
@@ -1725,9 +2114,11 @@ usbg_config *usbg_get_config(usbg_gadget *g, int id, const char *label)
 {
 	usbg_config *c = NULL;
 
+	usbg_lock_shared(g->parent);
 	TAILQ_FOREACH(c, &g->configs, cnode)
 		if (c->id == id && (!label || !strcmp(c->label, label)))
 			break;
+	usbg_unlock(g->parent);
 
 	return c;
 }
@@ -1736,50 +2127,75 @@ usbg_udc *usbg_get_udc(usbg_state *s, const char *name)
 {
 	usbg_udc *u;
 
+	usbg_lock_shared(s);
 	TAILQ_FOREACH(u, &s->udcs, unode)
 		if (!strcmp(u->name, name))
-			return u;
+			break;
+	usbg_unlock(s);
 
-	return NULL;
+	return u;
 }
 
 usbg_binding *usbg_get_binding(usbg_config *c, const char *name)
 {
 	usbg_binding *b;
 
+	usbg_lock_shared(c->parent->parent);
 	TAILQ_FOREACH(b, &c->bindings, bnode)
 		if (!strcmp(b->name, name))
-			return b;
+			break;
+	usbg_unlock(c->parent->parent);
 
-	return NULL;
+	return b;
 }
 
 usbg_binding *usbg_get_link_binding(usbg_config *c, usbg_function *f)
 {
 	usbg_binding *b;
 
+	usbg_lock_shared(c->parent->parent);
 	TAILQ_FOREACH(b, &c->bindings, bnode)
 		if (b->target == f)
-			return b;
+			break;
+	usbg_unlock(c->parent->parent);
 
-	return NULL;
+	return b;
 }
 
 int usbg_rm_binding(usbg_binding *b)
 {
 	int ret = USBG_SUCCESS;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	usbg_config *c;
+	usbg_state *s;
 
 	if (!b)
 		return USBG_ERROR_INVALID_PARAM;
 
 	c = b->parent;
+	s = c->parent->parent;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(s, c->parent->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(s);
+		return ret;
+	}
 
-	ret = ubsg_rm_file(b->path, b->name);
+	site = usbg_stats_enter(s, USBG_STATS_SITE_RM);
+	ret = ubsg_rm_file(s, b->path, b->name);
 	if (ret == USBG_SUCCESS) {
 		TAILQ_REMOVE(&(c->bindings), b, bnode);
 		usbg_free_binding(b);
+		usbg_state_changed(s);
 	}
+	usbg_stats_leave(s, site);
+	usbg_process_unlock(plock);
+	usbg_unlock(s);
 
 	return ret;
 }
@@ -1787,12 +2203,25 @@ int usbg_rm_binding(usbg_binding *b)
 int usbg_rm_config(usbg_config *c, int opts)
 {
 	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	usbg_gadget *g;
 
 	if (!c)
 		return ret;
 
 	g = c->parent;
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(g->parent, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(g->parent);
+		return ret;
+	}
+
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_RM);
 
 	if (opts & USBG_RM_RECURSE) {
 		/* Recursive flag was given
@@ -1815,28 +2244,31 @@ int usbg_rm_config(usbg_config *c, int opts)
 			goto out;
 		}
 
-		ret = usbg_rm_all_dirs(spath);
+		ret = usbg_rm_all_dirs(c->parent->parent, spath);
 		if (ret != USBG_SUCCESS)
 			goto out;
 	}
 
-	ret = usbg_rm_dir(c->path, c->name);
+	ret = usbg_rm_dir(c->parent->parent, c->path, c->name);
 	if (ret == USBG_SUCCESS) {
 		TAILQ_REMOVE(&(g->configs), c, cnode);
 		usbg_free_config(c);
+		usbg_state_changed(g->parent);
 	}
 
 out:
+	usbg_stats_leave(g->parent, site);
+	usbg_process_unlock(plock);
+	usbg_unlock(g->parent);
 	return ret;
 }
 
 static int usbg_rm_ms_function(usbg_function *f, int opts)
 {
 	int ret;
-	int nmb;
 	int i;
 	char lpath[USBG_MAX_PATH_LENGTH];
-	struct dirent **dent;
+	struct usbg_lun_index idx;
 
 	ret = snprintf(lpath, sizeof(lpath), "%s/%s/", f->path, f->name);
 	if (ret >= sizeof(lpath)) {
@@ -1844,27 +2276,18 @@ static int usbg_rm_ms_function(usbg_function *f, int opts)
 		goto out;
 	}
 
-	nmb = scandir(lpath, &dent, lun_select, lun_sort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+	ret = usbg_lun_index_build(f->parent->parent, lpath, &idx);
+	if (ret != USBG_SUCCESS)
 		goto out;
-	}
 
-	for (i = nmb - 1; i > 0; --i) {
-		ret = usbg_rm_dir(lpath, dent[i]->d_name);
-		free(dent[i]);
-		if (ret)
-			goto err_free_dent_loop;
+	/* lun0 cannot be removed */
+	for (i = idx.nluns - 1; i >= 0 && idx.luns[i].id > 0; --i) {
+		ret = usbg_rm_dir(f->parent->parent, lpath, idx.luns[i].name);
+		if (ret != USBG_SUCCESS)
+			break;
 	}
-	free(dent[0]);
-	free(dent);
 
-	return USBG_SUCCESS;
-
-err_free_dent_loop:
-	while (--i >= 0)
-		free(dent[i]);
-	free(dent[i]);
+	usbg_lun_index_free(&idx);
 out:
 	return ret;
 }
@@ -1872,12 +2295,25 @@ out:
 int usbg_rm_function(usbg_function *f, int opts)
 {
 	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	usbg_gadget *g;
 
 	if (!f)
 		return ret;
 
 	g = f->parent;
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(g->parent, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(g->parent);
+		return ret;
+	}
+
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_RM);
 
 	if (opts & USBG_RM_RECURSE) {
 		/* Recursive flag was given
@@ -1892,7 +2328,7 @@ int usbg_rm_function(usbg_function *f, int opts)
 					usbg_binding *b_next = TAILQ_NEXT(b, bnode);
 					ret = usbg_rm_binding(b);
 					if (ret != USBG_SUCCESS)
-						return ret;
+						goto out;
 
 					b = b_next;
 				} else {
@@ -1908,24 +2344,41 @@ int usbg_rm_function(usbg_function *f, int opts)
 			goto out;
 	}
 
-	ret = usbg_rm_dir(f->path, f->name);
+	ret = usbg_rm_dir(f->parent->parent, f->path, f->name);
 	if (ret == USBG_SUCCESS) {
 		TAILQ_REMOVE(&(g->functions), f, fnode);
 		usbg_free_function(f);
+		usbg_state_changed(g->parent);
 	}
 
 out:
+	usbg_stats_leave(g->parent, site);
+	usbg_process_unlock(plock);
+	usbg_unlock(g->parent);
 	return ret;
 }
 
 int usbg_rm_gadget(usbg_gadget *g)
 {
 	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	usbg_state *s;
 	if (!g)
-		goto out;
+		return ret;
 
 	s = g->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(s, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(s);
+		return ret;
+	}
+
+	site = usbg_stats_enter(s, USBG_STATS_SITE_RM);
 
 		/* Recursively remove all configs 
                    and functions by default if gadget
@@ -1957,17 +2410,21 @@ int usbg_rm_gadget(usbg_gadget *g)
 			goto out;
 		}
 
-		ret = usbg_rm_all_dirs(spath);
+		ret = usbg_rm_all_dirs(g->parent, spath);
 		if (ret != USBG_SUCCESS)
 			goto out;
          
-                ret = usbg_rm_dir(g->path, g->name);		
+                ret = usbg_rm_dir(g->parent, g->path, g->name);		
                 if (ret == USBG_SUCCESS) {
 		       TAILQ_REMOVE(&(s->gadgets), g, gnode);
 		       usbg_free_gadget(g);
+		       usbg_state_changed(s);
                 }
 
 out:
+	usbg_stats_leave(s, site);
+	usbg_process_unlock(plock);
+	usbg_unlock(s);
 	return ret;
 }
 
@@ -1982,9 +2439,13 @@ int usbg_rm_config_strs(usbg_config *c, int lang)
 
 	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", c->path, c->name,
 			STRINGS_DIR, lang);
-	if (nmb < sizeof(path))
-		ret = usbg_rm_dir(path, "");
-	else
+	if (nmb < sizeof(path)) {
+		usbg_state *s = c->parent->parent;
+		usbg_stats_site site = usbg_stats_enter(s, USBG_STATS_SITE_RM);
+
+		ret = usbg_rm_dir(s, path, "");
+		usbg_stats_leave(s, site);
+	} else
 		ret = USBG_ERROR_PATH_TOO_LONG;
 
 	return ret;
@@ -2001,9 +2462,13 @@ int usbg_rm_gadget_strs(usbg_gadget *g, int lang)
 
 	nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path, g->name,
 			STRINGS_DIR, lang);
-	if (nmb < sizeof(path))
-		ret = usbg_rm_dir(path, "");
-	else
+	if (nmb < sizeof(path)) {
+		usbg_stats_site site = usbg_stats_enter(g->parent,
+							USBG_STATS_SITE_RM);
+
+		ret = usbg_rm_dir(g->parent, path, "");
+		usbg_stats_leave(g->parent, site);
+	} else
 		ret = USBG_ERROR_PATH_TOO_LONG;
 
 	return ret;
@@ -2033,20 +2498,20 @@ static int usbg_create_empty_gadget(usbg_state *s, const char *name,
 
 	gad = *g; /* alias only */
 
-	ret = mkdir(gpath, S_IRWXU|S_IRWXG|S_IRWXO);
+	ret = usbg_io_mkdir(s, gpath, S_IRWXU|S_IRWXG|S_IRWXO);
 	if (ret == 0) {
 		/* Should be empty but read the default */
-		ret = usbg_read_string(gad->path, gad->name,
+		ret = usbg_read_string(s, gad->path, gad->name,
 				       "UDC", buf);
 		if (ret != USBG_SUCCESS) {
-			rmdir(gpath);
+			usbg_io_rmdir(s, gpath);
 		} else {
 			gad->udc = usbg_get_udc(s, buf);
 			if (gad->udc)
 				gad->udc->gadget = gad;
 		}
 	} else {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-ret);
 	}
 
 	if (ret != USBG_SUCCESS) {
@@ -2059,55 +2524,92 @@ out:
 }
 
 int usbg_create_gadget_vid_pid(usbg_state *s, const char *name,
-		uint16_t idVendor, uint16_t idProduct, usbg_gadget **g)
+			       uint16_t idVendor, uint16_t idProduct,
+			       usbg_gadget **g)
 {
 	int ret;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	usbg_gadget *gad;
 
 	if (!s || !g)
 		return USBG_ERROR_INVALID_PARAM;
 
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(s, name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(s);
+		return ret;
+	}
+
 	gad = usbg_get_gadget(s, name);
 	if (gad) {
 		ERROR("duplicate gadget name\n");
+		usbg_process_unlock(plock);
+		usbg_unlock(s);
 		return USBG_ERROR_EXIST;
 	}
 
+	site = usbg_stats_enter(s, USBG_STATS_SITE_CREATE);
 	ret = usbg_create_empty_gadget(s, name, g);
 	gad = *g;
 
 	/* Check if gadget creation was successful and set attributes */
 	if (ret == USBG_SUCCESS) {
-		ret = usbg_write_hex16(s->path, name, "idVendor", idVendor);
+		ret = usbg_write_hex16(s, s->path, name, "idVendor", idVendor);
 		if (ret == USBG_SUCCESS) {
-			ret = usbg_write_hex16(s->path, name, "idProduct", idProduct);
-			if (ret == USBG_SUCCESS)
+			ret = usbg_write_hex16(s, s->path, name, "idProduct",
+					       idProduct);
+			if (ret == USBG_SUCCESS) {
 				INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
 						gad, gnode);
-			else
+				usbg_state_changed(s);
+			} else {
 				usbg_free_gadget(gad);
+			}
 		}
 	}
+	usbg_stats_leave(s, site);
+	usbg_process_unlock(plock);
+	usbg_unlock(s);
 
 	return ret;
 }
 
 int usbg_create_gadget(usbg_state *s, const char *name,
-		       const usbg_gadget_attrs *g_attrs, const usbg_gadget_strs *g_strs,
-		       usbg_gadget **g)
+		       const usbg_gadget_attrs *g_attrs,
+		       const usbg_gadget_strs *g_strs, usbg_gadget **g)
 {
 	usbg_gadget *gad;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	int ret;
 
 	if (!s || !g)
 			return USBG_ERROR_INVALID_PARAM;
 
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(s, name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(s);
+		return ret;
+	}
+
 	gad = usbg_get_gadget(s, name);
 	if (gad) {
 		ERROR("duplicate gadget name\n");
+		usbg_process_unlock(plock);
+		usbg_unlock(s);
 		return USBG_ERROR_EXIST;
 	}
 
+	site = usbg_stats_enter(s, USBG_STATS_SITE_CREATE);
 	ret = usbg_create_empty_gadget(s, name, g);
 	gad = *g;
 
@@ -2119,18 +2621,24 @@ int usbg_create_gadget(usbg_state *s, const char *name,
 		if (g_strs)
 			ret = usbg_set_gadget_strs(gad, LANG_US_ENG, g_strs);
 
-		if (ret == USBG_SUCCESS)
+		if (ret == USBG_SUCCESS) {
 			INSERT_TAILQ_STRING_ORDER(&s->gadgets, ghead, name,
 				gad, gnode);
-		else
+			usbg_state_changed(s);
+		} else {
 			usbg_free_gadget(gad);
+		}
 	}
+	usbg_stats_leave(s, site);
+	usbg_process_unlock(plock);
+	usbg_unlock(s);
 	return ret;
 }
 
 int usbg_get_gadget_attrs(usbg_gadget *g, usbg_gadget_attrs *g_attrs)
 {
-	return g && g_attrs ? usbg_parse_gadget_attrs(g->path, g->name, g_attrs)
+	return g && g_attrs ? usbg_parse_gadget_attrs(g->parent, g->path,
+						      g->name, g_attrs)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
@@ -2188,7 +2696,7 @@ int usbg_set_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr, int val)
 	if (!attr_name)
 		goto out;
 
-	ret = usbg_write_hex(g->path, g->name, attr_name, val);
+	ret = usbg_write_hex(g->parent, g->path, g->name, attr_name, val);
 
 out:
 	return ret;
@@ -2206,7 +2714,7 @@ int usbg_get_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr)
 	if (!attr_name)
 		goto out;
 
-	usbg_read_hex(g->path, g->name, attr_name, &ret);
+	usbg_read_hex(g->parent, g->path, g->name, attr_name, &ret);
 
 out:
 	return ret;
@@ -2217,7 +2725,19 @@ usbg_udc *usbg_get_gadget_udc(usbg_gadget *g)
 	usbg_udc *u = NULL;
 
 	if (!g)
-		goto out;
+		return u;
+
+	/* Snapshot shows binding from the time when it was taken */
+	if (g->parent->read_only)
+		return g->udc;
+
+	/*
+	 * Caller which holds the lock shared (e.g. export) gets the binding
+	 * known to library as it is not allowed to modify the state.
+	 */
+	if (usbg_lock_exclusive(g->parent) != USBG_SUCCESS)
+		return g->udc;
+
 	/*
 	 * if gadget was enabled we have to check if kernel
 	 * didn't modify the UDC file due to some errors.
@@ -2228,7 +2748,7 @@ usbg_udc *usbg_get_gadget_udc(usbg_gadget *g)
 		char buf[USBG_MAX_STR_LENGTH];
 		int ret;
 
-		ret = usbg_read_string(g->path, g->name, "UDC", buf);
+		ret = usbg_read_string(g->parent, g->path, g->name, "UDC", buf);
 		if (ret != USBG_SUCCESS)
 			goto out;
 
@@ -2239,10 +2759,12 @@ usbg_udc *usbg_get_gadget_udc(usbg_gadget *g)
 			/* Kernel decided to detach this gadget */
 			g->udc->gadget = NULL;
 			g->udc = NULL;
+			usbg_state_changed(g->parent);
 		}
 	}
 
 out:
+	usbg_unlock(g->parent);
 	return u;
 }
 
@@ -2251,7 +2773,11 @@ usbg_gadget *usbg_get_udc_gadget(usbg_udc *u)
 	usbg_gadget *g = NULL;
 
 	if (!u)
-		goto out;
+		return g;
+
+	if (usbg_lock_exclusive(u->parent) != USBG_SUCCESS)
+		return u->gadget;
+
 	/*
 	 * if gadget was enabled on this UDC we have to check if kernel
 	 * didn't modify this due to some errors.
@@ -2267,10 +2793,11 @@ usbg_gadget *usbg_get_udc_gadget(usbg_udc *u)
 		} else {
 			u->gadget->udc = NULL;
 			u->gadget = NULL;
+			usbg_state_changed(u->parent);
 		}
 	}
 
-out:
+	usbg_unlock(u->parent);
 	return g;
 }
 
@@ -2280,41 +2807,42 @@ int usbg_set_gadget_attrs(usbg_gadget *g, const usbg_gadget_attrs *g_attrs)
 	if (!g || !g_attrs)
 		return USBG_ERROR_INVALID_PARAM;
 
-	ret = usbg_write_hex16(g->path, g->name, "bcdUSB", g_attrs->bcdUSB);
+	ret = usbg_write_hex16(g->parent, g->path, g->name, "bcdUSB",
+			       g_attrs->bcdUSB);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceClass",
+	ret = usbg_write_hex8(g->parent, g->path, g->name, "bDeviceClass",
 		g_attrs->bDeviceClass);
 	if (ret != USBG_SUCCESS)
 			goto out;
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceSubClass",
+	ret = usbg_write_hex8(g->parent, g->path, g->name, "bDeviceSubClass",
 		g_attrs->bDeviceSubClass);
 	if (ret != USBG_SUCCESS)
 			goto out;
 
-	ret = usbg_write_hex8(g->path, g->name, "bDeviceProtocol",
+	ret = usbg_write_hex8(g->parent, g->path, g->name, "bDeviceProtocol",
 		g_attrs->bDeviceProtocol);
 	if (ret != USBG_SUCCESS)
 			goto out;
 
-	ret = usbg_write_hex8(g->path, g->name, "bMaxPacketSize0",
+	ret = usbg_write_hex8(g->parent, g->path, g->name, "bMaxPacketSize0",
 		g_attrs->bMaxPacketSize0);
 	if (ret != USBG_SUCCESS)
 			goto out;
 
-	ret = usbg_write_hex16(g->path, g->name, "idVendor",
+	ret = usbg_write_hex16(g->parent, g->path, g->name, "idVendor",
 		g_attrs->idVendor);
 	if (ret != USBG_SUCCESS)
 			goto out;
 
-	ret = usbg_write_hex16(g->path, g->name, "idProduct",
+	ret = usbg_write_hex16(g->parent, g->path, g->name, "idProduct",
 		 g_attrs->idProduct);
 	if (ret != USBG_SUCCESS)
 			goto out;
 
-	ret = usbg_write_hex16(g->path, g->name, "bcdDevice",
+	ret = usbg_write_hex16(g->parent, g->path, g->name, "bcdDevice",
 		g_attrs->bcdDevice);
 
 out:
@@ -2323,72 +2851,78 @@ out:
 
 int usbg_set_gadget_vendor_id(usbg_gadget *g, uint16_t idVendor)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "idVendor", idVendor)
+	return g ? usbg_write_hex16(g->parent, g->path, g->name, "idVendor",
+				    idVendor)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_product_id(usbg_gadget *g, uint16_t idProduct)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "idProduct", idProduct)
+	return g ? usbg_write_hex16(g->parent, g->path, g->name, "idProduct",
+				    idProduct)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_device_class(usbg_gadget *g, uint8_t bDeviceClass)
 {
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceClass", bDeviceClass)
+	return g ? usbg_write_hex8(g->parent, g->path, g->name, "bDeviceClass",
+				   bDeviceClass)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_device_protocol(usbg_gadget *g, uint8_t bDeviceProtocol)
 {
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceProtocol", bDeviceProtocol)
+	return g ? usbg_write_hex8(g->parent, g->path, g->name,
+				   "bDeviceProtocol", bDeviceProtocol)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_device_subclass(usbg_gadget *g, uint8_t bDeviceSubClass)
 {
-	return g ? usbg_write_hex8(g->path, g->name, "bDeviceSubClass", bDeviceSubClass)
+	return g ? usbg_write_hex8(g->parent, g->path, g->name,
+				   "bDeviceSubClass", bDeviceSubClass)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_device_max_packet(usbg_gadget *g, uint8_t bMaxPacketSize0)
 {
-	return g ? usbg_write_hex8(g->path, g->name, "bMaxPacketSize0", bMaxPacketSize0)
+	return g ? usbg_write_hex8(g->parent, g->path, g->name,
+				   "bMaxPacketSize0", bMaxPacketSize0)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_device_bcd_device(usbg_gadget *g, uint16_t bcdDevice)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "bcdDevice", bcdDevice)
+	return g ? usbg_write_hex16(g->parent, g->path, g->name, "bcdDevice",
+				    bcdDevice)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_gadget_device_bcd_usb(usbg_gadget *g, uint16_t bcdUSB)
 {
-	return g ? usbg_write_hex16(g->path, g->name, "bcdUSB", bcdUSB)
+	return g ? usbg_write_hex16(g->parent, g->path, g->name, "bcdUSB",
+				    bcdUSB)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_get_gadget_strs(usbg_gadget *g, int lang,
 		usbg_gadget_strs *g_strs)
 {
-	return g && g_strs ? usbg_parse_gadget_strs(g->path, g->name, lang,
+	return g && g_strs ? usbg_parse_gadget_strs(g->parent, g->path, g->name,
+						    lang,
 			g_strs)	: USBG_ERROR_INVALID_PARAM;
 }
 
-static int usbg_check_dir(const char *path)
+static int usbg_check_dir(usbg_state *s, const char *path)
 {
-	int ret = USBG_SUCCESS;
-	DIR *dir;
+	int ret;
 
 	/* Assume that user will always have read access to this directory */
-	dir = opendir(path);
-	if (dir)
-		closedir(dir);
-	else if (errno != ENOENT || mkdir(path, S_IRWXU|S_IRWXG|S_IRWXO) != 0)
-		ret = usbg_translate_error(errno);
+	ret = usbg_io_check_dir(s, path);
+	if (ret == -ENOENT)
+		ret = usbg_io_mkdir(s, path, S_IRWXU|S_IRWXG|S_IRWXO);
 
-	return ret;
+	return ret ? usbg_translate_error(-ret) : USBG_SUCCESS;
 }
 
 int usbg_set_gadget_strs(usbg_gadget *g, int lang,
@@ -2408,17 +2942,20 @@ int usbg_set_gadget_strs(usbg_gadget *g, int lang,
 		goto out;
 	}
 
-	ret = usbg_check_dir(path);
+	ret = usbg_check_dir(g->parent, path);
 	if (ret == USBG_SUCCESS) {
-		ret = usbg_write_string(path, "", "serialnumber", g_strs->str_ser);
+		ret = usbg_write_string(g->parent, path, "", "serialnumber",
+					g_strs->str_ser);
 		if (ret != USBG_SUCCESS)
 			goto out;
 
-		ret = usbg_write_string(path, "", "manufacturer", g_strs->str_mnf);
+		ret = usbg_write_string(g->parent, path, "", "manufacturer",
+					g_strs->str_mnf);
 		if (ret != USBG_SUCCESS)
 			goto out;
 
-		ret = usbg_write_string(path, "", "product", g_strs->str_prd);
+		ret = usbg_write_string(g->parent, path, "", "product",
+					g_strs->str_prd);
 	}
 
 out:
@@ -2435,9 +2972,10 @@ int usbg_set_gadget_serial_number(usbg_gadget *g, int lang, const char *serno)
 		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
 				g->name, STRINGS_DIR, lang);
 		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
+			ret = usbg_check_dir(g->parent, path);
 			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "serialnumber", serno);
+				ret = usbg_write_string(g->parent, path, "",
+							"serialnumber", serno);
 		} else {
 			ret = USBG_ERROR_PATH_TOO_LONG;
 		}
@@ -2456,9 +2994,10 @@ int usbg_set_gadget_manufacturer(usbg_gadget *g, int lang, const char *mnf)
 		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
 				g->name, STRINGS_DIR, lang);
 		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
+			ret = usbg_check_dir(g->parent, path);
 			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "manufacturer", mnf);
+				ret = usbg_write_string(g->parent, path, "",
+							"manufacturer", mnf);
 		} else {
 			ret = USBG_ERROR_PATH_TOO_LONG;
 		}
@@ -2477,9 +3016,10 @@ int usbg_set_gadget_product(usbg_gadget *g, int lang, const char *prd)
 		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", g->path,
 				g->name, STRINGS_DIR, lang);
 		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
+			ret = usbg_check_dir(g->parent, path);
 			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "product", prd);
+				ret = usbg_write_string(g->parent, path, "",
+							"product", prd);
 		} else {
 			ret = USBG_ERROR_PATH_TOO_LONG;
 		}
@@ -2494,6 +3034,8 @@ int usbg_create_function(usbg_gadget *g, usbg_function_type type,
 {
 	char fpath[USBG_MAX_PATH_LENGTH];
 	usbg_function *func;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	int ret = USBG_ERROR_INVALID_PARAM;
 	int n, free_space;
 
@@ -2519,6 +3061,16 @@ int usbg_create_function(usbg_gadget *g, usbg_function_type type,
 		}
 	}
 
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(g->parent, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(g->parent);
+		return ret;
+	}
+
 	func = usbg_get_function(g, type, instance);
 	if (func) {
 		ERROR("duplicate function name\n");
@@ -2544,24 +3096,31 @@ int usbg_create_function(usbg_gadget *g, usbg_function_type type,
 	free_space = sizeof(fpath) - n;
 	n = snprintf(&(fpath[n]), free_space, "/%s", func->name);
 	if (n < free_space) {
-		ret = mkdir(fpath, S_IRWXU | S_IRWXG | S_IRWXO);
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_CREATE);
+		ret = usbg_io_mkdir(g->parent, fpath,
+				    S_IRWXU | S_IRWXG | S_IRWXO);
 		if (!ret) {
 			/* Success */
 			ret = USBG_SUCCESS;
 			if (f_attrs)
 				ret = usbg_set_function_attrs(func, f_attrs);
 		} else {
-			ret = usbg_translate_error(errno);
+			ret = usbg_translate_error(-ret);
 		}
+		usbg_stats_leave(g->parent, site);
 	}
 
-	if (ret == USBG_SUCCESS)
+	if (ret == USBG_SUCCESS) {
 		INSERT_TAILQ_STRING_ORDER(&g->functions, fhead, name,
 				func, fnode);
-	else
+		usbg_state_changed(g->parent);
+	} else {
 		usbg_free_function(func);
+	}
 
 out:
+	usbg_process_unlock(plock);
+	usbg_unlock(g->parent);
 	return ret;
 }
 
@@ -2571,15 +3130,27 @@ int usbg_create_config(usbg_gadget *g, int id, const char *label,
 {
 	char cpath[USBG_MAX_PATH_LENGTH];
 	usbg_config *conf = NULL;
+	usbg_stats_site site;
+	usbg_process_lock *plock;
 	int ret = USBG_ERROR_INVALID_PARAM;
 	int n, free_space;
 
 	if (!g || !c || id <= 0 || id > 255)
-		goto out;
+		return ret;
 
 	if (!label)
 		label = DEFAULT_CONFIG_LABEL;
 
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(g->parent, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(g->parent);
+		return ret;
+	}
+
 	conf = usbg_get_config(g, id, NULL);
 	if (conf) {
 		ERROR("duplicate configuration id\n");
@@ -2611,7 +3182,8 @@ int usbg_create_config(usbg_gadget *g, int id, const char *label,
 		goto out;
 	}
 
-	ret = mkdir(cpath, S_IRWXU | S_IRWXG | S_IRWXO);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_CREATE);
+	ret = usbg_io_mkdir(g->parent, cpath, S_IRWXU | S_IRWXG | S_IRWXO);
 	if (!ret) {
 		ret = USBG_SUCCESS;
 		if (c_attrs)
@@ -2621,16 +3193,21 @@ int usbg_create_config(usbg_gadget *g, int id, const char *label,
 			ret = usbg_set_config_string(conf, LANG_US_ENG,
 					c_strs->configuration);
 	} else {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-ret);
 	}
+	usbg_stats_leave(g->parent, site);
 
-	if (ret == USBG_SUCCESS)
+	if (ret == USBG_SUCCESS) {
 		INSERT_TAILQ_STRING_ORDER(&g->configs, chead, name,
 				conf, cnode);
-	else
+		usbg_state_changed(g->parent);
+	} else {
 		usbg_free_config(conf);
+	}
 
 out:
+	usbg_process_unlock(plock);
+	usbg_unlock(g->parent);
 	return ret;
 }
 
@@ -2686,9 +3263,11 @@ int usbg_set_config_attrs(usbg_config *c, const usbg_config_attrs *c_attrs)
 	int ret = USBG_ERROR_INVALID_PARAM;
 
 	if (c && c_attrs) {
-		ret = usbg_write_dec(c->path, c->name, "MaxPower", c_attrs->bMaxPower);
+		ret = usbg_write_dec(c->parent->parent, c->path, c->name,
+				     "MaxPower", c_attrs->bMaxPower);
 		if (ret == USBG_SUCCESS)
-			ret = usbg_write_hex8(c->path, c->name, "bmAttributes",
+			ret = usbg_write_hex8(c->parent->parent, c->path,
+					      c->name, "bmAttributes",
 					c_attrs->bmAttributes);
 	}
 
@@ -2698,25 +3277,29 @@ int usbg_set_config_attrs(usbg_config *c, const usbg_config_attrs *c_attrs)
 int usbg_get_config_attrs(usbg_config *c,
 		usbg_config_attrs *c_attrs)
 {
-	return c && c_attrs ? usbg_parse_config_attrs(c->path, c->name, c_attrs)
+	return c && c_attrs ? usbg_parse_config_attrs(c->parent->parent,
+						      c->path, c->name, c_attrs)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_config_max_power(usbg_config *c, int bMaxPower)
 {
-	return c ? usbg_write_dec(c->path, c->name, "MaxPower", bMaxPower)
+	return c ? usbg_write_dec(c->parent->parent, c->path, c->name,
+				  "MaxPower", bMaxPower)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_set_config_bm_attrs(usbg_config *c, int bmAttributes)
 {
-	return c ? usbg_write_hex8(c->path, c->name, "bmAttributes", bmAttributes)
+	return c ? usbg_write_hex8(c->parent->parent, c->path, c->name,
+				   "bmAttributes", bmAttributes)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
 int usbg_get_config_strs(usbg_config *c, int lang, usbg_config_strs *c_strs)
 {
-	return c && c_strs ? usbg_parse_config_strs(c->path, c->name, lang, c_strs)
+	return c && c_strs ? usbg_parse_config_strs(c->parent->parent, c->path,
+						    c->name, lang, c_strs)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
@@ -2736,9 +3319,11 @@ int usbg_set_config_string(usbg_config *c, int lang, const char *str)
 		nmb = snprintf(path, sizeof(path), "%s/%s/%s/0x%x", c->path,
 				c->name, STRINGS_DIR, lang);
 		if (nmb < sizeof(path)) {
-			ret = usbg_check_dir(path);
+			ret = usbg_check_dir(c->parent->parent, path);
 			if (ret == USBG_SUCCESS)
-				ret = usbg_write_string(path, "", "configuration", str);
+				ret = usbg_write_string(c->parent->parent, path,
+							"", "configuration",
+							str);
 		} else {
 			ret = USBG_ERROR_PATH_TOO_LONG;
 		}
@@ -2753,16 +3338,25 @@ int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
 	char fpath[USBG_MAX_PATH_LENGTH];
 	usbg_binding *b;
 	int ret = USBG_SUCCESS;
+	usbg_process_lock *plock;
 	int nmb;
 
-	if (!c || !f) {
-		ret = USBG_ERROR_INVALID_PARAM;
-		goto out;
-	}
+	if (!c || !f)
+		return USBG_ERROR_INVALID_PARAM;
 
 	if (!name)
 		name = f->name;
 
+	ret = usbg_lock_exclusive(c->parent->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(c->parent->parent, c->parent->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(c->parent->parent);
+		return ret;
+	}
+
 	b = usbg_get_binding(c, name);
 	if (b) {
 		ERROR("duplicate binding name\n");
@@ -2796,15 +3390,21 @@ int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
 		b->target = f;
 		nmb = snprintf(&(bpath[nmb]), free_space, "/%s", name);
 		if (nmb < free_space) {
+			usbg_state *s = c->parent->parent;
+			usbg_stats_site site;
 
-			ret = symlink(fpath, bpath);
+			site = usbg_stats_enter(s, USBG_STATS_SITE_CREATE);
+			ret = usbg_io_symlink(s, fpath, bpath);
+			usbg_stats_leave(s, site);
 			if (ret == 0) {
 				b->target = f;
 				INSERT_TAILQ_STRING_ORDER(&c->bindings, bhead,
 						name, b, bnode);
+				usbg_state_changed(s);
 			} else {
-				ERRORNO("%s -> %s\n", bpath, fpath);
-				ret = usbg_translate_error(errno);
+				ERROR("%s -> %s: %s\n", bpath, fpath,
+				      strerror(-ret));
+				ret = usbg_translate_error(-ret);
 			}
 		} else {
 			ret = USBG_ERROR_PATH_TOO_LONG;
@@ -2819,6 +3419,8 @@ int usbg_add_config_function(usbg_config *c, const char *name, usbg_function *f)
 	}
 
 out:
+	usbg_process_unlock(plock);
+	usbg_unlock(c->parent->parent);
 	return ret;
 }
 
@@ -2851,17 +3453,29 @@ int usbg_cpy_binding_name(usbg_binding *b, char *buf, size_t len)
 int usbg_enable_gadget(usbg_gadget *g, usbg_udc *udc)
 {
 	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_process_lock *plock;
 
 	if (!g)
 		return ret;
 
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(g->parent, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(g->parent);
+		return ret;
+	}
+
 	if (!udc) {
 		udc = usbg_get_first_udc(g->parent);
 		if (!udc)
-			return ret;
+			goto out;
 	}
 
-	ret = usbg_write_string(g->path, g->name, "UDC", udc->name);
+	USBG_PROBE2(enable_gadget_start, g->name, udc->name);
+	ret = usbg_write_string(g->parent, g->path, g->name, "UDC", udc->name);
 	if (ret == USBG_SUCCESS) {
 		/* If gadget has been detached and we didn't noticed
 		 * it we have to clean up now.
@@ -2870,28 +3484,288 @@ int usbg_enable_gadget(usbg_gadget *g, usbg_udc *udc)
 			g->udc->gadget = NULL;
 		g->udc = udc;
 		udc->gadget = g;
+		usbg_state_changed(g->parent);
 	}
+	USBG_PROBE2(enable_gadget_done, g->name, ret);
 
+out:
+	usbg_process_unlock(plock);
+	usbg_unlock(g->parent);
 	return ret;
 }
 
 int usbg_disable_gadget(usbg_gadget *g)
 {
 	int ret = USBG_ERROR_INVALID_PARAM;
+	usbg_process_lock *plock;
 
 	if (!g)
 		return ret;
 
-	ret = usbg_write_string(g->path, g->name, "UDC", "\n");
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_process_lock_auto(g->parent, g->name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(g->parent);
+		return ret;
+	}
+
+	USBG_PROBE1(disable_gadget_start, g->name);
+	ret = usbg_write_string(g->parent, g->path, g->name, "UDC", "\n");
 	if (ret == USBG_SUCCESS) {
 		if (g->udc)
 			g->udc->gadget = NULL;
 		g->udc = NULL;
+		usbg_state_changed(g->parent);
+	}
+	USBG_PROBE2(disable_gadget_done, g->name, ret);
+	usbg_process_unlock(plock);
+	usbg_unlock(g->parent);
+
+	return ret;
+}
+
+int usbg_get_udc_state(usbg_udc *u)
+{
+	char buf[USBG_MAX_STR_LENGTH];
+	int ret;
+
+	if (!u)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_read_string(u->parent, u->parent->udc_class_path, u->name,
+			       "state", buf);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_lookup_udc_state(buf);
+
+	return ret;
+}
+
+uint64_t usbg_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Map UDC state to the latest bind phase which it implies */
+static int usbg_udc_state_to_phase(int state)
+{
+	switch (state) {
+	case USBG_UDC_STATE_ATTACHED:
+	case USBG_UDC_STATE_POWERED:
+	case USBG_UDC_STATE_RECONNECTING:
+	case USBG_UDC_STATE_UNAUTHENTICATED:
+	case USBG_UDC_STATE_DEFAULT:
+		return USBG_BIND_PHASE_ATTACHED;
+	case USBG_UDC_STATE_ADDRESSED:
+		return USBG_BIND_PHASE_ADDRESSED;
+	case USBG_UDC_STATE_CONFIGURED:
+		return USBG_BIND_PHASE_CONFIGURED;
+	default:
+		return USBG_BIND_PHASE_ENABLED;
+	}
+}
+
+static void usbg_mark_bind_phase(usbg_gadget *g, usbg_bind_timings *t,
+				 int phase, uint64_t ns,
+				 usbg_bind_cb cb, void *data)
+{
+	int i;
+
+	/* States may change faster than we are able to notice, so
+	 * all skipped phases are reported with the same timestamp */
+	for (i = USBG_BIND_PHASE_MIN; i <= phase; ++i) {
+		if (t->reached & (1U << i))
+			continue;
+
+		t->reached |= 1U << i;
+		t->ns[i] = ns;
+		if (cb)
+			cb(g, i, ns, data);
+	}
+}
+
+/* Sysfs notifies state changes with POLLPRI but regular files
+ * never do, so wait only for a while and then simply re-read */
+#define UDC_STATE_POLL_MS 10
+
+static int usbg_wait_configured(usbg_gadget *g, usbg_udc *udc,
+				int timeout_ms, uint64_t start,
+				usbg_bind_timings *t, usbg_bind_cb cb,
+				void *data)
+{
+	char p[USBG_MAX_PATH_LENGTH];
+	char buf[USBG_MAX_STR_LENGTH];
+	uint64_t now, deadline = 0;
+	int nmb, state, wait_ms, fd;
+	int ret = USBG_SUCCESS;
+	char *nl;
+
+	nmb = snprintf(p, sizeof(p), "%s/%s/state",
+		       g->parent->udc_class_path, udc->name);
+	if (nmb >= sizeof(p))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	if (timeout_ms >= 0)
+		deadline = start + (uint64_t)timeout_ms * 1000000ULL;
+
+	/*
+	 * The same descriptor is read before each poll, freshly opened
+	 * sysfs file would report POLLPRI immediately.
+	 */
+	usbg_io_watch_attr(g->parent, p, &fd);
+	while (1) {
+		nmb = usbg_io_read_watched_attr(g->parent, fd, p, buf,
+						sizeof(buf));
+		if (nmb < 0) {
+			ret = usbg_translate_error(-nmb);
+			break;
+		}
+
+		nl = strchr(buf, '\n');
+		if (nl)
+			*nl = '\0';
+
+		now = usbg_now_ns();
+		state = usbg_lookup_udc_state(buf);
+		if (state >= 0)
+			usbg_mark_bind_phase(g, t,
+					     usbg_udc_state_to_phase(state),
+					     now - start, cb, data);
+
+		if (t->reached & (1U << USBG_BIND_PHASE_CONFIGURED))
+			break;
+
+		wait_ms = UDC_STATE_POLL_MS;
+		if (timeout_ms >= 0) {
+			if (now >= deadline) {
+				ret = USBG_ERROR_TIMEOUT;
+				break;
+			}
+
+			if ((deadline - now) / 1000000ULL < wait_ms)
+				wait_ms = (deadline - now + 999999ULL) / 1000000ULL;
+		}
+
+		nmb = usbg_io_wait_watched_attr(g->parent, fd, wait_ms);
+		if (nmb < 0) {
+			ret = usbg_translate_error(-nmb);
+			break;
+		}
+	}
+	usbg_io_unwatch_attr(g->parent, fd);
+
+	return ret;
+}
+
+int usbg_enable_gadget_wait(usbg_gadget *g, usbg_udc *udc,
+			    int timeout_ms, usbg_bind_timings *t,
+			    usbg_bind_cb cb, void *data)
+{
+	usbg_bind_timings local;
+	uint64_t start;
+	int ret = USBG_ERROR_INVALID_PARAM;
+
+	if (!g)
+		return ret;
+
+	if (!udc) {
+		udc = usbg_get_first_udc(g->parent);
+		if (!udc)
+			return ret;
 	}
 
+	if (!t)
+		t = &local;
+	memset(t, 0, sizeof(*t));
+
+	start = usbg_now_ns();
+	ret = usbg_enable_gadget(g, udc);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	usbg_mark_bind_phase(g, t, USBG_BIND_PHASE_ENABLED,
+			     usbg_now_ns() - start, cb, data);
+
+	ret = usbg_wait_configured(g, udc, timeout_ms, start, t, cb, data);
+out:
 	return ret;
 }
 
+void usbg_hist_add(usbg_hist *h, uint64_t ns)
+{
+	int bucket = 0;
+
+	if (!h)
+		return;
+
+	if (ns)
+		bucket = 63 - __builtin_clzll(ns);
+
+	if (!h->count || ns < h->min)
+		h->min = ns;
+	if (ns > h->max)
+		h->max = ns;
+
+	h->count++;
+	h->sum += ns;
+	h->buckets[bucket]++;
+}
+
+uint64_t usbg_hist_percentile(const usbg_hist *h, double percent)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	if (!h || !h->count)
+		return 0;
+
+	if (percent <= 0)
+		return h->min;
+
+	target = (uint64_t)(h->count * percent / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < USBG_HIST_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	/* Upper bound of bucket, but never above the real maximum */
+	if (i >= USBG_HIST_BUCKETS - 1)
+		return h->max;
+
+	return ((2ULL << i) - 1) < h->max ? (2ULL << i) - 1 : h->max;
+}
+
+void usbg_bind_stats_add(usbg_bind_stats *st, const usbg_bind_timings *t)
+{
+	int i;
+
+	if (!st || !t)
+		return;
+
+	st->cycles++;
+	if (!(t->reached & (1U << USBG_BIND_PHASE_CONFIGURED)))
+		st->incomplete++;
+
+	for (i = USBG_BIND_PHASE_MIN; i < USBG_BIND_PHASE_MAX; ++i)
+		if (t->reached & (1U << i))
+			usbg_hist_add(&st->phase[i], t->ns[i]);
+}
+
+void usbg_bind_stats_reset(usbg_bind_stats *st)
+{
+	if (st)
+		memset(st, 0, sizeof(*st));
+}
+
 /*
  * USB function-specific attribute configuration
  */
@@ -2990,51 +3864,64 @@ int usbg_set_function_net_attrs(usbg_function *f, const usbg_f_net_attrs *attrs)
 	}
 
 	addr = usbg_ether_ntoa_r(&attrs->dev_addr, addr_buf);
-	ret = usbg_write_string(f->path, f->name, "dev_addr", addr);
+	ret = usbg_write_string(f->parent->parent, f->path, f->name, "dev_addr",
+				addr);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
 	addr = usbg_ether_ntoa_r(&attrs->host_addr, addr_buf);
-	ret = usbg_write_string(f->path, f->name, "host_addr", addr);
+	ret = usbg_write_string(f->parent->parent, f->path, f->name,
+				"host_addr", addr);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_dec(f->path, f->name, "qmult", attrs->qmult);
+	ret = usbg_write_dec(f->parent->parent, f->path, f->name, "qmult",
+			     attrs->qmult);
 
 out:
 	return ret;
 }
 
-static int usbg_set_f_ms_lun_attrs(const char *path, const char *lun,
+/*
+ * Empty write never reaches kernel, so medium is ejected by writing
+ * bare new line, which kernel strips from file name.
+ */
+static inline const char *usbg_ms_lun_file(const char *filename)
+{
+	return filename && filename[0] ? filename : "\n";
+}
+
+static int usbg_set_f_ms_lun_attrs(usbg_state *s, const char *path,
+				   const char *lun,
 				   usbg_f_ms_lun_attrs *lun_attrs)
 {
 	int ret;
 
-	ret = usbg_write_bool(path, lun, "cdrom", lun_attrs->cdrom);
+	ret = usbg_write_bool(s, path, lun, "cdrom", lun_attrs->cdrom);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_bool(path, lun, "ro", lun_attrs->ro);
+	ret = usbg_write_bool(s, path, lun, "ro", lun_attrs->ro);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_bool(path, lun, "nofua", lun_attrs->nofua);
+	ret = usbg_write_bool(s, path, lun, "nofua", lun_attrs->nofua);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_bool(path, lun, "removable", lun_attrs->removable);
+	ret = usbg_write_bool(s, path, lun, "removable", lun_attrs->removable);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_string(path, lun, "file",
-				      lun_attrs->filename);
+	ret = usbg_write_string(s, path, lun, "file",
+				usbg_ms_lun_file(lun_attrs->filename));
 
 out:
 	return ret;
 }
 
-static int usbg_set_function_ms_attrs(usbg_function *f,
-				      const usbg_f_ms_attrs *f_attrs)
+static int usbg_set_function_ms_attrs_all(usbg_function *f,
+					  const usbg_f_ms_attrs *f_attrs)
 {
 	int ret;
 	int i, nmb;
@@ -3042,10 +3929,10 @@ static int usbg_set_function_ms_attrs(usbg_function *f,
 	char *new_lun_mask;
 	char lpath[USBG_MAX_PATH_LENGTH];
 	char *lpath_end;
-	DIR *dir;
-	struct dirent **dent;
+	struct usbg_lun_index idx;
 
-	ret = usbg_write_bool(f->path, f->name, "stall", f_attrs->stall);
+	ret = usbg_write_bool(f->parent->parent, f->path, f->name, "stall",
+			      f_attrs->stall);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
@@ -3090,14 +3977,13 @@ static int usbg_set_function_ms_attrs(usbg_function *f,
 		/*
 		 * Check if dir exist and create it if needed
 		 */
-		dir = opendir(lpath);
-		if (dir) {
-			closedir(dir);
-		} else if (errno != ENOENT) {
-			ret = usbg_translate_error(errno);
+		ret = usbg_io_check_dir(f->parent->parent, lpath);
+		if (ret && ret != -ENOENT) {
+			ret = usbg_translate_error(-ret);
 			goto err_lun_loop;
-		} else {
-			ret = mkdir(lpath, S_IRWXU|S_IRWXG|S_IRWXO);
+		} else if (ret) {
+			ret = usbg_io_mkdir(f->parent->parent, lpath,
+					    S_IRWXU|S_IRWXG|S_IRWXO);
 			if (!ret) {
 				/*
 				 * If we have created a new directory in
@@ -3106,7 +3992,7 @@ static int usbg_set_function_ms_attrs(usbg_function *f,
 				 */
 				new_lun_mask[i] = 1;
 			} else {
-				ret = usbg_translate_error(errno);
+				ret = usbg_translate_error(-ret);
 				goto err_lun_loop;
 			}
 		}
@@ -3115,40 +4001,33 @@ static int usbg_set_function_ms_attrs(usbg_function *f,
 		if (!lun)
 			continue;
 
-		ret = usbg_set_f_ms_lun_attrs(lpath, "", lun);
+		ret = usbg_set_f_ms_lun_attrs(f->parent->parent, lpath, "",
+					      lun);
 		if (ret != USBG_SUCCESS)
 			goto err_lun_loop;
 	}
 
 	/* Check if function has more luns and remove them */
 	*lpath_end = '\0';
-	i = 0;
-	nmb = scandir(lpath, &dent, lun_select, lun_sort);
-	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+	i = f_attrs->nluns;
+	ret = usbg_lun_index_build(f->parent->parent, lpath, &idx);
+	if (ret != USBG_SUCCESS)
 		goto err_lun_loop;
-	}
 
-	for (i = 0; i < f_attrs->nluns; ++i)
-		free(dent[i]);
-
-	for (; i < nmb; ++i) {
-		ret = usbg_rm_dir(lpath, dent[i]->d_name);
-		free(dent[i]);
+	for (nmb = idx.nluns - 1;
+	     nmb >= 0 && idx.luns[nmb].id >= f_attrs->nluns; --nmb) {
+		ret = usbg_rm_dir(f->parent->parent, lpath, idx.luns[nmb].name);
 		/* There is no good way to recover form this */
 		if (ret != USBG_SUCCESS)
-			goto err_rm_loop;
+			break;
 	}
-	free(dent);
-
-	return USBG_SUCCESS;
+	usbg_lun_index_free(&idx);
 
-err_rm_loop:
-	while (++i < nmb)
-		free(dent[i]);
-	free(dent);
+	if (ret == USBG_SUCCESS) {
+		free(new_lun_mask);
+		goto out;
+	}
 
-	i = f_attrs->nluns;
 err_lun_loop:
 	/* array is null terminated so we may access lun[nluns] */
 	for (; i >= 0; --i) {
@@ -3164,7 +4043,7 @@ err_lun_loop:
 			 */
 			continue;
 		}
-		rmdir(lpath);
+		usbg_io_rmdir(f->parent->parent, lpath);
 	}
 	free(new_lun_mask);
 
@@ -3172,32 +4051,259 @@ out:
 	return ret;
 }
 
+static inline bool usbg_ms_str_differ(const char *a, const char *b)
+{
+	return strcmp(a ? a : "", b ? b : "") != 0;
+}
+
+/*
+ * Write only attributes of lun which differ from their current values.
+ * They are read again each time as medium may have been ejected by host
+ * or changed by other process since we have seen it.
+ */
+static int usbg_set_f_ms_lun_changed_attrs(usbg_state *s, const char *path,
+					   int id,
+					   const usbg_f_ms_lun_attrs *new)
+{
+	struct usbg_lun_entry lun;
+	usbg_f_ms_lun_attrs old;
+	int ret;
+
+	lun.id = id;
+	sprintf(lun.name, "lun.%d", id);
+	ret = usbg_parse_function_ms_lun_attrs(s, path, &lun, &old);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	if (old.cdrom != new->cdrom) {
+		ret = usbg_write_bool(s, path, lun.name, "cdrom", new->cdrom);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (old.ro != new->ro) {
+		ret = usbg_write_bool(s, path, lun.name, "ro", new->ro);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (old.nofua != new->nofua) {
+		ret = usbg_write_bool(s, path, lun.name, "nofua", new->nofua);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (old.removable != new->removable) {
+		ret = usbg_write_bool(s, path, lun.name, "removable",
+				      new->removable);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	if (usbg_ms_str_differ(old.filename, new->filename))
+		ret = usbg_write_string(s, path, lun.name, "file",
+					usbg_ms_lun_file(new->filename));
+
+out:
+	free((char *)old.filename);
+	return ret;
+}
+
+/*
+ * Bring function to requested state using its known number of luns,
+ * creating or removing only luns which are missing or extra.
+ */
+static int usbg_reconcile_function_ms_attrs(usbg_function *f,
+					    const usbg_f_ms_attrs *f_attrs)
+{
+	char fpath[USBG_MAX_PATH_LENGTH];
+	char lpath[USBG_MAX_PATH_LENGTH];
+	char lun_name[USBG_MAX_NAME_LENGTH];
+	int common, created;
+	int i, nmb;
+	bool stall;
+	int ret = USBG_SUCCESS;
+
+	for (i = 0; i < f_attrs->nluns; ++i) {
+		usbg_f_ms_lun_attrs *lun = f_attrs->luns[i];
+
+		if (lun && lun->id >= 0 && lun->id != i)
+			return USBG_ERROR_INVALID_PARAM;
+	}
+
+	nmb = snprintf(fpath, sizeof(fpath), "%s/%s", f->path, f->name);
+	if (nmb >= sizeof(fpath))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	/* Kernel refuses to change stall of function which is in use */
+	ret = usbg_read_bool(f->parent->parent, f->path, f->name, "stall",
+			     &stall);
+	if (ret != USBG_SUCCESS)
+		goto err;
+
+	if (stall != f_attrs->stall) {
+		ret = usbg_write_bool(f->parent->parent, f->path, f->name,
+				      "stall",
+				      f_attrs->stall);
+		if (ret != USBG_SUCCESS)
+			goto err;
+	}
+
+	common = f->ms_nluns < f_attrs->nluns ?
+		f->ms_nluns : f_attrs->nluns;
+
+	for (i = 0; i < common; ++i) {
+		if (!f_attrs->luns[i])
+			continue;
+
+		ret = usbg_set_f_ms_lun_changed_attrs(f->parent->parent, fpath,
+						      i, f_attrs->luns[i]);
+		if (ret != USBG_SUCCESS)
+			goto err;
+	}
+
+	for (created = common; created < f_attrs->nluns; ++created) {
+		nmb = snprintf(lpath, sizeof(lpath), "%s/lun.%d",
+			       fpath, created);
+		if (nmb >= sizeof(lpath)) {
+			ret = USBG_ERROR_PATH_TOO_LONG;
+			goto err_rm_created;
+		}
+
+		nmb = usbg_io_mkdir(f->parent->parent, lpath,
+				    S_IRWXU|S_IRWXG|S_IRWXO);
+		if (nmb) {
+			ret = usbg_translate_error(-nmb);
+			goto err_rm_created;
+		}
+
+		if (!f_attrs->luns[created])
+			continue;
+
+		sprintf(lun_name, "lun.%d", created);
+		ret = usbg_set_f_ms_lun_attrs(f->parent->parent, fpath,
+					      lun_name,
+					      f_attrs->luns[created]);
+		if (ret != USBG_SUCCESS) {
+			created++;
+			goto err_rm_created;
+		}
+	}
+
+	/* lun0 cannot be removed so remove from the last one */
+	for (i = f->ms_nluns - 1; i >= f_attrs->nluns; --i) {
+		sprintf(lun_name, "lun.%d", i);
+		ret = usbg_rm_dir(f->parent->parent, fpath, lun_name);
+		/* There is no good way to recover form this */
+		if (ret != USBG_SUCCESS)
+			goto err;
+	}
+
+	f->ms_nluns = f_attrs->nluns;
+	return USBG_SUCCESS;
+
+err_rm_created:
+	while (--created >= common) {
+		sprintf(lun_name, "lun.%d", created);
+		usbg_rm_dir(f->parent->parent, fpath, lun_name);
+	}
+err:
+	/* Some luns could have been removed so we don't know them any more */
+	f->ms_nluns = -1;
+	return ret;
+}
+
+/*
+ * Learn which luns function has before changing them. Only contiguous
+ * luns can be reconciled, otherwise count stays unknown.
+ */
+static int usbg_read_function_ms_nluns(usbg_function *f)
+{
+	char fpath[USBG_MAX_PATH_LENGTH];
+	struct usbg_lun_index idx;
+	int nmb;
+	int ret;
+
+	nmb = snprintf(fpath, sizeof(fpath), "%s/%s/", f->path, f->name);
+	if (nmb >= sizeof(fpath))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	ret = usbg_lun_index_build(f->parent->parent, fpath, &idx);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (idx.nluns > 0 && idx.luns[idx.nluns - 1].id == idx.nluns - 1)
+		f->ms_nluns = idx.nluns;
+
+	usbg_lun_index_free(&idx);
+	return USBG_SUCCESS;
+}
+
+static int usbg_set_function_ms_attrs(usbg_function *f,
+				      const usbg_f_ms_attrs *f_attrs)
+{
+	usbg_state *s = f->parent->parent;
+	int ret;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (f->ms_nluns < 0 && f_attrs->luns && f_attrs->nluns > 0) {
+		ret = usbg_read_function_ms_nluns(f);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	/* lun0 cannot be removed */
+	if (f->ms_nluns > 0 && f_attrs->luns && f_attrs->nluns > 0) {
+		ret = usbg_reconcile_function_ms_attrs(f, f_attrs);
+		goto out;
+	}
+
+	ret = usbg_set_function_ms_attrs_all(f, f_attrs);
+	if (ret != USBG_SUCCESS)
+		f->ms_nluns = -1;
+	else if (f_attrs->luns && f_attrs->nluns > 0)
+		f->ms_nluns = f_attrs->nluns;
+
+out:
+	usbg_unlock(s);
+	return ret;
+}
+
 int usbg_set_function_midi_attrs(usbg_function *f,
 				 const usbg_f_midi_attrs *attrs)
 {
 	int ret;
 
-	ret = usbg_write_dec(f->path, f->name, "index", attrs->index);
+	ret = usbg_write_dec(f->parent->parent, f->path, f->name, "index",
+			     attrs->index);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_string(f->path, f->name, "id", attrs->id);
+	ret = usbg_write_string(f->parent->parent, f->path, f->name, "id",
+				attrs->id);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_dec(f->path, f->name, "in_ports", attrs->in_ports);
+	ret = usbg_write_dec(f->parent->parent, f->path, f->name, "in_ports",
+			     attrs->in_ports);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_dec(f->path, f->name, "out_ports", attrs->out_ports);
+	ret = usbg_write_dec(f->parent->parent, f->path, f->name, "out_ports",
+			     attrs->out_ports);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_dec(f->path, f->name, "buflen", attrs->buflen);
+	ret = usbg_write_dec(f->parent->parent, f->path, f->name, "buflen",
+			     attrs->buflen);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
-	ret = usbg_write_dec(f->path, f->name, "qlen", attrs->qlen);
+	ret = usbg_write_dec(f->parent->parent, f->path, f->name, "qlen",
+			     attrs->qlen);
 
 out:
 	return ret;
@@ -3270,7 +4376,8 @@ int usbg_set_net_dev_addr(usbg_function *f, struct ether_addr *dev_addr)
 	if (f && dev_addr) {
 		char str_buf[USBG_MAX_STR_LENGTH];
 		char *str_addr = usbg_ether_ntoa_r(dev_addr, str_buf);
-		ret = usbg_write_string(f->path, f->name, "dev_addr", str_addr);
+		ret = usbg_write_string(f->parent->parent, f->path, f->name,
+					"dev_addr", str_addr);
 	} else {
 		ret = USBG_ERROR_INVALID_PARAM;
 	}
@@ -3285,7 +4392,8 @@ int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *host_addr)
 	if (f && host_addr) {
 		char str_buf[USBG_MAX_STR_LENGTH];
 		char *str_addr = usbg_ether_ntoa_r(host_addr, str_buf);
-		ret = usbg_write_string(f->path, f->name, "host_addr", str_addr);
+		ret = usbg_write_string(f->parent->parent, f->path, f->name,
+					"host_addr", str_addr);
 	} else {
 		ret = USBG_ERROR_INVALID_PARAM;
 	}
@@ -3295,10 +4403,99 @@ int usbg_set_net_host_addr(usbg_function *f, struct ether_addr *host_addr)
 
 int usbg_set_net_qmult(usbg_function *f, int qmult)
 {
-	return f ? usbg_write_dec(f->path, f->name, "qmult", qmult)
+	return f ? usbg_write_dec(f->parent->parent, f->path, f->name, "qmult",
+				  qmult)
 			: USBG_ERROR_INVALID_PARAM;
 }
 
+static int usbg_swap_lun_media(usbg_function *f, int lun, const char *path,
+			       int flags)
+{
+	char fpath[USBG_MAX_PATH_LENGTH];
+	char lun_name[USBG_MAX_NAME_LENGTH];
+	int nmb;
+	int ret;
+
+	if (lun < 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	nmb = snprintf(fpath, sizeof(fpath), "%s/%s", f->path, f->name);
+	if (nmb >= sizeof(fpath))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	sprintf(lun_name, "lun.%d", lun);
+
+	if (flags & USBG_MS_SWAP_FORCE_EJECT) {
+		ret = usbg_write_bool(f->parent->parent, fpath, lun_name,
+				      "forced_eject", true);
+		/*
+		 * Old kernels don't have forced_eject and configfs refuses
+		 * to create missing attribute with EACCES. Real lack of
+		 * permissions is reported by writing file below.
+		 */
+		if (ret != USBG_SUCCESS && ret != USBG_ERROR_NOT_FOUND &&
+		    ret != USBG_ERROR_NO_ACCESS)
+			goto out;
+	}
+
+	ret = usbg_write_string(f->parent->parent, fpath, lun_name, "file",
+				usbg_ms_lun_file(path));
+
+out:
+	return ret;
+}
+
+int usbg_ms_lun_swap_media(usbg_function *f, int lun, const char *path,
+			   int flags)
+{
+	usbg_state *s;
+	int ret;
+
+	if (!f || f->type != F_MASS_STORAGE)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = f->parent->parent;
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_swap_lun_media(f, lun, path, flags);
+	usbg_unlock(s);
+
+	return ret;
+}
+
+int usbg_ms_lun_swap_media_batch(usbg_function *f, usbg_ms_lun_swap *swaps,
+				 int n)
+{
+	uint64_t start, end;
+	int ret = USBG_SUCCESS;
+	int i;
+
+	if (!f || f->type != F_MASS_STORAGE || !swaps || n < 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	start = usbg_now_ns();
+	for (i = 0; i < n; ++i) {
+		/* Don't keep readers waiting for the whole batch */
+		swaps[i].ret = usbg_lock_exclusive(f->parent->parent);
+		if (swaps[i].ret == USBG_SUCCESS) {
+			swaps[i].ret = usbg_swap_lun_media(f, swaps[i].lun,
+							   swaps[i].path,
+							   swaps[i].flags);
+			usbg_unlock(f->parent->parent);
+		}
+		end = usbg_now_ns();
+		swaps[i].latency_ns = end - start;
+		start = end;
+
+		if (swaps[i].ret != USBG_SUCCESS && ret == USBG_SUCCESS)
+			ret = swaps[i].ret;
+	}
+
+	return ret;
+}
+
 usbg_gadget *usbg_get_first_gadget(usbg_state *s)
 {
 	return s ? TAILQ_FIRST(&s->gadgets) : NULL;
@@ -0,0 +1,441 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_async.c
+ * @brief Asynchronous variants of blocking calls
+ * @details Requests are executed by a single worker thread in order of
+ * queueing. Finished ones are moved to completion queue and signalled
+ * using eventfd, so the application may wait for them in its own event
+ * loop and call callbacks from its thread using usbg_async_dispatch().
+ */
+
+struct usbg_async_req
+{
+	TAILQ_ENTRY(usbg_async_req) rnode;
+	usbg_async_cb cb;
+	void *data;
+	usbg_async_result res;
+
+	/* Arguments, meaning depends on operation */
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_udc *udc;
+	const void *obj;
+	const void *attrs;
+	const void *strs;
+	const char *name;
+	FILE *stream;
+	usbg_init_opts opts;
+	bool has_opts;
+};
+
+TAILQ_HEAD(usbg_async_rhead, usbg_async_req);
+
+struct usbg_async
+{
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct usbg_async_rhead pending;
+	struct usbg_async_rhead done;
+	int efd;
+	bool stop;
+};
+
+static void usbg_async_run(struct usbg_async_req *req)
+{
+	usbg_async_result *res = &req->res;
+
+	switch (res->op) {
+	case USBG_ASYNC_INIT:
+		res->ret = usbg_init_with_opts(req->name,
+					       req->has_opts ? &req->opts : NULL,
+					       &res->state);
+		break;
+	case USBG_ASYNC_CREATE_GADGET:
+		res->ret = usbg_create_gadget(req->s, req->name, req->attrs,
+					      req->strs, &res->gadget);
+		break;
+	case USBG_ASYNC_SET_GADGET_ATTRS:
+		res->ret = usbg_set_gadget_attrs(req->g, req->attrs);
+		break;
+	case USBG_ASYNC_SET_CONFIG_ATTRS:
+		res->ret = usbg_set_config_attrs((usbg_config *)req->obj,
+						 req->attrs);
+		break;
+	case USBG_ASYNC_SET_FUNCTION_ATTRS:
+		res->ret = usbg_set_function_attrs((usbg_function *)req->obj,
+						   req->attrs);
+		break;
+	case USBG_ASYNC_ENABLE_GADGET:
+		res->ret = usbg_enable_gadget(req->g, req->udc);
+		break;
+	case USBG_ASYNC_DISABLE_GADGET:
+		res->ret = usbg_disable_gadget(req->g);
+		break;
+	case USBG_ASYNC_RM_GADGET:
+		res->ret = usbg_rm_gadget(req->g);
+		break;
+	case USBG_ASYNC_IMPORT_GADGET:
+		res->ret = usbg_import_gadget(req->s, req->stream, req->name,
+					      &res->gadget);
+		break;
+	default:
+		res->ret = USBG_ERROR_NOT_SUPPORTED;
+		break;
+	}
+}
+
+static void *usbg_async_worker(void *data)
+{
+	struct usbg_async *a = data;
+	struct usbg_async_req *req;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&a->lock);
+	for (;;) {
+		while (TAILQ_EMPTY(&a->pending) && !a->stop)
+			pthread_cond_wait(&a->cond, &a->lock);
+
+		/* Queued requests are finished even if stop was requested */
+		req = TAILQ_FIRST(&a->pending);
+		if (!req)
+			break;
+		TAILQ_REMOVE(&a->pending, req, rnode);
+		pthread_mutex_unlock(&a->lock);
+
+		usbg_async_run(req);
+
+		pthread_mutex_lock(&a->lock);
+		TAILQ_INSERT_TAIL(&a->done, req, rnode);
+		if (write(a->efd, &one, sizeof(one)) < 0)
+			ERROR("signalling completion: %s\n", strerror(errno));
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	return NULL;
+}
+
+int usbg_async_create(usbg_async **a)
+{
+	struct usbg_async *ad;
+	int ret;
+
+	if (!a)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ad = calloc(1, sizeof(*ad));
+	if (!ad)
+		return USBG_ERROR_NO_MEM;
+
+	TAILQ_INIT(&ad->pending);
+	TAILQ_INIT(&ad->done);
+
+	ad->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ad->efd < 0) {
+		ret = usbg_translate_error(errno);
+		goto err_free;
+	}
+
+	ret = pthread_mutex_init(&ad->lock, NULL);
+	if (ret) {
+		ret = usbg_translate_error(ret);
+		goto err_close;
+	}
+
+	ret = pthread_cond_init(&ad->cond, NULL);
+	if (ret) {
+		ret = usbg_translate_error(ret);
+		goto err_mutex;
+	}
+
+	ret = pthread_create(&ad->worker, NULL, usbg_async_worker, ad);
+	if (ret) {
+		ret = usbg_translate_error(ret);
+		goto err_cond;
+	}
+
+	*a = ad;
+	return USBG_SUCCESS;
+
+err_cond:
+	pthread_cond_destroy(&ad->cond);
+err_mutex:
+	pthread_mutex_destroy(&ad->lock);
+err_close:
+	close(ad->efd);
+err_free:
+	free(ad);
+	return ret;
+}
+
+void usbg_async_destroy(usbg_async *a)
+{
+	if (!a)
+		return;
+
+	pthread_mutex_lock(&a->lock);
+	a->stop = true;
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	pthread_join(a->worker, NULL);
+	usbg_async_dispatch(a);
+
+	pthread_cond_destroy(&a->cond);
+	pthread_mutex_destroy(&a->lock);
+	close(a->efd);
+	free(a);
+}
+
+int usbg_async_get_fd(usbg_async *a)
+{
+	return a ? a->efd : USBG_ERROR_INVALID_PARAM;
+}
+
+int usbg_async_dispatch(usbg_async *a)
+{
+	struct usbg_async_rhead done;
+	struct usbg_async_req *req;
+	uint64_t cnt;
+	int n = 0;
+
+	if (!a)
+		return USBG_ERROR_INVALID_PARAM;
+
+	TAILQ_INIT(&done);
+
+	/* Counter is reset under lock so no completion is missed */
+	pthread_mutex_lock(&a->lock);
+	if (read(a->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		ERROR("reading completions: %s\n", strerror(errno));
+	TAILQ_CONCAT(&done, &a->done, rnode);
+	pthread_mutex_unlock(&a->lock);
+
+	while (!TAILQ_EMPTY(&done)) {
+		req = TAILQ_FIRST(&done);
+		TAILQ_REMOVE(&done, req, rnode);
+
+		if (req->cb)
+			req->cb(&req->res, req->data);
+		free(req);
+		n++;
+	}
+
+	return n;
+}
+
+static struct usbg_async_req *usbg_async_req_new(usbg_async_op op,
+						 usbg_async_cb cb,
+						 void *data)
+{
+	struct usbg_async_req *req;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return NULL;
+
+	req->res.op = op;
+	req->cb = cb;
+	req->data = data;
+
+	return req;
+}
+
+static int usbg_async_queue(usbg_async *a, struct usbg_async_req *req)
+{
+	pthread_mutex_lock(&a->lock);
+	TAILQ_INSERT_TAIL(&a->pending, req, rnode);
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	return USBG_SUCCESS;
+}
+
+int usbg_async_init(usbg_async *a, const char *configfs_path,
+		    const usbg_init_opts *opts, usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !configfs_path)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_INIT, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->name = configfs_path;
+	if (opts) {
+		req->opts = *opts;
+		req->has_opts = true;
+	}
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_create_gadget(usbg_async *a, usbg_state *s, const char *name,
+			     const usbg_gadget_attrs *g_attrs,
+			     const usbg_gadget_strs *g_strs,
+			     usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !s || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_CREATE_GADGET, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->s = s;
+	req->name = name;
+	req->attrs = g_attrs;
+	req->strs = g_strs;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_set_gadget_attrs(usbg_async *a, usbg_gadget *g,
+				const usbg_gadget_attrs *g_attrs,
+				usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !g || !g_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_SET_GADGET_ATTRS, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->g = g;
+	req->attrs = g_attrs;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_set_config_attrs(usbg_async *a, usbg_config *c,
+				const usbg_config_attrs *c_attrs,
+				usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !c || !c_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_SET_CONFIG_ATTRS, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->obj = c;
+	req->attrs = c_attrs;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_set_function_attrs(usbg_async *a, usbg_function *f,
+				  const usbg_function_attrs *f_attrs,
+				  usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !f || !f_attrs)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_SET_FUNCTION_ATTRS, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->obj = f;
+	req->attrs = f_attrs;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_enable_gadget(usbg_async *a, usbg_gadget *g, usbg_udc *udc,
+			     usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_ENABLE_GADGET, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->g = g;
+	req->udc = udc;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_disable_gadget(usbg_async *a, usbg_gadget *g,
+			      usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_DISABLE_GADGET, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->g = g;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_rm_gadget(usbg_async *a, usbg_gadget *g,
+			 usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !g)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_RM_GADGET, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->g = g;
+
+	return usbg_async_queue(a, req);
+}
+
+int usbg_async_import_gadget(usbg_async *a, usbg_state *s, FILE *stream,
+			     const char *name, usbg_async_cb cb, void *data)
+{
+	struct usbg_async_req *req;
+
+	if (!a || !s || !stream || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	req = usbg_async_req_new(USBG_ASYNC_IMPORT_GADGET, cb, data);
+	if (!req)
+		return USBG_ERROR_NO_MEM;
+
+	req->s = s;
+	req->stream = stream;
+	req->name = name;
+
+	return usbg_async_queue(a, req);
+}
@@ -0,0 +1,543 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_io.c
+ * @brief Default (libc based) I/O backend, dispatch to current one,
+ * operation statistics and tracing
+ */
+
+static int usbg_default_read_attr(void *ctx, const char *path,
+				  char *buf, size_t len)
+{
+	FILE *fp;
+	char *ret_ptr;
+	int ret = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	ret_ptr = fgets(buf, len, fp);
+	if (!ret_ptr) {
+		/* File is empty */
+		if (feof(fp))
+			buf[0] = '\0';
+		/* Error occurred */
+		else
+			ret = -EIO;
+	}
+
+	fclose(fp);
+
+	return ret;
+}
+
+static int usbg_default_write_attr(void *ctx, const char *path,
+				   const char *buf)
+{
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "w");
+	if (!fp)
+		return -errno;
+
+	fputs(buf, fp);
+	fflush(fp);
+
+	if (ferror(fp))
+		ret = errno ? -errno : -EIO;
+
+	fclose(fp);
+
+	return ret;
+}
+
+static int usbg_default_mkdir(void *ctx, const char *path, mode_t mode)
+{
+	return mkdir(path, mode) ? -errno : 0;
+}
+
+static int usbg_default_rmdir(void *ctx, const char *path)
+{
+	return rmdir(path) ? -errno : 0;
+}
+
+static int usbg_default_unlink(void *ctx, const char *path)
+{
+	return unlink(path) ? -errno : 0;
+}
+
+static int usbg_default_symlink(void *ctx, const char *target,
+				const char *path)
+{
+	return symlink(target, path) ? -errno : 0;
+}
+
+static ssize_t usbg_default_readlink(void *ctx, const char *path,
+				     char *buf, size_t len)
+{
+	ssize_t ret;
+
+	ret = readlink(path, buf, len);
+	return ret < 0 ? -errno : ret;
+}
+
+static int usbg_default_list_dir(void *ctx, const char *path,
+				 struct dirent ***namelist,
+				 usbg_dir_filter filter,
+				 usbg_dir_compar compar)
+{
+	int ret;
+
+	ret = scandir(path, namelist, filter, compar);
+	return ret < 0 ? -errno : ret;
+}
+
+static int usbg_default_check_dir(void *ctx, const char *path)
+{
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+
+	closedir(dir);
+	return 0;
+}
+
+static int usbg_default_open_attr(void *ctx, const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+static const usbg_io_backend usbg_default_io = {
+	.read_attr = usbg_default_read_attr,
+	.write_attr = usbg_default_write_attr,
+	.mkdir = usbg_default_mkdir,
+	.rmdir = usbg_default_rmdir,
+	.unlink = usbg_default_unlink,
+	.symlink = usbg_default_symlink,
+	.readlink = usbg_default_readlink,
+	.list_dir = usbg_default_list_dir,
+	.check_dir = usbg_default_check_dir,
+	.open_attr = usbg_default_open_attr,
+};
+
+const usbg_io_backend *usbg_get_default_io_backend(void)
+{
+	return &usbg_default_io;
+}
+
+__thread usbg_stats_site usbg_stats_cur_site = USBG_STATS_SITE_OTHER;
+
+/*
+ * Dispatch to backend of given state. All functions return 0 (or
+ * number of bytes/entries) on success and negative errno on failure.
+ * Snapshots refuse all modifications.
+ */
+
+static inline void usbg_stats_lock(usbg_state *s)
+{
+	if (s->thread_safe)
+		pthread_mutex_lock(&s->stats_lock);
+}
+
+static inline void usbg_stats_unlock(usbg_state *s)
+{
+	if (s->thread_safe)
+		pthread_mutex_unlock(&s->stats_lock);
+}
+
+static inline bool usbg_io_op_modifies(usbg_io_op op)
+{
+	return op != USBG_IO_OP_READ_ATTR && op != USBG_IO_OP_READLINK &&
+		op != USBG_IO_OP_LIST_DIR && op != USBG_IO_OP_CHECK_DIR;
+}
+
+/* Strip configfs or sysfs root so traces don't depend on mount point */
+static const char *usbg_io_rel_path(usbg_state *s, const char *path)
+{
+	const char *roots[] = {s->configfs_path, s->sysfs_path};
+	size_t len;
+	int i;
+
+	if (!path)
+		return NULL;
+
+	for (i = 0; i < ARRAY_SIZE(roots); ++i) {
+		len = strlen(roots[i]);
+		if (!strncmp(path, roots[i], len) && path[len] == '/')
+			return path + len + 1;
+	}
+
+	return path;
+}
+
+static void usbg_io_trace(usbg_state *s, usbg_trace_point point,
+			  usbg_io_op op, const char *path, const char *value,
+			  int err, uint64_t elapsed_ns)
+{
+	usbg_trace_event ev = {
+		.point = point,
+		.op = op,
+		.site = usbg_stats_cur_site,
+		.path = usbg_io_rel_path(s, path),
+		.value = op == USBG_IO_OP_SYMLINK ?
+			usbg_io_rel_path(s, value) : value,
+		.ret = err,
+		.elapsed_ns = elapsed_ns,
+	};
+
+	if (ev.site == USBG_STATS_SITE_OTHER)
+		ev.site = USBG_STATS_SITE_SET;
+
+	s->trace_cb(s, &ev, s->trace_ctx);
+}
+
+static inline uint64_t usbg_io_begin(usbg_state *s, usbg_io_op op,
+				     const char *path, const char *value)
+{
+	if (!s->stats && !s->trace_cb)
+		return 0;
+
+	if (s->trace_cb && usbg_io_op_modifies(op))
+		usbg_io_trace(s, USBG_TRACE_BEGIN, op, path, value, 0, 0);
+
+	return usbg_now_ns();
+}
+
+static void usbg_io_end(usbg_state *s, usbg_io_op op, uint64_t start,
+			ssize_t ret, const char *path, const char *value)
+{
+	usbg_stats_site site = usbg_stats_cur_site;
+	int err = ret < 0 ? ret : 0;
+	usbg_io_op_stats *st;
+	uint64_t elapsed;
+
+	if (!s->stats && !s->trace_cb)
+		return;
+
+	elapsed = usbg_now_ns() - start;
+
+	if (s->stats) {
+		/* Modification not done by any other API call is a setter */
+		if (site == USBG_STATS_SITE_OTHER && usbg_io_op_modifies(op))
+			site = USBG_STATS_SITE_SET;
+
+		usbg_stats_lock(s);
+		/* Might have been disabled in the meantime */
+		if (s->stats) {
+			st = &s->stats->op[site][op];
+			usbg_hist_add(&st->latency, elapsed);
+			if (err)
+				st->errors++;
+		}
+		usbg_stats_unlock(s);
+	}
+
+	if (s->trace_cb && usbg_io_op_modifies(op))
+		usbg_io_trace(s, USBG_TRACE_END, op, path, value, err,
+			      elapsed);
+}
+
+int usbg_io_read_attr(usbg_state *s, const char *path, char *buf, size_t len)
+{
+	uint64_t start;
+	int ret;
+
+	start = usbg_io_begin(s, USBG_IO_OP_READ_ATTR, path, NULL);
+	ret = s->io->read_attr(s->io_ctx, path, buf, len);
+	usbg_io_end(s, USBG_IO_OP_READ_ATTR, start, ret, path, NULL);
+	return ret;
+}
+
+int usbg_io_write_attr(usbg_state *s, const char *path, const char *buf)
+{
+	uint64_t start;
+	int ret;
+
+	if (s->read_only)
+		return -EROFS;
+
+	start = usbg_io_begin(s, USBG_IO_OP_WRITE_ATTR, path, buf);
+	ret = s->io->write_attr(s->io_ctx, path, buf);
+	usbg_io_end(s, USBG_IO_OP_WRITE_ATTR, start, ret, path, buf);
+	return ret;
+}
+
+int usbg_io_mkdir(usbg_state *s, const char *path, mode_t mode)
+{
+	uint64_t start;
+	int ret;
+
+	if (s->read_only)
+		return -EROFS;
+
+	start = usbg_io_begin(s, USBG_IO_OP_MKDIR, path, NULL);
+	ret = s->io->mkdir(s->io_ctx, path, mode);
+	usbg_io_end(s, USBG_IO_OP_MKDIR, start, ret, path, NULL);
+	return ret;
+}
+
+int usbg_io_rmdir(usbg_state *s, const char *path)
+{
+	uint64_t start;
+	int ret;
+
+	if (s->read_only)
+		return -EROFS;
+
+	start = usbg_io_begin(s, USBG_IO_OP_RMDIR, path, NULL);
+	ret = s->io->rmdir(s->io_ctx, path);
+	usbg_io_end(s, USBG_IO_OP_RMDIR, start, ret, path, NULL);
+	return ret;
+}
+
+int usbg_io_unlink(usbg_state *s, const char *path)
+{
+	uint64_t start;
+	int ret;
+
+	if (s->read_only)
+		return -EROFS;
+
+	start = usbg_io_begin(s, USBG_IO_OP_UNLINK, path, NULL);
+	ret = s->io->unlink(s->io_ctx, path);
+	usbg_io_end(s, USBG_IO_OP_UNLINK, start, ret, path, NULL);
+	return ret;
+}
+
+int usbg_io_symlink(usbg_state *s, const char *target, const char *path)
+{
+	uint64_t start;
+	int ret;
+
+	if (s->read_only)
+		return -EROFS;
+
+	start = usbg_io_begin(s, USBG_IO_OP_SYMLINK, path, target);
+	ret = s->io->symlink(s->io_ctx, target, path);
+	usbg_io_end(s, USBG_IO_OP_SYMLINK, start, ret, path, target);
+	return ret;
+}
+
+ssize_t usbg_io_readlink(usbg_state *s, const char *path,
+			 char *buf, size_t len)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	start = usbg_io_begin(s, USBG_IO_OP_READLINK, path, NULL);
+	ret = s->io->readlink(s->io_ctx, path, buf, len);
+	usbg_io_end(s, USBG_IO_OP_READLINK, start, ret, path, NULL);
+	return ret;
+}
+
+int usbg_io_list_dir(usbg_state *s, const char *path,
+		     struct dirent ***namelist, usbg_dir_filter filter,
+		     usbg_dir_compar compar)
+{
+	uint64_t start;
+	int ret;
+
+	start = usbg_io_begin(s, USBG_IO_OP_LIST_DIR, path, NULL);
+	ret = s->io->list_dir(s->io_ctx, path, namelist, filter, compar);
+	usbg_io_end(s, USBG_IO_OP_LIST_DIR, start, ret, path, NULL);
+	return ret;
+}
+
+int usbg_io_check_dir(usbg_state *s, const char *path)
+{
+	uint64_t start;
+	int ret;
+
+	start = usbg_io_begin(s, USBG_IO_OP_CHECK_DIR, path, NULL);
+	ret = s->io->check_dir(s->io_ctx, path);
+	usbg_io_end(s, USBG_IO_OP_CHECK_DIR, start, ret, path, NULL);
+	return ret;
+}
+
+/*
+ * Watching is neither accounted nor traced, it would only blur latencies.
+ * If attribute cannot be watched, fd is -1 and it is re-read using
+ * read_attr after sleeping instead.
+ */
+void usbg_io_watch_attr(usbg_state *s, const char *path, int *fd)
+{
+	*fd = s->io->open_attr ? s->io->open_attr(s->io_ctx, path) : -1;
+	if (*fd < 0)
+		*fd = -1;
+}
+
+void usbg_io_unwatch_attr(usbg_state *s, int fd)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+int usbg_io_read_watched_attr(usbg_state *s, int fd, const char *path,
+			      char *buf, size_t len)
+{
+	ssize_t n;
+	char *p;
+
+	if (fd < 0)
+		return usbg_io_read_attr(s, path, buf, len);
+
+	/* Sysfs notifies only readers which have read the current value */
+	n = pread(fd, buf, len - 1, 0);
+	if (n < 0)
+		return -errno;
+
+	buf[n] = '\0';
+	p = strchr(buf, '\n');
+	if (p)
+		p[1] = '\0';
+
+	return 0;
+}
+
+int usbg_io_wait_watched_attr(usbg_state *s, int fd, int timeout_ms)
+{
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L,
+	};
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLPRI | POLLERR,
+	};
+
+	if (fd < 0) {
+		nanosleep(&ts, NULL);
+		return 0;
+	}
+
+	/*
+	 * Sysfs notifies changes with POLLPRI, regular files never do
+	 * so for them we simply sleep until timeout.
+	 */
+	if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR)
+		return -errno;
+
+	return 0;
+}
+
+int usbg_enable_stats(usbg_state *s, bool enable)
+{
+	int ret = USBG_SUCCESS;
+
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_stats_lock(s);
+	if (!enable) {
+		free(s->stats);
+		s->stats = NULL;
+	} else if (!s->stats) {
+		s->stats = calloc(1, sizeof(*s->stats));
+		if (!s->stats)
+			ret = USBG_ERROR_NO_MEM;
+	}
+	usbg_stats_unlock(s);
+
+	return ret;
+}
+
+int usbg_get_stats(usbg_state *s, usbg_stats *st)
+{
+	int ret = USBG_SUCCESS;
+
+	if (!s || !st)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_stats_lock(s);
+	if (s->stats)
+		*st = *s->stats;
+	else
+		ret = USBG_ERROR_NOT_FOUND;
+	usbg_stats_unlock(s);
+
+	return ret;
+}
+
+void usbg_reset_stats(usbg_state *s)
+{
+	if (!s)
+		return;
+
+	usbg_stats_lock(s);
+	if (s->stats)
+		memset(s->stats, 0, sizeof(*s->stats));
+	usbg_stats_unlock(s);
+}
+
+const char *usbg_get_io_op_str(usbg_io_op op)
+{
+	static const char *const names[] = {
+		[USBG_IO_OP_READ_ATTR] = "read_attr",
+		[USBG_IO_OP_WRITE_ATTR] = "write_attr",
+		[USBG_IO_OP_MKDIR] = "mkdir",
+		[USBG_IO_OP_RMDIR] = "rmdir",
+		[USBG_IO_OP_UNLINK] = "unlink",
+		[USBG_IO_OP_SYMLINK] = "symlink",
+		[USBG_IO_OP_READLINK] = "readlink",
+		[USBG_IO_OP_LIST_DIR] = "list_dir",
+		[USBG_IO_OP_CHECK_DIR] = "check_dir",
+	};
+
+	return op >= USBG_IO_OP_MIN && op < USBG_IO_OP_MAX ? names[op] : NULL;
+}
+
+const char *usbg_get_stats_site_str(usbg_stats_site site)
+{
+	static const char *const names[] = {
+		[USBG_STATS_SITE_OTHER] = "other",
+		[USBG_STATS_SITE_PARSE] = "parse",
+		[USBG_STATS_SITE_CREATE] = "create",
+		[USBG_STATS_SITE_SET] = "set",
+		[USBG_STATS_SITE_RM] = "rm",
+		[USBG_STATS_SITE_IMPORT] = "import",
+		[USBG_STATS_SITE_EXPORT] = "export",
+	};
+
+	return site >= USBG_STATS_SITE_MIN && site < USBG_STATS_SITE_MAX ?
+		names[site] : NULL;
+}
+
+int usbg_set_trace_callback(usbg_state *s, usbg_trace_cb cb, void *ctx)
+{
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s->trace_cb = cb;
+	s->trace_ctx = cb ? ctx : NULL;
+	return USBG_SUCCESS;
+}
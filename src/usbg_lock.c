@@ -0,0 +1,426 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_lock.c
+ * @brief Reader/writer lock of state used in thread safe mode and
+ * advisory locks shared with other processes
+ * @details API functions call each other (e.g. import creates functions)
+ * so each thread keeps its own depth and mode of locking of given state
+ * and only the outermost call really takes or releases the lock. The same
+ * applies to process locks which are counted per state.
+ */
+
+#define USBG_STATE_LOCK_FILE "state.lock"
+
+int usbg_lock_init(usbg_state *s)
+{
+	int ret;
+
+	ret = pthread_rwlock_init(&s->lock, NULL);
+	if (ret)
+		return usbg_translate_error(ret);
+
+	ret = pthread_key_create(&s->lock_depth, NULL);
+	if (ret)
+		goto key_failed;
+
+	ret = pthread_mutex_init(&s->stats_lock, NULL);
+	if (ret)
+		goto mutex_failed;
+
+	s->thread_safe = true;
+	return USBG_SUCCESS;
+
+mutex_failed:
+	pthread_key_delete(s->lock_depth);
+key_failed:
+	pthread_rwlock_destroy(&s->lock);
+	return usbg_translate_error(ret);
+}
+
+void usbg_lock_destroy(usbg_state *s)
+{
+	if (!s->thread_safe)
+		return;
+
+	pthread_mutex_destroy(&s->stats_lock);
+	pthread_key_delete(s->lock_depth);
+	pthread_rwlock_destroy(&s->lock);
+	s->thread_safe = false;
+}
+
+/* Lowest bit of per thread value is set if lock is held exclusively */
+#define USBG_LOCK_EXCLUSIVE	1
+#define USBG_LOCK_DEPTH_UNIT	2
+
+static inline intptr_t usbg_lock_get_depth(usbg_state *s)
+{
+	return (intptr_t)pthread_getspecific(s->lock_depth);
+}
+
+static inline void usbg_lock_set_depth(usbg_state *s, intptr_t depth)
+{
+	pthread_setspecific(s->lock_depth, (void *)depth);
+}
+
+/*
+ * Nested call keeps the lock which has been taken by the outermost one.
+ * Shared lock cannot be upgraded, as two readers doing so would wait for
+ * each other, so modification is refused while thread holds only shared
+ * lock.
+ */
+static int usbg_lock(usbg_state *s, bool exclusive)
+{
+	intptr_t depth;
+
+	if (!s || !s->thread_safe)
+		return USBG_SUCCESS;
+
+	depth = usbg_lock_get_depth(s);
+	if (!depth) {
+		if (exclusive) {
+			pthread_rwlock_wrlock(&s->lock);
+			depth = USBG_LOCK_EXCLUSIVE;
+		} else {
+			pthread_rwlock_rdlock(&s->lock);
+		}
+	} else if (exclusive && !(depth & USBG_LOCK_EXCLUSIVE)) {
+		return USBG_ERROR_BUSY;
+	}
+
+	usbg_lock_set_depth(s, depth + USBG_LOCK_DEPTH_UNIT);
+	return USBG_SUCCESS;
+}
+
+void usbg_lock_shared(usbg_state *s)
+{
+	usbg_lock(s, false);
+}
+
+int usbg_lock_exclusive(usbg_state *s)
+{
+	return usbg_lock(s, true);
+}
+
+void usbg_unlock(usbg_state *s)
+{
+	intptr_t depth;
+
+	if (!s || !s->thread_safe)
+		return;
+
+	depth = usbg_lock_get_depth(s);
+	if (depth < USBG_LOCK_DEPTH_UNIT)
+		return;
+
+	depth -= USBG_LOCK_DEPTH_UNIT;
+	if (depth >= USBG_LOCK_DEPTH_UNIT) {
+		usbg_lock_set_depth(s, depth);
+		return;
+	}
+	usbg_lock_set_depth(s, 0);
+	pthread_rwlock_unlock(&s->lock);
+}
+
+int usbg_read_lock(usbg_state *s)
+{
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_lock_shared(s);
+	return USBG_SUCCESS;
+}
+
+int usbg_read_unlock(usbg_state *s)
+{
+	if (!s)
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (s->thread_safe && usbg_lock_get_depth(s) < USBG_LOCK_DEPTH_UNIT)
+		return USBG_ERROR_INVALID_PARAM;
+
+	usbg_unlock(s);
+	return USBG_SUCCESS;
+}
+
+/*
+ * Process locks
+ */
+
+int usbg_process_lock_init(usbg_state *s, const usbg_init_opts *opts)
+{
+	int ret;
+
+	s->process_lock = opts && opts->process_lock;
+	TAILQ_INIT(&s->plocks);
+
+	s->lock_dir = strdup(opts && opts->lock_dir ?
+			     opts->lock_dir : USBG_LOCK_DIR);
+	if (!s->lock_dir)
+		return USBG_ERROR_NO_MEM;
+
+	ret = pthread_mutex_init(&s->plock_mutex, NULL);
+	if (ret) {
+		free(s->lock_dir);
+		return usbg_translate_error(ret);
+	}
+
+	return USBG_SUCCESS;
+}
+
+static void usbg_process_lock_free(usbg_process_lock *pl)
+{
+	/* Closing the last descriptor releases flock() */
+	close(pl->fd);
+	free(pl->name);
+	free(pl);
+}
+
+void usbg_process_lock_destroy(usbg_state *s)
+{
+	usbg_process_lock *pl;
+
+	while (!TAILQ_EMPTY(&s->plocks)) {
+		pl = TAILQ_FIRST(&s->plocks);
+		TAILQ_REMOVE(&s->plocks, pl, plnode);
+		usbg_process_lock_free(pl);
+	}
+
+	pthread_mutex_destroy(&s->plock_mutex);
+	free(s->lock_dir);
+}
+
+static int usbg_process_lock_open(usbg_state *s, const char *name, int *fd)
+{
+	char path[USBG_MAX_PATH_LENGTH];
+	int nmb;
+
+	if (name)
+		nmb = snprintf(path, sizeof(path), "%s/gadget.%s.lock",
+			       s->lock_dir, name);
+	else
+		nmb = snprintf(path, sizeof(path), "%s/" USBG_STATE_LOCK_FILE,
+			       s->lock_dir);
+	if (nmb >= sizeof(path))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	*fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (*fd < 0 && errno == ENOENT) {
+		/* Lock directory is usually on tmpfs, create it on first use */
+		if (mkdir(s->lock_dir, 0755) < 0 && errno != EEXIST) {
+			ERROR("%s: %s\n", s->lock_dir, strerror(errno));
+			return usbg_translate_error(errno);
+		}
+
+		*fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	}
+
+	if (*fd < 0) {
+		ERROR("%s: %s\n", path, strerror(errno));
+		return usbg_translate_error(errno);
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_process_flock(int fd, bool exclusive, int flags)
+{
+	int op = exclusive ? LOCK_EX : LOCK_SH;
+	int ret;
+
+	if (flags & USBG_PROCESS_LOCK_NONBLOCK)
+		op |= LOCK_NB;
+
+	do {
+		ret = flock(fd, op);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return errno == EWOULDBLOCK ? USBG_ERROR_BUSY :
+			usbg_translate_error(errno);
+
+	return USBG_SUCCESS;
+}
+
+/* Find lock already held by process or take a new one */
+static int usbg_process_lock_get(usbg_state *s, const char *name,
+				 bool exclusive, int flags,
+				 usbg_process_lock **lock)
+{
+	usbg_process_lock *pl;
+	int ret;
+
+	TAILQ_FOREACH(pl, &s->plocks, plnode)
+		if (name ? pl->name && !strcmp(pl->name, name) : !pl->name)
+			break;
+
+	if (pl) {
+		/*
+		 * Shared lock is never upgraded. flock() converts it by
+		 * releasing the old one first, so other process could take
+		 * it in between and without waiting nothing would be held.
+		 */
+		if (exclusive && !pl->exclusive)
+			return USBG_ERROR_BUSY;
+
+		pl->refs++;
+		if (exclusive)
+			pl->ex_refs++;
+		*lock = pl;
+		return USBG_SUCCESS;
+	}
+
+	pl = calloc(1, sizeof(*pl));
+	if (!pl)
+		return USBG_ERROR_NO_MEM;
+
+	if (name) {
+		pl->name = strdup(name);
+		if (!pl->name) {
+			ret = USBG_ERROR_NO_MEM;
+			goto err_free;
+		}
+	}
+
+	ret = usbg_process_lock_open(s, name, &pl->fd);
+	if (ret != USBG_SUCCESS)
+		goto err_free;
+
+	ret = usbg_process_flock(pl->fd, exclusive, flags);
+	if (ret != USBG_SUCCESS)
+		goto err_close;
+
+	pl->parent = s;
+	pl->refs = 1;
+	pl->ex_refs = exclusive ? 1 : 0;
+	pl->exclusive = exclusive;
+	TAILQ_INSERT_TAIL(&s->plocks, pl, plnode);
+
+	*lock = pl;
+	return USBG_SUCCESS;
+
+err_close:
+	close(pl->fd);
+err_free:
+	free(pl->name);
+	free(pl);
+	return ret;
+}
+
+static void usbg_process_lock_put(usbg_process_lock *pl, bool exclusive)
+{
+	/*
+	 * Let other processes take their gadgets if the remaining holders
+	 * need only shared lock. Nobody else holds the lock so this doesn't
+	 * wait.
+	 */
+	if (exclusive && !--pl->ex_refs && pl->refs > 1) {
+		if (usbg_process_flock(pl->fd, false, 0) == USBG_SUCCESS)
+			pl->exclusive = false;
+	}
+
+	if (--pl->refs)
+		return;
+
+	TAILQ_REMOVE(&pl->parent->plocks, pl, plnode);
+	usbg_process_lock_free(pl);
+}
+
+/*
+ * Process lock mutex is held also while waiting for other process,
+ * threads are serialized anyway by exclusive lock of state.
+ */
+int usbg_process_lock_gadget(usbg_state *s, const char *name, int flags,
+			     usbg_process_lock **lock)
+{
+	usbg_process_lock *state_lock;
+	int ret;
+
+	if (!s || !name || !*name || strchr(name, '/') || !lock)
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&s->plock_mutex);
+	ret = usbg_process_lock_get(s, NULL, false, flags, &state_lock);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_process_lock_get(s, name, true, flags, lock);
+	if (ret != USBG_SUCCESS)
+		usbg_process_lock_put(state_lock, false);
+
+out:
+	pthread_mutex_unlock(&s->plock_mutex);
+	return ret;
+}
+
+int usbg_process_lock_state(usbg_state *s, int flags,
+			    usbg_process_lock **lock)
+{
+	int ret;
+
+	if (!s || !lock)
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&s->plock_mutex);
+	ret = usbg_process_lock_get(s, NULL, true, flags, lock);
+	pthread_mutex_unlock(&s->plock_mutex);
+
+	return ret;
+}
+
+void usbg_process_unlock(usbg_process_lock *lock)
+{
+	usbg_process_lock *pl;
+	usbg_state *s;
+	bool gadget;
+
+	if (!lock)
+		return;
+
+	s = lock->parent;
+	gadget = lock->name != NULL;
+
+	pthread_mutex_lock(&s->plock_mutex);
+	/* Locks returned to callers are always exclusive */
+	usbg_process_lock_put(lock, true);
+
+	/* Gadget lock holds also state lock */
+	if (gadget) {
+		TAILQ_FOREACH(pl, &s->plocks, plnode)
+			if (!pl->name)
+				break;
+		if (pl)
+			usbg_process_lock_put(pl, false);
+	}
+	pthread_mutex_unlock(&s->plock_mutex);
+}
+
+int usbg_process_lock_auto(usbg_state *s, const char *name,
+			   usbg_process_lock **lock)
+{
+	*lock = NULL;
+	if (!s->process_lock)
+		return USBG_SUCCESS;
+
+	return usbg_process_lock_gadget(s, name, 0, lock);
+}
@@ -0,0 +1,161 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_log.c
+ * @brief Log messages with levels, user callback and rate limiting
+ */
+
+#define USBG_LOG_MAX_LENGTH 512
+
+usbg_log_level usbg_log_threshold = USBG_LOG_ERR;
+
+static usbg_log_cb usbg_log_callback;
+static void *usbg_log_data;
+
+static unsigned int usbg_log_burst;
+static uint64_t usbg_log_interval_ns;
+/* Bumped on each limit change to restart windows of all call sites */
+static unsigned int usbg_log_generation;
+
+/*
+ * Protects callback, limits and state of all call sites as errors may
+ * be logged from many threads. Taken only for messages which pass the
+ * level check, never while callback is running.
+ */
+static pthread_mutex_t usbg_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usbg_log_stderr(const usbg_log_record *rec, void *data)
+{
+	if (rec->suppressed)
+		fprintf(stderr, "%s()  %s (%u similar messages suppressed)\n",
+			rec->func, rec->msg, rec->suppressed);
+	else
+		fprintf(stderr, "%s()  %s\n", rec->func, rec->msg);
+}
+
+static uint64_t usbg_log_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Return true if message from given site should be dropped.
+ * Called with usbg_log_lock held.
+ */
+static bool usbg_log_limited(struct usbg_log_site *site)
+{
+	uint64_t now;
+
+	if (!usbg_log_burst)
+		return false;
+
+	now = usbg_log_now_ns();
+	if (site->generation != usbg_log_generation ||
+	    now - site->window_start >= usbg_log_interval_ns) {
+		site->generation = usbg_log_generation;
+		site->window_start = now;
+		site->count = 0;
+	}
+
+	if (site->count >= usbg_log_burst) {
+		site->suppressed++;
+		return true;
+	}
+
+	site->count++;
+	return false;
+}
+
+void usbg_log(struct usbg_log_site *site, usbg_log_level level,
+	      const char *file, int line, const char *func,
+	      const char *fmt, ...)
+{
+	char msg[USBG_LOG_MAX_LENGTH];
+	usbg_log_record rec;
+	usbg_log_cb cb;
+	void *data;
+	va_list args;
+	int len;
+
+	pthread_mutex_lock(&usbg_log_lock);
+	if (usbg_log_limited(site)) {
+		pthread_mutex_unlock(&usbg_log_lock);
+		return;
+	}
+
+	rec.suppressed = site->suppressed;
+	site->suppressed = 0;
+	cb = usbg_log_callback;
+	data = usbg_log_data;
+	pthread_mutex_unlock(&usbg_log_lock);
+
+	va_start(args, fmt);
+	len = vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+
+	if (len >= sizeof(msg))
+		len = sizeof(msg) - 1;
+	/* Messages are written with trailing new line, drop it */
+	while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == ' '))
+		msg[--len] = '\0';
+
+	rec.level = level;
+	rec.file = file;
+	rec.line = line;
+	rec.func = func;
+	rec.msg = msg;
+
+	if (cb)
+		cb(&rec, data);
+	else
+		usbg_log_stderr(&rec, NULL);
+}
+
+void usbg_set_log_callback(usbg_log_cb cb, void *data)
+{
+	pthread_mutex_lock(&usbg_log_lock);
+	usbg_log_callback = cb;
+	usbg_log_data = cb ? data : NULL;
+	pthread_mutex_unlock(&usbg_log_lock);
+}
+
+void usbg_set_log_level(usbg_log_level level)
+{
+	__atomic_store_n(&usbg_log_threshold, level, __ATOMIC_RELAXED);
+}
+
+usbg_log_level usbg_get_log_level(void)
+{
+	return __atomic_load_n(&usbg_log_threshold, __ATOMIC_RELAXED);
+}
+
+void usbg_set_log_rate_limit(unsigned int burst, unsigned int interval_ms)
+{
+	pthread_mutex_lock(&usbg_log_lock);
+	usbg_log_burst = burst;
+	usbg_log_interval_ns = (uint64_t)interval_ms * 1000000ULL;
+	usbg_log_generation++;
+	pthread_mutex_unlock(&usbg_log_lock);
+}
@@ -0,0 +1,1827 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
+
+/**
+ * @file usbg_schemes.c
+ * @brief Model of gadget schemes shared by all scheme formats
+ */
+
+void *usbg_scheme_append(void **array, int *n, size_t size)
+{
+	char *new;
+
+	new = realloc(*array, (*n + 1) * size);
+	if (!new)
+		return NULL;
+
+	memset(new + *n * size, 0, size);
+	*array = new;
+
+	return new + (*n)++ * size;
+}
+
+/* Make room for len more bytes and terminating '\0' */
+static int usbg_scheme_out_reserve(struct usbg_scheme_out *out, size_t len)
+{
+	size_t size = out->size ? out->size : 256;
+	char *new;
+
+	if (out->len + len < out->size)
+		return 0;
+
+	while (out->len + len >= size)
+		size *= 2;
+
+	new = realloc(out->data, size);
+	if (!new) {
+		out->error = USBG_ERROR_NO_MEM;
+		return -1;
+	}
+
+	out->data = new;
+	out->size = size;
+	return 0;
+}
+
+void usbg_scheme_out_write(struct usbg_scheme_out *out, const void *data,
+			   size_t len)
+{
+	/* fputs() is avoided as it may be replaced by the test suite */
+	if (out->stream) {
+		if (fwrite(data, 1, len, out->stream) != len)
+			out->error = USBG_ERROR_IO;
+		return;
+	}
+
+	if (usbg_scheme_out_reserve(out, len))
+		return;
+
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+	out->data[out->len] = '\0';
+}
+
+void usbg_scheme_out_putc(struct usbg_scheme_out *out, char c)
+{
+	if (out->stream) {
+		if (fputc(c, out->stream) == EOF)
+			out->error = USBG_ERROR_IO;
+		return;
+	}
+
+	usbg_scheme_out_write(out, &c, 1);
+}
+
+void usbg_scheme_out_printf(struct usbg_scheme_out *out, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	if (out->stream) {
+		if (vfprintf(out->stream, fmt, ap) < 0)
+			out->error = USBG_ERROR_IO;
+		va_end(ap);
+		return;
+	}
+
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		out->error = USBG_ERROR_INVALID_PARAM;
+		return;
+	}
+
+	if (usbg_scheme_out_reserve(out, n))
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(out->data + out->len, n + 1, fmt, ap);
+	va_end(ap);
+	out->len += n;
+}
+
+void usbg_scheme_free_function(struct usbg_scheme_function *sf)
+{
+	free(sf->label);
+	free(sf->instance);
+	if (sf->mask & USBG_SCHEME_F_ATTRS)
+		usbg_cleanup_function_attrs(&sf->attrs);
+	memset(sf, 0, sizeof(*sf));
+}
+
+void usbg_scheme_free_config(struct usbg_scheme_config *sc)
+{
+	struct usbg_scheme_binding *sb;
+	int i;
+
+	for (i = 0; i < sc->nbindings; ++i) {
+		sb = sc->bindings + i;
+		free(sb->name);
+		free(sb->label);
+		if (sb->function) {
+			usbg_scheme_free_function(sb->function);
+			free(sb->function);
+		}
+	}
+
+	free(sc->bindings);
+	free(sc->strs);
+	free(sc->label);
+	memset(sc, 0, sizeof(*sc));
+}
+
+void usbg_scheme_free_gadget(struct usbg_scheme_gadget *sg)
+{
+	int i;
+
+	for (i = 0; i < sg->nfunctions; ++i)
+		usbg_scheme_free_function(sg->functions + i);
+
+	for (i = 0; i < sg->nconfigs; ++i)
+		usbg_scheme_free_config(sg->configs + i);
+
+	free(sg->functions);
+	free(sg->configs);
+	free(sg->strs);
+	memset(sg, 0, sizeof(*sg));
+}
+
+void usbg_scheme_free_state(struct usbg_scheme_state *ss)
+{
+	int i;
+
+	for (i = 0; i < ss->ngadgets; ++i) {
+		free(ss->gadgets[i].name);
+		free(ss->gadgets[i].udc);
+		usbg_scheme_free_gadget(&ss->gadgets[i].gadget);
+	}
+
+	free(ss->gadgets);
+	memset(ss, 0, sizeof(*ss));
+}
+
+/*
+ * Reading of gadget
+ */
+
+int usbg_scheme_read_function(usbg_function *f,
+			      struct usbg_scheme_function *sf)
+{
+	char label[USBG_MAX_NAME_LENGTH];
+	int nmb;
+	int ret;
+
+	if (f->label) {
+		sf->label = strdup(f->label);
+	} else {
+		nmb = generate_function_label(f, label, sizeof(label));
+		if (nmb >= sizeof(label))
+			return USBG_ERROR_OTHER_ERROR;
+		sf->label = strdup(label);
+	}
+
+	sf->type = f->type;
+	sf->instance = strdup(f->instance);
+	if (!sf->label || !sf->instance)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_get_function_attrs(f, &sf->attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	sf->mask = USBG_SCHEME_F_ATTRS;
+	switch (sf->attrs.header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		sf->mask |= USBG_SCHEME_F_PORT_NUM;
+		break;
+	case USBG_F_ATTRS_NET:
+		sf->mask |= USBG_SCHEME_F_DEV_ADDR | USBG_SCHEME_F_HOST_ADDR |
+			USBG_SCHEME_F_QMULT;
+		break;
+	default:
+		break;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Languages are taken from names of directories in strings directory */
+static int usbg_scheme_list_langs(usbg_state *s, const char *path,
+				  const char *name, int **langs)
+{
+	char spath[USBG_MAX_PATH_LENGTH];
+	struct dirent **dent;
+	int nmb, i;
+	int ret = USBG_SUCCESS;
+
+	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", path, name,
+		       STRINGS_DIR);
+	if (nmb >= sizeof(spath))
+		return USBG_ERROR_PATH_TOO_LONG;
+
+	nmb = usbg_io_list_dir(s, spath, &dent, file_select, alphasort);
+	if (nmb < 0)
+		return usbg_translate_error(-nmb);
+
+	*langs = calloc(nmb + 1, sizeof(**langs));
+	if (!*langs)
+		ret = USBG_ERROR_NO_MEM;
+
+	for (i = 0; i < nmb; ++i) {
+		if (ret == USBG_SUCCESS &&
+		    sscanf(dent[i]->d_name, "%x", *langs + i) != 1)
+			ret = USBG_ERROR_OTHER_ERROR;
+		free(dent[i]);
+	}
+	free(dent);
+
+	if (ret != USBG_SUCCESS) {
+		free(*langs);
+		*langs = NULL;
+		return ret;
+	}
+
+	return nmb;
+}
+
+int usbg_scheme_read_config(usbg_config *c, struct usbg_scheme_config *sc)
+{
+	struct usbg_scheme_config_strs *ss;
+	struct usbg_scheme_binding *sb;
+	char label[USBG_MAX_NAME_LENGTH];
+	usbg_config_attrs attrs;
+	usbg_binding *b;
+	int *langs;
+	int nmb, i;
+	int ret;
+
+	sc->id = c->id;
+	sc->label = strdup(c->label);
+	if (!sc->label)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_get_config_attrs(c, &attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	sc->attrs_mask = USBG_SCHEME_C_BM_ATTRIBUTES |
+		USBG_SCHEME_C_B_MAX_POWER;
+	sc->bmAttributes = attrs.bmAttributes;
+	sc->bMaxPower = attrs.bMaxPower;
+
+	nmb = usbg_scheme_list_langs(c->parent->parent, c->path, c->name,
+				     &langs);
+	if (nmb < 0)
+		return nmb;
+
+	for (i = 0; i < nmb; ++i) {
+		ss = usbg_scheme_new(sc->strs, sc->nstrs);
+		if (!ss) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		ss->lang = langs[i];
+		ret = usbg_get_config_strs(c, langs[i], &ss->strs);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+	free(langs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	/* Target is always referenced by label which follows convention */
+	TAILQ_FOREACH(b, &c->bindings, bnode) {
+		sb = usbg_scheme_new(sc->bindings, sc->nbindings);
+		if (!sb)
+			return USBG_ERROR_NO_MEM;
+
+		nmb = generate_function_label(b->target, label, sizeof(label));
+		if (nmb >= sizeof(label))
+			return USBG_ERROR_OTHER_ERROR;
+
+		sb->name = strdup(b->name);
+		sb->label = strdup(label);
+		if (!sb->name || !sb->label)
+			return USBG_ERROR_NO_MEM;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static void usbg_scheme_set_gadget_attrs(struct usbg_scheme_gadget *sg,
+					 const usbg_gadget_attrs *attrs)
+{
+	sg->attrs[BCD_USB] = attrs->bcdUSB;
+	sg->attrs[B_DEVICE_CLASS] = attrs->bDeviceClass;
+	sg->attrs[B_DEVICE_SUB_CLASS] = attrs->bDeviceSubClass;
+	sg->attrs[B_DEVICE_PROTOCOL] = attrs->bDeviceProtocol;
+	sg->attrs[B_MAX_PACKET_SIZE_0] = attrs->bMaxPacketSize0;
+	sg->attrs[ID_VENDOR] = attrs->idVendor;
+	sg->attrs[ID_PRODUCT] = attrs->idProduct;
+	sg->attrs[BCD_DEVICE] = attrs->bcdDevice;
+	sg->attrs_mask = (1 << USBG_GADGET_ATTR_MAX) - 1;
+}
+
+int usbg_scheme_read_gadget(usbg_gadget *g, struct usbg_scheme_gadget *sg)
+{
+	struct usbg_scheme_gadget_strs *ss;
+	struct usbg_scheme_function *sf;
+	struct usbg_scheme_config *sc;
+	usbg_gadget_attrs attrs;
+	usbg_function *f;
+	usbg_config *c;
+	int *langs;
+	int nmb, i;
+	int ret;
+
+	memset(sg, 0, sizeof(*sg));
+
+	ret = usbg_get_gadget_attrs(g, &attrs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	usbg_scheme_set_gadget_attrs(sg, &attrs);
+
+	nmb = usbg_scheme_list_langs(g->parent, g->path, g->name, &langs);
+	if (nmb < 0) {
+		ret = nmb;
+		goto out;
+	}
+
+	for (i = 0; i < nmb; ++i) {
+		ss = usbg_scheme_new(sg->strs, sg->nstrs);
+		if (!ss) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		ss->lang = langs[i];
+		ret = usbg_get_gadget_strs(g, langs[i], &ss->strs);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+	free(langs);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		sf = usbg_scheme_new(sg->functions, sg->nfunctions);
+		if (!sf) {
+			ret = USBG_ERROR_NO_MEM;
+			goto out;
+		}
+
+		ret = usbg_scheme_read_function(f, sf);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		sc = usbg_scheme_new(sg->configs, sg->nconfigs);
+		if (!sc) {
+			ret = USBG_ERROR_NO_MEM;
+			goto out;
+		}
+
+		ret = usbg_scheme_read_config(c, sc);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+out:
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+	return ret;
+}
+
+int usbg_scheme_read_state(usbg_state *s, struct usbg_scheme_state *ss)
+{
+	struct usbg_scheme_state_gadget *sg;
+	usbg_gadget *g;
+	int ret = USBG_SUCCESS;
+
+	memset(ss, 0, sizeof(*ss));
+
+	TAILQ_FOREACH(g, &s->gadgets, gnode) {
+		sg = usbg_scheme_new(ss->gadgets, ss->ngadgets);
+		if (!sg) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		sg->name = strdup(g->name);
+		if (!sg->name) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		if (g->udc) {
+			sg->udc = strdup(g->udc->name);
+			if (!sg->udc) {
+				ret = USBG_ERROR_NO_MEM;
+				break;
+			}
+		}
+
+		ret = usbg_scheme_read_gadget(g, &sg->gadget);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_state(ss);
+	return ret;
+}
+
+/*
+ * Creation of gadget
+ */
+
+static int split_function_label(const char *label, usbg_function_type *type,
+				const char **instance)
+{
+	const char *floor;
+	char buf[USBG_MAX_NAME_LENGTH];
+	int len;
+	int function_type;
+	int ret = USBG_ERROR_NOT_FOUND;
+
+	/* We assume that function type string doesn't contain '_' */
+	floor = strchr(label, '_');
+	if (!floor)
+		goto out;
+
+	/* if phrase before _ is longer than max name length we may
+	 * stop looking */
+	len = floor - label;
+	if (len >= USBG_MAX_NAME_LENGTH || floor == label)
+		goto out;
+
+	strncpy(buf, label, len);
+	buf[len] = '\0';
+
+	function_type = usbg_lookup_function_type(buf);
+	if (function_type < 0)
+		goto out;
+
+	*type = (usbg_function_type)function_type;
+	*instance = floor + 1;
+
+	ret = USBG_SUCCESS;
+out:
+	return ret;
+}
+
+/*
+ * Open addressing hash table of strings. Keys are not copied, so they
+ * have to outlive the table. The first value added for key is kept.
+ */
+struct usbg_scheme_index {
+	unsigned size;
+	unsigned n;
+	struct usbg_scheme_index_entry {
+		const char *key;
+		void *value;
+	} *entries;
+};
+
+static unsigned usbg_scheme_hash(const char *key)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+
+	while (*key) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static struct usbg_scheme_index_entry *
+usbg_scheme_index_slot(const struct usbg_scheme_index *idx, const char *key)
+{
+	unsigned i = usbg_scheme_hash(key) & (idx->size - 1);
+
+	while (idx->entries[i].key && strcmp(idx->entries[i].key, key))
+		i = (i + 1) & (idx->size - 1);
+
+	return idx->entries + i;
+}
+
+static void *usbg_scheme_index_find(const struct usbg_scheme_index *idx,
+				    const char *key)
+{
+	return idx->size ? usbg_scheme_index_slot(idx, key)->value : NULL;
+}
+
+static int usbg_scheme_index_add(struct usbg_scheme_index *idx,
+				 const char *key, void *value)
+{
+	struct usbg_scheme_index_entry *slot;
+
+	/* Keep at most half of slots used */
+	if (2 * (idx->n + 1) > idx->size) {
+		struct usbg_scheme_index bigger = { 0 };
+		unsigned i;
+
+		bigger.size = idx->size ? 2 * idx->size : 16;
+		bigger.entries = calloc(bigger.size, sizeof(*bigger.entries));
+		if (!bigger.entries)
+			return USBG_ERROR_NO_MEM;
+
+		for (i = 0; i < idx->size; ++i) {
+			if (idx->entries[i].key)
+				*usbg_scheme_index_slot(&bigger,
+						idx->entries[i].key) =
+					idx->entries[i];
+		}
+
+		bigger.n = idx->n;
+		free(idx->entries);
+		*idx = bigger;
+	}
+
+	slot = usbg_scheme_index_slot(idx, key);
+	if (!slot->key) {
+		slot->key = key;
+		slot->value = value;
+		idx->n++;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static void usbg_scheme_index_free(struct usbg_scheme_index *idx)
+{
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->size = idx->n = 0;
+}
+
+/*
+ * Functions by label and by instance of each type, so binding label is
+ * resolved without scanning all functions of gadget.
+ */
+struct usbg_function_index {
+	struct usbg_scheme_index labels;
+	struct usbg_scheme_index instances[USBG_FUNCTION_TYPE_MAX];
+};
+
+static int usbg_function_index_add(struct usbg_function_index *fi,
+				   const char *label, usbg_function_type type,
+				   const char *instance, void *value)
+{
+	int ret = USBG_SUCCESS;
+
+	if (label)
+		ret = usbg_scheme_index_add(&fi->labels, label, value);
+
+	if (ret == USBG_SUCCESS)
+		ret = usbg_scheme_index_add(fi->instances + type, instance,
+					    value);
+
+	return ret;
+}
+
+/*
+ * Label given by user takes precedence, then label is checked if it
+ * follows the naming convention.
+ */
+static void *usbg_function_index_find(const struct usbg_function_index *fi,
+				      const char *label)
+{
+	usbg_function_type type;
+	const char *instance;
+	void *value;
+
+	value = usbg_scheme_index_find(&fi->labels, label);
+	if (value)
+		return value;
+
+	if (split_function_label(label, &type, &instance) != USBG_SUCCESS)
+		return NULL;
+
+	return usbg_scheme_index_find(fi->instances + type, instance);
+}
+
+static void usbg_function_index_free(struct usbg_function_index *fi)
+{
+	int i;
+
+	usbg_scheme_index_free(&fi->labels);
+	for (i = USBG_FUNCTION_TYPE_MIN; i < USBG_FUNCTION_TYPE_MAX; ++i)
+		usbg_scheme_index_free(fi->instances + i);
+}
+
+static int usbg_function_index_add_function(struct usbg_function_index *fi,
+					    usbg_function *f)
+{
+	return usbg_function_index_add(fi, f->label, f->type, f->instance, f);
+}
+
+static int usbg_scheme_set_function_attrs(usbg_function *f,
+					  const struct usbg_scheme_function *sf)
+{
+	const usbg_f_net_attrs *net = &sf->attrs.attrs.net;
+	struct ether_addr addr;
+	int ret = USBG_SUCCESS;
+
+	if (!(sf->mask & USBG_SCHEME_F_ATTRS))
+		return USBG_SUCCESS;
+
+	switch (sf->attrs.header.attrs_type) {
+	case USBG_F_ATTRS_NET:
+		if (sf->mask & USBG_SCHEME_F_HOST_ADDR) {
+			addr = net->host_addr;
+			ret = usbg_set_net_host_addr(f, &addr);
+			if (ret != USBG_SUCCESS)
+				break;
+		}
+
+		if (sf->mask & USBG_SCHEME_F_DEV_ADDR) {
+			addr = net->dev_addr;
+			ret = usbg_set_net_dev_addr(f, &addr);
+			if (ret != USBG_SUCCESS)
+				break;
+		}
+
+		if (sf->mask & USBG_SCHEME_F_QMULT)
+			ret = usbg_set_net_qmult(f, net->qmult);
+		break;
+
+	case USBG_F_ATTRS_MS:
+	case USBG_F_ATTRS_MIDI:
+		ret = usbg_set_function_attrs(f, &sf->attrs);
+		break;
+
+	default:
+		/* Remaining attributes are read only or part of instance */
+		break;
+	}
+
+	return ret;
+}
+
+int usbg_scheme_create_function(usbg_gadget *g,
+				const struct usbg_scheme_function *sf,
+				const char *instance, usbg_function **f)
+{
+	usbg_function *newf;
+	int ret;
+
+	ret = usbg_create_function(g, sf->type, instance, NULL, &newf);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_scheme_set_function_attrs(newf, sf);
+	if (ret != USBG_SUCCESS)
+		goto error;
+
+	/* Set the label given by user */
+	if (sf->label) {
+		newf->label = strdup(sf->label);
+		if (!newf->label) {
+			ret = USBG_ERROR_NO_MEM;
+			goto error;
+		}
+	}
+
+	*f = newf;
+	return USBG_SUCCESS;
+
+error:
+	/* We ignore returned value, if function fails
+	 * there is no way to handle it */
+	usbg_rm_function(newf, USBG_RM_RECURSE);
+	return ret;
+}
+
+static int usbg_scheme_create_binding(usbg_config *c,
+				      const struct usbg_scheme_binding *sb,
+				      struct usbg_function_index *fi)
+{
+	usbg_function *target;
+	int ret;
+
+	/* It is allowed to provide link to existing function
+	 * or define unlabeled instance of function in this place */
+	if (sb->function) {
+		ret = usbg_scheme_create_function(c->parent, sb->function,
+						  sb->function->instance,
+						  &target);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		ret = usbg_function_index_add_function(fi, target);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	} else {
+		target = usbg_function_index_find(fi, sb->label);
+		if (!target)
+			return USBG_ERROR_NOT_FOUND;
+	}
+
+	/* When no name given, default one is used */
+	return usbg_add_config_function(c, sb->name ? sb->name : target->name,
+					target);
+}
+
+static int usbg_scheme_create_indexed_config(usbg_gadget *g,
+					     const struct usbg_scheme_config *sc,
+					     int id,
+					     struct usbg_function_index *fi,
+					     usbg_config **c)
+{
+	usbg_config *newc;
+	int i;
+	int ret;
+
+	ret = usbg_create_config(g, id, sc->label, NULL, NULL, &newc);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (sc->attrs_mask & USBG_SCHEME_C_BM_ATTRIBUTES) {
+		ret = usbg_set_config_bm_attrs(newc, sc->bmAttributes);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	if (sc->attrs_mask & USBG_SCHEME_C_B_MAX_POWER) {
+		ret = usbg_set_config_max_power(newc, sc->bMaxPower);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	for (i = 0; i < sc->nstrs; ++i) {
+		ret = usbg_set_config_strs(newc, sc->strs[i].lang,
+					   &sc->strs[i].strs);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	for (i = 0; i < sc->nbindings; ++i) {
+		ret = usbg_scheme_create_binding(newc, sc->bindings + i, fi);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	*c = newc;
+	return USBG_SUCCESS;
+
+error:
+	/* We ignore returned value, if function fails
+	 * there is no way to handle it */
+	usbg_rm_config(newc, USBG_RM_RECURSE);
+	return ret;
+}
+
+int usbg_scheme_create_config(usbg_gadget *g,
+			      const struct usbg_scheme_config *sc,
+			      int id, usbg_config **c)
+{
+	struct usbg_function_index fi = { 0 };
+	usbg_function *f;
+	int ret = USBG_SUCCESS;
+
+	/* Functions are in name order, so the first one wins as before */
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		ret = usbg_function_index_add_function(&fi, f);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	ret = usbg_scheme_create_indexed_config(g, sc, id, &fi, c);
+out:
+	usbg_function_index_free(&fi);
+	return ret;
+}
+
+/* Typed setters are used to keep the width of written hex values */
+static int usbg_scheme_set_gadget_attr(usbg_gadget *g, usbg_gadget_attr attr,
+				       int val)
+{
+	int ret;
+
+	switch (attr) {
+	case BCD_USB:
+		ret = usbg_set_gadget_device_bcd_usb(g, val);
+		break;
+	case B_DEVICE_CLASS:
+		ret = usbg_set_gadget_device_class(g, val);
+		break;
+	case B_DEVICE_SUB_CLASS:
+		ret = usbg_set_gadget_device_subclass(g, val);
+		break;
+	case B_DEVICE_PROTOCOL:
+		ret = usbg_set_gadget_device_protocol(g, val);
+		break;
+	case B_MAX_PACKET_SIZE_0:
+		ret = usbg_set_gadget_device_max_packet(g, val);
+		break;
+	case ID_VENDOR:
+		ret = usbg_set_gadget_vendor_id(g, val);
+		break;
+	case ID_PRODUCT:
+		ret = usbg_set_gadget_product_id(g, val);
+		break;
+	case BCD_DEVICE:
+		ret = usbg_set_gadget_device_bcd_device(g, val);
+		break;
+	default:
+		ret = usbg_set_gadget_attr(g, attr, val);
+		break;
+	}
+
+	return ret;
+}
+
+/* Scheme has been already checked by usbg_scheme_validate_gadget() */
+static int usbg_scheme_create_valid_gadget(usbg_state *s,
+					   const struct usbg_scheme_gadget *sg,
+					   const char *name, usbg_gadget **g)
+{
+	struct usbg_function_index fi = { 0 };
+	usbg_gadget *newg;
+	usbg_function *f;
+	usbg_config *c;
+	int i;
+	int ret;
+
+	/* There is no mandatory data in gadget so let's start with
+	 * creating a new gadget */
+	ret = usbg_create_gadget(s, name, NULL, NULL, &newg);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		if (!(sg->attrs_mask & (1 << i)))
+			continue;
+
+		ret = usbg_scheme_set_gadget_attr(newg, i, sg->attrs[i]);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	for (i = 0; i < sg->nstrs; ++i) {
+		ret = usbg_set_gadget_strs(newg, sg->strs[i].lang,
+					   &sg->strs[i].strs);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	for (i = 0; i < sg->nfunctions; ++i) {
+		ret = usbg_scheme_create_function(newg, sg->functions + i,
+						  sg->functions[i].instance,
+						  &f);
+		if (ret != USBG_SUCCESS)
+			goto error;
+
+		ret = usbg_function_index_add_function(&fi, f);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	/* Index is built once and shared by bindings of all configs */
+	for (i = 0; i < sg->nconfigs; ++i) {
+		ret = usbg_scheme_create_indexed_config(newg, sg->configs + i,
+							sg->configs[i].id,
+							&fi, &c);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	usbg_function_index_free(&fi);
+	*g = newg;
+	return USBG_SUCCESS;
+
+error:
+	usbg_function_index_free(&fi);
+	/* We ignore returned value, if function fails
+	 * there is no way to handle it */
+	usbg_rm_gadget(newg);
+	return ret;
+}
+
+int usbg_scheme_create_gadget(usbg_state *s,
+			      const struct usbg_scheme_gadget *sg,
+			      const char *name, usbg_gadget **g)
+{
+	int ret;
+
+	ret = usbg_scheme_validate_gadget(s, sg, name);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	return usbg_scheme_create_valid_gadget(s, sg, name, g);
+}
+
+static int usbg_scheme_validate_state(usbg_state *s,
+				      const struct usbg_scheme_state *ss,
+				      int flags)
+{
+	int i, j;
+	int ret;
+
+	for (i = 0; i < ss->ngadgets; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (ss->gadgets[j].name && ss->gadgets[i].name &&
+			    !strcmp(ss->gadgets[j].name, ss->gadgets[i].name)) {
+				ERROR("duplicate gadget %s\n",
+				      ss->gadgets[i].name);
+				return USBG_ERROR_EXIST;
+			}
+		}
+
+		ret = usbg_scheme_validate_gadget(s, &ss->gadgets[i].gadget,
+						  ss->gadgets[i].name);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		if (!(flags & USBG_IMPORT_STATE_ENABLE) || !ss->gadgets[i].udc)
+			continue;
+
+		if (!usbg_get_udc(s, ss->gadgets[i].udc)) {
+			ERROR("udc %s of gadget %s not found\n",
+			      ss->gadgets[i].udc, ss->gadgets[i].name);
+			return USBG_ERROR_NOT_FOUND;
+		}
+
+		/* Only one gadget can be bound to udc */
+		for (j = 0; j < i; ++j) {
+			if (ss->gadgets[j].udc &&
+			    !strcmp(ss->gadgets[j].udc, ss->gadgets[i].udc)) {
+				ERROR("udc %s of gadget %s used also by %s\n",
+				      ss->gadgets[i].udc, ss->gadgets[i].name,
+				      ss->gadgets[j].name);
+				return USBG_ERROR_BUSY;
+			}
+		}
+	}
+
+	return USBG_SUCCESS;
+}
+
+int usbg_scheme_create_state(usbg_state *s,
+			     const struct usbg_scheme_state *ss, int flags)
+{
+	usbg_gadget **gadgets;
+	usbg_udc *u;
+	int created = 0, i;
+	int ret = USBG_SUCCESS;
+
+	ret = usbg_scheme_validate_state(s, ss, flags);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	gadgets = calloc(ss->ngadgets ? ss->ngadgets : 1, sizeof(*gadgets));
+	if (!gadgets)
+		return USBG_ERROR_NO_MEM;
+
+	for (; created < ss->ngadgets; ++created) {
+		ret = usbg_scheme_create_valid_gadget(s,
+						&ss->gadgets[created].gadget,
+						ss->gadgets[created].name,
+						gadgets + created);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+	if (!(flags & USBG_IMPORT_STATE_ENABLE))
+		goto out;
+
+	/* Gadgets are enabled only when all of them are ready */
+	for (i = 0; i < ss->ngadgets; ++i) {
+		if (!ss->gadgets[i].udc)
+			continue;
+
+		u = usbg_get_udc(s, ss->gadgets[i].udc);
+		if (!u) {
+			ERROR("udc %s of gadget %s not found\n",
+			      ss->gadgets[i].udc, ss->gadgets[i].name);
+			ret = USBG_ERROR_NOT_FOUND;
+			goto error;
+		}
+
+		ret = usbg_enable_gadget(gadgets[i], u);
+		if (ret != USBG_SUCCESS)
+			goto error;
+	}
+
+out:
+	free(gadgets);
+	return ret;
+
+error:
+	/* We ignore returned values, there is no way to handle them */
+	while (created--) {
+		if (usbg_get_gadget_udc(gadgets[created]))
+			usbg_disable_gadget(gadgets[created]);
+		usbg_rm_gadget(gadgets[created]);
+	}
+	goto out;
+}
+
+/*
+ * Validation of gadget scheme
+ */
+
+/* Limits of kernel mass storage and MIDI functions */
+#define USBG_SCHEME_MAX_LUNS		16
+#define USBG_SCHEME_MAX_MIDI_PORTS	16
+
+static int usbg_scheme_check_name(const char *what, const char *name)
+{
+	if (!name || !*name || strchr(name, '/') ||
+	    !strcmp(name, ".") || !strcmp(name, "..")) {
+		ERROR("invalid %s name \"%s\"\n", what, name ? name : "");
+		return USBG_ERROR_INVALID_VALUE;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_scheme_check_range(const char *what, int val, int min, int max)
+{
+	if (val < min || val > max) {
+		ERROR("%s %d out of range <%d, %d>\n", what, val, min, max);
+		return USBG_ERROR_INVALID_VALUE;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Check length of the longest path which will be created or written */
+static int usbg_scheme_check_path(const char *fmt, ...)
+	__attribute__ ((format (printf, 1, 2)));
+
+static int usbg_scheme_check_path(const char *fmt, ...)
+{
+	char buf[USBG_MAX_PATH_LENGTH];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || n >= sizeof(buf)) {
+		ERROR("path %s... too long\n", buf);
+		return USBG_ERROR_PATH_TOO_LONG;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_scheme_check_lang(const char *path, int lang,
+				  const char *attr)
+{
+	int ret;
+
+	ret = usbg_scheme_check_range("language", lang, 0, 0xffff);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_scheme_check_path("%s/%s/0x%x/%s", path,
+					     STRINGS_DIR, lang, attr);
+
+	return ret;
+}
+
+static int usbg_scheme_duplicate_lang(int lang)
+{
+	ERROR("duplicate strings of language 0x%x\n", lang);
+	return USBG_ERROR_EXIST;
+}
+
+static int usbg_scheme_check_function_attrs(const struct usbg_scheme_function *sf,
+					    const char *fpath)
+{
+	const usbg_f_ms_attrs *ms = &sf->attrs.attrs.ms;
+	const usbg_f_midi_attrs *midi = &sf->attrs.attrs.midi;
+	int attrs_type;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	if (!(sf->mask & USBG_SCHEME_F_ATTRS))
+		return USBG_SUCCESS;
+
+	attrs_type = usbg_lookup_function_attrs_type(sf->type);
+	if (sf->attrs.header.attrs_type &&
+	    sf->attrs.header.attrs_type != attrs_type) {
+		ERROR("attributes of %s do not match its type\n", fpath);
+		return USBG_ERROR_INVALID_TYPE;
+	}
+
+	switch (attrs_type) {
+	case USBG_F_ATTRS_NET:
+		if (sf->mask & USBG_SCHEME_F_QMULT)
+			ret = usbg_scheme_check_range("qmult",
+						      sf->attrs.attrs.net.qmult,
+						      0, INT_MAX);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_scheme_check_path("%s/host_addr", fpath);
+		break;
+
+	case USBG_F_ATTRS_MS:
+		ret = usbg_scheme_check_range("number of luns", ms->nluns,
+					      0, USBG_SCHEME_MAX_LUNS);
+		if (ret != USBG_SUCCESS || !ms->luns)
+			break;
+
+		for (i = 0; i < ms->nluns; ++i) {
+			/* id may be left unset, see usbg_set_function_attrs() */
+			if (ms->luns[i] && ms->luns[i]->id >= 0 &&
+			    ms->luns[i]->id != i) {
+				ERROR("lun %d of %s has id %d\n", i, fpath,
+				      ms->luns[i]->id);
+				return USBG_ERROR_INVALID_VALUE;
+			}
+		}
+
+		if (ms->nluns > 0)
+			ret = usbg_scheme_check_path("%s/lun.%d/removable",
+						     fpath, ms->nluns - 1);
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		ret = usbg_scheme_check_range("number of MIDI in ports",
+					      midi->in_ports, 0,
+					      USBG_SCHEME_MAX_MIDI_PORTS);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_scheme_check_range("number of MIDI out ports",
+						      midi->out_ports, 0,
+						      USBG_SCHEME_MAX_MIDI_PORTS);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_scheme_check_path("%s/out_ports", fpath);
+		break;
+
+	default:
+		/* Remaining attributes are not imported */
+		break;
+	}
+
+	return ret;
+}
+
+/* Check function and add it to functions which exist at this point */
+static int usbg_scheme_check_function(const struct usbg_scheme_function *sf,
+				      const char *gpath,
+				      struct usbg_function_index *known)
+{
+	const char *type;
+	char fpath[USBG_MAX_PATH_LENGTH];
+	int n;
+	int ret;
+
+	type = usbg_get_function_type_str(sf->type);
+	if (!type) {
+		ERROR("unknown function type %d\n", sf->type);
+		return USBG_ERROR_INVALID_TYPE;
+	}
+
+	ret = usbg_scheme_check_name("function instance", sf->instance);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (usbg_scheme_index_find(known->instances + sf->type,
+				   sf->instance)) {
+		ERROR("duplicate function %s.%s\n", type, sf->instance);
+		return USBG_ERROR_EXIST;
+	}
+
+	if (sf->label && usbg_scheme_index_find(&known->labels, sf->label)) {
+		ERROR("duplicate function label %s\n", sf->label);
+		return USBG_ERROR_EXIST;
+	}
+
+	n = snprintf(fpath, sizeof(fpath), "%s/%s/%s.%s", gpath,
+		     FUNCTIONS_DIR, type, sf->instance);
+	if (n >= sizeof(fpath)) {
+		ERROR("path of function %s.%s too long\n", type, sf->instance);
+		return USBG_ERROR_PATH_TOO_LONG;
+	}
+
+	ret = usbg_scheme_check_function_attrs(sf, fpath);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	return usbg_function_index_add(known, sf->label, sf->type,
+				       sf->instance, (void *)sf);
+}
+
+static const char *usbg_scheme_binding_name(const struct usbg_scheme_binding *sb,
+					    const struct usbg_scheme_function *target,
+					    char *buf, size_t len)
+{
+	if (sb->name)
+		return sb->name;
+
+	snprintf(buf, len, "%s.%s", usbg_get_function_type_str(target->type),
+		 target->instance);
+	return buf;
+}
+
+static int usbg_scheme_check_config(const struct usbg_scheme_config *sc,
+				    const char *gpath,
+				    struct usbg_function_index *known)
+{
+	const struct usbg_scheme_function *target;
+	const char *label = sc->label ? sc->label : DEFAULT_CONFIG_LABEL;
+	struct usbg_scheme_index names = { 0 };
+	struct usbg_function_index bound = { 0 };
+	char **generated;
+	const char *name;
+	char cpath[USBG_MAX_PATH_LENGTH];
+	char buf[USBG_MAX_PATH_LENGTH];
+	int i, j, n;
+	int ret;
+
+	ret = usbg_scheme_check_range("configuration id", sc->id, 1, 255);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_scheme_check_name("configuration", label);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (sc->attrs_mask & USBG_SCHEME_C_BM_ATTRIBUTES) {
+		ret = usbg_scheme_check_range("bmAttributes",
+					      sc->bmAttributes, 0, 0xff);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	if (sc->attrs_mask & USBG_SCHEME_C_B_MAX_POWER) {
+		ret = usbg_scheme_check_range("MaxPower", sc->bMaxPower,
+					      0, 0xffff);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	n = snprintf(cpath, sizeof(cpath), "%s/%s/%s.%d", gpath, CONFIGS_DIR,
+		     label, sc->id);
+	if (n >= sizeof(cpath)) {
+		ERROR("path of configuration %s.%d too long\n", label, sc->id);
+		return USBG_ERROR_PATH_TOO_LONG;
+	}
+
+	ret = usbg_scheme_check_path("%s/bmAttributes", cpath);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = 0; i < sc->nstrs; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (sc->strs[j].lang == sc->strs[i].lang)
+				return usbg_scheme_duplicate_lang(
+					sc->strs[i].lang);
+		}
+
+		ret = usbg_scheme_check_lang(cpath, sc->strs[i].lang,
+					     "configuration");
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	/* Index keys have to outlive it, so generated names are copied */
+	generated = calloc(sc->nbindings ? sc->nbindings : 1,
+			   sizeof(*generated));
+	if (!generated)
+		return USBG_ERROR_NO_MEM;
+
+	for (i = 0; i < sc->nbindings; ++i) {
+		const struct usbg_scheme_binding *sb = sc->bindings + i;
+
+		if (sb->function) {
+			ret = usbg_scheme_check_function(sb->function, gpath,
+							 known);
+			if (ret != USBG_SUCCESS)
+				goto out;
+
+			target = sb->function;
+		} else {
+			target = usbg_function_index_find(known, sb->label);
+			if (!target) {
+				ERROR("function %s bound to %s.%d not found\n",
+				      sb->label, label, sc->id);
+				ret = USBG_ERROR_NOT_FOUND;
+				goto out;
+			}
+		}
+
+		name = usbg_scheme_binding_name(sb, target, buf, sizeof(buf));
+		ret = usbg_scheme_check_name("binding", name);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		/* Functions of gadget are unique by type and instance */
+		if (usbg_scheme_index_find(&names, name) ||
+		    usbg_scheme_index_find(bound.instances + target->type,
+					   target->instance)) {
+			ERROR("duplicate binding %s in %s.%d\n", name,
+			      label, sc->id);
+			ret = USBG_ERROR_EXIST;
+			goto out;
+		}
+
+		if (!sb->name) {
+			name = generated[i] = strdup(name);
+			if (!name) {
+				ret = USBG_ERROR_NO_MEM;
+				goto out;
+			}
+		}
+
+		ret = usbg_scheme_index_add(&names, name, (void *)target);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_function_index_add(&bound, NULL,
+						      target->type,
+						      target->instance,
+						      (void *)target);
+		if (ret != USBG_SUCCESS)
+			goto out;
+
+		ret = usbg_scheme_check_path("%s/%s", cpath, name);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+out:
+	usbg_function_index_free(&bound);
+	usbg_scheme_index_free(&names);
+	for (j = 0; j < sc->nbindings; ++j)
+		free(generated[j]);
+	free(generated);
+	return ret;
+}
+
+int usbg_scheme_validate_gadget(usbg_state *s,
+				const struct usbg_scheme_gadget *sg,
+				const char *name)
+{
+	struct usbg_function_index known = { 0 };
+	char gpath[USBG_MAX_PATH_LENGTH];
+	int i, n;
+	int ret;
+
+	ret = usbg_scheme_check_name("gadget", name);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (usbg_get_gadget(s, name)) {
+		ERROR("duplicate gadget name\n");
+		return USBG_ERROR_EXIST;
+	}
+
+	n = snprintf(gpath, sizeof(gpath), "%s/%s", s->path, name);
+	if (n >= sizeof(gpath)) {
+		ERROR("path of gadget %s too long\n", name);
+		return USBG_ERROR_PATH_TOO_LONG;
+	}
+
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		int max;
+
+		if (!(sg->attrs_mask & (1 << i)))
+			continue;
+
+		switch (i) {
+		case BCD_USB:
+		case ID_VENDOR:
+		case ID_PRODUCT:
+		case BCD_DEVICE:
+			max = 0xffff;
+			break;
+		default:
+			max = 0xff;
+			break;
+		}
+
+		ret = usbg_scheme_check_range(usbg_get_gadget_attr_str(i),
+					      sg->attrs[i], 0, max);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	if (sg->attrs_mask >> USBG_GADGET_ATTR_MAX) {
+		ERROR("unknown gadget attribute\n");
+		return USBG_ERROR_INVALID_VALUE;
+	}
+
+	for (i = 0; i < sg->nstrs; ++i) {
+		for (n = 0; n < i; ++n) {
+			if (sg->strs[n].lang == sg->strs[i].lang)
+				return usbg_scheme_duplicate_lang(
+					sg->strs[i].lang);
+		}
+
+		ret = usbg_scheme_check_lang(gpath, sg->strs[i].lang,
+					     "serialnumber");
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	for (i = 0; i < sg->nfunctions; ++i) {
+		ret = usbg_scheme_check_function(sg->functions + i, gpath,
+						 &known);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+	for (i = 0; i < sg->nconfigs; ++i) {
+		int j;
+
+		for (j = 0; j < i; ++j) {
+			if (sg->configs[j].id == sg->configs[i].id) {
+				ERROR("duplicate configuration id %d\n",
+				      sg->configs[i].id);
+				ret = USBG_ERROR_EXIST;
+				goto out;
+			}
+		}
+
+		ret = usbg_scheme_check_config(sg->configs + i, gpath, &known);
+		if (ret != USBG_SUCCESS)
+			goto out;
+	}
+
+out:
+	usbg_function_index_free(&known);
+	return ret;
+}
+
+/*
+ * Conversion between formats
+ */
+
+static const struct {
+	int (*parse)(FILE *stream, struct usbg_scheme_gadget *sg);
+	int (*write)(const struct usbg_scheme_gadget *sg, FILE *stream);
+	int (*parse_state)(FILE *stream, struct usbg_scheme_state *ss);
+	int (*write_state)(const struct usbg_scheme_state *ss, FILE *stream);
+	/* Documents in memory, NULL if format has no such document */
+	int (*parse_function_buf)(const char *buf, size_t len,
+				  struct usbg_scheme_function *sf);
+	int (*parse_config_buf)(const char *buf, size_t len,
+				struct usbg_scheme_config *sc);
+	int (*parse_gadget_buf)(const char *buf, size_t len,
+				struct usbg_scheme_gadget *sg);
+	int (*export_function)(usbg_function *f, struct usbg_scheme_out *out);
+	int (*export_config)(usbg_config *c, struct usbg_scheme_out *out);
+	int (*export_gadget)(usbg_gadget *g, struct usbg_scheme_out *out);
+} usbg_scheme_formats[USBG_SCHEME_FORMAT_MAX] = {
+	[USBG_SCHEME_LIBCONFIG] = {
+#ifdef HAS_GADGET_SCHEMES
+		.parse = usbg_scheme_parse_gadget_libconfig,
+		.parse_state = usbg_scheme_parse_state_libconfig,
+		.parse_function_buf = usbg_scheme_parse_function_libconfig_buf,
+		.parse_config_buf = usbg_scheme_parse_config_libconfig_buf,
+		.parse_gadget_buf = usbg_scheme_parse_gadget_libconfig_buf,
+#else
+		.parse = usbg_scheme_parse_gadget_text,
+		.parse_state = usbg_scheme_parse_state_text,
+		.parse_function_buf = usbg_scheme_parse_function_text_buf,
+		.parse_config_buf = usbg_scheme_parse_config_text_buf,
+		.parse_gadget_buf = usbg_scheme_parse_gadget_text_buf,
+#endif
+		.write = usbg_scheme_write_gadget_libconfig,
+		.write_state = usbg_scheme_write_state_libconfig,
+		.export_function = usbg_scheme_export_function_libconfig,
+		.export_config = usbg_scheme_export_config_libconfig,
+		.export_gadget = usbg_scheme_export_gadget_libconfig,
+	},
+	[USBG_SCHEME_BIN] = {
+		.parse = usbg_scheme_parse_gadget_bin,
+		.write = usbg_scheme_write_gadget_bin,
+		.parse_state = usbg_scheme_parse_state_bin,
+		.write_state = usbg_scheme_write_state_bin,
+		.parse_gadget_buf = usbg_scheme_parse_gadget_bin_buf,
+		.export_gadget = usbg_scheme_export_gadget_bin,
+	},
+	[USBG_SCHEME_JSON] = {
+		.parse = usbg_scheme_parse_gadget_json,
+		.write = usbg_scheme_write_gadget_json,
+		.parse_state = usbg_scheme_parse_state_json,
+		.write_state = usbg_scheme_write_state_json,
+		.parse_function_buf = usbg_scheme_parse_function_json_buf,
+		.parse_config_buf = usbg_scheme_parse_config_json_buf,
+		.parse_gadget_buf = usbg_scheme_parse_gadget_json_buf,
+		.export_function = usbg_scheme_export_function_json,
+		.export_config = usbg_scheme_export_config_json,
+		.export_gadget = usbg_scheme_export_gadget_json,
+	},
+};
+
+int usbg_scheme_parse_gadget(FILE *stream, usbg_scheme_format format,
+			     struct usbg_scheme_gadget *sg)
+{
+	if (format < USBG_SCHEME_FORMAT_MIN || format >= USBG_SCHEME_FORMAT_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_formats[format].parse(stream, sg);
+}
+
+int usbg_convert_gadget_scheme(FILE *in, usbg_scheme_format in_format,
+			       FILE *out, usbg_scheme_format out_format)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	int ret;
+
+	if (!in || !out ||
+	    in_format < USBG_SCHEME_FORMAT_MIN ||
+	    in_format >= USBG_SCHEME_FORMAT_MAX ||
+	    out_format < USBG_SCHEME_FORMAT_MIN ||
+	    out_format >= USBG_SCHEME_FORMAT_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_scheme_formats[in_format].parse(in, &sg);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_scheme_formats[out_format].write(&sg, out);
+	usbg_scheme_free_gadget(&sg);
+
+	return ret;
+}
+
+int usbg_validate_gadget_scheme(usbg_state *s, FILE *stream,
+				usbg_scheme_format format, const char *name)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	int ret;
+
+	if (!s || !stream || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_scheme_parse_gadget(stream, format, &sg);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	usbg_lock_shared(s);
+	ret = usbg_scheme_validate_gadget(s, &sg, name);
+	usbg_unlock(s);
+
+	usbg_scheme_free_gadget(&sg);
+	return ret;
+}
+
+/*
+ * Schemes in memory buffers
+ */
+
+static bool usbg_scheme_format_valid(usbg_scheme_format format)
+{
+	return format >= USBG_SCHEME_FORMAT_MIN &&
+		format < USBG_SCHEME_FORMAT_MAX;
+}
+
+/* Output is handed to caller only on success */
+static int usbg_scheme_out_finish(struct usbg_scheme_out *out, int ret,
+				  char **buf, size_t *len)
+{
+	if (ret != USBG_SUCCESS) {
+		free(out->data);
+		return ret;
+	}
+
+	*buf = out->data;
+	*len = out->len;
+	return ret;
+}
+
+int usbg_export_function_buf(usbg_function *f, char **buf, size_t *len,
+			     usbg_scheme_format format)
+{
+	struct usbg_scheme_out out = { 0 };
+	int ret;
+
+	if (!f || !buf || !len || !usbg_scheme_format_valid(format))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_scheme_formats[format].export_function)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	ret = usbg_scheme_formats[format].export_function(f, &out);
+	return usbg_scheme_out_finish(&out, ret, buf, len);
+}
+
+int usbg_export_config_buf(usbg_config *c, char **buf, size_t *len,
+			   usbg_scheme_format format)
+{
+	struct usbg_scheme_out out = { 0 };
+	int ret;
+
+	if (!c || !buf || !len || !usbg_scheme_format_valid(format))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_scheme_formats[format].export_config)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	ret = usbg_scheme_formats[format].export_config(c, &out);
+	return usbg_scheme_out_finish(&out, ret, buf, len);
+}
+
+int usbg_export_gadget_buf(usbg_gadget *g, char **buf, size_t *len,
+			   usbg_scheme_format format)
+{
+	struct usbg_scheme_out out = { 0 };
+	int ret;
+
+	if (!g || !buf || !len || !usbg_scheme_format_valid(format))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_scheme_formats[format].export_gadget)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	ret = usbg_scheme_formats[format].export_gadget(g, &out);
+	return usbg_scheme_out_finish(&out, ret, buf, len);
+}
+
+int usbg_import_function_buf(usbg_gadget *g, const char *buf, size_t len,
+			     usbg_scheme_format format, const char *instance,
+			     usbg_function **f)
+{
+	struct usbg_scheme_function sf = { 0 };
+	usbg_function *newf;
+	usbg_stats_site site;
+	int ret;
+
+	if (!g || !buf || !instance || !usbg_scheme_format_valid(format))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_scheme_formats[format].parse_function_buf)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	USBG_PROBE1(import_function_start, instance);
+	ret = usbg_scheme_formats[format].parse_function_buf(buf, len, &sf);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_function(g, &sf, instance, &newf);
+		usbg_stats_leave(g->parent, site);
+		usbg_unlock(g->parent);
+	}
+
+	if (ret == USBG_SUCCESS && f)
+		*f = newf;
+
+	usbg_scheme_free_function(&sf);
+out:
+	USBG_PROBE2(import_function_done, instance, ret);
+	return ret;
+}
+
+int usbg_import_config_buf(usbg_gadget *g, const char *buf, size_t len,
+			   usbg_scheme_format format, int id, usbg_config **c)
+{
+	struct usbg_scheme_config sc = { 0 };
+	usbg_config *newc;
+	usbg_stats_site site;
+	int ret;
+
+	if (!g || !buf || id < 0 || !usbg_scheme_format_valid(format))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_scheme_formats[format].parse_config_buf)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	USBG_PROBE1(import_config_start, id);
+	ret = usbg_scheme_formats[format].parse_config_buf(buf, len, &sc);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_config(g, &sc, id, &newc);
+		usbg_stats_leave(g->parent, site);
+		usbg_unlock(g->parent);
+	}
+
+	if (ret == USBG_SUCCESS && c)
+		*c = newc;
+
+	usbg_scheme_free_config(&sc);
+out:
+	USBG_PROBE2(import_config_done, id, ret);
+	return ret;
+}
+
+int usbg_import_gadget_buf(usbg_state *s, const char *buf, size_t len,
+			   usbg_scheme_format format, const char *name,
+			   usbg_gadget **g)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	usbg_gadget *newg;
+	usbg_stats_site site;
+	int ret;
+
+	if (!s || !buf || !name || !usbg_scheme_format_valid(format))
+		return USBG_ERROR_INVALID_PARAM;
+
+	if (!usbg_scheme_formats[format].parse_gadget_buf)
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	USBG_PROBE1(import_gadget_start, name);
+	ret = usbg_scheme_formats[format].parse_gadget_buf(buf, len, &sg);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_gadget(s, &sg, name, &newg);
+		usbg_stats_leave(s, site);
+		usbg_unlock(s);
+	}
+
+	if (ret == USBG_SUCCESS && g)
+		*g = newg;
+
+	usbg_scheme_free_gadget(&sg);
+out:
+	USBG_PROBE2(import_gadget_done, name, ret);
+	return ret;
+}
+
+/*
+ * Whole state
+ */
+
+int usbg_export_state(usbg_state *s, FILE *stream, usbg_scheme_format format)
+{
+	struct usbg_scheme_state ss;
+	usbg_stats_site site;
+	int ret;
+
+	if (!s || !stream || format < USBG_SCHEME_FORMAT_MIN ||
+	    format >= USBG_SCHEME_FORMAT_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(export_state_start, s->configfs_path);
+	usbg_lock_shared(s);
+	site = usbg_stats_enter(s, USBG_STATS_SITE_EXPORT);
+	ret = usbg_scheme_read_state(s, &ss);
+	usbg_stats_leave(s, site);
+	usbg_unlock(s);
+
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_scheme_formats[format].write_state(&ss, stream);
+		usbg_scheme_free_state(&ss);
+	}
+
+	USBG_PROBE1(export_state_done, ret);
+	return ret;
+}
+
+int usbg_import_state(usbg_state *s, FILE *stream, usbg_scheme_format format,
+		      int flags)
+{
+	struct usbg_scheme_state ss = { 0 };
+	usbg_stats_site site;
+	int ret;
+
+	if (!s || !stream || format < USBG_SCHEME_FORMAT_MIN ||
+	    format >= USBG_SCHEME_FORMAT_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_state_start, s->configfs_path);
+	ret = usbg_scheme_formats[format].parse_state(stream, &ss);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_state(s, &ss, flags);
+		usbg_stats_leave(s, site);
+		usbg_unlock(s);
+	}
+
+	usbg_scheme_free_state(&ss);
+out:
+	USBG_PROBE1(import_state_done, ret);
+	return ret;
+}
@@ -0,0 +1,1121 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
+
+/**
+ * @file usbg_schemes_bin.c
+ * @brief Binary format of gadget schemes
+ * @details Scheme starts with header: magic "USBG", major and minor
+ * version (one byte each) and two reserved bytes. It is followed by
+ * records: tag (u16), length of payload (u32) and payload. All integers
+ * are little endian, strings are stored as length (u16) followed by
+ * characters without terminating zero, length 0xFFFF means no string.
+ *
+ * Payload of record is a fixed set of fields, optionally followed by
+ * nested records. Unknown records are skipped, so new data may be added
+ * in new records without changing major version. Top level records are
+ * gadget attrs, gadget strings, functions and configs in this order,
+ * terminated by end record.
+ *
+ * State scheme has the same header and its top level records are
+ * gadgets terminated by end record. Payload of gadget record is its name
+ * and UDC followed by the same records as top level ones of gadget
+ * scheme, but without end record.
+ */
+
+#define USBG_BIN_MAGIC "USBG"
+#define USBG_BIN_MAGIC_LEN 4
+#define USBG_BIN_VERSION_MAJOR 1
+#define USBG_BIN_VERSION_MINOR 0
+#define USBG_BIN_HEADER_LEN 8
+#define USBG_BIN_RECORD_HEADER_LEN 6
+#define USBG_BIN_NO_STR 0xFFFF
+
+enum usbg_bin_tag {
+	USBG_BIN_END = 0,
+	USBG_BIN_GADGET_ATTRS,
+	USBG_BIN_GADGET_STRS,
+	USBG_BIN_FUNCTION,
+	USBG_BIN_CONFIG,
+	/* nested in config */
+	USBG_BIN_CONFIG_STRS,
+	USBG_BIN_BINDING,
+	/* nested in function of mass storage type */
+	USBG_BIN_LUN,
+	/* top level record of state scheme */
+	USBG_BIN_STATE_GADGET,
+};
+
+/* Flags of lun record */
+#define USBG_BIN_LUN_CDROM	(1 << 0)
+#define USBG_BIN_LUN_RO		(1 << 1)
+#define USBG_BIN_LUN_NOFUA	(1 << 2)
+#define USBG_BIN_LUN_REMOVABLE	(1 << 3)
+
+/*
+ * Encoding
+ */
+
+struct usbg_bin_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+static void usbg_bin_put(struct usbg_bin_buf *b, const void *data,
+			 size_t len)
+{
+	uint8_t *new;
+	size_t size;
+
+	if (b->error)
+		return;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size * 2 : 1024;
+		while (size < b->len + len)
+			size *= 2;
+
+		new = realloc(b->data, size);
+		if (!new) {
+			b->error = USBG_ERROR_NO_MEM;
+			return;
+		}
+
+		b->data = new;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void usbg_bin_put_u8(struct usbg_bin_buf *b, unsigned val)
+{
+	uint8_t v = val;
+
+	usbg_bin_put(b, &v, 1);
+}
+
+static void usbg_bin_put_u16(struct usbg_bin_buf *b, unsigned val)
+{
+	uint8_t v[2] = { val & 0xFF, (val >> 8) & 0xFF };
+
+	usbg_bin_put(b, v, sizeof(v));
+}
+
+static void usbg_bin_put_u32(struct usbg_bin_buf *b, uint32_t val)
+{
+	uint8_t v[4] = { val & 0xFF, (val >> 8) & 0xFF,
+			 (val >> 16) & 0xFF, (val >> 24) & 0xFF };
+
+	usbg_bin_put(b, v, sizeof(v));
+}
+
+static void usbg_bin_put_str(struct usbg_bin_buf *b, const char *str)
+{
+	size_t len;
+
+	if (!str) {
+		usbg_bin_put_u16(b, USBG_BIN_NO_STR);
+		return;
+	}
+
+	len = strlen(str);
+	if (len >= USBG_BIN_NO_STR) {
+		if (!b->error)
+			b->error = USBG_ERROR_INVALID_VALUE;
+		return;
+	}
+
+	usbg_bin_put_u16(b, len);
+	usbg_bin_put(b, str, len);
+}
+
+/* Returns offset of record which has to be passed to usbg_bin_close() */
+static size_t usbg_bin_open(struct usbg_bin_buf *b, enum usbg_bin_tag tag)
+{
+	size_t offset = b->len;
+
+	usbg_bin_put_u16(b, tag);
+	/* Length is filled when record is closed */
+	usbg_bin_put_u32(b, 0);
+
+	return offset;
+}
+
+static void usbg_bin_close(struct usbg_bin_buf *b, size_t offset)
+{
+	uint32_t len;
+	uint8_t *p;
+
+	if (b->error)
+		return;
+
+	len = b->len - offset - USBG_BIN_RECORD_HEADER_LEN;
+	p = b->data + offset + 2;
+	p[0] = len & 0xFF;
+	p[1] = (len >> 8) & 0xFF;
+	p[2] = (len >> 16) & 0xFF;
+	p[3] = (len >> 24) & 0xFF;
+}
+
+static void usbg_bin_put_function(struct usbg_bin_buf *b,
+				  const struct usbg_scheme_function *sf)
+{
+	const usbg_f_attrs *attrs = &sf->attrs.attrs;
+	usbg_f_ms_lun_attrs *lun;
+	unsigned flags;
+	size_t offset, lun_offset;
+	int i;
+
+	offset = usbg_bin_open(b, USBG_BIN_FUNCTION);
+	usbg_bin_put_str(b, sf->label);
+	usbg_bin_put_str(b, usbg_get_function_type_str(sf->type));
+	usbg_bin_put_str(b, sf->instance);
+	usbg_bin_put_u32(b, sf->mask);
+
+	if (!(sf->mask & USBG_SCHEME_F_ATTRS))
+		goto out;
+
+	switch (sf->attrs.header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		usbg_bin_put_u32(b, attrs->serial.port_num);
+		break;
+
+	case USBG_F_ATTRS_NET:
+		usbg_bin_put(b, &attrs->net.dev_addr,
+			     sizeof(attrs->net.dev_addr));
+		usbg_bin_put(b, &attrs->net.host_addr,
+			     sizeof(attrs->net.host_addr));
+		usbg_bin_put_u32(b, attrs->net.qmult);
+		break;
+
+	case USBG_F_ATTRS_MS:
+		usbg_bin_put_u8(b, attrs->ms.stall);
+		for (i = 0; i < attrs->ms.nluns; ++i) {
+			lun = attrs->ms.luns[i];
+			flags = (lun->cdrom ? USBG_BIN_LUN_CDROM : 0) |
+				(lun->ro ? USBG_BIN_LUN_RO : 0) |
+				(lun->nofua ? USBG_BIN_LUN_NOFUA : 0) |
+				(lun->removable ? USBG_BIN_LUN_REMOVABLE : 0);
+
+			lun_offset = usbg_bin_open(b, USBG_BIN_LUN);
+			usbg_bin_put_u8(b, flags);
+			usbg_bin_put_str(b, lun->filename);
+			usbg_bin_close(b, lun_offset);
+		}
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		usbg_bin_put_u32(b, attrs->midi.index);
+		usbg_bin_put_str(b, attrs->midi.id);
+		usbg_bin_put_u32(b, attrs->midi.in_ports);
+		usbg_bin_put_u32(b, attrs->midi.out_ports);
+		usbg_bin_put_u32(b, attrs->midi.buflen);
+		usbg_bin_put_u32(b, attrs->midi.qlen);
+		break;
+
+	default:
+		/* Nothing to be stored for remaining types */
+		break;
+	}
+
+out:
+	usbg_bin_close(b, offset);
+}
+
+static void usbg_bin_put_config(struct usbg_bin_buf *b,
+				const struct usbg_scheme_config *sc)
+{
+	const struct usbg_scheme_binding *sb;
+	size_t offset, sub_offset;
+	int i;
+
+	offset = usbg_bin_open(b, USBG_BIN_CONFIG);
+	usbg_bin_put_u32(b, sc->id);
+	usbg_bin_put_str(b, sc->label);
+	usbg_bin_put_u32(b, sc->attrs_mask);
+	usbg_bin_put_u32(b, sc->bmAttributes);
+	usbg_bin_put_u32(b, sc->bMaxPower);
+
+	for (i = 0; i < sc->nstrs; ++i) {
+		sub_offset = usbg_bin_open(b, USBG_BIN_CONFIG_STRS);
+		usbg_bin_put_u16(b, sc->strs[i].lang);
+		usbg_bin_put_str(b, sc->strs[i].strs.configuration);
+		usbg_bin_close(b, sub_offset);
+	}
+
+	/* Inline function is nested in its binding */
+	for (i = 0; i < sc->nbindings; ++i) {
+		sb = sc->bindings + i;
+		sub_offset = usbg_bin_open(b, USBG_BIN_BINDING);
+		usbg_bin_put_str(b, sb->name);
+		usbg_bin_put_str(b, sb->label);
+		if (sb->function)
+			usbg_bin_put_function(b, sb->function);
+		usbg_bin_close(b, sub_offset);
+	}
+
+	usbg_bin_close(b, offset);
+}
+
+static void usbg_bin_put_header(struct usbg_bin_buf *b)
+{
+	usbg_bin_put(b, USBG_BIN_MAGIC, USBG_BIN_MAGIC_LEN);
+	usbg_bin_put_u8(b, USBG_BIN_VERSION_MAJOR);
+	usbg_bin_put_u8(b, USBG_BIN_VERSION_MINOR);
+	usbg_bin_put_u16(b, 0);
+}
+
+static void usbg_bin_put_end(struct usbg_bin_buf *b)
+{
+	size_t offset;
+
+	offset = usbg_bin_open(b, USBG_BIN_END);
+	usbg_bin_close(b, offset);
+}
+
+/* All records of gadget without end record */
+static void usbg_bin_put_gadget_records(struct usbg_bin_buf *b,
+					const struct usbg_scheme_gadget *sg)
+{
+	const usbg_gadget_strs *strs;
+	size_t offset;
+	int i;
+
+	offset = usbg_bin_open(b, USBG_BIN_GADGET_ATTRS);
+	usbg_bin_put_u32(b, sg->attrs_mask);
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i)
+		usbg_bin_put_u16(b, sg->attrs[i]);
+	usbg_bin_close(b, offset);
+
+	for (i = 0; i < sg->nstrs; ++i) {
+		strs = &sg->strs[i].strs;
+		offset = usbg_bin_open(b, USBG_BIN_GADGET_STRS);
+		usbg_bin_put_u16(b, sg->strs[i].lang);
+		usbg_bin_put_str(b, strs->str_mnf);
+		usbg_bin_put_str(b, strs->str_prd);
+		usbg_bin_put_str(b, strs->str_ser);
+		usbg_bin_close(b, offset);
+	}
+
+	for (i = 0; i < sg->nfunctions; ++i)
+		usbg_bin_put_function(b, sg->functions + i);
+
+	for (i = 0; i < sg->nconfigs; ++i)
+		usbg_bin_put_config(b, sg->configs + i);
+}
+
+static int usbg_bin_put_gadget(struct usbg_bin_buf *b,
+			       const struct usbg_scheme_gadget *sg)
+{
+	usbg_bin_put_header(b);
+	usbg_bin_put_gadget_records(b, sg);
+	usbg_bin_put_end(b);
+
+	return b->error;
+}
+
+static int usbg_bin_put_state(struct usbg_bin_buf *b,
+			      const struct usbg_scheme_state *ss)
+{
+	size_t offset;
+	int i;
+
+	usbg_bin_put_header(b);
+	for (i = 0; i < ss->ngadgets; ++i) {
+		offset = usbg_bin_open(b, USBG_BIN_STATE_GADGET);
+		usbg_bin_put_str(b, ss->gadgets[i].name);
+		usbg_bin_put_str(b, ss->gadgets[i].udc);
+		usbg_bin_put_gadget_records(b, &ss->gadgets[i].gadget);
+		usbg_bin_close(b, offset);
+	}
+	usbg_bin_put_end(b);
+
+	return b->error;
+}
+
+int usbg_scheme_write_gadget_bin(const struct usbg_scheme_gadget *sg,
+				 FILE *stream)
+{
+	struct usbg_bin_buf b = { 0 };
+	int ret;
+
+	ret = usbg_bin_put_gadget(&b, sg);
+	if (ret == USBG_SUCCESS &&
+	    fwrite(b.data, 1, b.len, stream) != b.len)
+		ret = USBG_ERROR_IO;
+
+	free(b.data);
+	return ret;
+}
+
+int usbg_scheme_write_state_bin(const struct usbg_scheme_state *ss,
+				FILE *stream)
+{
+	struct usbg_bin_buf b = { 0 };
+	int ret;
+
+	ret = usbg_bin_put_state(&b, ss);
+	if (ret == USBG_SUCCESS &&
+	    fwrite(b.data, 1, b.len, stream) != b.len)
+		ret = USBG_ERROR_IO;
+
+	free(b.data);
+	return ret;
+}
+
+/*
+ * Decoding
+ */
+
+struct usbg_bin_cursor {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+static int usbg_bin_get(struct usbg_bin_cursor *c, void *data, size_t len)
+{
+	if (c->end - c->p < len)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	memcpy(data, c->p, len);
+	c->p += len;
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_u8(struct usbg_bin_cursor *c, unsigned *val)
+{
+	if (c->p == c->end)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	*val = *c->p++;
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_u16(struct usbg_bin_cursor *c, unsigned *val)
+{
+	if (c->end - c->p < 2)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	*val = c->p[0] | (c->p[1] << 8);
+	c->p += 2;
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_u32(struct usbg_bin_cursor *c, uint32_t *val)
+{
+	if (c->end - c->p < 4)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	*val = c->p[0] | (c->p[1] << 8) | (c->p[2] << 16) |
+		((uint32_t)c->p[3] << 24);
+	c->p += 4;
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_int(struct usbg_bin_cursor *c, int *val)
+{
+	uint32_t v;
+	int ret;
+
+	ret = usbg_bin_get_u32(c, &v);
+	if (ret == USBG_SUCCESS)
+		*val = (int32_t)v;
+
+	return ret;
+}
+
+/* Get string into buffer of given size, missing string is an empty one */
+static int usbg_bin_get_str_buf(struct usbg_bin_cursor *c, char *buf,
+				size_t size)
+{
+	unsigned len;
+	int ret;
+
+	ret = usbg_bin_get_u16(c, &len);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (len == USBG_BIN_NO_STR)
+		len = 0;
+	else if (len >= size || c->end - c->p < len)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	memcpy(buf, c->p, len);
+	buf[len] = '\0';
+	c->p += len;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_str(struct usbg_bin_cursor *c, char **str)
+{
+	unsigned len;
+	int ret;
+
+	ret = usbg_bin_get_u16(c, &len);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (len == USBG_BIN_NO_STR) {
+		*str = NULL;
+		return USBG_SUCCESS;
+	}
+
+	if (c->end - c->p < len)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	*str = strndup((const char *)c->p, len);
+	if (!*str)
+		return USBG_ERROR_NO_MEM;
+
+	c->p += len;
+	return USBG_SUCCESS;
+}
+
+/* Take next record, its payload is returned as separate cursor */
+static int usbg_bin_get_record(struct usbg_bin_cursor *c, unsigned *tag,
+			       struct usbg_bin_cursor *payload)
+{
+	uint32_t len;
+	int ret;
+
+	ret = usbg_bin_get_u16(c, tag);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_bin_get_u32(c, &len);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (c->end - c->p < len)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	payload->p = c->p;
+	payload->end = c->p + len;
+	c->p += len;
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_lun(struct usbg_bin_cursor *c, usbg_f_ms_attrs *ms)
+{
+	usbg_f_ms_lun_attrs *lun, **luns;
+	unsigned flags;
+	int ret;
+
+	luns = realloc(ms->luns, (ms->nluns + 2) * sizeof(*luns));
+	if (!luns)
+		return USBG_ERROR_NO_MEM;
+
+	ms->luns = luns;
+	lun = calloc(1, sizeof(*lun));
+	if (!lun)
+		return USBG_ERROR_NO_MEM;
+
+	luns[ms->nluns++] = lun;
+	luns[ms->nluns] = NULL;
+	lun->id = -1;
+
+	ret = usbg_bin_get_u8(c, &flags);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	lun->cdrom = !!(flags & USBG_BIN_LUN_CDROM);
+	lun->ro = !!(flags & USBG_BIN_LUN_RO);
+	lun->nofua = !!(flags & USBG_BIN_LUN_NOFUA);
+	lun->removable = !!(flags & USBG_BIN_LUN_REMOVABLE);
+
+	ret = usbg_bin_get_str(c, (char **)&lun->filename);
+	if (ret == USBG_SUCCESS && !lun->filename) {
+		lun->filename = strdup("");
+		if (!lun->filename)
+			ret = USBG_ERROR_NO_MEM;
+	}
+
+	return ret;
+}
+
+static int usbg_bin_get_function(struct usbg_bin_cursor *c,
+				 struct usbg_scheme_function *sf)
+{
+	char type[USBG_MAX_NAME_LENGTH];
+	struct usbg_bin_cursor sub;
+	usbg_f_attrs *attrs = &sf->attrs.attrs;
+	unsigned val, tag;
+	uint32_t mask = 0;
+	int attrs_type;
+	int ret;
+
+	ret = usbg_bin_get_str(c, &sf->label);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_bin_get_str_buf(c, type, sizeof(type));
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_lookup_function_type(type);
+	if (ret < 0)
+		return USBG_ERROR_NOT_SUPPORTED;
+	sf->type = ret;
+
+	ret = usbg_bin_get_str(c, &sf->instance);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (!sf->instance)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	ret = usbg_bin_get_u32(c, &mask);
+	if (ret != USBG_SUCCESS || !(mask & USBG_SCHEME_F_ATTRS))
+		goto out;
+
+	attrs_type = usbg_lookup_function_attrs_type(sf->type);
+	if (attrs_type < 0)
+		return attrs_type;
+
+	/* From now on attrs have to be cleaned up */
+	sf->mask = USBG_SCHEME_F_ATTRS;
+	sf->attrs.header.attrs_type = attrs_type;
+
+	switch (attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		ret = usbg_bin_get_int(c, &attrs->serial.port_num);
+		break;
+
+	case USBG_F_ATTRS_NET:
+		ret = usbg_bin_get(c, &attrs->net.dev_addr,
+				   sizeof(attrs->net.dev_addr));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get(c, &attrs->net.host_addr,
+					   sizeof(attrs->net.host_addr));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get_int(c, &attrs->net.qmult);
+		break;
+
+	case USBG_F_ATTRS_MS:
+		ret = usbg_bin_get_u8(c, &val);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		attrs->ms.stall = !!val;
+		while (ret == USBG_SUCCESS && c->p != c->end) {
+			ret = usbg_bin_get_record(c, &tag, &sub);
+			if (ret == USBG_SUCCESS && tag == USBG_BIN_LUN)
+				ret = usbg_bin_get_lun(&sub, &attrs->ms);
+		}
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		ret = usbg_bin_get_int(c, &attrs->midi.index);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get_str(c, (char **)&attrs->midi.id);
+		if (ret == USBG_SUCCESS && !attrs->midi.id) {
+			attrs->midi.id = strdup("");
+			if (!attrs->midi.id)
+				ret = USBG_ERROR_NO_MEM;
+		}
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get_u32(c, &attrs->midi.in_ports);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get_u32(c, &attrs->midi.out_ports);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get_u32(c, &attrs->midi.buflen);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_bin_get_u32(c, &attrs->midi.qlen);
+		break;
+
+	default:
+		break;
+	}
+
+out:
+	sf->mask |= mask;
+	return ret;
+}
+
+static int usbg_bin_get_binding(struct usbg_bin_cursor *c,
+				struct usbg_scheme_binding *sb)
+{
+	struct usbg_bin_cursor sub;
+	unsigned tag;
+	int ret;
+
+	ret = usbg_bin_get_str(c, &sb->name);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_bin_get_str(c, &sb->label);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	while (c->p != c->end) {
+		ret = usbg_bin_get_record(c, &tag, &sub);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		if (tag != USBG_BIN_FUNCTION || sb->function)
+			continue;
+
+		sb->function = calloc(1, sizeof(*sb->function));
+		if (!sb->function)
+			return USBG_ERROR_NO_MEM;
+
+		ret = usbg_bin_get_function(&sub, sb->function);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	if (!sb->label == !sb->function)
+		ret = USBG_ERROR_INVALID_FORMAT;
+
+	return ret;
+}
+
+static int usbg_bin_get_config(struct usbg_bin_cursor *c,
+			       struct usbg_scheme_config *sc)
+{
+	struct usbg_scheme_config_strs *strs;
+	struct usbg_scheme_binding *sb;
+	struct usbg_bin_cursor sub;
+	unsigned tag, lang;
+	int ret;
+
+	ret = usbg_bin_get_int(c, &sc->id);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_bin_get_str(c, &sc->label);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	ret = usbg_bin_get_u32(c, &sc->attrs_mask);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_bin_get_int(c, &sc->bmAttributes);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_bin_get_int(c, &sc->bMaxPower);
+
+	while (ret == USBG_SUCCESS && c->p != c->end) {
+		ret = usbg_bin_get_record(c, &tag, &sub);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		switch (tag) {
+		case USBG_BIN_CONFIG_STRS:
+			ret = usbg_bin_get_u16(&sub, &lang);
+			if (ret != USBG_SUCCESS)
+				break;
+
+			strs = usbg_scheme_new(sc->strs, sc->nstrs);
+			if (!strs) {
+				ret = USBG_ERROR_NO_MEM;
+				break;
+			}
+
+			strs->lang = lang;
+			ret = usbg_bin_get_str_buf(&sub, strs->strs.configuration,
+						   sizeof(strs->strs.configuration));
+			break;
+
+		case USBG_BIN_BINDING:
+			sb = usbg_scheme_new(sc->bindings, sc->nbindings);
+			if (!sb) {
+				ret = USBG_ERROR_NO_MEM;
+				break;
+			}
+
+			ret = usbg_bin_get_binding(&sub, sb);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static int usbg_bin_get_gadget_attrs(struct usbg_bin_cursor *c,
+				     struct usbg_scheme_gadget *sg)
+{
+	unsigned val;
+	uint32_t mask;
+	int i, ret;
+
+	ret = usbg_bin_get_u32(c, &mask);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		ret = usbg_bin_get_u16(c, &val);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		sg->attrs[i] = val;
+	}
+
+	sg->attrs_mask = mask & ((1 << USBG_GADGET_ATTR_MAX) - 1);
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_gadget_strs(struct usbg_bin_cursor *c,
+				    struct usbg_scheme_gadget *sg)
+{
+	struct usbg_scheme_gadget_strs *strs;
+	unsigned lang;
+	int ret;
+
+	ret = usbg_bin_get_u16(c, &lang);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	strs = usbg_scheme_new(sg->strs, sg->nstrs);
+	if (!strs)
+		return USBG_ERROR_NO_MEM;
+
+	strs->lang = lang;
+	ret = usbg_bin_get_str_buf(c, strs->strs.str_mnf,
+				   sizeof(strs->strs.str_mnf));
+	if (ret == USBG_SUCCESS)
+		ret = usbg_bin_get_str_buf(c, strs->strs.str_prd,
+					   sizeof(strs->strs.str_prd));
+	if (ret == USBG_SUCCESS)
+		ret = usbg_bin_get_str_buf(c, strs->strs.str_ser,
+					   sizeof(strs->strs.str_ser));
+
+	return ret;
+}
+
+static int usbg_bin_get_header(struct usbg_bin_cursor *c)
+{
+	if (c->end - c->p < USBG_BIN_HEADER_LEN ||
+	    memcmp(c->p, USBG_BIN_MAGIC, USBG_BIN_MAGIC_LEN) ||
+	    c->p[USBG_BIN_MAGIC_LEN] != USBG_BIN_VERSION_MAJOR)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	/* Newer minor version may only add records, which are skipped */
+	c->p += USBG_BIN_HEADER_LEN;
+	return USBG_SUCCESS;
+}
+
+/* One of records of gadget other than end record */
+static int usbg_bin_get_gadget_record(struct usbg_bin_cursor *sub,
+				      unsigned tag,
+				      struct usbg_scheme_gadget *sg)
+{
+	struct usbg_scheme_function *sf;
+	struct usbg_scheme_config *sc;
+	int ret;
+
+	switch (tag) {
+	case USBG_BIN_GADGET_ATTRS:
+		ret = usbg_bin_get_gadget_attrs(sub, sg);
+		break;
+
+	case USBG_BIN_GADGET_STRS:
+		ret = usbg_bin_get_gadget_strs(sub, sg);
+		break;
+
+	case USBG_BIN_FUNCTION:
+		sf = usbg_scheme_new(sg->functions, sg->nfunctions);
+		if (!sf)
+			return USBG_ERROR_NO_MEM;
+
+		ret = usbg_bin_get_function(sub, sf);
+		if (ret == USBG_SUCCESS && !sf->label)
+			ret = USBG_ERROR_INVALID_FORMAT;
+		break;
+
+	case USBG_BIN_CONFIG:
+		sc = usbg_scheme_new(sg->configs, sg->nconfigs);
+		if (!sc)
+			return USBG_ERROR_NO_MEM;
+
+		ret = usbg_bin_get_config(sub, sc);
+		break;
+
+	default:
+		ret = USBG_SUCCESS;
+		break;
+	}
+
+	return ret;
+}
+
+static int usbg_bin_get_gadget(struct usbg_bin_cursor *c,
+			       struct usbg_scheme_gadget *sg)
+{
+	struct usbg_bin_cursor sub;
+	unsigned tag;
+	int ret;
+
+	ret = usbg_bin_get_header(c);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	while (c->p != c->end) {
+		ret = usbg_bin_get_record(c, &tag, &sub);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		if (tag == USBG_BIN_END)
+			return USBG_SUCCESS;
+
+		ret = usbg_bin_get_gadget_record(&sub, tag, sg);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	/* Truncated scheme */
+	return USBG_ERROR_INVALID_FORMAT;
+}
+
+static int usbg_bin_get_state_gadget(struct usbg_bin_cursor *c,
+				     struct usbg_scheme_state_gadget *sg)
+{
+	struct usbg_bin_cursor sub;
+	unsigned tag;
+	int ret;
+
+	ret = usbg_bin_get_str(c, &sg->name);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (!sg->name)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	ret = usbg_bin_get_str(c, &sg->udc);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	while (c->p != c->end) {
+		ret = usbg_bin_get_record(c, &tag, &sub);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		ret = usbg_bin_get_gadget_record(&sub, tag, &sg->gadget);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_bin_get_state(struct usbg_bin_cursor *c,
+			      struct usbg_scheme_state *ss)
+{
+	struct usbg_scheme_state_gadget *sg;
+	struct usbg_bin_cursor sub;
+	unsigned tag;
+	int ret;
+
+	ret = usbg_bin_get_header(c);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	while (c->p != c->end) {
+		ret = usbg_bin_get_record(c, &tag, &sub);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		switch (tag) {
+		case USBG_BIN_END:
+			return USBG_SUCCESS;
+
+		case USBG_BIN_STATE_GADGET:
+			sg = usbg_scheme_new(ss->gadgets, ss->ngadgets);
+			if (!sg)
+				return USBG_ERROR_NO_MEM;
+
+			ret = usbg_bin_get_state_gadget(&sub, sg);
+			break;
+
+		default:
+			ret = USBG_SUCCESS;
+			break;
+		}
+
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	/* Truncated scheme */
+	return USBG_ERROR_INVALID_FORMAT;
+}
+
+/* Whole scheme is read at once, it is small and this is fastest */
+static int usbg_bin_read(FILE *stream, uint8_t **data, size_t *len)
+{
+	uint8_t *new;
+	size_t size = 0, n;
+
+	*data = NULL;
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 4096;
+			new = realloc(*data, size);
+			if (!new)
+				return USBG_ERROR_NO_MEM;
+			*data = new;
+		}
+
+		n = fread(*data + *len, 1, size - *len, stream);
+		*len += n;
+	} while (n > 0);
+
+	return ferror(stream) ? USBG_ERROR_IO : USBG_SUCCESS;
+}
+
+int usbg_scheme_parse_gadget_bin(FILE *stream, struct usbg_scheme_gadget *sg)
+{
+	struct usbg_bin_cursor c;
+	uint8_t *data;
+	size_t len;
+	int ret;
+
+	ret = usbg_bin_read(stream, &data, &len);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	c.p = data;
+	c.end = data + len;
+	ret = usbg_bin_get_gadget(&c, sg);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+
+out:
+	free(data);
+	return ret;
+}
+
+int usbg_scheme_parse_state_bin(FILE *stream, struct usbg_scheme_state *ss)
+{
+	struct usbg_bin_cursor c;
+	uint8_t *data;
+	size_t len;
+	int ret;
+
+	ret = usbg_bin_read(stream, &data, &len);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	c.p = data;
+	c.end = data + len;
+	ret = usbg_bin_get_state(&c, ss);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_state(ss);
+
+out:
+	free(data);
+	return ret;
+}
+
+int usbg_scheme_parse_gadget_bin_buf(const char *buf, size_t len,
+				     struct usbg_scheme_gadget *sg)
+{
+	struct usbg_bin_cursor c = {
+		.p = (const uint8_t *)buf,
+		.end = (const uint8_t *)buf + len,
+	};
+	int ret;
+
+	ret = usbg_bin_get_gadget(&c, sg);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+
+	return ret;
+}
+
+int usbg_scheme_export_gadget_bin(usbg_gadget *g, struct usbg_scheme_out *out)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	struct usbg_bin_buf b = { 0 };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_gadget_start, g->name);
+	usbg_lock_shared(g->parent);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_scheme_read_gadget(g, &sg);
+	usbg_stats_leave(g->parent, site);
+	usbg_unlock(g->parent);
+
+	if (ret == USBG_SUCCESS) {
+		ret = usbg_bin_put_gadget(&b, &sg);
+		usbg_scheme_free_gadget(&sg);
+	}
+
+	if (ret == USBG_SUCCESS) {
+		usbg_scheme_out_write(out, b.data, b.len);
+		ret = out->error;
+	}
+
+	free(b.data);
+	USBG_PROBE2(export_gadget_done, g->name, ret);
+	return ret;
+}
+
+int usbg_export_gadget_bin(usbg_gadget *g, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!g || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_gadget_bin(g, &out);
+}
+
+int usbg_import_gadget_bin(usbg_state *s, FILE *stream, const char *name,
+			   usbg_gadget **g)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	usbg_stats_site site;
+	usbg_gadget *newg;
+	int ret;
+
+	if (!s || !stream || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_gadget_start, name);
+	ret = usbg_scheme_parse_gadget_bin(stream, &sg);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_gadget(s, &sg, name, &newg);
+		usbg_stats_leave(s, site);
+		usbg_unlock(s);
+	}
+
+	if (ret == USBG_SUCCESS && g)
+		*g = newg;
+
+	usbg_scheme_free_gadget(&sg);
+out:
+	USBG_PROBE2(import_gadget_done, name, ret);
+	return ret;
+}
@@ -0,0 +1,2250 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
+
+/**
+ * @file usbg_schemes_json.c
+ * @brief JSON format of gadget schemes
+ * @details JSON schemes have the same structure and tag names as
+ * libconfig ones (see doc/gadget_schemes.txt), groups are objects and
+ * lists are arrays. Numbers are decimal integers and booleans may be
+ * given also as numbers. Members may be given in any order and unknown
+ * members are skipped.
+ *
+ * Parser reads stream character by character and fills the scheme
+ * model directly, no document tree is built. The only buffer is the
+ * one for the current string value, which is reused for all of them.
+ *
+ * The same parser reads also text schemes (doc/gadget_schemes.txt) when
+ * library is built without libconfig. Only tokenizer differs: groups
+ * and lists are iterated as objects and arrays, names of settings are
+ * keys and root group has no braces. Include directive is not supported.
+ */
+
+/* Limits nesting of skipped values */
+#define USBG_JSON_MAX_DEPTH 32
+/* Limits nesting of groups and lists in text schemes */
+#define USBG_TEXT_MAX_DEPTH 64
+
+enum usbg_json_type {
+	USBG_JSON_INVALID = 0,
+	USBG_JSON_OBJECT,
+	USBG_JSON_ARRAY,
+	USBG_JSON_STRING,
+	USBG_JSON_NUMBER,
+	USBG_JSON_BOOL,
+	USBG_JSON_NULL,
+};
+
+struct usbg_json {
+	/* document is read from memory if stream is not set */
+	FILE *stream;
+	const char *p;
+	const char *end;
+	/* characters given back, at most two */
+	int back[2];
+	int nback;
+	int line;
+	/* value of last string token */
+	char *buf;
+	size_t size;
+	/* text scheme syntax instead of JSON */
+	bool text;
+	/* closing characters of open groups and lists of text scheme */
+	int close[USBG_TEXT_MAX_DEPTH];
+	int depth;
+};
+
+/*
+ * Tokenizer
+ */
+
+static int usbg_json_getc(struct usbg_json *j)
+{
+	int c;
+
+	if (j->nback)
+		c = j->back[--j->nback];
+	else if (j->stream)
+		c = getc_unlocked(j->stream);
+	else
+		c = j->p < j->end ? (unsigned char)*j->p++ : EOF;
+
+	if (c == '\n')
+		++j->line;
+
+	return c;
+}
+
+static void usbg_json_ungetc(struct usbg_json *j, int c)
+{
+	if (c == EOF)
+		return;
+
+	if (c == '\n')
+		--j->line;
+
+	j->back[j->nback++] = c;
+}
+
+/*
+ * Returns true if comment of text scheme has been skipped. Unterminated
+ * comment is left as invalid character.
+ */
+static bool usbg_text_comment(struct usbg_json *j, int c)
+{
+	int next;
+
+	if (c == '/') {
+		next = usbg_json_getc(j);
+		if (next != '/' && next != '*') {
+			usbg_json_ungetc(j, next);
+			return false;
+		}
+		c = next;
+	} else if (c != '#') {
+		return false;
+	}
+
+	if (c == '*') {
+		c = usbg_json_getc(j);
+		while (c != EOF) {
+			next = usbg_json_getc(j);
+			if (c == '*' && next == '/')
+				return true;
+			c = next;
+		}
+		return false;
+	}
+
+	do {
+		c = usbg_json_getc(j);
+	} while (c != '\n' && c != EOF);
+
+	return true;
+}
+
+/* Returns next character which is not a white space without taking it */
+static int usbg_json_peek(struct usbg_json *j)
+{
+	int c;
+
+	do {
+		c = usbg_json_getc(j);
+	} while (c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+		 (j->text && (c == '\f' || usbg_text_comment(j, c))));
+
+	usbg_json_ungetc(j, c);
+	return c;
+}
+
+static int usbg_json_expect(struct usbg_json *j, int expected)
+{
+	usbg_json_peek(j);
+
+	return usbg_json_getc(j) == expected ?
+		USBG_SUCCESS : USBG_ERROR_INVALID_FORMAT;
+}
+
+static enum usbg_json_type usbg_text_type(int c)
+{
+	switch (c) {
+	case '{':
+		return USBG_JSON_OBJECT;
+	case '(':
+	case '[':
+		return USBG_JSON_ARRAY;
+	case '"':
+		return USBG_JSON_STRING;
+	case 't':
+	case 'T':
+	case 'f':
+	case 'F':
+		return USBG_JSON_BOOL;
+	default:
+		if (c == '-' || c == '+' || (c >= '0' && c <= '9'))
+			return USBG_JSON_NUMBER;
+	}
+
+	return USBG_JSON_INVALID;
+}
+
+static enum usbg_json_type usbg_json_type(struct usbg_json *j)
+{
+	int c;
+
+	c = usbg_json_peek(j);
+	if (j->text)
+		return usbg_text_type(c);
+
+	switch (c) {
+	case '{':
+		return USBG_JSON_OBJECT;
+	case '[':
+		return USBG_JSON_ARRAY;
+	case '"':
+		return USBG_JSON_STRING;
+	case 't':
+	case 'f':
+		return USBG_JSON_BOOL;
+	case 'n':
+		return USBG_JSON_NULL;
+	default:
+		if (c == '-' || (c >= '0' && c <= '9'))
+			return USBG_JSON_NUMBER;
+	}
+
+	return USBG_JSON_INVALID;
+}
+
+static int usbg_json_buf_put(struct usbg_json *j, size_t *len, char c)
+{
+	char *new;
+	size_t size;
+
+	/* Keep space for terminating zero */
+	if (*len + 1 >= j->size) {
+		size = j->size ? j->size * 2 : USBG_MAX_STR_LENGTH;
+		new = realloc(j->buf, size);
+		if (!new)
+			return USBG_ERROR_NO_MEM;
+
+		j->buf = new;
+		j->size = size;
+	}
+
+	j->buf[(*len)++] = c;
+	return USBG_SUCCESS;
+}
+
+static int usbg_json_hex(struct usbg_json *j, int digits, unsigned *code)
+{
+	int c, i;
+
+	*code = 0;
+	for (i = 0; i < digits; ++i) {
+		c = usbg_json_getc(j);
+		if (c >= '0' && c <= '9')
+			c -= '0';
+		else if (c >= 'a' && c <= 'f')
+			c -= 'a' - 10;
+		else if (c >= 'A' && c <= 'F')
+			c -= 'A' - 10;
+		else
+			return USBG_ERROR_INVALID_FORMAT;
+
+		*code = (*code << 4) | c;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Code point given as \uXXXX escape is stored as UTF-8 */
+static int usbg_json_unicode(struct usbg_json *j, size_t *len)
+{
+	unsigned code, low;
+	int ret;
+
+	ret = usbg_json_hex(j, 4, &code);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (code >= 0xD800 && code <= 0xDBFF) {
+		if (usbg_json_getc(j) != '\\' || usbg_json_getc(j) != 'u')
+			return USBG_ERROR_INVALID_FORMAT;
+
+		ret = usbg_json_hex(j, 4, &low);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		if (low < 0xDC00 || low > 0xDFFF)
+			return USBG_ERROR_INVALID_FORMAT;
+
+		code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+	} else if (code >= 0xDC00 && code <= 0xDFFF) {
+		return USBG_ERROR_INVALID_FORMAT;
+	}
+
+	/* Strings are passed to C API, so they can't contain zero */
+	if (!code)
+		return USBG_ERROR_INVALID_VALUE;
+
+	if (code < 0x80) {
+		ret = usbg_json_buf_put(j, len, code);
+	} else if (code < 0x800) {
+		ret = usbg_json_buf_put(j, len, 0xC0 | (code >> 6));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_json_buf_put(j, len, 0x80 | (code & 0x3F));
+	} else if (code < 0x10000) {
+		ret = usbg_json_buf_put(j, len, 0xE0 | (code >> 12));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_json_buf_put(j, len,
+						0x80 | ((code >> 6) & 0x3F));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_json_buf_put(j, len, 0x80 | (code & 0x3F));
+	} else {
+		ret = usbg_json_buf_put(j, len, 0xF0 | (code >> 18));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_json_buf_put(j, len,
+						0x80 | ((code >> 12) & 0x3F));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_json_buf_put(j, len,
+						0x80 | ((code >> 6) & 0x3F));
+		if (ret == USBG_SUCCESS)
+			ret = usbg_json_buf_put(j, len, 0x80 | (code & 0x3F));
+	}
+
+	return ret;
+}
+
+/* Adjacent strings of text scheme are concatenated */
+static int usbg_text_string(struct usbg_json *j, const char **str)
+{
+	unsigned code;
+	size_t len = 0;
+	int c;
+	int ret;
+
+	do {
+		ret = usbg_json_expect(j, '"');
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		while ((c = usbg_json_getc(j)) != '"') {
+			if (c == EOF)
+				return USBG_ERROR_INVALID_FORMAT;
+
+			if (c == '\\') {
+				c = usbg_json_getc(j);
+				switch (c) {
+				case '"':
+				case '\\':
+					break;
+				case 'f':
+					c = '\f';
+					break;
+				case 'n':
+					c = '\n';
+					break;
+				case 'r':
+					c = '\r';
+					break;
+				case 't':
+					c = '\t';
+					break;
+				case 'x':
+					ret = usbg_json_hex(j, 2, &code);
+					if (ret != USBG_SUCCESS)
+						return ret;
+					/* Strings are passed to C API */
+					if (!code)
+						return USBG_ERROR_INVALID_VALUE;
+					c = code;
+					break;
+				default:
+					return USBG_ERROR_INVALID_FORMAT;
+				}
+			}
+
+			ret = usbg_json_buf_put(j, &len, c);
+			if (ret != USBG_SUCCESS)
+				return ret;
+		}
+	} while (usbg_json_peek(j) == '"');
+
+	ret = usbg_json_buf_put(j, &len, '\0');
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	*str = j->buf;
+	return USBG_SUCCESS;
+}
+
+/* Returned string is valid until next string is read */
+static int usbg_json_string(struct usbg_json *j, const char **str)
+{
+	size_t len = 0;
+	int c;
+	int ret;
+
+	if (j->text)
+		return usbg_text_string(j, str);
+
+	ret = usbg_json_expect(j, '"');
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	while ((c = usbg_json_getc(j)) != '"') {
+		if (c == EOF || (c >= 0 && c < ' '))
+			return USBG_ERROR_INVALID_FORMAT;
+
+		if (c == '\\') {
+			c = usbg_json_getc(j);
+			switch (c) {
+			case '"':
+			case '\\':
+			case '/':
+				break;
+			case 'b':
+				c = '\b';
+				break;
+			case 'f':
+				c = '\f';
+				break;
+			case 'n':
+				c = '\n';
+				break;
+			case 'r':
+				c = '\r';
+				break;
+			case 't':
+				c = '\t';
+				break;
+			case 'u':
+				ret = usbg_json_unicode(j, &len);
+				if (ret != USBG_SUCCESS)
+					return ret;
+				continue;
+			default:
+				return USBG_ERROR_INVALID_FORMAT;
+			}
+		}
+
+		ret = usbg_json_buf_put(j, &len, c);
+		if (ret != USBG_SUCCESS)
+			return ret;
+	}
+
+	/* Empty string has never touched the buffer */
+	ret = usbg_json_buf_put(j, &len, '\0');
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	*str = j->buf;
+	return USBG_SUCCESS;
+}
+
+/* Integers of text scheme may be hexadecimal and have L suffix */
+static int usbg_text_number(struct usbg_json *j, int *val)
+{
+	char buf[24];
+	long long tmp;
+	size_t len = 0;
+	int base = 10;
+	int c, next;
+
+	usbg_json_peek(j);
+	c = usbg_json_getc(j);
+	if (c == '-' || c == '+') {
+		buf[len++] = c;
+		c = usbg_json_getc(j);
+	}
+
+	if (c == '0') {
+		next = usbg_json_getc(j);
+		if (next == 'x' || next == 'X') {
+			base = 16;
+			c = usbg_json_getc(j);
+		} else {
+			usbg_json_ungetc(j, next);
+		}
+	}
+
+	while (base == 16 ? isxdigit(c) : isdigit(c)) {
+		if (len == sizeof(buf) - 1)
+			return USBG_ERROR_INVALID_VALUE;
+
+		buf[len++] = c;
+		c = usbg_json_getc(j);
+	}
+
+	if (c == 'L') {
+		c = usbg_json_getc(j);
+		if (c == 'L')
+			c = usbg_json_getc(j);
+	} else if (base == 10 && (c == '.' || c == 'e' || c == 'E')) {
+		/* Only integers are used in schemes */
+		return USBG_ERROR_INVALID_TYPE;
+	}
+
+	usbg_json_ungetc(j, c);
+	buf[len] = '\0';
+
+	if (!len || !isxdigit(buf[len - 1]))
+		return USBG_ERROR_INVALID_FORMAT;
+
+	errno = 0;
+	tmp = strtoll(buf, NULL, base);
+	if (errno || tmp < INT_MIN || tmp > INT_MAX)
+		return USBG_ERROR_INVALID_VALUE;
+
+	*val = tmp;
+	return USBG_SUCCESS;
+}
+
+static int usbg_json_number(struct usbg_json *j, int *val)
+{
+	char buf[24];
+	char *digits, *end;
+	long long tmp;
+	size_t len = 0;
+	int c;
+
+	if (j->text)
+		return usbg_text_number(j, val);
+
+	usbg_json_peek(j);
+	c = usbg_json_getc(j);
+	while (c == '-' || (c >= '0' && c <= '9')) {
+		if (len == sizeof(buf) - 1)
+			return USBG_ERROR_INVALID_VALUE;
+
+		buf[len++] = c;
+		c = usbg_json_getc(j);
+	}
+
+	/* Only integers are used in schemes */
+	if (c == '.' || c == 'e' || c == 'E')
+		return USBG_ERROR_INVALID_TYPE;
+
+	usbg_json_ungetc(j, c);
+	buf[len] = '\0';
+
+	/* JSON doesn't allow leading zeros nor plus sign */
+	digits = buf + (buf[0] == '-');
+	if (!isdigit(digits[0]) || (digits[0] == '0' && digits[1]))
+		return USBG_ERROR_INVALID_FORMAT;
+
+	errno = 0;
+	tmp = strtoll(buf, &end, 10);
+	/* Minus sign is allowed only in front of the number */
+	if (*end)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	if (errno || tmp < INT_MIN || tmp > INT_MAX)
+		return USBG_ERROR_INVALID_VALUE;
+
+	*val = tmp;
+	return USBG_SUCCESS;
+}
+
+/* Literals of text scheme are case insensitive */
+static int usbg_json_literal(struct usbg_json *j, const char *literal)
+{
+	int c;
+
+	usbg_json_peek(j);
+	for (; *literal; ++literal) {
+		c = usbg_json_getc(j);
+		if (j->text)
+			c = tolower(c);
+		if (c != *literal)
+			return USBG_ERROR_INVALID_FORMAT;
+	}
+
+	return USBG_SUCCESS;
+}
+
+/* Groups and lists of text scheme remember their closing character */
+static int usbg_text_open(struct usbg_json *j, int close)
+{
+	if (j->depth == USBG_TEXT_MAX_DEPTH)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	j->close[j->depth++] = close;
+	return USBG_SUCCESS;
+}
+
+/* Settings of group may be terminated by semicolon or comma */
+static int usbg_text_group_next(struct usbg_json *j, int *n, char *key,
+				size_t size)
+{
+	size_t len = 0;
+	int c;
+
+	c = usbg_json_peek(j);
+	if (*n && (c == ';' || c == ',')) {
+		usbg_json_getc(j);
+		c = usbg_json_peek(j);
+	}
+
+	if (c == j->close[j->depth - 1]) {
+		usbg_json_getc(j);
+		--j->depth;
+		return 0;
+	}
+
+	/* Included file would be looked up relatively to unknown path */
+	if (c == '@')
+		return USBG_ERROR_NOT_SUPPORTED;
+
+	if (!isalpha(c) && c != '*')
+		return USBG_ERROR_INVALID_FORMAT;
+
+	c = usbg_json_getc(j);
+	do {
+		if (key) {
+			if (len + 1 >= size)
+				return USBG_ERROR_INVALID_VALUE;
+			key[len++] = c;
+		}
+		c = usbg_json_getc(j);
+	} while (isalnum(c) || c == '_' || c == '-' || c == '*');
+
+	usbg_json_ungetc(j, c);
+	if (key)
+		key[len] = '\0';
+
+	usbg_json_peek(j);
+	c = usbg_json_getc(j);
+	if (c != '=' && c != ':')
+		return USBG_ERROR_INVALID_FORMAT;
+
+	++*n;
+	return 1;
+}
+
+/*
+ * Members of object are iterated by usbg_json_object_next() which
+ * returns 1 and key of next member, 0 at the end of object or error.
+ * n is a counter of members initialized to 0 by the caller.
+ * Key is not copied if key buffer is NULL.
+ */
+static int usbg_json_object_begin(struct usbg_json *j)
+{
+	/* Root group of text scheme has no braces */
+	if (j->text && !j->depth)
+		return usbg_text_open(j, EOF);
+
+	if (usbg_json_type(j) != USBG_JSON_OBJECT)
+		return USBG_ERROR_INVALID_TYPE;
+
+	usbg_json_getc(j);
+	return j->text ? usbg_text_open(j, '}') : USBG_SUCCESS;
+}
+
+static int usbg_json_object_next(struct usbg_json *j, int *n, char *key,
+				 size_t size)
+{
+	const char *str;
+	int ret;
+
+	if (j->text)
+		return usbg_text_group_next(j, n, key, size);
+
+	if (usbg_json_peek(j) == '}') {
+		usbg_json_getc(j);
+		return 0;
+	}
+
+	if (*n && usbg_json_expect(j, ',') != USBG_SUCCESS)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	ret = usbg_json_string(j, &str);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (key) {
+		if (strlen(str) >= size)
+			return USBG_ERROR_INVALID_VALUE;
+		strcpy(key, str);
+	}
+
+	ret = usbg_json_expect(j, ':');
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	++*n;
+	return 1;
+}
+
+/* Same as for objects, but there is no key */
+static int usbg_json_array_begin(struct usbg_json *j)
+{
+	int c;
+
+	if (usbg_json_type(j) != USBG_JSON_ARRAY)
+		return USBG_ERROR_INVALID_TYPE;
+
+	c = usbg_json_getc(j);
+	if (!j->text)
+		return USBG_SUCCESS;
+
+	return usbg_text_open(j, c == '(' ? ')' : ']');
+}
+
+static int usbg_json_array_next(struct usbg_json *j, int *n)
+{
+	int close = j->text ? j->close[j->depth - 1] : ']';
+
+	if (usbg_json_peek(j) == close) {
+		usbg_json_getc(j);
+		if (j->text)
+			--j->depth;
+		return 0;
+	}
+
+	if (*n && usbg_json_expect(j, ',') != USBG_SUCCESS)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	++*n;
+	return 1;
+}
+
+static int usbg_json_skip(struct usbg_json *j, int depth)
+{
+	const char *str;
+	int n = 0;
+	int val;
+	int ret;
+
+	if (depth > USBG_JSON_MAX_DEPTH)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	switch (usbg_json_type(j)) {
+	case USBG_JSON_OBJECT:
+		ret = usbg_json_object_begin(j);
+		while (ret == USBG_SUCCESS &&
+		       (ret = usbg_json_object_next(j, &n, NULL, 0)) > 0)
+			ret = usbg_json_skip(j, depth + 1);
+		break;
+	case USBG_JSON_ARRAY:
+		ret = usbg_json_array_begin(j);
+		while (ret == USBG_SUCCESS &&
+		       (ret = usbg_json_array_next(j, &n)) > 0)
+			ret = usbg_json_skip(j, depth + 1);
+		break;
+	case USBG_JSON_STRING:
+		ret = usbg_json_string(j, &str);
+		break;
+	case USBG_JSON_NUMBER:
+		ret = usbg_json_number(j, &val);
+		/* Fractions are valid in skipped values */
+		while (ret == USBG_ERROR_INVALID_TYPE &&
+		       strchr("0123456789.eE+-", usbg_json_peek(j)) &&
+		       usbg_json_peek(j) != EOF)
+			ret = usbg_json_getc(j) == EOF ?
+				USBG_ERROR_INVALID_FORMAT :
+				USBG_ERROR_INVALID_TYPE;
+		if (ret == USBG_ERROR_INVALID_TYPE ||
+		    ret == USBG_ERROR_INVALID_VALUE)
+			ret = USBG_SUCCESS;
+		break;
+	case USBG_JSON_BOOL:
+		ret = usbg_json_literal(j, tolower(usbg_json_peek(j)) == 't' ?
+					"true" : "false");
+		break;
+	case USBG_JSON_NULL:
+		ret = usbg_json_literal(j, "null");
+		break;
+	default:
+		ret = USBG_ERROR_INVALID_FORMAT;
+		break;
+	}
+
+	return ret;
+}
+
+/* Typed values, type mismatch is reported as in libconfig backend */
+static int usbg_json_get_int(struct usbg_json *j, int *val)
+{
+	if (usbg_json_type(j) != USBG_JSON_NUMBER)
+		return USBG_ERROR_INVALID_TYPE;
+
+	return usbg_json_number(j, val);
+}
+
+static int usbg_json_get_bool(struct usbg_json *j, bool *val)
+{
+	int tmp;
+	int ret;
+
+	switch (usbg_json_type(j)) {
+	case USBG_JSON_NUMBER:
+		ret = usbg_json_number(j, &tmp);
+		if (ret == USBG_SUCCESS)
+			*val = !!tmp;
+		break;
+	case USBG_JSON_BOOL:
+		*val = tolower(usbg_json_peek(j)) == 't';
+		ret = usbg_json_literal(j, *val ? "true" : "false");
+		break;
+	default:
+		ret = USBG_ERROR_INVALID_TYPE;
+		break;
+	}
+
+	return ret;
+}
+
+static int usbg_json_get_string(struct usbg_json *j, const char **str)
+{
+	if (usbg_json_type(j) != USBG_JSON_STRING)
+		return USBG_ERROR_INVALID_TYPE;
+
+	return usbg_json_string(j, str);
+}
+
+/* Duplicated member replaces the previous one */
+static int usbg_json_get_strdup(struct usbg_json *j, char **dst)
+{
+	const char *str;
+	int ret;
+
+	ret = usbg_json_get_string(j, &str);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	free(*dst);
+	*dst = strdup(str);
+
+	return *dst ? USBG_SUCCESS : USBG_ERROR_NO_MEM;
+}
+
+/* Auto truncate the string to max length */
+static int usbg_json_get_strcpy(struct usbg_json *j, char *dst)
+{
+	const char *str;
+	int ret;
+
+	ret = usbg_json_get_string(j, &str);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	strncpy(dst, str, USBG_MAX_STR_LENGTH - 1);
+	dst[USBG_MAX_STR_LENGTH - 1] = '\0';
+
+	return USBG_SUCCESS;
+}
+
+/*
+ * Parsing of scheme model
+ */
+
+/*
+ * Members of attrs may precede the type of function, so values of all
+ * types are collected and only those matching the type are used.
+ */
+struct usbg_json_f_attrs {
+	/* USBG_SCHEME_F_* bits of net attributes */
+	unsigned mask;
+	usbg_f_net_attrs net;
+	bool luns_given;
+	usbg_f_ms_attrs ms;
+	usbg_f_midi_attrs midi;
+};
+
+static void usbg_json_f_attrs_init(struct usbg_json_f_attrs *fa)
+{
+	memset(fa, 0, sizeof(*fa));
+	fa->midi.index = -1;
+	fa->midi.in_ports = 1;
+	fa->midi.out_ports = 1;
+	fa->midi.buflen = 256;
+	fa->midi.qlen = 32;
+}
+
+static void usbg_json_f_attrs_cleanup(struct usbg_json_f_attrs *fa)
+{
+	int i;
+
+	for (i = 0; i < fa->ms.nluns; ++i) {
+		free((char *)fa->ms.luns[i]->filename);
+		free(fa->ms.luns[i]);
+	}
+	free(fa->ms.luns);
+	free((char *)fa->midi.id);
+}
+
+static int usbg_json_parse_lun(struct usbg_json *j, usbg_f_ms_attrs *ms)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	usbg_f_ms_lun_attrs *lun, **luns;
+	int n = 0;
+	int ret;
+
+	luns = realloc(ms->luns, (ms->nluns + 2) * sizeof(*luns));
+	if (!luns)
+		return USBG_ERROR_NO_MEM;
+
+	ms->luns = luns;
+	lun = calloc(1, sizeof(*lun));
+	if (!lun)
+		return USBG_ERROR_NO_MEM;
+
+	luns[ms->nluns++] = lun;
+	luns[ms->nluns] = NULL;
+	lun->id = -1;
+	lun->removable = true;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, "cdrom"))
+			ret = usbg_json_get_bool(j, &lun->cdrom);
+		else if (!strcmp(key, "ro"))
+			ret = usbg_json_get_bool(j, &lun->ro);
+		else if (!strcmp(key, "nofua"))
+			ret = usbg_json_get_bool(j, &lun->nofua);
+		else if (!strcmp(key, "removable"))
+			ret = usbg_json_get_bool(j, &lun->removable);
+		else if (!strcmp(key, "filename"))
+			ret = usbg_json_get_strdup(j, (char **)&lun->filename);
+		else
+			ret = usbg_json_skip(j, 0);
+	}
+
+	if (ret == USBG_SUCCESS && !lun->filename) {
+		lun->filename = strdup("");
+		if (!lun->filename)
+			ret = USBG_ERROR_NO_MEM;
+	}
+
+	return ret;
+}
+
+static int usbg_json_parse_midi_int(struct usbg_json *j, unsigned *dst,
+				    int minval)
+{
+	int val;
+	int ret;
+
+	ret = usbg_json_get_int(j, &val);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (val < minval)
+		return USBG_ERROR_INVALID_VALUE;
+
+	*dst = val;
+	return USBG_SUCCESS;
+}
+
+static int usbg_json_parse_addr(struct usbg_json *j, struct ether_addr *addr)
+{
+	const char *str;
+	int ret;
+
+	ret = usbg_json_get_string(j, &str);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	return ether_aton_r(str, addr) ? USBG_SUCCESS : USBG_ERROR_INVALID_VALUE;
+}
+
+static int usbg_json_parse_f_attrs(struct usbg_json *j,
+				   struct usbg_json_f_attrs *fa)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	int n = 0, i = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, "dev_addr")) {
+			ret = usbg_json_parse_addr(j, &fa->net.dev_addr);
+			fa->mask |= USBG_SCHEME_F_DEV_ADDR;
+		} else if (!strcmp(key, "host_addr")) {
+			ret = usbg_json_parse_addr(j, &fa->net.host_addr);
+			fa->mask |= USBG_SCHEME_F_HOST_ADDR;
+		} else if (!strcmp(key, "qmult")) {
+			ret = usbg_json_get_int(j, &fa->net.qmult);
+			fa->mask |= USBG_SCHEME_F_QMULT;
+		} else if (!strcmp(key, "stall")) {
+			ret = usbg_json_get_bool(j, &fa->ms.stall);
+		} else if (!strcmp(key, "luns")) {
+			fa->luns_given = true;
+			ret = usbg_json_array_begin(j);
+			while (ret == USBG_SUCCESS &&
+			       (ret = usbg_json_array_next(j, &i)) > 0)
+				ret = usbg_json_parse_lun(j, &fa->ms);
+		} else if (!strcmp(key, "index")) {
+			ret = usbg_json_get_int(j, &fa->midi.index);
+		} else if (!strcmp(key, "id")) {
+			ret = usbg_json_get_strdup(j, (char **)&fa->midi.id);
+		} else if (!strcmp(key, "in_ports")) {
+			ret = usbg_json_parse_midi_int(j, &fa->midi.in_ports, 0);
+		} else if (!strcmp(key, "out_ports")) {
+			ret = usbg_json_parse_midi_int(j, &fa->midi.out_ports,
+						       0);
+		} else if (!strcmp(key, "buflen")) {
+			ret = usbg_json_parse_midi_int(j, &fa->midi.buflen, 0);
+		} else if (!strcmp(key, "qlen")) {
+			ret = usbg_json_parse_midi_int(j, &fa->midi.qlen, 0);
+		} else {
+			/* port_num and ifname are read only */
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	return ret;
+}
+
+/* Move collected attributes matching type of function to the model */
+static int usbg_json_set_f_attrs(struct usbg_scheme_function *sf,
+				 struct usbg_json_f_attrs *fa)
+{
+	int attrs_type;
+
+	attrs_type = usbg_lookup_function_attrs_type(sf->type);
+	if (attrs_type < 0)
+		return attrs_type;
+
+	sf->attrs.header.attrs_type = attrs_type;
+	sf->mask |= USBG_SCHEME_F_ATTRS;
+
+	switch (attrs_type) {
+	case USBG_F_ATTRS_NET:
+		sf->attrs.attrs.net = fa->net;
+		sf->mask |= fa->mask;
+		break;
+
+	case USBG_F_ATTRS_MS:
+		if (!fa->luns_given)
+			return USBG_ERROR_INVALID_PARAM;
+
+		if (!fa->ms.luns) {
+			fa->ms.luns = calloc(1, sizeof(*fa->ms.luns));
+			if (!fa->ms.luns)
+				return USBG_ERROR_NO_MEM;
+		}
+
+		sf->attrs.attrs.ms = fa->ms;
+		fa->ms.luns = NULL;
+		fa->ms.nluns = 0;
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		if (!fa->midi.id) {
+			fa->midi.id = strdup("");
+			if (!fa->midi.id)
+				return USBG_ERROR_NO_MEM;
+		}
+
+		sf->attrs.attrs.midi = fa->midi;
+		fa->midi.id = NULL;
+		break;
+
+	default:
+		/* Remaining attributes are read only or part of instance */
+		break;
+	}
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_json_parse_function(struct usbg_json *j,
+				    struct usbg_scheme_function *sf,
+				    bool with_instance)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	struct usbg_json_f_attrs fa;
+	bool type_given = false, attrs_given = false;
+	const char *type_str;
+	int function_type;
+	int n = 0;
+	int ret;
+
+	usbg_json_f_attrs_init(&fa);
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (with_instance && !strcmp(key, USBG_INSTANCE_TAG)) {
+			ret = usbg_json_get_strdup(j, &sf->instance);
+		} else if (!strcmp(key, USBG_TYPE_TAG)) {
+			ret = usbg_json_get_string(j, &type_str);
+			if (ret != USBG_SUCCESS)
+				break;
+
+			/* Check if this type is supported */
+			function_type = usbg_lookup_function_type(type_str);
+			if (function_type < 0) {
+				ret = USBG_ERROR_NOT_SUPPORTED;
+				break;
+			}
+
+			sf->type = (usbg_function_type)function_type;
+			type_given = true;
+		} else if (!strcmp(key, USBG_ATTRS_TAG)) {
+			ret = usbg_json_parse_f_attrs(j, &fa);
+			attrs_given = true;
+		} else {
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	/* function type is mandatory, instance too if defined in gadget */
+	if (!type_given || (with_instance && !sf->instance)) {
+		ret = USBG_ERROR_MISSING_TAG;
+		goto out;
+	}
+
+	if (attrs_given)
+		ret = usbg_json_set_f_attrs(sf, &fa);
+
+out:
+	usbg_json_f_attrs_cleanup(&fa);
+	return ret;
+}
+
+static int usbg_json_parse_binding(struct usbg_json *j,
+				   struct usbg_scheme_binding *sb)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	int n = 0;
+	int ret;
+
+	/* We have a string which should match with one of function labels */
+	if (usbg_json_type(j) == USBG_JSON_STRING)
+		return usbg_json_get_strdup(j, &sb->label);
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, USBG_NAME_TAG)) {
+			ret = usbg_json_get_strdup(j, &sb->name);
+		} else if (!strcmp(key, USBG_FUNCTION_TAG)) {
+			if (sb->label || sb->function) {
+				ret = USBG_ERROR_INVALID_FORMAT;
+				break;
+			}
+
+			/* It is allowed to provide link to existing function
+			 * or define unlabeled instance of function in this
+			 * place */
+			switch (usbg_json_type(j)) {
+			case USBG_JSON_STRING:
+				ret = usbg_json_get_strdup(j, &sb->label);
+				break;
+			case USBG_JSON_OBJECT:
+				sb->function = calloc(1, sizeof(*sb->function));
+				if (!sb->function) {
+					ret = USBG_ERROR_NO_MEM;
+					break;
+				}
+				ret = usbg_json_parse_function(j, sb->function,
+							       true);
+				break;
+			default:
+				ret = USBG_ERROR_INVALID_TYPE;
+				break;
+			}
+		} else {
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	if (ret == USBG_SUCCESS && !sb->label && !sb->function)
+		ret = USBG_ERROR_MISSING_TAG;
+
+	return ret;
+}
+
+static int usbg_json_parse_config_strs(struct usbg_json *j,
+				       struct usbg_scheme_config *sc)
+{
+	struct usbg_scheme_config_strs *ss;
+	char key[USBG_MAX_NAME_LENGTH];
+	bool lang_given = false;
+	int n = 0;
+	int ret;
+
+	ss = usbg_scheme_new(sc->strs, sc->nstrs);
+	if (!ss)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, USBG_LANG_TAG)) {
+			ret = usbg_json_get_int(j, &ss->lang);
+			lang_given = true;
+		} else if (!strcmp(key, "configuration")) {
+			ret = usbg_json_get_strcpy(j, ss->strs.configuration);
+		} else {
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	if (ret == USBG_SUCCESS && !lang_given)
+		ret = USBG_ERROR_MISSING_TAG;
+
+	return ret;
+}
+
+static int usbg_json_parse_config_attrs(struct usbg_json *j,
+					struct usbg_scheme_config *sc)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	int n = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, "bmAttributes")) {
+			ret = usbg_json_get_int(j, &sc->bmAttributes);
+			sc->attrs_mask |= USBG_SCHEME_C_BM_ATTRIBUTES;
+		} else if (!strcmp(key, "bMaxPower")) {
+			ret = usbg_json_get_int(j, &sc->bMaxPower);
+			sc->attrs_mask |= USBG_SCHEME_C_B_MAX_POWER;
+		} else {
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	return ret;
+}
+
+static int usbg_json_parse_config(struct usbg_json *j,
+				  struct usbg_scheme_config *sc, bool with_id)
+{
+	struct usbg_scheme_binding *sb;
+	char key[USBG_MAX_NAME_LENGTH];
+	bool id_given = false;
+	int n = 0, i = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		i = 0;
+		if (with_id && !strcmp(key, USBG_ID_TAG)) {
+			ret = usbg_json_get_int(j, &sc->id);
+			id_given = true;
+		} else if (!strcmp(key, USBG_NAME_TAG)) {
+			ret = usbg_json_get_strdup(j, &sc->label);
+		} else if (!strcmp(key, USBG_ATTRS_TAG)) {
+			ret = usbg_json_parse_config_attrs(j, sc);
+		} else if (!strcmp(key, USBG_STRINGS_TAG)) {
+			ret = usbg_json_array_begin(j);
+			while (ret == USBG_SUCCESS &&
+			       (ret = usbg_json_array_next(j, &i)) > 0)
+				ret = usbg_json_parse_config_strs(j, sc);
+		} else if (!strcmp(key, USBG_FUNCTIONS_TAG)) {
+			ret = usbg_json_array_begin(j);
+			while (ret == USBG_SUCCESS &&
+			       (ret = usbg_json_array_next(j, &i)) > 0) {
+				sb = usbg_scheme_new(sc->bindings,
+						     sc->nbindings);
+				if (!sb) {
+					ret = USBG_ERROR_NO_MEM;
+					break;
+				}
+				ret = usbg_json_parse_binding(j, sb);
+			}
+		} else {
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	/* Label is mandatory, id too if defined in gadget */
+	if (ret == USBG_SUCCESS && (!sc->label || (with_id && !id_given)))
+		ret = USBG_ERROR_MISSING_TAG;
+
+	return ret;
+}
+
+static int usbg_json_parse_gadget_strs(struct usbg_json *j,
+				       struct usbg_scheme_gadget *sg)
+{
+	struct usbg_scheme_gadget_strs *ss;
+	char key[USBG_MAX_NAME_LENGTH];
+	bool lang_given = false;
+	int n = 0;
+	int ret;
+
+	ss = usbg_scheme_new(sg->strs, sg->nstrs);
+	if (!ss)
+		return USBG_ERROR_NO_MEM;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, USBG_LANG_TAG)) {
+			ret = usbg_json_get_int(j, &ss->lang);
+			lang_given = true;
+		} else if (!strcmp(key, "manufacturer")) {
+			ret = usbg_json_get_strcpy(j, ss->strs.str_mnf);
+		} else if (!strcmp(key, "product")) {
+			ret = usbg_json_get_strcpy(j, ss->strs.str_prd);
+		} else if (!strcmp(key, "serialnumber")) {
+			ret = usbg_json_get_strcpy(j, ss->strs.str_ser);
+		} else {
+			ret = usbg_json_skip(j, 0);
+		}
+	}
+
+	if (ret == USBG_SUCCESS && !lang_given)
+		ret = USBG_ERROR_MISSING_TAG;
+
+	return ret;
+}
+
+static int usbg_json_parse_gadget_attrs(struct usbg_json *j,
+					struct usbg_scheme_gadget *sg)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	int attr, val, max;
+	int n = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		attr = usbg_lookup_gadget_attr(key);
+		if (attr < 0) {
+			ret = usbg_json_skip(j, 0);
+			continue;
+		}
+
+		ret = usbg_json_get_int(j, &val);
+		if (ret != USBG_SUCCESS)
+			break;
+
+		switch (attr) {
+		case BCD_USB:
+		case ID_VENDOR:
+		case ID_PRODUCT:
+		case BCD_DEVICE:
+			max = UINT16_MAX;
+			break;
+		default:
+			max = UINT8_MAX;
+			break;
+		}
+
+		if (val < 0 || val > max) {
+			ret = USBG_ERROR_INVALID_VALUE;
+			break;
+		}
+
+		sg->attrs[attr] = val;
+		sg->attrs_mask |= 1 << attr;
+	}
+
+	return ret;
+}
+
+/* Gadget members are shared by gadget and state schemes */
+static int usbg_json_parse_gadget_member(struct usbg_json *j, const char *key,
+					 struct usbg_scheme_gadget *sg)
+{
+	struct usbg_scheme_function *sf;
+	struct usbg_scheme_config *sc;
+	char label[USBG_MAX_STR_LENGTH];
+	int i = 0;
+	int ret;
+
+	if (!strcmp(key, USBG_ATTRS_TAG)) {
+		ret = usbg_json_parse_gadget_attrs(j, sg);
+	} else if (!strcmp(key, USBG_STRINGS_TAG)) {
+		ret = usbg_json_array_begin(j);
+		while (ret == USBG_SUCCESS &&
+		       (ret = usbg_json_array_next(j, &i)) > 0)
+			ret = usbg_json_parse_gadget_strs(j, sg);
+	} else if (!strcmp(key, USBG_FUNCTIONS_TAG)) {
+		/* Each function is labeled by its key */
+		ret = usbg_json_object_begin(j);
+		while (ret == USBG_SUCCESS &&
+		       (ret = usbg_json_object_next(j, &i, label,
+						    sizeof(label))) > 0) {
+			sf = usbg_scheme_new(sg->functions, sg->nfunctions);
+			if (!sf)
+				return USBG_ERROR_NO_MEM;
+
+			sf->label = strdup(label);
+			if (!sf->label)
+				return USBG_ERROR_NO_MEM;
+
+			ret = usbg_json_parse_function(j, sf, true);
+		}
+	} else if (!strcmp(key, USBG_CONFIGS_TAG)) {
+		ret = usbg_json_array_begin(j);
+		while (ret == USBG_SUCCESS &&
+		       (ret = usbg_json_array_next(j, &i)) > 0) {
+			sc = usbg_scheme_new(sg->configs, sg->nconfigs);
+			if (!sc)
+				return USBG_ERROR_NO_MEM;
+
+			ret = usbg_json_parse_config(j, sc, true);
+		}
+	} else {
+		ret = usbg_json_skip(j, 0);
+	}
+
+	return ret;
+}
+
+static int usbg_json_parse_gadget(struct usbg_json *j,
+				  struct usbg_scheme_gadget *sg)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	int n = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0)
+		ret = usbg_json_parse_gadget_member(j, key, sg);
+
+	return ret;
+}
+
+static int usbg_json_parse_state_gadget(struct usbg_json *j,
+					struct usbg_scheme_state_gadget *sg)
+{
+	char key[USBG_MAX_NAME_LENGTH];
+	int n = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (!strcmp(key, USBG_NAME_TAG))
+			ret = usbg_json_get_strdup(j, &sg->name);
+		else if (!strcmp(key, USBG_UDC_TAG))
+			ret = usbg_json_get_strdup(j, &sg->udc);
+		else
+			ret = usbg_json_parse_gadget_member(j, key,
+							    &sg->gadget);
+	}
+
+	if (ret == USBG_SUCCESS && !sg->name)
+		ret = USBG_ERROR_MISSING_TAG;
+
+	return ret;
+}
+
+static int usbg_json_parse_state(struct usbg_json *j,
+				 struct usbg_scheme_state *ss)
+{
+	struct usbg_scheme_state_gadget *sg;
+	char key[USBG_MAX_NAME_LENGTH];
+	int n = 0, i = 0;
+	int ret;
+
+	ret = usbg_json_object_begin(j);
+	while (ret == USBG_SUCCESS &&
+	       (ret = usbg_json_object_next(j, &n, key, sizeof(key))) > 0) {
+		if (strcmp(key, USBG_GADGETS_TAG)) {
+			ret = usbg_json_skip(j, 0);
+			continue;
+		}
+
+		ret = usbg_json_array_begin(j);
+		while (ret == USBG_SUCCESS &&
+		       (ret = usbg_json_array_next(j, &i)) > 0) {
+			sg = usbg_scheme_new(ss->gadgets, ss->ngadgets);
+			if (!sg)
+				return USBG_ERROR_NO_MEM;
+
+			ret = usbg_json_parse_state_gadget(j, sg);
+		}
+	}
+
+	return ret;
+}
+
+typedef int (*usbg_json_parse_f)(struct usbg_json *j, void *scheme);
+
+static int usbg_json_parse_function_cb(struct usbg_json *j, void *scheme)
+{
+	return usbg_json_parse_function(j, scheme, false);
+}
+
+static int usbg_json_parse_config_cb(struct usbg_json *j, void *scheme)
+{
+	return usbg_json_parse_config(j, scheme, false);
+}
+
+static int usbg_json_parse_gadget_cb(struct usbg_json *j, void *scheme)
+{
+	return usbg_json_parse_gadget(j, scheme);
+}
+
+static int usbg_json_parse_state_cb(struct usbg_json *j, void *scheme)
+{
+	return usbg_json_parse_state(j, scheme);
+}
+
+/*
+ * Parse whole document, model is not released on error. Error is logged
+ * by caller which knows the format.
+ */
+static int usbg_json_parse_doc(struct usbg_json *j, usbg_json_parse_f parse,
+			       void *scheme)
+{
+	int ret;
+
+	ret = parse(j, scheme);
+	/* Nothing but white spaces may follow the document */
+	if (ret == USBG_SUCCESS && usbg_json_peek(j) != EOF)
+		ret = USBG_ERROR_INVALID_FORMAT;
+
+	free(j->buf);
+	return ret;
+}
+
+static int usbg_json_parse(FILE *stream, usbg_json_parse_f parse,
+			   void *scheme)
+{
+	struct usbg_json j = { .stream = stream, .line = 1, };
+	int ret;
+
+	flockfile(stream);
+	ret = usbg_json_parse_doc(&j, parse, scheme);
+	funlockfile(stream);
+
+	if (ret != USBG_SUCCESS)
+		ERROR("JSON scheme: %s in line %d\n", usbg_strerror(ret),
+		      j.line);
+
+	return ret;
+}
+
+static int usbg_json_parse_buf(const char *buf, size_t len,
+			       usbg_json_parse_f parse, void *scheme)
+{
+	struct usbg_json j = { .p = buf, .end = buf + len, .line = 1, };
+	int ret;
+
+	ret = usbg_json_parse_doc(&j, parse, scheme);
+	if (ret != USBG_SUCCESS)
+		ERROR("JSON scheme: %s in line %d\n", usbg_strerror(ret),
+		      j.line);
+
+	return ret;
+}
+
+int usbg_scheme_parse_gadget_json(FILE *stream, struct usbg_scheme_gadget *sg)
+{
+	int ret;
+
+	ret = usbg_json_parse(stream, usbg_json_parse_gadget_cb, sg);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+
+	return ret;
+}
+
+int usbg_scheme_parse_state_json(FILE *stream, struct usbg_scheme_state *ss)
+{
+	int ret;
+
+	ret = usbg_json_parse(stream, usbg_json_parse_state_cb, ss);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_state(ss);
+
+	return ret;
+}
+
+int usbg_scheme_parse_function_json_buf(const char *buf, size_t len,
+					struct usbg_scheme_function *sf)
+{
+	int ret;
+
+	ret = usbg_json_parse_buf(buf, len, usbg_json_parse_function_cb, sf);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_function(sf);
+
+	return ret;
+}
+
+int usbg_scheme_parse_config_json_buf(const char *buf, size_t len,
+				      struct usbg_scheme_config *sc)
+{
+	int ret;
+
+	ret = usbg_json_parse_buf(buf, len, usbg_json_parse_config_cb, sc);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_config(sc);
+
+	return ret;
+}
+
+int usbg_scheme_parse_gadget_json_buf(const char *buf, size_t len,
+				      struct usbg_scheme_gadget *sg)
+{
+	int ret;
+
+	ret = usbg_json_parse_buf(buf, len, usbg_json_parse_gadget_cb, sg);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+
+	return ret;
+}
+
+/*
+ * Text schemes
+ */
+
+int usbg_scheme_parse_text(FILE *stream, const char *buf, size_t len,
+			   enum usbg_scheme_doc doc, void *scheme, int *line)
+{
+	static const usbg_json_parse_f parse[] = {
+		[USBG_SCHEME_DOC_FUNCTION] = usbg_json_parse_function_cb,
+		[USBG_SCHEME_DOC_CONFIG] = usbg_json_parse_config_cb,
+		[USBG_SCHEME_DOC_GADGET] = usbg_json_parse_gadget_cb,
+		[USBG_SCHEME_DOC_STATE] = usbg_json_parse_state_cb,
+	};
+	struct usbg_json j = { .stream = stream, .line = 1, .text = true, };
+	int ret;
+
+	if (stream) {
+		flockfile(stream);
+		ret = usbg_json_parse_doc(&j, parse[doc], scheme);
+		funlockfile(stream);
+	} else {
+		j.p = buf;
+		j.end = buf + len;
+		ret = usbg_json_parse_doc(&j, parse[doc], scheme);
+	}
+
+	if (ret == USBG_SUCCESS)
+		return ret;
+
+	ERROR("text scheme: %s in line %d\n", usbg_strerror(ret), j.line);
+
+	switch (doc) {
+	case USBG_SCHEME_DOC_FUNCTION:
+		usbg_scheme_free_function(scheme);
+		break;
+	case USBG_SCHEME_DOC_CONFIG:
+		usbg_scheme_free_config(scheme);
+		break;
+	case USBG_SCHEME_DOC_GADGET:
+		usbg_scheme_free_gadget(scheme);
+		break;
+	case USBG_SCHEME_DOC_STATE:
+		usbg_scheme_free_state(scheme);
+		break;
+	}
+
+	if (line)
+		*line = j.line;
+	return ret;
+}
+
+/*
+ * Writing of scheme model
+ */
+
+struct usbg_json_writer {
+	struct usbg_scheme_out *out;
+};
+
+static void usbg_json_puts(struct usbg_json_writer *w, const char *s)
+{
+	usbg_scheme_out_write(w->out, s, strlen(s));
+}
+
+static void usbg_json_putc(struct usbg_json_writer *w, char c)
+{
+	usbg_scheme_out_putc(w->out, c);
+}
+
+static void usbg_json_indent(struct usbg_json_writer *w, int depth)
+{
+	if (depth > 0)
+		usbg_scheme_out_printf(w->out, "%*s", depth * USBG_TAB_WIDTH,
+				       " ");
+}
+
+static void usbg_json_quote(struct usbg_json_writer *w, const char *value)
+{
+	char esc[7];
+	const char *p;
+	int c;
+
+	usbg_json_putc(w, '"');
+	for (p = value; p && *p; ++p) {
+		c = *p & 0xFF;
+		switch (c) {
+		case '"':
+		case '\\':
+			usbg_json_putc(w, '\\');
+			usbg_json_putc(w, c);
+			break;
+		case '\n':
+			usbg_json_puts(w, "\\n");
+			break;
+		case '\r':
+			usbg_json_puts(w, "\\r");
+			break;
+		case '\t':
+			usbg_json_puts(w, "\\t");
+			break;
+		default:
+			if (c >= ' ') {
+				usbg_json_putc(w, c);
+			} else {
+				snprintf(esc, sizeof(esc), "\\u%04X", c);
+				usbg_json_puts(w, esc);
+			}
+		}
+	}
+	usbg_json_putc(w, '"');
+}
+
+/*
+ * Each member or element starts in new line at given depth, n is
+ * a counter of members written so far. Key is NULL for array elements.
+ */
+static void usbg_json_member(struct usbg_json_writer *w, int depth, int *n,
+			     const char *key)
+{
+	usbg_json_puts(w, (*n)++ ? ",\n" : "\n");
+	usbg_json_indent(w, depth);
+	if (key) {
+		usbg_json_quote(w, key);
+		usbg_json_puts(w, ": ");
+	}
+}
+
+static void usbg_json_close(struct usbg_json_writer *w, int depth, int n,
+			    char c)
+{
+	if (n) {
+		usbg_json_putc(w, '\n');
+		usbg_json_indent(w, depth);
+	}
+	usbg_json_putc(w, c);
+}
+
+static void usbg_json_int(struct usbg_json_writer *w, int depth, int *n,
+			  const char *key, int value)
+{
+	usbg_json_member(w, depth, n, key);
+	usbg_scheme_out_printf(w->out, "%d", value);
+}
+
+static void usbg_json_bool(struct usbg_json_writer *w, int depth, int *n,
+			   const char *key, bool value)
+{
+	usbg_json_member(w, depth, n, key);
+	usbg_json_puts(w, value ? "true" : "false");
+}
+
+static void usbg_json_str(struct usbg_json_writer *w, int depth, int *n,
+			  const char *key, const char *value)
+{
+	usbg_json_member(w, depth, n, key);
+	usbg_json_quote(w, value);
+}
+
+static void usbg_json_write_luns(struct usbg_json_writer *w, int depth,
+				 const usbg_f_ms_attrs *ms)
+{
+	const usbg_f_ms_lun_attrs *lun;
+	int n = 0, m;
+	int i;
+
+	usbg_json_putc(w, '[');
+	for (i = 0; i < ms->nluns; ++i) {
+		lun = ms->luns[i];
+		m = 0;
+
+		usbg_json_member(w, depth + 1, &n, NULL);
+		usbg_json_putc(w, '{');
+		usbg_json_bool(w, depth + 2, &m, "cdrom", lun->cdrom);
+		usbg_json_bool(w, depth + 2, &m, "ro", lun->ro);
+		usbg_json_bool(w, depth + 2, &m, "nofua", lun->nofua);
+		usbg_json_bool(w, depth + 2, &m, "removable", lun->removable);
+		usbg_json_str(w, depth + 2, &m, "filename", lun->filename);
+		usbg_json_close(w, depth + 1, m, '}');
+	}
+	usbg_json_close(w, depth, n, ']');
+}
+
+static void usbg_json_write_f_attrs(struct usbg_json_writer *w, int depth,
+				    const struct usbg_scheme_function *sf)
+{
+	const usbg_f_attrs *attrs = &sf->attrs.attrs;
+	char addr_buf[USBG_MAX_STR_LENGTH];
+	int n = 0;
+
+	usbg_json_putc(w, '{');
+
+	switch (sf->attrs.header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		if (sf->mask & USBG_SCHEME_F_PORT_NUM)
+			usbg_json_int(w, depth + 1, &n, "port_num",
+				      attrs->serial.port_num);
+		break;
+
+	case USBG_F_ATTRS_NET:
+		if (sf->mask & USBG_SCHEME_F_DEV_ADDR)
+			usbg_json_str(w, depth + 1, &n, "dev_addr",
+				      usbg_ether_ntoa_r(&attrs->net.dev_addr,
+							addr_buf));
+		if (sf->mask & USBG_SCHEME_F_HOST_ADDR)
+			usbg_json_str(w, depth + 1, &n, "host_addr",
+				      usbg_ether_ntoa_r(&attrs->net.host_addr,
+							addr_buf));
+		if (sf->mask & USBG_SCHEME_F_QMULT)
+			usbg_json_int(w, depth + 1, &n, "qmult",
+				      attrs->net.qmult);
+		break;
+
+	case USBG_F_ATTRS_MS:
+		usbg_json_bool(w, depth + 1, &n, "stall", attrs->ms.stall);
+		usbg_json_member(w, depth + 1, &n, "luns");
+		usbg_json_write_luns(w, depth + 1, &attrs->ms);
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		usbg_json_int(w, depth + 1, &n, "index", attrs->midi.index);
+		usbg_json_str(w, depth + 1, &n, "id", attrs->midi.id);
+		usbg_json_int(w, depth + 1, &n, "in_ports",
+			      attrs->midi.in_ports);
+		usbg_json_int(w, depth + 1, &n, "out_ports",
+			      attrs->midi.out_ports);
+		usbg_json_int(w, depth + 1, &n, "buflen", attrs->midi.buflen);
+		usbg_json_int(w, depth + 1, &n, "qlen", attrs->midi.qlen);
+		break;
+
+	default:
+		/* Nothing to be stored for remaining types */
+		break;
+	}
+
+	usbg_json_close(w, depth, n, '}');
+}
+
+static void usbg_json_write_function(struct usbg_json_writer *w, int depth,
+				     const struct usbg_scheme_function *sf,
+				     bool with_instance)
+{
+	int n = 0;
+
+	usbg_json_putc(w, '{');
+	if (with_instance)
+		usbg_json_str(w, depth + 1, &n, USBG_INSTANCE_TAG,
+			      sf->instance);
+	usbg_json_str(w, depth + 1, &n, USBG_TYPE_TAG,
+		      usbg_get_function_type_str(sf->type));
+	if (sf->mask & USBG_SCHEME_F_ATTRS) {
+		usbg_json_member(w, depth + 1, &n, USBG_ATTRS_TAG);
+		usbg_json_write_f_attrs(w, depth + 1, sf);
+	}
+	usbg_json_close(w, depth, n, '}');
+}
+
+static void usbg_json_write_config(struct usbg_json_writer *w, int depth,
+				   const struct usbg_scheme_config *sc,
+				   bool with_id)
+{
+	const struct usbg_scheme_binding *sb;
+	int n = 0, m, k;
+	int i;
+
+	usbg_json_putc(w, '{');
+	if (with_id)
+		usbg_json_int(w, depth + 1, &n, USBG_ID_TAG, sc->id);
+	usbg_json_str(w, depth + 1, &n, USBG_NAME_TAG, sc->label);
+
+	m = 0;
+	usbg_json_member(w, depth + 1, &n, USBG_ATTRS_TAG);
+	usbg_json_putc(w, '{');
+	if (sc->attrs_mask & USBG_SCHEME_C_BM_ATTRIBUTES)
+		usbg_json_int(w, depth + 2, &m, "bmAttributes",
+			      sc->bmAttributes);
+	if (sc->attrs_mask & USBG_SCHEME_C_B_MAX_POWER)
+		usbg_json_int(w, depth + 2, &m, "bMaxPower", sc->bMaxPower);
+	usbg_json_close(w, depth + 1, m, '}');
+
+	m = 0;
+	usbg_json_member(w, depth + 1, &n, USBG_STRINGS_TAG);
+	usbg_json_putc(w, '[');
+	for (i = 0; i < sc->nstrs; ++i) {
+		k = 0;
+		usbg_json_member(w, depth + 2, &m, NULL);
+		usbg_json_putc(w, '{');
+		usbg_json_int(w, depth + 3, &k, USBG_LANG_TAG,
+			      sc->strs[i].lang);
+		usbg_json_str(w, depth + 3, &k, "configuration",
+			      sc->strs[i].strs.configuration);
+		usbg_json_close(w, depth + 2, k, '}');
+	}
+	usbg_json_close(w, depth + 1, m, ']');
+
+	m = 0;
+	usbg_json_member(w, depth + 1, &n, USBG_FUNCTIONS_TAG);
+	usbg_json_putc(w, '[');
+	for (i = 0; i < sc->nbindings; ++i) {
+		sb = sc->bindings + i;
+		k = 0;
+
+		usbg_json_member(w, depth + 2, &m, NULL);
+		usbg_json_putc(w, '{');
+		if (sb->name)
+			usbg_json_str(w, depth + 3, &k, USBG_NAME_TAG,
+				      sb->name);
+		if (sb->function) {
+			usbg_json_member(w, depth + 3, &k, USBG_FUNCTION_TAG);
+			usbg_json_write_function(w, depth + 3, sb->function,
+						 true);
+		} else {
+			usbg_json_str(w, depth + 3, &k, USBG_FUNCTION_TAG,
+				      sb->label);
+		}
+		usbg_json_close(w, depth + 2, k, '}');
+	}
+	usbg_json_close(w, depth + 1, m, ']');
+
+	usbg_json_close(w, depth, n, '}');
+}
+
+static void usbg_json_write_gadget_members(struct usbg_json_writer *w,
+					   int depth, int *n,
+					   const struct usbg_scheme_gadget *sg)
+{
+	const usbg_gadget_strs *strs;
+	int m, k;
+	int i;
+
+	m = 0;
+	usbg_json_member(w, depth + 1, n, USBG_ATTRS_TAG);
+	usbg_json_putc(w, '{');
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		if (sg->attrs_mask & (1 << i))
+			usbg_json_int(w, depth + 2, &m,
+				      usbg_get_gadget_attr_str(i),
+				      sg->attrs[i]);
+	}
+	usbg_json_close(w, depth + 1, m, '}');
+
+	m = 0;
+	usbg_json_member(w, depth + 1, n, USBG_STRINGS_TAG);
+	usbg_json_putc(w, '[');
+	for (i = 0; i < sg->nstrs; ++i) {
+		strs = &sg->strs[i].strs;
+		k = 0;
+
+		usbg_json_member(w, depth + 2, &m, NULL);
+		usbg_json_putc(w, '{');
+		usbg_json_int(w, depth + 3, &k, USBG_LANG_TAG,
+			      sg->strs[i].lang);
+		usbg_json_str(w, depth + 3, &k, "manufacturer",
+			      strs->str_mnf);
+		usbg_json_str(w, depth + 3, &k, "product", strs->str_prd);
+		usbg_json_str(w, depth + 3, &k, "serialnumber",
+			      strs->str_ser);
+		usbg_json_close(w, depth + 2, k, '}');
+	}
+	usbg_json_close(w, depth + 1, m, ']');
+
+	m = 0;
+	usbg_json_member(w, depth + 1, n, USBG_FUNCTIONS_TAG);
+	usbg_json_putc(w, '{');
+	for (i = 0; i < sg->nfunctions; ++i) {
+		usbg_json_member(w, depth + 2, &m, sg->functions[i].label);
+		usbg_json_write_function(w, depth + 2, sg->functions + i,
+					 true);
+	}
+	usbg_json_close(w, depth + 1, m, '}');
+
+	m = 0;
+	usbg_json_member(w, depth + 1, n, USBG_CONFIGS_TAG);
+	usbg_json_putc(w, '[');
+	for (i = 0; i < sg->nconfigs; ++i) {
+		usbg_json_member(w, depth + 2, &m, NULL);
+		usbg_json_write_config(w, depth + 2, sg->configs + i, true);
+	}
+	usbg_json_close(w, depth + 1, m, ']');
+}
+
+static void usbg_json_write_gadget(struct usbg_json_writer *w, int depth,
+				   const struct usbg_scheme_gadget *sg)
+{
+	int n = 0;
+
+	usbg_json_putc(w, '{');
+	usbg_json_write_gadget_members(w, depth, &n, sg);
+	usbg_json_close(w, depth, n, '}');
+}
+
+static void usbg_json_write_state(struct usbg_json_writer *w,
+				  const struct usbg_scheme_state *ss)
+{
+	const struct usbg_scheme_state_gadget *sg;
+	int n = 0, m = 0, k;
+	int i;
+
+	usbg_json_putc(w, '{');
+	usbg_json_member(w, 1, &n, USBG_GADGETS_TAG);
+	usbg_json_putc(w, '[');
+	for (i = 0; i < ss->ngadgets; ++i) {
+		sg = ss->gadgets + i;
+		k = 0;
+
+		usbg_json_member(w, 2, &m, NULL);
+		usbg_json_putc(w, '{');
+		usbg_json_str(w, 3, &k, USBG_NAME_TAG, sg->name);
+		if (sg->udc)
+			usbg_json_str(w, 3, &k, USBG_UDC_TAG, sg->udc);
+		usbg_json_write_gadget_members(w, 2, &k, &sg->gadget);
+		usbg_json_close(w, 2, k, '}');
+	}
+	usbg_json_close(w, 1, m, ']');
+	usbg_json_close(w, 0, n, '}');
+}
+
+static int usbg_json_finish(struct usbg_json_writer *w)
+{
+	usbg_json_putc(w, '\n');
+
+	return w->out->error;
+}
+
+int usbg_scheme_write_gadget_json(const struct usbg_scheme_gadget *sg,
+				  FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+	struct usbg_json_writer w = { .out = &out, };
+
+	usbg_json_write_gadget(&w, 0, sg);
+	return usbg_json_finish(&w);
+}
+
+int usbg_scheme_write_state_json(const struct usbg_scheme_state *ss,
+				 FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+	struct usbg_json_writer w = { .out = &out, };
+
+	usbg_json_write_state(&w, ss);
+	return usbg_json_finish(&w);
+}
+
+/* Export gadget/function/config API implementation */
+
+int usbg_scheme_export_function_json(usbg_function *f,
+				     struct usbg_scheme_out *out)
+{
+	struct usbg_json_writer w = { .out = out, };
+	struct usbg_scheme_function sf = { 0 };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_function_start, f->name);
+	usbg_lock_shared(f->parent->parent);
+	site = usbg_stats_enter(f->parent->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_scheme_read_function(f, &sf);
+	usbg_stats_leave(f->parent->parent, site);
+	usbg_unlock(f->parent->parent);
+
+	/* Instance is a property of gadget */
+	if (ret == USBG_SUCCESS) {
+		usbg_json_write_function(&w, 0, &sf, false);
+		ret = usbg_json_finish(&w);
+	}
+
+	usbg_scheme_free_function(&sf);
+	USBG_PROBE2(export_function_done, f->name, ret);
+	return ret;
+}
+
+int usbg_scheme_export_config_json(usbg_config *c,
+				   struct usbg_scheme_out *out)
+{
+	struct usbg_json_writer w = { .out = out, };
+	struct usbg_scheme_config sc = { 0 };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_config_start, c->name);
+	usbg_lock_shared(c->parent->parent);
+	site = usbg_stats_enter(c->parent->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_scheme_read_config(c, &sc);
+	usbg_stats_leave(c->parent->parent, site);
+	usbg_unlock(c->parent->parent);
+
+	/* Id is not a part of config itself */
+	if (ret == USBG_SUCCESS) {
+		usbg_json_write_config(&w, 0, &sc, false);
+		ret = usbg_json_finish(&w);
+	}
+
+	usbg_scheme_free_config(&sc);
+	USBG_PROBE2(export_config_done, c->name, ret);
+	return ret;
+}
+
+int usbg_scheme_export_gadget_json(usbg_gadget *g,
+				   struct usbg_scheme_out *out)
+{
+	struct usbg_json_writer w = { .out = out, };
+	struct usbg_scheme_gadget sg = { 0 };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_gadget_start, g->name);
+	usbg_lock_shared(g->parent);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_scheme_read_gadget(g, &sg);
+	usbg_stats_leave(g->parent, site);
+	usbg_unlock(g->parent);
+
+	/* Name of gadget is not exported, it should be given during import */
+	if (ret == USBG_SUCCESS) {
+		usbg_json_write_gadget(&w, 0, &sg);
+		ret = usbg_json_finish(&w);
+		usbg_scheme_free_gadget(&sg);
+	}
+
+	USBG_PROBE2(export_gadget_done, g->name, ret);
+	return ret;
+}
+
+int usbg_export_function_json(usbg_function *f, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!f || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_function_json(f, &out);
+}
+
+int usbg_export_config_json(usbg_config *c, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!c || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_config_json(c, &out);
+}
+
+int usbg_export_gadget_json(usbg_gadget *g, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!g || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_gadget_json(g, &out);
+}
+
+/* Import gadget/function/config API implementation */
+
+int usbg_import_function_json(usbg_gadget *g, FILE *stream,
+			      const char *instance, usbg_function **f)
+{
+	struct usbg_scheme_function sf = { 0 };
+	usbg_function *newf;
+	usbg_stats_site site;
+	int ret;
+
+	if (!g || !stream || !instance)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_function_start, instance);
+	ret = usbg_json_parse(stream, usbg_json_parse_function_cb, &sf);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_function(g, &sf, instance, &newf);
+		usbg_stats_leave(g->parent, site);
+		usbg_unlock(g->parent);
+	}
+
+	if (ret == USBG_SUCCESS && f)
+		*f = newf;
+out:
+	usbg_scheme_free_function(&sf);
+	USBG_PROBE2(import_function_done, instance, ret);
+	return ret;
+}
+
+int usbg_import_config_json(usbg_gadget *g, FILE *stream, int id,
+			    usbg_config **c)
+{
+	struct usbg_scheme_config sc = { 0 };
+	usbg_config *newc;
+	usbg_stats_site site;
+	int ret;
+
+	if (!g || !stream || id < 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_config_start, id);
+	ret = usbg_json_parse(stream, usbg_json_parse_config_cb, &sc);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_config(g, &sc, id, &newc);
+		usbg_stats_leave(g->parent, site);
+		usbg_unlock(g->parent);
+	}
+
+	if (ret == USBG_SUCCESS && c)
+		*c = newc;
+out:
+	usbg_scheme_free_config(&sc);
+	USBG_PROBE2(import_config_done, id, ret);
+	return ret;
+}
+
+int usbg_import_gadget_json(usbg_state *s, FILE *stream, const char *name,
+			    usbg_gadget **g)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	usbg_gadget *newg;
+	usbg_stats_site site;
+	int ret;
+
+	if (!s || !stream || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_gadget_start, name);
+	ret = usbg_scheme_parse_gadget_json(stream, &sg);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_lock_exclusive(s);
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_gadget(s, &sg, name, &newg);
+		usbg_stats_leave(s, site);
+		usbg_unlock(s);
+	}
+
+	usbg_scheme_free_gadget(&sg);
+
+	if (ret == USBG_SUCCESS && g)
+		*g = newg;
+out:
+	USBG_PROBE2(import_gadget_done, name, ret);
+	return ret;
+}
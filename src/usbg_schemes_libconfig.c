@@ -15,26 +15,8 @@
 #include <string.h>
 #include <libconfig.h>
 
-#include "usbg/usbg_internal.h"
-
-#define USBG_NAME_TAG "name"
-#define USBG_ATTRS_TAG "attrs"
-#define USBG_STRINGS_TAG "strings"
-#define USBG_FUNCTIONS_TAG "functions"
-#define USBG_CONFIGS_TAG "configs"
-#define USBG_LANG_TAG "lang"
-#define USBG_TYPE_TAG "type"
-#define USBG_INSTANCE_TAG "instance"
-#define USBG_ID_TAG "id"
-#define USBG_FUNCTION_TAG "function"
-#define USBG_TAB_WIDTH 4
-
-static inline int generate_function_label(usbg_function *f, char *buf, int size)
-{
-	return snprintf(buf, size, "%s_%s",
-			 usbg_get_function_type_str(f->type), f->instance);
-
-}
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
 
 static int usbg_export_binding(usbg_binding *b, config_setting_t *root)
 {
@@ -160,9 +142,10 @@ static int usbg_export_config_strings(usbg_config *c, config_setting_t *root)
 		goto out;
 	}
 
-	nmb = scandir(spath, &dent, file_select, alphasort);
+	nmb = usbg_io_list_dir(c->parent->parent, spath, &dent, file_select,
+			       alphasort);
 	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-nmb);
 		goto out;
 	}
 
@@ -691,9 +674,10 @@ static int usbg_export_gadget_strings(usbg_gadget *g, config_setting_t *root)
 		goto out;
 	}
 
-	nmb = scandir(spath, &dent, file_select, alphasort);
+	nmb = usbg_io_list_dir(g->parent, spath, &dent, file_select,
+			       alphasort);
 	if (nmb < 0) {
-		ret = usbg_translate_error(errno);
+		ret = usbg_translate_error(-nmb);
 		goto out;
 	}
 
@@ -823,11 +807,13 @@ int usbg_export_function(usbg_function *f, FILE *stream)
 {
 	config_t cfg;
 	config_setting_t *root;
+	usbg_stats_site site;
 	int ret;
 
 	if (!f || !stream)
 		return USBG_ERROR_INVALID_PARAM;
 
+	USBG_PROBE1(export_function_start, f->name);
 	config_init(&cfg);
 
 	/* Set format */
@@ -836,13 +822,18 @@ int usbg_export_function(usbg_function *f, FILE *stream)
 	/* Always successful */
 	root = config_root_setting(&cfg);
 
+	usbg_lock_shared(f->parent->parent);
+	site = usbg_stats_enter(f->parent->parent, USBG_STATS_SITE_EXPORT);
 	ret = usbg_export_function_prep(f, root);
+	usbg_stats_leave(f->parent->parent, site);
+	usbg_unlock(f->parent->parent);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
 	config_write(&cfg, stream);
 out:
 	config_destroy(&cfg);
+	USBG_PROBE2(export_function_done, f->name, ret);
 	return ret;
 }
 
@@ -850,11 +841,13 @@ int usbg_export_config(usbg_config *c, FILE *stream)
 {
 	config_t cfg;
 	config_setting_t *root;
+	usbg_stats_site site;
 	int ret;
 
 	if (!c || !stream)
 		return USBG_ERROR_INVALID_PARAM;
 
+	USBG_PROBE1(export_config_start, c->name);
 	config_init(&cfg);
 
 	/* Set format */
@@ -863,13 +856,18 @@ int usbg_export_config(usbg_config *c, FILE *stream)
 	/* Always successful */
 	root = config_root_setting(&cfg);
 
+	usbg_lock_shared(c->parent->parent);
+	site = usbg_stats_enter(c->parent->parent, USBG_STATS_SITE_EXPORT);
 	ret = usbg_export_config_prep(c, root);
+	usbg_stats_leave(c->parent->parent, site);
+	usbg_unlock(c->parent->parent);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
 	config_write(&cfg, stream);
 out:
 	config_destroy(&cfg);
+	USBG_PROBE2(export_config_done, c->name, ret);
 	return ret;
 }
 
@@ -877,11 +875,13 @@ int usbg_export_gadget(usbg_gadget *g, FILE *stream)
 {
 	config_t cfg;
 	config_setting_t *root;
+	usbg_stats_site site;
 	int ret;
 
 	if (!g || !stream)
 		return USBG_ERROR_INVALID_PARAM;
 
+	USBG_PROBE1(export_gadget_start, g->name);
 	config_init(&cfg);
 
 	/* Set format */
@@ -890,13 +890,18 @@ int usbg_export_gadget(usbg_gadget *g, FILE *stream)
 	/* Always successful */
 	root = config_root_setting(&cfg);
 
+	usbg_lock_shared(g->parent);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_EXPORT);
 	ret = usbg_export_gadget_prep(g, root);
+	usbg_stats_leave(g->parent, site);
+	usbg_unlock(g->parent);
 	if (ret != USBG_SUCCESS)
 		goto out;
 
 	config_write(&cfg, stream);
 out:
 	config_destroy(&cfg);
+	USBG_PROBE2(export_gadget_done, g->name, ret);
 	return ret;
 }
 
@@ -904,80 +909,41 @@ out:
 #define usbg_config_is_string(node) \
 	(config_setting_type(node) == CONFIG_TYPE_STRING)
 
-static int split_function_label(const char *label, usbg_function_type *type,
-				const char **instance)
+static void usbg_set_failed_import(usbg_failed_import **to_set,
+				   usbg_failed_import *failed)
 {
-	const char *floor;
-	char buf[USBG_MAX_NAME_LENGTH];
-	int len;
-	int function_type;
-	int ret = USBG_ERROR_NOT_FOUND;
-
-	/* We assume that function type string doesn't contain '_' */
-	floor = strchr(label, '_');
-	/* if phrase before _ is longer than max name length we may
-	 * stop looking */
-	len = floor - label;
-	if (len >= USBG_MAX_NAME_LENGTH || floor == label)
-		goto out;
-
-	strncpy(buf, label, len);
-	buf[len] = '\0';
-
-	function_type = usbg_lookup_function_type(buf);
-	if (function_type < 0)
-		goto out;
-
-	*type = (usbg_function_type)function_type;
-	*instance = floor + 1;
-
-	ret = USBG_SUCCESS;
-out:
-	return ret;
-}
-
-static void usbg_set_failed_import(config_t **to_set, config_t *failed)
-{
-	if (*to_set != NULL) {
-		config_destroy(*to_set);
-		free(*to_set);
-	}
-
+	usbg_free_failed_import(*to_set);
 	*to_set = failed;
 }
 
-static int usbg_import_f_net_attrs(config_setting_t *root, usbg_function *f)
+static int usbg_parse_f_net_attrs(config_setting_t *root,
+				  struct usbg_scheme_function *sf)
 {
+	usbg_f_net_attrs *attrs = &sf->attrs.attrs.net;
 	config_setting_t *node;
 	int ret = USBG_SUCCESS;
-	int qmult;
-	struct ether_addr *addr;
-	struct ether_addr addr_buf;
 	const char *str;
 
-#define GET_OPTIONAL_ADDR(NAME)					\
-	do {							\
-		node = config_setting_get_member(root, #NAME);	\
-		if (node) {					\
-			str = config_setting_get_string(node);	\
-			if (!str) {				\
-				ret = USBG_ERROR_INVALID_TYPE;	\
-				goto out;			\
-			}					\
-								\
-			addr = ether_aton_r(str, &addr_buf);	\
-			if (!addr) {				\
-				ret = USBG_ERROR_INVALID_VALUE;	\
-				goto out;			\
-			}					\
-			ret = usbg_set_net_##NAME(f, addr);	\
-			if (ret != USBG_SUCCESS)		\
-				goto out;			\
-		}						\
+#define GET_OPTIONAL_ADDR(NAME, MASK)					\
+	do {								\
+		node = config_setting_get_member(root, #NAME);		\
+		if (node) {						\
+			str = config_setting_get_string(node);		\
+			if (!str) {					\
+				ret = USBG_ERROR_INVALID_TYPE;		\
+				goto out;				\
+			}						\
+									\
+			if (!ether_aton_r(str, &attrs->NAME)) {		\
+				ret = USBG_ERROR_INVALID_VALUE;		\
+				goto out;				\
+			}						\
+			sf->mask |= MASK;				\
+		}							\
 	} while (0)
 
-	GET_OPTIONAL_ADDR(host_addr);
-	GET_OPTIONAL_ADDR(dev_addr);
+	GET_OPTIONAL_ADDR(host_addr, USBG_SCHEME_F_HOST_ADDR);
+	GET_OPTIONAL_ADDR(dev_addr, USBG_SCHEME_F_DEV_ADDR);
 
 #undef GET_OPTIONAL_ADDR
 
@@ -987,23 +953,24 @@ static int usbg_import_f_net_attrs(config_setting_t *root, usbg_function *f)
 			ret = USBG_ERROR_INVALID_TYPE;
 			goto out;
 		}
-		qmult = config_setting_get_int(node);
-		ret = usbg_set_net_qmult(f, qmult);
+		attrs->qmult = config_setting_get_int(node);
+		sf->mask |= USBG_SCHEME_F_QMULT;
 	}
 
 out:
 	return ret;
 }
 
-static int usbg_import_f_ms_lun_attrs(usbg_f_ms_lun_attrs *lattrs,
-				      config_setting_t *root)
+static int usbg_parse_f_ms_lun_attrs(usbg_f_ms_lun_attrs *lattrs,
+				     config_setting_t *root)
 {
 	config_setting_t *node;
+	const char *filename = "";
 	int i;
 	int ret = USBG_ERROR_NO_MEM;
 
 #define BOOL_ATTR(_name, _default_val) \
-	{ .name = #_name, .value = &lattrs->_name, }
+	{ .name = #_name, .value = &lattrs->_name, .default_val = _default_val, }
 	struct {
 		char *name;
 		bool *value;
@@ -1046,25 +1013,22 @@ static int usbg_import_f_ms_lun_attrs(usbg_f_ms_lun_attrs *lattrs,
 			ret = USBG_ERROR_INVALID_PARAM;
 			goto out;
 		}
-		lattrs->filename = (char *)config_setting_get_string(node);
-	} else {
-			lattrs->filename = "";
+		filename = config_setting_get_string(node);
 	}
 
-	ret = USBG_SUCCESS;
+	lattrs->filename = strdup(filename);
+	ret = lattrs->filename ? USBG_SUCCESS : USBG_ERROR_NO_MEM;
 out:
 	return ret;
 }
 
-static int usbg_import_f_ms_attrs(config_setting_t *root,  usbg_function *f)
+static int usbg_parse_f_ms_attrs(config_setting_t *root,
+				 struct usbg_scheme_function *sf)
 {
+	usbg_f_ms_attrs *ms_attrs = &sf->attrs.attrs.ms;
 	config_setting_t *luns_node, *node;
-	int i;
+	int nluns, i;
 	int ret = USBG_ERROR_NO_MEM;
-	usbg_function_attrs attrs;
-	usbg_f_ms_attrs *ms_attrs = &attrs.attrs.ms;
-
-	memset(&attrs, 0, sizeof(attrs));
 
 	node = config_setting_get_member(root, "stall");
 	if (node) {
@@ -1083,7 +1047,7 @@ static int usbg_import_f_ms_attrs(config_setting_t *root,  usbg_function *f)
 	}
 
 	luns_node = config_setting_get_member(root, "luns");
-	if (!node) {
+	if (!luns_node) {
 		ret = USBG_ERROR_INVALID_PARAM;
 		goto out;
 	}
@@ -1093,58 +1057,52 @@ static int usbg_import_f_ms_attrs(config_setting_t *root,  usbg_function *f)
 		goto out;
 	}
 
-	ms_attrs->nluns = config_setting_length(luns_node);
+	nluns = config_setting_length(luns_node);
 
-	ms_attrs->luns = calloc(ms_attrs->nluns + 1, sizeof(*(ms_attrs->luns)));
+	ms_attrs->luns = calloc(nluns + 1, sizeof(*(ms_attrs->luns)));
 	if (!ms_attrs->luns) {
 		ret = USBG_ERROR_NO_MEM;
 		goto out;
 	}
 
-	for (i = 0; i < ms_attrs->nluns; ++i) {
+	/* Luns are released together with the whole scheme */
+	for (i = 0; i < nluns; ++i) {
 		node = config_setting_get_elem(luns_node, i);
 		if (!node) {
 			ret = USBG_ERROR_INVALID_FORMAT;
-			goto free_luns;
+			goto out;
 		}
 
 		if (!config_setting_is_group(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto free_luns;
+			goto out;
 		}
 
 		ms_attrs->luns[i] = malloc(sizeof(*(ms_attrs->luns[i])));
 		if (!ms_attrs->luns[i]) {
 			ret = USBG_ERROR_NO_MEM;
-			goto free_luns;
+			goto out;
 		}
+		ms_attrs->nluns = i + 1;
 
-		ret = usbg_import_f_ms_lun_attrs(ms_attrs->luns[i], node);
+		ret = usbg_parse_f_ms_lun_attrs(ms_attrs->luns[i], node);
 		if (ret != USBG_SUCCESS)
-			goto free_luns;
+			goto out;
 	}
 
-	ret = usbg_set_function_attrs(f, &attrs);
-
-free_luns:
-	while (--i >= 0)
-		if (ms_attrs->luns[i])
-			free(ms_attrs->luns[i]);
-	free(ms_attrs->luns);
+	ret = USBG_SUCCESS;
 out:
 	return ret;
-
 }
 
-static int usbg_import_f_midi_attrs(config_setting_t *root,  usbg_function *f)
+static int usbg_parse_f_midi_attrs(config_setting_t *root,
+				   struct usbg_scheme_function *sf)
 {
+	usbg_f_midi_attrs *midi_attrs = &sf->attrs.attrs.midi;
 	config_setting_t *node;
+	const char *id = "";
 	int ret = USBG_ERROR_NO_MEM;
 	int tmp;
-	usbg_function_attrs attrs;
-	usbg_f_midi_attrs *midi_attrs = &attrs.attrs.midi;
-
-	attrs.header.attrs_type = USBG_F_ATTRS_MIDI;
 
 #define ADD_F_MIDI_INT_ATTR(attr, defval, minval)			\
 	do {								\
@@ -1180,35 +1138,38 @@ static int usbg_import_f_midi_attrs(config_setting_t *root,  usbg_function *f)
 			goto out;
 		}
 
-		midi_attrs->id = config_setting_get_string(node);
-	} else {
-		midi_attrs->id = "";
+		id = config_setting_get_string(node);
 	}
 
-
-	ret = usbg_set_function_attrs(f, &attrs);
+	midi_attrs->id = strdup(id);
+	ret = midi_attrs->id ? USBG_SUCCESS : USBG_ERROR_NO_MEM;
 out:
 	return ret;
 }
 
-static int usbg_import_function_attrs(config_setting_t *root, usbg_function *f)
+static int usbg_parse_function_attrs(config_setting_t *root,
+				     struct usbg_scheme_function *sf)
 {
 	int ret = USBG_SUCCESS;
 	int attrs_type;
 
-	attrs_type = usbg_lookup_function_attrs_type(f->type);
+	attrs_type = usbg_lookup_function_attrs_type(sf->type);
 	if (attrs_type < 0) {
 		ret = attrs_type;
 		goto out;
 	}
 
+	/* From now on attrs are released together with the scheme */
+	sf->attrs.header.attrs_type = attrs_type;
+	sf->mask |= USBG_SCHEME_F_ATTRS;
+
 	switch (attrs_type) {
 	case USBG_F_ATTRS_SERIAL:
-                /* Don't import port_num because it is read only */
+		/* Don't import port_num because it is read only */
 		break;
 
 	case USBG_F_ATTRS_NET:
-		ret = usbg_import_f_net_attrs(root, f);
+		ret = usbg_parse_f_net_attrs(root, sf);
 		break;
 
 	case USBG_F_ATTRS_PHONET:
@@ -1221,11 +1182,11 @@ static int usbg_import_function_attrs(config_setting_t *root, usbg_function *f)
 		break;
 
 	case USBG_F_ATTRS_MS:
-		ret = usbg_import_f_ms_attrs(root, f);
+		ret = usbg_parse_f_ms_attrs(root, sf);
 		break;
 
 	case USBG_F_ATTRS_MIDI:
-		ret = usbg_import_f_midi_attrs(root, f);
+		ret = usbg_parse_f_midi_attrs(root, sf);
 		break;
 
 	default:
@@ -1238,12 +1199,11 @@ out:
 	return ret;
 }
 
-static int usbg_import_function_run(usbg_gadget *g, config_setting_t *root,
-				    const char *instance, usbg_function **f)
+static int usbg_parse_function(config_setting_t *root,
+			       struct usbg_scheme_function *sf)
 {
 	config_setting_t *node;
 	const char *type_str;
-	int usbg_ret;
 	int function_type;
 	int ret = USBG_ERROR_MISSING_TAG;
 
@@ -1265,83 +1225,62 @@ static int usbg_import_function_run(usbg_gadget *g, config_setting_t *root,
 		goto out;
 	}
 
-	/* All data collected, let's get to work and create this function */
-	ret = usbg_create_function(g, (usbg_function_type)function_type,
-				   instance, NULL, f);
-
-	if (ret != USBG_SUCCESS)
-		goto out;
+	sf->type = (usbg_function_type)function_type;
 
 	/* Attrs are optional */
 	node = config_setting_get_member(root, USBG_ATTRS_TAG);
-	if (node) {
-		usbg_ret = usbg_import_function_attrs(node, *f);
-		if (usbg_ret != USBG_SUCCESS) {
-			ret = usbg_ret;
-			goto out;
-		}
-	}
+	if (node)
+		ret = usbg_parse_function_attrs(node, sf);
+	else
+		ret = USBG_SUCCESS;
 out:
 	return ret;
 }
 
-static usbg_function *usbg_lookup_function(usbg_gadget *g, const char *label)
+/* Instance of function is also mandatory when defined in gadget */
+static int usbg_parse_function_instance(config_setting_t *root,
+					struct usbg_scheme_function *sf)
 {
-	usbg_function *f;
-	int usbg_ret;
+	config_setting_t *node;
+	const char *instance;
 
-	/* check if such function has also been imported */
-	TAILQ_FOREACH(f, &g->functions, fnode) {
-		if (f->label && !strcmp(f->label, label))
-			break;
-	}
+	node = config_setting_get_member(root, USBG_INSTANCE_TAG);
+	if (!node)
+		return USBG_ERROR_MISSING_TAG;
 
-	/* if not let's check if label follows the naming convention */
-	if (!f) {
-		usbg_function_type type;
-		const char *instance;
+	if (!usbg_config_is_string(node))
+		return USBG_ERROR_INVALID_TYPE;
 
-		usbg_ret = split_function_label(label, &type, &instance);
-		if (usbg_ret != USBG_SUCCESS)
-			goto out;
+	instance = config_setting_get_string(node);
+	if (!instance)
+		return USBG_ERROR_OTHER_ERROR;
 
-		/* check if such function exist */
-		f = usbg_get_function(g, type, instance);
-	}
+	sf->instance = strdup(instance);
+	if (!sf->instance)
+		return USBG_ERROR_NO_MEM;
 
-out:
-	return f;
+	return usbg_parse_function(root, sf);
 }
 
-/* We have a string which should match with one of function names */
-static int usbg_import_binding_string(config_setting_t *root, usbg_config *c)
+/* We have a string which should match with one of function labels */
+static int usbg_parse_binding_string(config_setting_t *root,
+				     struct usbg_scheme_binding *sb)
 {
 	const char *func_label;
-	usbg_function *target;
-	int ret;
 
 	func_label = config_setting_get_string(root);
-	if (!func_label) {
-		ret = USBG_ERROR_OTHER_ERROR;
-		goto out;
-	}
+	if (!func_label)
+		return USBG_ERROR_OTHER_ERROR;
 
-	target = usbg_lookup_function(c->parent, func_label);
-	if (!target) {
-		ret = USBG_ERROR_NOT_FOUND;
-		goto out;
-	}
-
-	ret = usbg_add_config_function(c, target->name, target);
-out:
-	return ret;
+	sb->label = strdup(func_label);
+	return sb->label ? USBG_SUCCESS : USBG_ERROR_NO_MEM;
 }
 
-static int usbg_import_binding_group(config_setting_t *root, usbg_config *c)
+static int usbg_parse_binding_group(config_setting_t *root,
+				    struct usbg_scheme_binding *sb)
 {
 	config_setting_t *node;
 	const char *func_label, *name;
-	usbg_function *target;
 	int ret;
 
 	node = config_setting_get_member(root, USBG_FUNCTION_TAG);
@@ -1359,29 +1298,19 @@ static int usbg_import_binding_group(config_setting_t *root, usbg_config *c)
 			goto out;
 		}
 
-		target = usbg_lookup_function(c->parent, func_label);
-		if (!target) {
-			ret = USBG_ERROR_NOT_FOUND;
+		sb->label = strdup(func_label);
+		if (!sb->label) {
+			ret = USBG_ERROR_NO_MEM;
 			goto out;
 		}
 	} else if (config_setting_is_group(node)) {
-		config_setting_t *inst_node;
-		const char *instance;
-
-		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
-		if (!inst_node) {
-			ret = USBG_ERROR_MISSING_TAG;
-			goto out;
-		}
-
-		instance = config_setting_get_string(inst_node);
-		if (!instance) {
-			ret = USBG_ERROR_OTHER_ERROR;
+		sb->function = calloc(1, sizeof(*sb->function));
+		if (!sb->function) {
+			ret = USBG_ERROR_NO_MEM;
 			goto out;
 		}
 
-		ret = usbg_import_function_run(c->parent, node,
-					       instance, &target);
+		ret = usbg_parse_function_instance(node, sb->function);
 		if (ret != USBG_SUCCESS)
 			goto out;
 	} else {
@@ -1402,17 +1331,23 @@ static int usbg_import_binding_group(config_setting_t *root, usbg_config *c)
 			ret = USBG_ERROR_OTHER_ERROR;
 			goto out;
 		}
-	} else {
-		name = target->name;
+
+		sb->name = strdup(name);
+		if (!sb->name) {
+			ret = USBG_ERROR_NO_MEM;
+			goto out;
+		}
 	}
 
-	ret = usbg_add_config_function(c, name, target);
+	ret = USBG_SUCCESS;
 out:
 	return ret;
 }
 
-static int usbg_import_config_bindings(config_setting_t *root, usbg_config *c)
+static int usbg_parse_config_bindings(config_setting_t *root,
+				      struct usbg_scheme_config *sc)
 {
+	struct usbg_scheme_binding *sb;
 	config_setting_t *node;
 	int ret = USBG_SUCCESS;
 	int count, i;
@@ -1422,10 +1357,16 @@ static int usbg_import_config_bindings(config_setting_t *root, usbg_config *c)
 	for (i = 0; i < count; ++i) {
 		node = config_setting_get_elem(root, i);
 
+		sb = usbg_scheme_new(sc->bindings, sc->nbindings);
+		if (!sb) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
 		if (usbg_config_is_string(node))
-			ret = usbg_import_binding_string(node, c);
+			ret = usbg_parse_binding_string(node, sb);
 		else if (config_setting_is_group(node))
-			ret = usbg_import_binding_group(node, c);
+			ret = usbg_parse_binding_group(node, sb);
 		else
 			ret = USBG_ERROR_INVALID_TYPE;
 
@@ -1436,14 +1377,20 @@ static int usbg_import_config_bindings(config_setting_t *root, usbg_config *c)
 	return ret;
 }
 
-static int usbg_import_config_strs_lang(config_setting_t *root, usbg_config *c)
+static int usbg_parse_config_strs_lang(config_setting_t *root,
+				       struct usbg_scheme_config *sc)
 {
+	struct usbg_scheme_config_strs *ss;
 	config_setting_t *node;
-	int lang;
 	const char *str;
-	usbg_config_strs c_strs = {{0}};
 	int ret = USBG_ERROR_INVALID_TYPE;
 
+	ss = usbg_scheme_new(sc->strs, sc->nstrs);
+	if (!ss) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
 	node = config_setting_get_member(root, USBG_LANG_TAG);
 	if (!node) {
 		ret = USBG_ERROR_MISSING_TAG;
@@ -1453,7 +1400,7 @@ static int usbg_import_config_strs_lang(config_setting_t *root, usbg_config *c)
 	if (!usbg_config_is_int(node))
 		goto out;
 
-	lang = config_setting_get_int(node);
+	ss->lang = config_setting_get_int(node);
 
 	/* Configuration string is optional */
 	node = config_setting_get_member(root, "configuration");
@@ -1464,17 +1411,17 @@ static int usbg_import_config_strs_lang(config_setting_t *root, usbg_config *c)
 		str = config_setting_get_string(node);
 
 		/* Auto truncate the string to max length */
-		strncpy(c_strs.configuration, str, USBG_MAX_STR_LENGTH);
-		c_strs.configuration[USBG_MAX_STR_LENGTH - 1] = 0;
+		strncpy(ss->strs.configuration, str, USBG_MAX_STR_LENGTH);
+		ss->strs.configuration[USBG_MAX_STR_LENGTH - 1] = 0;
 	}
 
-	ret = usbg_set_config_strs(c, lang, &c_strs);
-
+	ret = USBG_SUCCESS;
 out:
 	return ret;
 }
 
-static int usbg_import_config_strings(config_setting_t *root, usbg_config *c)
+static int usbg_parse_config_strings(config_setting_t *root,
+				     struct usbg_scheme_config *sc)
 {
 	config_setting_t *node;
 	int ret = USBG_SUCCESS;
@@ -1489,7 +1436,7 @@ static int usbg_import_config_strings(config_setting_t *root, usbg_config *c)
 			break;
 		}
 
-		ret = usbg_import_config_strs_lang(node, c);
+		ret = usbg_parse_config_strs_lang(node, sc);
 		if (ret != USBG_SUCCESS)
 			break;
 	}
@@ -1497,11 +1444,10 @@ static int usbg_import_config_strings(config_setting_t *root, usbg_config *c)
 	return ret;
 }
 
-static int usbg_import_config_attrs(config_setting_t *root, usbg_config *c)
+static int usbg_parse_config_attrs(config_setting_t *root,
+				   struct usbg_scheme_config *sc)
 {
 	config_setting_t *node;
-	int usbg_ret;
-	int bmAttributes, bMaxPower;
 	int ret = USBG_ERROR_INVALID_TYPE;
 
 	node = config_setting_get_member(root, "bmAttributes");
@@ -1509,12 +1455,8 @@ static int usbg_import_config_attrs(config_setting_t *root, usbg_config *c)
 		if (!usbg_config_is_int(node))
 			goto out;
 
-		bmAttributes = config_setting_get_int(node);
-		usbg_ret = usbg_set_config_bm_attrs(c, bmAttributes);
-		if (usbg_ret != USBG_SUCCESS) {
-			ret = usbg_ret;
-			goto out;
-		}
+		sc->bmAttributes = config_setting_get_int(node);
+		sc->attrs_mask |= USBG_SCHEME_C_BM_ATTRIBUTES;
 	}
 
 	node = config_setting_get_member(root, "bMaxPower");
@@ -1522,12 +1464,8 @@ static int usbg_import_config_attrs(config_setting_t *root, usbg_config *c)
 		if (!usbg_config_is_int(node))
 			goto out;
 
-		bMaxPower = config_setting_get_int(node);
-		usbg_ret = usbg_set_config_max_power(c, bMaxPower);
-		if (usbg_ret != USBG_SUCCESS) {
-			ret = usbg_ret;
-			goto out;
-		}
+		sc->bMaxPower = config_setting_get_int(node);
+		sc->attrs_mask |= USBG_SCHEME_C_B_MAX_POWER;
 	}
 
 	/* Empty attrs section is also considered to be valid */
@@ -1537,13 +1475,11 @@ out:
 
 }
 
-static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
-				  int id, usbg_config **c)
+static int usbg_parse_config(config_setting_t *root,
+			     struct usbg_scheme_config *sc)
 {
 	config_setting_t *node;
 	const char *name;
-	usbg_config *newc;
-	int usbg_ret;
 	int ret = USBG_ERROR_MISSING_TAG;
 
 	/*
@@ -1560,10 +1496,9 @@ static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
 		goto out;
 	}
 
-	/* Required data collected, let's create our config */
-	usbg_ret = usbg_create_config(g, id, name, NULL, NULL, &newc);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
+	sc->label = strdup(name);
+	if (!sc->label) {
+		ret = USBG_ERROR_NO_MEM;
 		goto out;
 	}
 
@@ -1572,12 +1507,12 @@ static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
 	if (node) {
 		if (!config_setting_is_group(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
 
-		usbg_ret = usbg_import_config_attrs(node, newc);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		ret = usbg_parse_config_attrs(node, sc);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
 	/* Strings are also optional */
@@ -1585,12 +1520,12 @@ static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
 	if (node) {
 		if (!config_setting_is_list(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
 
-		usbg_ret = usbg_import_config_strings(node, newc);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		ret = usbg_parse_config_strings(node, sc);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
 	/* Functions too, because some config may not be
@@ -1599,33 +1534,24 @@ static int usbg_import_config_run(usbg_gadget *g, config_setting_t *root,
 	if (node) {
 		if (!config_setting_is_list(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
 
-		usbg_ret = usbg_import_config_bindings(node, newc);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		ret = usbg_parse_config_bindings(node, sc);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
-	*c = newc;
 	ret = USBG_SUCCESS;
 out:
 	return ret;
-
-error:
-	ret = usbg_ret;
-error2:
-	/* We ignore returned value, if function fails
-	 * there is no way to handle it */
-	usbg_rm_config(newc, USBG_RM_RECURSE);
-	return ret;
 }
 
-static int usbg_import_gadget_configs(config_setting_t *root, usbg_gadget *g)
+static int usbg_parse_gadget_configs(config_setting_t *root,
+				     struct usbg_scheme_gadget *sg)
 {
+	struct usbg_scheme_config *sc;
 	config_setting_t *node, *id_node;
-	int id;
-	usbg_config *c;
 	int ret = USBG_SUCCESS;
 	int count, i;
 
@@ -1655,9 +1581,15 @@ static int usbg_import_gadget_configs(config_setting_t *root, usbg_gadget *g)
 			break;
 		}
 
-		id = config_setting_get_int(id_node);
+		sc = usbg_scheme_new(sg->configs, sg->nconfigs);
+		if (!sc) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		sc->id = config_setting_get_int(id_node);
 
-		ret = usbg_import_config_run(g, node, id, &c);
+		ret = usbg_parse_config(node, sc);
 		if (ret != USBG_SUCCESS)
 			break;
 	}
@@ -1665,12 +1597,12 @@ static int usbg_import_gadget_configs(config_setting_t *root, usbg_gadget *g)
 	return ret;
 }
 
-static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g)
+static int usbg_parse_gadget_functions(config_setting_t *root,
+				       struct usbg_scheme_gadget *sg)
 {
-	config_setting_t *node, *inst_node;
-	const char *instance;
+	struct usbg_scheme_function *sf;
+	config_setting_t *node;
 	const char *label;
-	usbg_function *f;
 	int ret = USBG_SUCCESS;
 	int count, i;
 
@@ -1688,25 +1620,13 @@ static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g)
 			break;
 		}
 
-		/* Look for instance name */
-		inst_node = config_setting_get_member(node, USBG_INSTANCE_TAG);
-		if (!inst_node) {
-			ret = USBG_ERROR_MISSING_TAG;
-			break;
-		}
-
-		if (!usbg_config_is_string(inst_node)) {
-			ret = USBG_ERROR_INVALID_TYPE;
-			break;
-		}
-
-		instance = config_setting_get_string(inst_node);
-		if (!instance) {
-			ret = USBG_ERROR_OTHER_ERROR;
+		sf = usbg_scheme_new(sg->functions, sg->nfunctions);
+		if (!sf) {
+			ret = USBG_ERROR_NO_MEM;
 			break;
 		}
 
-		ret = usbg_import_function_run(g, node, instance, &f);
+		ret = usbg_parse_function_instance(node, sf);
 		if (ret != USBG_SUCCESS)
 			break;
 
@@ -1717,8 +1637,8 @@ static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g)
 			break;
 		}
 
-		f->label = strdup(label);
-		if (!f->label) {
+		sf->label = strdup(label);
+		if (!sf->label) {
 			ret = USBG_ERROR_NO_MEM;
 			break;
 		}
@@ -1727,14 +1647,20 @@ static int usbg_import_gadget_functions(config_setting_t *root, usbg_gadget *g)
 	return ret;
 }
 
-static int usbg_import_gadget_strs_lang(config_setting_t *root, usbg_gadget *g)
+static int usbg_parse_gadget_strs_lang(config_setting_t *root,
+				       struct usbg_scheme_gadget *sg)
 {
+	struct usbg_scheme_gadget_strs *ss;
 	config_setting_t *node;
-	int lang;
 	const char *str;
-	usbg_gadget_strs g_strs = {{0}};
 	int ret = USBG_ERROR_INVALID_TYPE;
 
+	ss = usbg_scheme_new(sg->strs, sg->nstrs);
+	if (!ss) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
 	node = config_setting_get_member(root, USBG_LANG_TAG);
 	if (!node) {
 		ret = USBG_ERROR_MISSING_TAG;
@@ -1744,7 +1670,7 @@ static int usbg_import_gadget_strs_lang(config_setting_t *root, usbg_gadget *g)
 	if (!usbg_config_is_int(node))
 		goto out;
 
-	lang = config_setting_get_int(node);
+	ss->lang = config_setting_get_int(node);
 
 	/* Auto truncate the string to max length */
 #define GET_OPTIONAL_GADGET_STR(NAME, FIELD)				\
@@ -1754,8 +1680,8 @@ static int usbg_import_gadget_strs_lang(config_setting_t *root, usbg_gadget *g)
 			if (!usbg_config_is_string(node))		\
 				goto out;				\
 			str = config_setting_get_string(node);		\
-			strncpy(g_strs.FIELD, str, USBG_MAX_STR_LENGTH); \
-			g_strs.FIELD[USBG_MAX_STR_LENGTH - 1] = '\0';	\
+			strncpy(ss->strs.FIELD, str, USBG_MAX_STR_LENGTH); \
+			ss->strs.FIELD[USBG_MAX_STR_LENGTH - 1] = '\0';	\
 		}							\
 	} while (0)
 
@@ -1765,13 +1691,13 @@ static int usbg_import_gadget_strs_lang(config_setting_t *root, usbg_gadget *g)
 
 #undef GET_OPTIONAL_GADGET_STR
 
-	ret = usbg_set_gadget_strs(g, lang, &g_strs);
-
+	ret = USBG_SUCCESS;
 out:
 	return ret;
 }
 
-static int usbg_import_gadget_strings(config_setting_t *root, usbg_gadget *g)
+static int usbg_parse_gadget_strings(config_setting_t *root,
+				     struct usbg_scheme_gadget *sg)
 {
 	config_setting_t *node;
 	int ret = USBG_SUCCESS;
@@ -1786,7 +1712,7 @@ static int usbg_import_gadget_strings(config_setting_t *root, usbg_gadget *g)
 			break;
 		}
 
-		ret = usbg_import_gadget_strs_lang(node, g);
+		ret = usbg_parse_gadget_strs_lang(node, sg);
 		if (ret != USBG_SUCCESS)
 			break;
 	}
@@ -1794,15 +1720,14 @@ static int usbg_import_gadget_strings(config_setting_t *root, usbg_gadget *g)
 	return ret;
 }
 
-
-static int usbg_import_gadget_attrs(config_setting_t *root, usbg_gadget *g)
+static int usbg_parse_gadget_attrs(config_setting_t *root,
+				   struct usbg_scheme_gadget *sg)
 {
 	config_setting_t *node;
-	int usbg_ret;
 	int val;
 	int ret = USBG_ERROR_INVALID_TYPE;
 
-#define GET_OPTIONAL_GADGET_ATTR(NAME, FUNC_END, TYPE)			\
+#define GET_OPTIONAL_GADGET_ATTR(NAME, ATTR, TYPE)			\
 	do {								\
 		node = config_setting_get_member(root, #NAME);		\
 		if (node) {						\
@@ -1813,22 +1738,19 @@ static int usbg_import_gadget_attrs(config_setting_t *root, usbg_gadget *g)
 				ret = USBG_ERROR_INVALID_VALUE;		\
 				goto out;				\
 			}						\
-			usbg_ret = usbg_set_gadget_##FUNC_END(g, (TYPE)val); \
-			if (usbg_ret != USBG_SUCCESS) {			\
-				ret = usbg_ret;				\
-				goto out;				\
-			}						\
+			sg->attrs[ATTR] = val;				\
+			sg->attrs_mask |= 1 << ATTR;			\
 		}							\
 	} while (0)
 
-	GET_OPTIONAL_GADGET_ATTR(bcdUSB, device_bcd_usb, uint16_t);
-	GET_OPTIONAL_GADGET_ATTR(bDeviceClass, device_class, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(bDeviceSubClass, device_subclass, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(bDeviceProtocol, device_protocol, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(bMaxPacketSize0, device_max_packet, uint8_t);
-	GET_OPTIONAL_GADGET_ATTR(idVendor, vendor_id, uint16_t);
-	GET_OPTIONAL_GADGET_ATTR(idProduct, product_id, uint16_t);
-	GET_OPTIONAL_GADGET_ATTR(bcdDevice, device_bcd_device, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(bcdUSB, BCD_USB, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(bDeviceClass, B_DEVICE_CLASS, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(bDeviceSubClass, B_DEVICE_SUB_CLASS, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(bDeviceProtocol, B_DEVICE_PROTOCOL, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(bMaxPacketSize0, B_MAX_PACKET_SIZE_0, uint8_t);
+	GET_OPTIONAL_GADGET_ATTR(idVendor, ID_VENDOR, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(idProduct, ID_PRODUCT, uint16_t);
+	GET_OPTIONAL_GADGET_ATTR(bcdDevice, BCD_DEVICE, uint16_t);
 
 #undef GET_OPTIONAL_GADGET_ATTR
 
@@ -1839,33 +1761,23 @@ out:
 
 }
 
-static int usbg_import_gadget_run(usbg_state *s, config_setting_t *root,
-				  const char *name, usbg_gadget **g)
+static int usbg_parse_gadget(config_setting_t *root,
+			     struct usbg_scheme_gadget *sg)
 {
 	config_setting_t *node;
-	usbg_gadget *newg;
-	int usbg_ret;
-	int ret = USBG_ERROR_MISSING_TAG;
-
-	/* There is no mandatory data in gadget so let's start with
-	 * creating a new gadget */
-	usbg_ret = usbg_create_gadget(s, name, NULL, NULL, &newg);
-	if (usbg_ret != USBG_SUCCESS) {
-		ret = usbg_ret;
-		goto out;
-	}
+	int ret = USBG_SUCCESS;
 
 	/* Attrs are optional */
 	node = config_setting_get_member(root, USBG_ATTRS_TAG);
 	if (node) {
 		if (!config_setting_is_group(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
 
-		usbg_ret = usbg_import_gadget_attrs(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		ret = usbg_parse_gadget_attrs(node, sg);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
 	/* Strings are also optional */
@@ -1873,12 +1785,12 @@ static int usbg_import_gadget_run(usbg_state *s, config_setting_t *root,
 	if (node) {
 		if (!config_setting_is_list(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
 
-		usbg_ret = usbg_import_gadget_strings(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+		ret = usbg_parse_gadget_strings(node, sg);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
 	/* Functions too, because some gadgets may not be fully
@@ -1888,11 +1800,12 @@ static int usbg_import_gadget_run(usbg_state *s, config_setting_t *root,
 	if (node) {
 		if (!config_setting_is_group(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
-		usbg_ret = usbg_import_gadget_functions(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+
+		ret = usbg_parse_gadget_functions(node, sg);
+		if (ret != USBG_SUCCESS)
+			goto out;
 	}
 
 	/* Some gadget may not be fully configured
@@ -1901,38 +1814,226 @@ static int usbg_import_gadget_run(usbg_state *s, config_setting_t *root,
 	if (node) {
 		if (!config_setting_is_list(node)) {
 			ret = USBG_ERROR_INVALID_TYPE;
-			goto error2;
+			goto out;
 		}
-		usbg_ret = usbg_import_gadget_configs(node, newg);
-		if (usbg_ret != USBG_SUCCESS)
-			goto error;
+
+		ret = usbg_parse_gadget_configs(node, sg);
 	}
 
-	*g = newg;
-	ret = USBG_SUCCESS;
 out:
 	return ret;
+}
 
-error:
-	ret = usbg_ret;
-error2:
-	/* We ignore returned value, if function fails
-	 * there is no way to handle it */
-	usbg_rm_gadget(newg);
+int usbg_scheme_parse_gadget_libconfig(FILE *stream,
+				       struct usbg_scheme_gadget *sg)
+{
+	config_t cfg;
+	int ret;
+
+	config_init(&cfg);
+
+	if (config_read(&cfg, stream) != CONFIG_TRUE) {
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	ret = usbg_parse_gadget(config_root_setting(&cfg), sg);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+out:
+	config_destroy(&cfg);
+	return ret;
+}
+
+static int usbg_parse_state(config_setting_t *root,
+			    struct usbg_scheme_state *ss)
+{
+	struct usbg_scheme_state_gadget *sg;
+	config_setting_t *list, *node, *elem;
+	const char *str;
+	int count, i;
+	int ret = USBG_SUCCESS;
+
+	list = config_setting_get_member(root, USBG_GADGETS_TAG);
+	if (!list)
+		goto out;
+
+	if (!config_setting_is_list(list)) {
+		ret = USBG_ERROR_INVALID_TYPE;
+		goto out;
+	}
+
+	count = config_setting_length(list);
+	for (i = 0; i < count; ++i) {
+		elem = config_setting_get_elem(list, i);
+		if (!config_setting_is_group(elem)) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		sg = usbg_scheme_new(ss->gadgets, ss->ngadgets);
+		if (!sg) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		/* Name of gadget is mandatory */
+		node = config_setting_get_member(elem, USBG_NAME_TAG);
+		if (!node) {
+			ret = USBG_ERROR_MISSING_TAG;
+			break;
+		}
+
+		str = config_setting_get_string(node);
+		if (!str) {
+			ret = USBG_ERROR_INVALID_TYPE;
+			break;
+		}
+
+		sg->name = strdup(str);
+		if (!sg->name) {
+			ret = USBG_ERROR_NO_MEM;
+			break;
+		}
+
+		/* UDC is present only for enabled gadgets */
+		node = config_setting_get_member(elem, USBG_UDC_TAG);
+		if (node) {
+			str = config_setting_get_string(node);
+			if (!str) {
+				ret = USBG_ERROR_INVALID_TYPE;
+				break;
+			}
+
+			sg->udc = strdup(str);
+			if (!sg->udc) {
+				ret = USBG_ERROR_NO_MEM;
+				break;
+			}
+		}
+
+		ret = usbg_parse_gadget(elem, &sg->gadget);
+		if (ret != USBG_SUCCESS)
+			break;
+	}
+
+out:
+	return ret;
+}
+
+int usbg_scheme_parse_state_libconfig(FILE *stream,
+				      struct usbg_scheme_state *ss)
+{
+	config_t cfg;
+	int ret;
+
+	config_init(&cfg);
+
+	if (config_read(&cfg, stream) != CONFIG_TRUE) {
+		ret = USBG_ERROR_INVALID_FORMAT;
+		goto out;
+	}
+
+	ret = usbg_parse_state(config_root_setting(&cfg), ss);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_state(ss);
+out:
+	config_destroy(&cfg);
+	return ret;
+}
+
+/* libconfig reads only strings terminated by '\0' */
+static int usbg_read_buf(config_t *cfg, const char *buf, size_t len)
+{
+	char *str;
+	int ret = USBG_SUCCESS;
+
+	str = strndup(buf, len);
+	if (!str)
+		return USBG_ERROR_NO_MEM;
+
+	if (config_read_string(cfg, str) != CONFIG_TRUE)
+		ret = USBG_ERROR_INVALID_FORMAT;
+
+	free(str);
+	return ret;
+}
+
+int usbg_scheme_parse_function_libconfig_buf(const char *buf, size_t len,
+					     struct usbg_scheme_function *sf)
+{
+	config_t cfg;
+	int ret;
+
+	config_init(&cfg);
+
+	ret = usbg_read_buf(&cfg, buf, len);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_parse_function(config_root_setting(&cfg), sf);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_function(sf);
+out:
+	config_destroy(&cfg);
+	return ret;
+}
+
+int usbg_scheme_parse_config_libconfig_buf(const char *buf, size_t len,
+					   struct usbg_scheme_config *sc)
+{
+	config_t cfg;
+	int ret;
+
+	config_init(&cfg);
+
+	ret = usbg_read_buf(&cfg, buf, len);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_parse_config(config_root_setting(&cfg), sc);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_config(sc);
+out:
+	config_destroy(&cfg);
+	return ret;
+}
+
+int usbg_scheme_parse_gadget_libconfig_buf(const char *buf, size_t len,
+					   struct usbg_scheme_gadget *sg)
+{
+	config_t cfg;
+	int ret;
+
+	config_init(&cfg);
+
+	ret = usbg_read_buf(&cfg, buf, len);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_parse_gadget(config_root_setting(&cfg), sg);
+	if (ret != USBG_SUCCESS)
+		usbg_scheme_free_gadget(sg);
+out:
+	config_destroy(&cfg);
 	return ret;
 }
 
 int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 			 usbg_function **f)
 {
+	struct usbg_scheme_function sf = { 0 };
 	config_t *cfg;
 	config_setting_t *root;
 	usbg_function *newf;
+	usbg_stats_site site;
 	int ret, cfg_ret;
 
 	if (!g || !stream || !instance)
 		return USBG_ERROR_INVALID_PARAM;
 
+	USBG_PROBE1(import_function_start, instance);
+
 	cfg = malloc(sizeof(*cfg));
 	if (!cfg)
 		return USBG_ERROR_NO_MEM;
@@ -1940,6 +2041,13 @@ int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 	config_init(cfg);
 
 	cfg_ret = config_read(cfg, stream);
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS) {
+		config_destroy(cfg);
+		free(cfg);
+		goto out_probe;
+	}
+
 	if (cfg_ret != CONFIG_TRUE) {
 		usbg_set_failed_import(&g->last_failed_import, cfg);
 		ret = USBG_ERROR_INVALID_FORMAT;
@@ -1949,7 +2057,12 @@ int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 	/* Always successful */
 	root = config_root_setting(cfg);
 
-	ret = usbg_import_function_run(g, root, instance, &newf);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+	ret = usbg_parse_function(root, &sf);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_scheme_create_function(g, &sf, instance, &newf);
+	usbg_scheme_free_function(&sf);
+	usbg_stats_leave(g->parent, site);
 	if (ret != USBG_SUCCESS) {
 		usbg_set_failed_import(&g->last_failed_import, cfg);
 		goto out;
@@ -1963,20 +2076,27 @@ int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
 	/* Clean last error */
 	usbg_set_failed_import(&g->last_failed_import, NULL);
 out:
+	usbg_unlock(g->parent);
+out_probe:
+	USBG_PROBE2(import_function_done, instance, ret);
 	return ret;
 
 }
 
 int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 {
+	struct usbg_scheme_config sc = { 0 };
 	config_t *cfg;
 	config_setting_t *root;
 	usbg_config *newc;
+	usbg_stats_site site;
 	int ret, cfg_ret;
 
 	if (!g || !stream || id < 0)
 		return USBG_ERROR_INVALID_PARAM;
 
+	USBG_PROBE1(import_config_start, id);
+
 	cfg = malloc(sizeof(*cfg));
 	if (!cfg)
 		return USBG_ERROR_NO_MEM;
@@ -1984,6 +2104,13 @@ int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 	config_init(cfg);
 
 	cfg_ret = config_read(cfg, stream);
+	ret = usbg_lock_exclusive(g->parent);
+	if (ret != USBG_SUCCESS) {
+		config_destroy(cfg);
+		free(cfg);
+		goto out_probe;
+	}
+
 	if (cfg_ret != CONFIG_TRUE) {
 		usbg_set_failed_import(&g->last_failed_import, cfg);
 		ret = USBG_ERROR_INVALID_FORMAT;
@@ -1993,7 +2120,12 @@ int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 	/* Always successful */
 	root = config_root_setting(cfg);
 
-	ret = usbg_import_config_run(g, root, id, &newc);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+	ret = usbg_parse_config(root, &sc);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_scheme_create_config(g, &sc, id, &newc);
+	usbg_scheme_free_config(&sc);
+	usbg_stats_leave(g->parent, site);
 	if (ret != USBG_SUCCESS) {
 		usbg_set_failed_import(&g->last_failed_import, cfg);
 		goto out;
@@ -2007,20 +2139,27 @@ int usbg_import_config(usbg_gadget *g, FILE *stream, int id,  usbg_config **c)
 	/* Clean last error */
 	usbg_set_failed_import(&g->last_failed_import, NULL);
 out:
+	usbg_unlock(g->parent);
+out_probe:
+	USBG_PROBE2(import_config_done, id, ret);
 	return ret;
 }
 
 int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 		       usbg_gadget **g)
 {
+	struct usbg_scheme_gadget sg = { 0 };
 	config_t *cfg;
 	config_setting_t *root;
 	usbg_gadget *newg;
+	usbg_stats_site site;
 	int ret, cfg_ret;
 
 	if (!s || !stream || !name)
 		return USBG_ERROR_INVALID_PARAM;
 
+	USBG_PROBE1(import_gadget_start, name);
+
 	cfg = malloc(sizeof(*cfg));
 	if (!cfg)
 		return USBG_ERROR_NO_MEM;
@@ -2028,6 +2167,13 @@ int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 	config_init(cfg);
 
 	cfg_ret = config_read(cfg, stream);
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS) {
+		config_destroy(cfg);
+		free(cfg);
+		goto out_probe;
+	}
+
 	if (cfg_ret != CONFIG_TRUE) {
 		usbg_set_failed_import(&s->last_failed_import, cfg);
 		ret = USBG_ERROR_INVALID_FORMAT;
@@ -2037,7 +2183,12 @@ int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 	/* Always successful */
 	root = config_root_setting(cfg);
 
-	ret = usbg_import_gadget_run(s, root, name, &newg);
+	site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+	ret = usbg_parse_gadget(root, &sg);
+	if (ret == USBG_SUCCESS)
+		ret = usbg_scheme_create_gadget(s, &sg, name, &newg);
+	usbg_scheme_free_gadget(&sg);
+	usbg_stats_leave(s, site);
 	if (ret != USBG_SUCCESS) {
 		usbg_set_failed_import(&s->last_failed_import, cfg);
 		goto out;
@@ -2051,6 +2202,9 @@ int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
 	/* Clean last error */
 	usbg_set_failed_import(&s->last_failed_import, NULL);
 out:
+	usbg_unlock(s);
+out_probe:
+	USBG_PROBE2(import_gadget_done, name, ret);
 	return ret;
 }
 
@@ -0,0 +1,565 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
+
+/**
+ * @file usbg_schemes_ops.c
+ * @brief Compiled gadget schemes
+ * @details Scheme is compiled by creating the gadget in a private
+ * simulator and recording each configfs modification done by the
+ * library, so the list has exactly the same order and values as
+ * a regular import. Replay only executes the list.
+ *
+ * Compiled scheme starts with header: magic "USBO", major and minor
+ * version (one byte each) and two reserved bytes. It is followed by
+ * operations: op (u8), path and value. Strings are stored as length
+ * (u16) including terminating zero followed by characters, so they are
+ * used directly from the buffer, length 0 means no string. Paths and
+ * symlink targets are relative to configfs root. First operation names
+ * the gadget, list is terminated by end operation.
+ */
+
+#define USBG_OPS_MAGIC "USBO"
+#define USBG_OPS_MAGIC_LEN 4
+#define USBG_OPS_VERSION_MAJOR 1
+#define USBG_OPS_VERSION_MINOR 0
+#define USBG_OPS_HEADER_LEN 8
+/* Only relative paths are recorded, so any configfs root will do */
+#define USBG_OPS_SIM_CONFIGFS "/sys/kernel/config"
+
+enum usbg_ops_op {
+	USBG_OPS_END = 0,
+	USBG_OPS_GADGET,
+	USBG_OPS_MKDIR,
+	USBG_OPS_RMDIR,
+	USBG_OPS_WRITE,
+	USBG_OPS_SYMLINK,
+	USBG_OPS_UNLINK,
+	USBG_OPS_MAX,
+};
+
+/*
+ * Compilation
+ */
+
+struct usbg_ops_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	int error;
+};
+
+static void usbg_ops_put(struct usbg_ops_buf *b, const void *data,
+			 size_t len)
+{
+	uint8_t *new;
+	size_t size;
+
+	/* Absent strings have no data, memcpy() from NULL is undefined */
+	if (b->error || !len)
+		return;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size * 2 : 1024;
+		while (size < b->len + len)
+			size *= 2;
+
+		new = realloc(b->data, size);
+		if (!new) {
+			b->error = USBG_ERROR_NO_MEM;
+			return;
+		}
+
+		b->data = new;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void usbg_ops_put_str(struct usbg_ops_buf *b, const char *str)
+{
+	uint8_t v[2] = { 0, 0 };
+	size_t len;
+
+	len = str ? strlen(str) + 1 : 0;
+	if (len > UINT16_MAX) {
+		if (!b->error)
+			b->error = USBG_ERROR_INVALID_VALUE;
+		return;
+	}
+
+	v[0] = len & 0xFF;
+	v[1] = (len >> 8) & 0xFF;
+	usbg_ops_put(b, v, sizeof(v));
+	usbg_ops_put(b, str, len);
+}
+
+static void usbg_ops_put_op(struct usbg_ops_buf *b, enum usbg_ops_op op,
+			    const char *path, const char *value)
+{
+	uint8_t v = op;
+
+	usbg_ops_put(b, &v, 1);
+	usbg_ops_put_str(b, path);
+	usbg_ops_put_str(b, value);
+}
+
+static void usbg_ops_trace(usbg_state *s, const usbg_trace_event *ev,
+			   void *ctx)
+{
+	static const enum usbg_ops_op ops[USBG_IO_OP_MAX] = {
+		[USBG_IO_OP_MKDIR] = USBG_OPS_MKDIR,
+		[USBG_IO_OP_RMDIR] = USBG_OPS_RMDIR,
+		[USBG_IO_OP_WRITE_ATTR] = USBG_OPS_WRITE,
+		[USBG_IO_OP_SYMLINK] = USBG_OPS_SYMLINK,
+		[USBG_IO_OP_UNLINK] = USBG_OPS_UNLINK,
+	};
+
+	/* Failed operations haven't changed anything */
+	if (ev->point != USBG_TRACE_END || ev->ret || !ops[ev->op])
+		return;
+
+	usbg_ops_put_op(ctx, ops[ev->op], ev->path, ev->value);
+}
+
+static int usbg_ops_compile(const struct usbg_scheme_gadget *sg,
+			    const char *name, const char *udc,
+			    struct usbg_ops_buf *b)
+{
+	usbg_init_opts opts;
+	usbg_gadget *g;
+	usbg_sim *sim;
+	usbg_state *s;
+	int ret;
+
+	ret = usbg_sim_create(USBG_OPS_SIM_CONFIGFS, &sim);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	if (udc) {
+		ret = usbg_sim_add_udc(sim, udc);
+		if (ret != USBG_SUCCESS)
+			goto out_sim;
+	}
+
+	usbg_sim_get_init_opts(sim, &opts);
+	ret = usbg_init_with_opts(USBG_OPS_SIM_CONFIGFS, &opts, &s);
+	if (ret != USBG_SUCCESS)
+		goto out_sim;
+
+	usbg_set_trace_callback(s, usbg_ops_trace, b);
+
+	ret = usbg_scheme_create_gadget(s, sg, name, &g);
+	if (ret == USBG_SUCCESS && udc)
+		ret = usbg_enable_gadget(g, usbg_get_udc(s, udc));
+
+	usbg_set_trace_callback(s, NULL, NULL);
+	usbg_cleanup(s);
+out_sim:
+	usbg_sim_destroy(sim);
+	return ret;
+}
+
+int usbg_compile_gadget_scheme(FILE *in, usbg_scheme_format format,
+			       const char *name, const char *udc, FILE *out)
+{
+	static const uint8_t header[USBG_OPS_HEADER_LEN] = {
+		'U', 'S', 'B', 'O',
+		USBG_OPS_VERSION_MAJOR, USBG_OPS_VERSION_MINOR, 0, 0,
+	};
+	struct usbg_scheme_gadget sg = { 0 };
+	struct usbg_ops_buf b = { 0 };
+	int ret;
+
+	if (!in || !name || !out)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_scheme_parse_gadget(in, format, &sg);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	usbg_ops_put(&b, header, sizeof(header));
+	usbg_ops_put_op(&b, USBG_OPS_GADGET, NULL, name);
+
+	ret = usbg_ops_compile(&sg, name, udc, &b);
+	usbg_scheme_free_gadget(&sg);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	usbg_ops_put_op(&b, USBG_OPS_END, NULL, NULL);
+	ret = b.error;
+	if (ret == USBG_SUCCESS &&
+	    fwrite(b.data, 1, b.len, out) != b.len)
+		ret = USBG_ERROR_IO;
+
+out:
+	free(b.data);
+	return ret;
+}
+
+/*
+ * Replay
+ */
+
+struct usbg_ops_entry {
+	enum usbg_ops_op op;
+	const char *path;
+	const char *value;
+};
+
+struct usbg_ops_list {
+	uint8_t *data;
+	const char *name;
+	int nops;
+	struct usbg_ops_entry *ops;
+};
+
+static int usbg_ops_get_str(const uint8_t **p, const uint8_t *end,
+			    const char **str)
+{
+	size_t len;
+
+	if (end - *p < 2)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	len = (*p)[0] | ((*p)[1] << 8);
+	*p += 2;
+
+	if (!len) {
+		*str = NULL;
+		return USBG_SUCCESS;
+	}
+
+	if (end - *p < len || (*p)[len - 1] != '\0' ||
+	    memchr(*p, '\0', len) != *p + len - 1)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	*str = (const char *)*p;
+	*p += len;
+	return USBG_SUCCESS;
+}
+
+/* Path has to stay inside of configfs */
+static bool usbg_ops_path_valid(const char *path)
+{
+	const char *p;
+
+	if (!path || !*path || *path == '/')
+		return false;
+
+	for (p = path; p; p = strchr(p, '/')) {
+		if (*p == '/')
+			++p;
+		if (!strncmp(p, "..", 2) && (p[2] == '/' || !p[2]))
+			return false;
+	}
+
+	return true;
+}
+
+/* Whole list is checked before anything is executed */
+static int usbg_ops_decode(const uint8_t *data, size_t len,
+			   struct usbg_ops_list *l)
+{
+	const uint8_t *p = data, *end = data + len;
+	struct usbg_ops_entry *e;
+	int ret;
+
+	if (len < USBG_OPS_HEADER_LEN ||
+	    memcmp(p, USBG_OPS_MAGIC, USBG_OPS_MAGIC_LEN) ||
+	    p[USBG_OPS_MAGIC_LEN] != USBG_OPS_VERSION_MAJOR)
+		return USBG_ERROR_INVALID_FORMAT;
+
+	p += USBG_OPS_HEADER_LEN;
+	while (p != end) {
+		e = usbg_scheme_new(l->ops, l->nops);
+		if (!e)
+			return USBG_ERROR_NO_MEM;
+
+		e->op = *p++;
+		ret = usbg_ops_get_str(&p, end, &e->path);
+		if (ret == USBG_SUCCESS)
+			ret = usbg_ops_get_str(&p, end, &e->value);
+		if (ret != USBG_SUCCESS)
+			return ret;
+
+		switch (e->op) {
+		case USBG_OPS_END:
+			/* Name of gadget is mandatory */
+			--l->nops;
+			return l->name ? USBG_SUCCESS :
+				USBG_ERROR_INVALID_FORMAT;
+
+		case USBG_OPS_GADGET:
+			if (l->nops != 1 || !e->value)
+				return USBG_ERROR_INVALID_FORMAT;
+			l->name = e->value;
+			--l->nops;
+			break;
+
+		case USBG_OPS_WRITE:
+		case USBG_OPS_SYMLINK:
+			if (!e->value ||
+			    (e->op == USBG_OPS_SYMLINK &&
+			     !usbg_ops_path_valid(e->value)))
+				return USBG_ERROR_INVALID_FORMAT;
+			/* fall through */
+		case USBG_OPS_MKDIR:
+		case USBG_OPS_RMDIR:
+		case USBG_OPS_UNLINK:
+			if (!l->name || !usbg_ops_path_valid(e->path))
+				return USBG_ERROR_INVALID_FORMAT;
+			break;
+
+		default:
+			/* New operations require new major version */
+			return USBG_ERROR_INVALID_FORMAT;
+		}
+	}
+
+	/* Truncated list */
+	return USBG_ERROR_INVALID_FORMAT;
+}
+
+static int usbg_ops_read(FILE *stream, struct usbg_ops_list *l)
+{
+	uint8_t *new;
+	size_t len = 0, size = 0, n;
+
+	/* Whole list is read at once, strings are used in place */
+	do {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			new = realloc(l->data, size);
+			if (!new)
+				return USBG_ERROR_NO_MEM;
+			l->data = new;
+		}
+
+		n = fread(l->data + len, 1, size - len, stream);
+		len += n;
+	} while (n > 0);
+
+	if (ferror(stream))
+		return USBG_ERROR_IO;
+
+	return usbg_ops_decode(l->data, len, l);
+}
+
+/*
+ * Operations are executed relative to configfs directory when state
+ * uses default backend, otherwise they are dispatched to its backend.
+ * Return 0 or negative errno.
+ */
+struct usbg_ops_target {
+	usbg_state *s;
+	int dirfd;
+};
+
+static int usbg_ops_full_path(usbg_state *s, const char *path, char *buf,
+			      size_t len)
+{
+	int nmb;
+
+	nmb = snprintf(buf, len, "%s/%s", s->configfs_path, path);
+	return nmb < len ? 0 : -ENAMETOOLONG;
+}
+
+static int usbg_ops_write_fd(int dirfd, const char *path, const char *value)
+{
+	size_t len = strlen(value);
+	int fd;
+	int ret = 0;
+
+	fd = openat(dirfd, path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (write(fd, value, len) != len)
+		ret = errno ? -errno : -EIO;
+
+	close(fd);
+	return ret;
+}
+
+static int usbg_ops_exec(struct usbg_ops_target *t,
+			 const struct usbg_ops_entry *e)
+{
+	char path[USBG_MAX_PATH_LENGTH];
+	char target[USBG_MAX_PATH_LENGTH];
+	int ret;
+
+	/* Symlink target is always absolute */
+	if (e->op == USBG_OPS_SYMLINK) {
+		ret = usbg_ops_full_path(t->s, e->value, target,
+					 sizeof(target));
+		if (ret)
+			return ret;
+	}
+
+	if (t->dirfd >= 0) {
+		switch (e->op) {
+		case USBG_OPS_MKDIR:
+			ret = mkdirat(t->dirfd, e->path,
+				      S_IRWXU | S_IRWXG | S_IRWXO);
+			break;
+		case USBG_OPS_RMDIR:
+			ret = unlinkat(t->dirfd, e->path, AT_REMOVEDIR);
+			break;
+		case USBG_OPS_WRITE:
+			return usbg_ops_write_fd(t->dirfd, e->path, e->value);
+		case USBG_OPS_SYMLINK:
+			ret = symlinkat(target, t->dirfd, e->path);
+			break;
+		case USBG_OPS_UNLINK:
+			ret = unlinkat(t->dirfd, e->path, 0);
+			break;
+		default:
+			return 0;
+		}
+
+		return ret ? -errno : 0;
+	}
+
+	ret = usbg_ops_full_path(t->s, e->path, path, sizeof(path));
+	if (ret)
+		return ret;
+
+	switch (e->op) {
+	case USBG_OPS_MKDIR:
+		return usbg_io_mkdir(t->s, path, S_IRWXU | S_IRWXG | S_IRWXO);
+	case USBG_OPS_RMDIR:
+		return usbg_io_rmdir(t->s, path);
+	case USBG_OPS_WRITE:
+		return usbg_io_write_attr(t->s, path, e->value);
+	case USBG_OPS_SYMLINK:
+		return usbg_io_symlink(t->s, target, path);
+	case USBG_OPS_UNLINK:
+		return usbg_io_unlink(t->s, path);
+	default:
+		return 0;
+	}
+}
+
+/* Created directories and symlinks are removed in reverse order */
+static void usbg_ops_undo(struct usbg_ops_target *t,
+			  const struct usbg_ops_list *l, int executed)
+{
+	struct usbg_ops_entry undo;
+
+	while (executed--) {
+		undo = l->ops[executed];
+		if (undo.op == USBG_OPS_MKDIR)
+			undo.op = USBG_OPS_RMDIR;
+		else if (undo.op == USBG_OPS_SYMLINK)
+			undo.op = USBG_OPS_UNLINK;
+		else
+			continue;
+
+		/* We ignore returned value, there is no way to handle it */
+		usbg_ops_exec(t, &undo);
+	}
+}
+
+static int usbg_ops_replay(usbg_state *s, const struct usbg_ops_list *l)
+{
+	struct usbg_ops_target t = { .s = s, .dirfd = -1, };
+	int i;
+	int ret = USBG_SUCCESS;
+
+	if (s->io == usbg_get_default_io_backend()) {
+		t.dirfd = open(s->configfs_path,
+			       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (t.dirfd < 0)
+			return usbg_translate_error(errno);
+	}
+
+	for (i = 0; i < l->nops; ++i) {
+		ret = usbg_ops_exec(&t, l->ops + i);
+		if (ret) {
+			ERROR("replay of %s failed: %s\n", l->ops[i].path,
+			      strerror(-ret));
+			ret = usbg_translate_error(-ret);
+			usbg_ops_undo(&t, l, i);
+			break;
+		}
+	}
+
+	if (t.dirfd >= 0)
+		close(t.dirfd);
+
+	return ret;
+}
+
+int usbg_replay_gadget(usbg_state *s, FILE *stream, usbg_gadget **g)
+{
+	struct usbg_ops_list l = { 0 };
+	usbg_process_lock *plock;
+	usbg_gadget *newg;
+	usbg_stats_site site;
+	int ret;
+
+	if (!s || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	ret = usbg_ops_read(stream, &l);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	USBG_PROBE1(import_gadget_start, l.name);
+	ret = usbg_lock_exclusive(s);
+	if (ret != USBG_SUCCESS)
+		goto out_probe;
+
+	ret = usbg_process_lock_auto(s, l.name, &plock);
+	if (ret != USBG_SUCCESS) {
+		usbg_unlock(s);
+		goto out_probe;
+	}
+
+	site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+	if (s->read_only)
+		ret = usbg_translate_error(EROFS);
+	else if (usbg_get_gadget(s, l.name))
+		ret = USBG_ERROR_EXIST;
+	else
+		ret = usbg_ops_replay(s, &l);
+
+	/* Library has to know about the new gadget */
+	if (ret == USBG_SUCCESS)
+		ret = usbg_parse_new_gadget(s, l.name, &newg);
+	usbg_stats_leave(s, site);
+
+	usbg_process_unlock(plock);
+	usbg_unlock(s);
+
+	if (ret == USBG_SUCCESS && g)
+		*g = newg;
+out_probe:
+	USBG_PROBE2(import_gadget_done, l.name, ret);
+out:
+	free(l.ops);
+	free(l.data);
+	return ret;
+}
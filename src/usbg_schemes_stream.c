@@ -0,0 +1,894 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
+
+/**
+ * @file usbg_schemes_stream.c
+ * @brief Streaming exporter of gadget schemes
+ * @details Text is written to the stream while walking the gadget, no
+ * intermediate tree is built. Output is the same as produced by
+ * config_write() of libconfig with default options and tab width
+ * USBG_TAB_WIDTH, so the tree based exporter may be used as a reference.
+ *
+ * Depth of setting follows libconfig: members of root group have depth 1,
+ * setting of depth d is indented by (d - 1) * USBG_TAB_WIDTH spaces.
+ */
+
+struct usbg_stream_writer {
+	struct usbg_scheme_out *out;
+};
+
+static void usbg_stream_puts(struct usbg_stream_writer *w, const char *s)
+{
+	usbg_scheme_out_write(w->out, s, strlen(s));
+}
+
+static void usbg_stream_putc(struct usbg_stream_writer *w, char c)
+{
+	usbg_scheme_out_putc(w->out, c);
+}
+
+static void usbg_stream_indent(struct usbg_stream_writer *w, int depth)
+{
+	if (depth > 1)
+		usbg_scheme_out_printf(w->out, "%*s",
+				       (depth - 1) * USBG_TAB_WIDTH, " ");
+}
+
+static void usbg_stream_name(struct usbg_stream_writer *w, int depth,
+			     const char *name, bool group)
+{
+	usbg_stream_indent(w, depth);
+	usbg_stream_puts(w, name);
+	usbg_stream_puts(w, group ? " : " : " = ");
+}
+
+static void usbg_stream_end(struct usbg_stream_writer *w)
+{
+	usbg_stream_puts(w, ";\n");
+}
+
+static void usbg_stream_int(struct usbg_stream_writer *w, int depth,
+			    const char *name, int value, bool hex)
+{
+	usbg_stream_name(w, depth, name, false);
+	usbg_scheme_out_printf(w->out, hex ? "0x%X" : "%d", value);
+	usbg_stream_end(w);
+}
+
+static void usbg_stream_bool(struct usbg_stream_writer *w, int depth,
+			     const char *name, bool value)
+{
+	usbg_stream_name(w, depth, name, false);
+	usbg_stream_puts(w, value ? "true" : "false");
+	usbg_stream_end(w);
+}
+
+static void usbg_stream_string(struct usbg_stream_writer *w, int depth,
+			       const char *name, const char *value)
+{
+	char esc[5];
+	const char *p;
+	int c;
+
+	usbg_stream_name(w, depth, name, false);
+	usbg_stream_putc(w, '"');
+	for (p = value; p && *p; ++p) {
+		c = *p & 0xFF;
+		switch (c) {
+		case '"':
+		case '\\':
+			usbg_stream_putc(w, '\\');
+			usbg_stream_putc(w, c);
+			break;
+		case '\n':
+			usbg_stream_puts(w, "\\n");
+			break;
+		case '\r':
+			usbg_stream_puts(w, "\\r");
+			break;
+		case '\f':
+			usbg_stream_puts(w, "\\f");
+			break;
+		case '\t':
+			usbg_stream_puts(w, "\\t");
+			break;
+		default:
+			if (c >= ' ') {
+				usbg_stream_putc(w, c);
+			} else {
+				snprintf(esc, sizeof(esc), "\\x%02X", c);
+				usbg_stream_puts(w, esc);
+			}
+		}
+	}
+	usbg_stream_putc(w, '"');
+	usbg_stream_end(w);
+}
+
+/*
+ * Group is opened either as named setting or as element of list.
+ * Only the named one is terminated by semicolon.
+ */
+static void usbg_stream_group_open(struct usbg_stream_writer *w, int depth,
+				   const char *name)
+{
+	if (name)
+		usbg_stream_name(w, depth, name, true);
+	usbg_stream_putc(w, '\n');
+	usbg_stream_indent(w, depth);
+	usbg_stream_puts(w, "{\n");
+}
+
+static void usbg_stream_group_close(struct usbg_stream_writer *w, int depth,
+				    bool named)
+{
+	usbg_stream_indent(w, depth);
+	usbg_stream_putc(w, '}');
+	if (named)
+		usbg_stream_end(w);
+}
+
+static void usbg_stream_list_open(struct usbg_stream_writer *w, int depth,
+				  const char *name)
+{
+	usbg_stream_name(w, depth, name, false);
+	usbg_stream_puts(w, "( ");
+}
+
+/* Called before each element of list, n is number of elements so far */
+static void usbg_stream_list_next(struct usbg_stream_writer *w, int n)
+{
+	if (n)
+		usbg_stream_puts(w, ", ");
+}
+
+static void usbg_stream_list_close(struct usbg_stream_writer *w, int n)
+{
+	usbg_stream_puts(w, n ? " )" : ")");
+	usbg_stream_end(w);
+}
+
+static int usbg_stream_binding(struct usbg_stream_writer *w, int depth,
+			       usbg_binding *b)
+{
+	char label[USBG_MAX_NAME_LENGTH];
+	int nmb;
+
+	nmb = generate_function_label(b->target, label, sizeof(label));
+	if (nmb >= sizeof(label))
+		return USBG_ERROR_OTHER_ERROR;
+
+	usbg_stream_string(w, depth, USBG_NAME_TAG, b->name);
+	usbg_stream_string(w, depth, USBG_FUNCTION_TAG, label);
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_stream_config_bindings(struct usbg_stream_writer *w,
+				       int depth, usbg_config *c)
+{
+	usbg_binding *b;
+	int n = 0;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_list_open(w, depth, USBG_FUNCTIONS_TAG);
+	TAILQ_FOREACH(b, &c->bindings, bnode) {
+		usbg_stream_list_next(w, n++);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		ret = usbg_stream_binding(w, depth + 2, b);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, n);
+
+out:
+	return ret;
+}
+
+/*
+ * Languages are taken from directory listing, so the callback is
+ * responsible only for strings in given language.
+ */
+typedef int (*usbg_stream_lang_f)(struct usbg_stream_writer *w, int depth,
+				  void *obj, int lang);
+
+static int usbg_stream_strings(struct usbg_stream_writer *w, int depth,
+			       usbg_state *s, const char *path,
+			       usbg_stream_lang_f stream_lang, void *obj)
+{
+	struct dirent **dent;
+	int lang;
+	int nmb, i;
+	int ret = USBG_SUCCESS;
+
+	nmb = usbg_io_list_dir(s, path, &dent, file_select, alphasort);
+	if (nmb < 0)
+		return usbg_translate_error(-nmb);
+
+	usbg_stream_list_open(w, depth, USBG_STRINGS_TAG);
+	for (i = 0; i < nmb; ++i) {
+		if (sscanf(dent[i]->d_name, "%x", &lang) != 1) {
+			ret = USBG_ERROR_OTHER_ERROR;
+			break;
+		}
+
+		usbg_stream_list_next(w, i);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		usbg_stream_int(w, depth + 2, USBG_LANG_TAG, lang, true);
+		ret = stream_lang(w, depth + 2, obj, lang);
+		if (ret != USBG_SUCCESS)
+			break;
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+
+	if (ret == USBG_SUCCESS)
+		usbg_stream_list_close(w, nmb);
+
+	for (i = 0; i < nmb; ++i)
+		free(dent[i]);
+	free(dent);
+
+	return ret;
+}
+
+static int usbg_stream_config_strs_lang(struct usbg_stream_writer *w,
+					int depth, void *obj, int lang)
+{
+	usbg_config_strs strs;
+	int ret;
+
+	ret = usbg_get_config_strs(obj, lang, &strs);
+	if (ret == USBG_SUCCESS)
+		usbg_stream_string(w, depth, "configuration",
+				   strs.configuration);
+
+	return ret;
+}
+
+static int usbg_stream_config_attrs(struct usbg_stream_writer *w, int depth,
+				    usbg_config *c)
+{
+	usbg_config_attrs attrs;
+	int ret;
+
+	ret = usbg_get_config_attrs(c, &attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	usbg_stream_group_open(w, depth, USBG_ATTRS_TAG);
+	usbg_stream_int(w, depth + 1, "bmAttributes", attrs.bmAttributes,
+			true);
+	usbg_stream_int(w, depth + 1, "bMaxPower", attrs.bMaxPower, true);
+	usbg_stream_group_close(w, depth, true);
+
+	return USBG_SUCCESS;
+}
+
+/* Same as usbg_export_config_prep(), id is not a part of config itself */
+static int usbg_stream_config_prep(struct usbg_stream_writer *w, int depth,
+				   usbg_config *c)
+{
+	char spath[USBG_MAX_PATH_LENGTH];
+	int nmb;
+	int ret;
+
+	usbg_stream_string(w, depth, USBG_NAME_TAG, c->label);
+
+	ret = usbg_stream_config_attrs(w, depth, c);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", c->path,
+		       c->name, STRINGS_DIR);
+	if (nmb >= sizeof(spath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_stream_strings(w, depth, c->parent->parent, spath,
+				  usbg_stream_config_strs_lang, c);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_stream_config_bindings(w, depth, c);
+out:
+	return ret;
+}
+
+static int usbg_stream_gadget_configs(struct usbg_stream_writer *w,
+				      int depth, usbg_gadget *g)
+{
+	usbg_config *c;
+	int n = 0;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_list_open(w, depth, USBG_CONFIGS_TAG);
+	TAILQ_FOREACH(c, &g->configs, cnode) {
+		usbg_stream_list_next(w, n++);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		usbg_stream_int(w, depth + 2, USBG_ID_TAG, c->id, false);
+		ret = usbg_stream_config_prep(w, depth + 2, c);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, n);
+
+out:
+	return ret;
+}
+
+static void usbg_stream_f_net_attrs(struct usbg_stream_writer *w, int depth,
+				    usbg_f_net_attrs *attrs)
+{
+	char addr_buf[USBG_MAX_STR_LENGTH];
+
+	usbg_stream_string(w, depth, "dev_addr",
+			   usbg_ether_ntoa_r(&attrs->dev_addr, addr_buf));
+	usbg_stream_string(w, depth, "host_addr",
+			   usbg_ether_ntoa_r(&attrs->host_addr, addr_buf));
+	usbg_stream_int(w, depth, "qmult", attrs->qmult, false);
+	/* if name is read only so we don't export it */
+}
+
+static void usbg_stream_f_ms_attrs(struct usbg_stream_writer *w, int depth,
+				   const usbg_f_ms_attrs *attrs)
+{
+	const usbg_f_ms_lun_attrs *lattrs;
+	int i;
+
+	usbg_stream_bool(w, depth, "stall", attrs->stall);
+
+	usbg_stream_list_open(w, depth, "luns");
+	for (i = 0; i < attrs->nluns; ++i) {
+		lattrs = attrs->luns[i];
+
+		usbg_stream_list_next(w, i);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		usbg_stream_bool(w, depth + 2, "cdrom", lattrs->cdrom);
+		usbg_stream_bool(w, depth + 2, "ro", lattrs->ro);
+		usbg_stream_bool(w, depth + 2, "nofua", lattrs->nofua);
+		usbg_stream_bool(w, depth + 2, "removable", lattrs->removable);
+		usbg_stream_string(w, depth + 2, "filename", lattrs->filename);
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, attrs->nluns);
+}
+
+static int usbg_stream_f_midi_attrs(struct usbg_stream_writer *w, int depth,
+				    const usbg_f_midi_attrs *attrs)
+{
+#define STREAM_F_MIDI_INT_ATTR(attr, minval)				\
+	do {								\
+		if ((int)attrs->attr < minval)				\
+			return USBG_ERROR_INVALID_VALUE;		\
+		usbg_stream_int(w, depth, #attr, attrs->attr, false);	\
+	} while (0)
+
+	STREAM_F_MIDI_INT_ATTR(index, INT_MIN);
+	usbg_stream_string(w, depth, "id", attrs->id);
+	STREAM_F_MIDI_INT_ATTR(in_ports, 0);
+	STREAM_F_MIDI_INT_ATTR(out_ports, 0);
+	STREAM_F_MIDI_INT_ATTR(buflen, 0);
+	STREAM_F_MIDI_INT_ATTR(qlen, 0);
+
+#undef STREAM_F_MIDI_INT_ATTR
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_stream_function_attrs(struct usbg_stream_writer *w,
+				      int depth, usbg_function *f)
+{
+	usbg_function_attrs f_attrs;
+	int ret = USBG_SUCCESS;
+
+	ret = usbg_get_function_attrs(f, &f_attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	usbg_stream_group_open(w, depth, USBG_ATTRS_TAG);
+
+	switch (f_attrs.header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		usbg_stream_int(w, depth + 1, "port_num",
+				f_attrs.attrs.serial.port_num, false);
+		break;
+
+	case USBG_F_ATTRS_NET:
+		usbg_stream_f_net_attrs(w, depth + 1, &f_attrs.attrs.net);
+		break;
+
+	case USBG_F_ATTRS_MS:
+		usbg_stream_f_ms_attrs(w, depth + 1, &f_attrs.attrs.ms);
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		ret = usbg_stream_f_midi_attrs(w, depth + 1,
+					       &f_attrs.attrs.midi);
+		break;
+
+	case USBG_F_ATTRS_PHONET:
+		/* Don't export ifname because it is read only */
+	case USBG_F_ATTRS_FFS:
+		/* We don't need to export ffs attributes
+		 * due to instance name export */
+		break;
+	default:
+		ERROR("Unsupported function type\n");
+		ret = USBG_ERROR_NOT_SUPPORTED;
+	}
+
+	if (ret == USBG_SUCCESS)
+		usbg_stream_group_close(w, depth, true);
+
+	usbg_cleanup_function_attrs(&f_attrs);
+	return ret;
+}
+
+/* Same as usbg_export_function_prep(), instance is a property of gadget */
+static int usbg_stream_function_prep(struct usbg_stream_writer *w, int depth,
+				     usbg_function *f)
+{
+	usbg_stream_string(w, depth, USBG_TYPE_TAG,
+			   usbg_get_function_type_str(f->type));
+
+	return usbg_stream_function_attrs(w, depth, f);
+}
+
+static int usbg_stream_gadget_functions(struct usbg_stream_writer *w,
+					int depth, usbg_gadget *g)
+{
+	usbg_function *f;
+	char label[USBG_MAX_NAME_LENGTH];
+	char *func_label;
+	int nmb;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_group_open(w, depth, USBG_FUNCTIONS_TAG);
+	TAILQ_FOREACH(f, &g->functions, fnode) {
+		if (f->label) {
+			func_label = f->label;
+		} else {
+			nmb = generate_function_label(f, label, sizeof(label));
+			if (nmb >= sizeof(label)) {
+				ret = USBG_ERROR_OTHER_ERROR;
+				goto out;
+			}
+			func_label = label;
+		}
+
+		usbg_stream_group_open(w, depth + 1, func_label);
+		/* Add instance name to identify in this gadget */
+		usbg_stream_string(w, depth + 2, USBG_INSTANCE_TAG,
+				   f->instance);
+		ret = usbg_stream_function_prep(w, depth + 2, f);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(w, depth + 1, true);
+	}
+	usbg_stream_group_close(w, depth, true);
+
+out:
+	return ret;
+}
+
+static int usbg_stream_gadget_strs_lang(struct usbg_stream_writer *w,
+					int depth, void *obj, int lang)
+{
+	usbg_gadget_strs strs;
+	int ret;
+
+	ret = usbg_get_gadget_strs(obj, lang, &strs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+	usbg_stream_string(w, depth, "manufacturer", strs.str_mnf);
+	usbg_stream_string(w, depth, "product", strs.str_prd);
+	usbg_stream_string(w, depth, "serialnumber", strs.str_ser);
+
+	return USBG_SUCCESS;
+}
+
+static int usbg_stream_gadget_attrs(struct usbg_stream_writer *w, int depth,
+				    usbg_gadget *g)
+{
+	usbg_gadget_attrs attrs;
+	int ret;
+
+	/* All attributes are read at once before anything is written */
+	ret = usbg_get_gadget_attrs(g, &attrs);
+	if (ret != USBG_SUCCESS)
+		return ret;
+
+#define STREAM_GADGET_ATTR(attr_name)					\
+	usbg_stream_int(w, depth + 1, #attr_name, attrs.attr_name, true)
+
+	usbg_stream_group_open(w, depth, USBG_ATTRS_TAG);
+	STREAM_GADGET_ATTR(bcdUSB);
+	STREAM_GADGET_ATTR(bDeviceClass);
+	STREAM_GADGET_ATTR(bDeviceSubClass);
+	STREAM_GADGET_ATTR(bDeviceProtocol);
+	STREAM_GADGET_ATTR(bMaxPacketSize0);
+	STREAM_GADGET_ATTR(idVendor);
+	STREAM_GADGET_ATTR(idProduct);
+	STREAM_GADGET_ATTR(bcdDevice);
+	usbg_stream_group_close(w, depth, true);
+
+#undef STREAM_GADGET_ATTR
+
+	return USBG_SUCCESS;
+}
+
+/* Name of gadget is not exported, it should be given during import */
+static int usbg_stream_gadget_prep(struct usbg_stream_writer *w, int depth,
+				   usbg_gadget *g)
+{
+	char spath[USBG_MAX_PATH_LENGTH];
+	int nmb;
+	int ret;
+
+	ret = usbg_stream_gadget_attrs(w, depth, g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	nmb = snprintf(spath, sizeof(spath), "%s/%s/%s", g->path,
+		       g->name, STRINGS_DIR);
+	if (nmb >= sizeof(spath)) {
+		ret = USBG_ERROR_PATH_TOO_LONG;
+		goto out;
+	}
+
+	ret = usbg_stream_strings(w, depth, g->parent, spath,
+				  usbg_stream_gadget_strs_lang, g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_stream_gadget_functions(w, depth, g);
+	if (ret != USBG_SUCCESS)
+		goto out;
+
+	ret = usbg_stream_gadget_configs(w, depth, g);
+out:
+	return ret;
+}
+
+static int usbg_stream_finish(struct usbg_stream_writer *w, int ret)
+{
+	if (ret == USBG_SUCCESS)
+		ret = w->out->error;
+
+	return ret;
+}
+
+/*
+ * Writing of scheme model. Output is the same as the one of export
+ * functions above, optional values missing in model are just omitted.
+ */
+
+static int usbg_stream_scheme_function_attrs(struct usbg_stream_writer *w,
+					     int depth,
+					     const struct usbg_scheme_function *sf)
+{
+	const usbg_f_attrs *attrs = &sf->attrs.attrs;
+	char addr_buf[USBG_MAX_STR_LENGTH];
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_group_open(w, depth, USBG_ATTRS_TAG);
+
+	switch (sf->attrs.header.attrs_type) {
+	case USBG_F_ATTRS_SERIAL:
+		if (sf->mask & USBG_SCHEME_F_PORT_NUM)
+			usbg_stream_int(w, depth + 1, "port_num",
+					attrs->serial.port_num, false);
+		break;
+
+	case USBG_F_ATTRS_NET:
+		if (sf->mask & USBG_SCHEME_F_DEV_ADDR)
+			usbg_stream_string(w, depth + 1, "dev_addr",
+					   usbg_ether_ntoa_r(&attrs->net.dev_addr,
+							     addr_buf));
+		if (sf->mask & USBG_SCHEME_F_HOST_ADDR)
+			usbg_stream_string(w, depth + 1, "host_addr",
+					   usbg_ether_ntoa_r(&attrs->net.host_addr,
+							     addr_buf));
+		if (sf->mask & USBG_SCHEME_F_QMULT)
+			usbg_stream_int(w, depth + 1, "qmult",
+					attrs->net.qmult, false);
+		break;
+
+	case USBG_F_ATTRS_MS:
+		usbg_stream_f_ms_attrs(w, depth + 1, &attrs->ms);
+		break;
+
+	case USBG_F_ATTRS_MIDI:
+		ret = usbg_stream_f_midi_attrs(w, depth + 1, &attrs->midi);
+		break;
+
+	case USBG_F_ATTRS_PHONET:
+	case USBG_F_ATTRS_FFS:
+		break;
+	default:
+		ret = USBG_ERROR_NOT_SUPPORTED;
+	}
+
+	if (ret == USBG_SUCCESS)
+		usbg_stream_group_close(w, depth, true);
+
+	return ret;
+}
+
+static int usbg_stream_scheme_function(struct usbg_stream_writer *w,
+				       int depth,
+				       const struct usbg_scheme_function *sf)
+{
+	usbg_stream_string(w, depth, USBG_INSTANCE_TAG, sf->instance);
+	usbg_stream_string(w, depth, USBG_TYPE_TAG,
+			   usbg_get_function_type_str(sf->type));
+
+	if (!(sf->mask & USBG_SCHEME_F_ATTRS))
+		return USBG_SUCCESS;
+
+	return usbg_stream_scheme_function_attrs(w, depth, sf);
+}
+
+static int usbg_stream_scheme_config(struct usbg_stream_writer *w, int depth,
+				     const struct usbg_scheme_config *sc)
+{
+	const struct usbg_scheme_binding *sb;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_int(w, depth, USBG_ID_TAG, sc->id, false);
+	usbg_stream_string(w, depth, USBG_NAME_TAG, sc->label);
+
+	usbg_stream_group_open(w, depth, USBG_ATTRS_TAG);
+	if (sc->attrs_mask & USBG_SCHEME_C_BM_ATTRIBUTES)
+		usbg_stream_int(w, depth + 1, "bmAttributes",
+				sc->bmAttributes, true);
+	if (sc->attrs_mask & USBG_SCHEME_C_B_MAX_POWER)
+		usbg_stream_int(w, depth + 1, "bMaxPower", sc->bMaxPower,
+				true);
+	usbg_stream_group_close(w, depth, true);
+
+	usbg_stream_list_open(w, depth, USBG_STRINGS_TAG);
+	for (i = 0; i < sc->nstrs; ++i) {
+		usbg_stream_list_next(w, i);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		usbg_stream_int(w, depth + 2, USBG_LANG_TAG, sc->strs[i].lang,
+				true);
+		usbg_stream_string(w, depth + 2, "configuration",
+				   sc->strs[i].strs.configuration);
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, sc->nstrs);
+
+	usbg_stream_list_open(w, depth, USBG_FUNCTIONS_TAG);
+	for (i = 0; i < sc->nbindings; ++i) {
+		sb = sc->bindings + i;
+
+		usbg_stream_list_next(w, i);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		if (sb->name)
+			usbg_stream_string(w, depth + 2, USBG_NAME_TAG,
+					   sb->name);
+
+		if (sb->function) {
+			usbg_stream_group_open(w, depth + 2, USBG_FUNCTION_TAG);
+			ret = usbg_stream_scheme_function(w, depth + 3,
+							  sb->function);
+			if (ret != USBG_SUCCESS)
+				goto out;
+			usbg_stream_group_close(w, depth + 2, true);
+		} else {
+			usbg_stream_string(w, depth + 2, USBG_FUNCTION_TAG,
+					   sb->label);
+		}
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, sc->nbindings);
+
+out:
+	return ret;
+}
+
+static int usbg_stream_scheme_gadget(struct usbg_stream_writer *w, int depth,
+				     const struct usbg_scheme_gadget *sg)
+{
+	const usbg_gadget_strs *strs;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_group_open(w, depth, USBG_ATTRS_TAG);
+	for (i = USBG_GADGET_ATTR_MIN; i < USBG_GADGET_ATTR_MAX; ++i) {
+		if (sg->attrs_mask & (1 << i))
+			usbg_stream_int(w, depth + 1,
+					usbg_get_gadget_attr_str(i),
+					sg->attrs[i], true);
+	}
+	usbg_stream_group_close(w, depth, true);
+
+	usbg_stream_list_open(w, depth, USBG_STRINGS_TAG);
+	for (i = 0; i < sg->nstrs; ++i) {
+		strs = &sg->strs[i].strs;
+
+		usbg_stream_list_next(w, i);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		usbg_stream_int(w, depth + 2, USBG_LANG_TAG, sg->strs[i].lang,
+				true);
+		usbg_stream_string(w, depth + 2, "manufacturer", strs->str_mnf);
+		usbg_stream_string(w, depth + 2, "product", strs->str_prd);
+		usbg_stream_string(w, depth + 2, "serialnumber", strs->str_ser);
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, sg->nstrs);
+
+	usbg_stream_group_open(w, depth, USBG_FUNCTIONS_TAG);
+	for (i = 0; i < sg->nfunctions; ++i) {
+		usbg_stream_group_open(w, depth + 1, sg->functions[i].label);
+		ret = usbg_stream_scheme_function(w, depth + 2,
+						  sg->functions + i);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(w, depth + 1, true);
+	}
+	usbg_stream_group_close(w, depth, true);
+
+	usbg_stream_list_open(w, depth, USBG_CONFIGS_TAG);
+	for (i = 0; i < sg->nconfigs; ++i) {
+		usbg_stream_list_next(w, i);
+		usbg_stream_group_open(w, depth + 1, NULL);
+		ret = usbg_stream_scheme_config(w, depth + 2, sg->configs + i);
+		if (ret != USBG_SUCCESS)
+			goto out;
+		usbg_stream_group_close(w, depth + 1, false);
+	}
+	usbg_stream_list_close(w, sg->nconfigs);
+
+out:
+	return ret;
+}
+
+int usbg_scheme_write_gadget_libconfig(const struct usbg_scheme_gadget *sg,
+				       FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+	struct usbg_stream_writer w = { .out = &out, };
+	int ret;
+
+	ret = usbg_stream_scheme_gadget(&w, 1, sg);
+	return usbg_stream_finish(&w, ret);
+}
+
+int usbg_scheme_write_state_libconfig(const struct usbg_scheme_state *ss,
+				      FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+	struct usbg_stream_writer w = { .out = &out, };
+	const struct usbg_scheme_state_gadget *sg;
+	int i;
+	int ret = USBG_SUCCESS;
+
+	usbg_stream_list_open(&w, 1, USBG_GADGETS_TAG);
+	for (i = 0; i < ss->ngadgets && ret == USBG_SUCCESS; ++i) {
+		sg = ss->gadgets + i;
+
+		usbg_stream_list_next(&w, i);
+		usbg_stream_group_open(&w, 2, NULL);
+		usbg_stream_string(&w, 3, USBG_NAME_TAG, sg->name);
+		if (sg->udc)
+			usbg_stream_string(&w, 3, USBG_UDC_TAG, sg->udc);
+		ret = usbg_stream_scheme_gadget(&w, 3, &sg->gadget);
+		usbg_stream_group_close(&w, 2, false);
+	}
+	usbg_stream_list_close(&w, ss->ngadgets);
+
+	return usbg_stream_finish(&w, ret);
+}
+
+/* Export gadget/function/config API implementation */
+
+int usbg_scheme_export_function_libconfig(usbg_function *f,
+					  struct usbg_scheme_out *out)
+{
+	struct usbg_stream_writer w = { .out = out, };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_function_start, f->name);
+	usbg_lock_shared(f->parent->parent);
+	site = usbg_stats_enter(f->parent->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_stream_function_prep(&w, 1, f);
+	usbg_stats_leave(f->parent->parent, site);
+	usbg_unlock(f->parent->parent);
+
+	ret = usbg_stream_finish(&w, ret);
+	USBG_PROBE2(export_function_done, f->name, ret);
+	return ret;
+}
+
+int usbg_scheme_export_config_libconfig(usbg_config *c,
+					struct usbg_scheme_out *out)
+{
+	struct usbg_stream_writer w = { .out = out, };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_config_start, c->name);
+	usbg_lock_shared(c->parent->parent);
+	site = usbg_stats_enter(c->parent->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_stream_config_prep(&w, 1, c);
+	usbg_stats_leave(c->parent->parent, site);
+	usbg_unlock(c->parent->parent);
+
+	ret = usbg_stream_finish(&w, ret);
+	USBG_PROBE2(export_config_done, c->name, ret);
+	return ret;
+}
+
+int usbg_scheme_export_gadget_libconfig(usbg_gadget *g,
+					struct usbg_scheme_out *out)
+{
+	struct usbg_stream_writer w = { .out = out, };
+	usbg_stats_site site;
+	int ret;
+
+	USBG_PROBE1(export_gadget_start, g->name);
+	usbg_lock_shared(g->parent);
+	site = usbg_stats_enter(g->parent, USBG_STATS_SITE_EXPORT);
+	ret = usbg_stream_gadget_prep(&w, 1, g);
+	usbg_stats_leave(g->parent, site);
+	usbg_unlock(g->parent);
+
+	ret = usbg_stream_finish(&w, ret);
+	USBG_PROBE2(export_gadget_done, g->name, ret);
+	return ret;
+}
+
+int usbg_export_function_streaming(usbg_function *f, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!f || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_function_libconfig(f, &out);
+}
+
+int usbg_export_config_streaming(usbg_config *c, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!c || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_config_libconfig(c, &out);
+}
+
+int usbg_export_gadget_streaming(usbg_gadget *g, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!g || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_gadget_libconfig(g, &out);
+}
@@ -0,0 +1,283 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <stdlib.h>
+
+#include <usbg/usbg.h>
+#include "usbg/usbg_schemes.h"
+#include "usbg/usbg_probes.h"
+
+/**
+ * @file usbg_schemes_text.c
+ * @brief Text gadget schemes without libconfig
+ * @details Used in place of libconfig backend when library is built
+ * without libconfig. Schemes are read by built-in parser shared with
+ * JSON schemes and written by streaming exporter, so nothing but the
+ * current string value is allocated besides the scheme model.
+ */
+
+/*
+ * As in libconfig backend, error which is not in the document itself
+ * has no text and line 0.
+ */
+static void usbg_set_failed_import(usbg_failed_import **to_set, int ret,
+				   int line)
+{
+	usbg_free_failed_import(*to_set);
+	*to_set = NULL;
+
+	if (ret == USBG_SUCCESS)
+		return;
+
+	*to_set = calloc(1, sizeof(**to_set));
+	if (*to_set && line) {
+		(*to_set)->text = usbg_strerror(ret);
+		(*to_set)->line = line;
+	}
+}
+
+int usbg_scheme_parse_gadget_text(FILE *stream, struct usbg_scheme_gadget *sg)
+{
+	return usbg_scheme_parse_text(stream, NULL, 0, USBG_SCHEME_DOC_GADGET,
+				      sg, NULL);
+}
+
+int usbg_scheme_parse_state_text(FILE *stream, struct usbg_scheme_state *ss)
+{
+	return usbg_scheme_parse_text(stream, NULL, 0, USBG_SCHEME_DOC_STATE,
+				      ss, NULL);
+}
+
+int usbg_scheme_parse_function_text_buf(const char *buf, size_t len,
+					struct usbg_scheme_function *sf)
+{
+	return usbg_scheme_parse_text(NULL, buf, len,
+				      USBG_SCHEME_DOC_FUNCTION, sf, NULL);
+}
+
+int usbg_scheme_parse_config_text_buf(const char *buf, size_t len,
+				      struct usbg_scheme_config *sc)
+{
+	return usbg_scheme_parse_text(NULL, buf, len, USBG_SCHEME_DOC_CONFIG,
+				      sc, NULL);
+}
+
+int usbg_scheme_parse_gadget_text_buf(const char *buf, size_t len,
+				      struct usbg_scheme_gadget *sg)
+{
+	return usbg_scheme_parse_text(NULL, buf, len, USBG_SCHEME_DOC_GADGET,
+				      sg, NULL);
+}
+
+/* Export gadget/function/config API implementation */
+
+int usbg_export_function(usbg_function *f, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!f || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_function_libconfig(f, &out);
+}
+
+int usbg_export_config(usbg_config *c, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!c || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_config_libconfig(c, &out);
+}
+
+int usbg_export_gadget(usbg_gadget *g, FILE *stream)
+{
+	struct usbg_scheme_out out = { .stream = stream, };
+
+	if (!g || !stream)
+		return USBG_ERROR_INVALID_PARAM;
+
+	return usbg_scheme_export_gadget_libconfig(g, &out);
+}
+
+/* Import gadget/function/config API implementation */
+
+int usbg_import_function(usbg_gadget *g, FILE *stream, const char *instance,
+			 usbg_function **f)
+{
+	struct usbg_scheme_function sf = { 0 };
+	usbg_function *newf;
+	usbg_stats_site site;
+	int line = 0;
+	int ret, err;
+
+	if (!g || !stream || !instance)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_function_start, instance);
+	ret = usbg_scheme_parse_text(stream, NULL, 0, USBG_SCHEME_DOC_FUNCTION,
+				     &sf, &line);
+
+	err = usbg_lock_exclusive(g->parent);
+	if (err != USBG_SUCCESS) {
+		if (ret == USBG_SUCCESS)
+			usbg_scheme_free_function(&sf);
+		ret = err;
+		goto out;
+	}
+
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_function(g, &sf, instance, &newf);
+		usbg_stats_leave(g->parent, site);
+		usbg_scheme_free_function(&sf);
+	}
+	usbg_set_failed_import(&g->last_failed_import, ret, line);
+	usbg_unlock(g->parent);
+
+	if (ret == USBG_SUCCESS && f)
+		*f = newf;
+
+out:
+	USBG_PROBE2(import_function_done, instance, ret);
+	return ret;
+}
+
+int usbg_import_config(usbg_gadget *g, FILE *stream, int id, usbg_config **c)
+{
+	struct usbg_scheme_config sc = { 0 };
+	usbg_config *newc;
+	usbg_stats_site site;
+	int line = 0;
+	int ret, err;
+
+	if (!g || !stream || id < 0)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_config_start, id);
+	ret = usbg_scheme_parse_text(stream, NULL, 0, USBG_SCHEME_DOC_CONFIG,
+				     &sc, &line);
+
+	err = usbg_lock_exclusive(g->parent);
+	if (err != USBG_SUCCESS) {
+		if (ret == USBG_SUCCESS)
+			usbg_scheme_free_config(&sc);
+		ret = err;
+		goto out;
+	}
+
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(g->parent, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_config(g, &sc, id, &newc);
+		usbg_stats_leave(g->parent, site);
+		usbg_scheme_free_config(&sc);
+	}
+	usbg_set_failed_import(&g->last_failed_import, ret, line);
+	usbg_unlock(g->parent);
+
+	if (ret == USBG_SUCCESS && c)
+		*c = newc;
+
+out:
+	USBG_PROBE2(import_config_done, id, ret);
+	return ret;
+}
+
+int usbg_import_gadget(usbg_state *s, FILE *stream, const char *name,
+		       usbg_gadget **g)
+{
+	struct usbg_scheme_gadget sg = { 0 };
+	usbg_gadget *newg;
+	usbg_stats_site site;
+	int line = 0;
+	int ret, err;
+
+	if (!s || !stream || !name)
+		return USBG_ERROR_INVALID_PARAM;
+
+	USBG_PROBE1(import_gadget_start, name);
+	ret = usbg_scheme_parse_text(stream, NULL, 0, USBG_SCHEME_DOC_GADGET,
+				     &sg, &line);
+
+	err = usbg_lock_exclusive(s);
+	if (err != USBG_SUCCESS) {
+		if (ret == USBG_SUCCESS)
+			usbg_scheme_free_gadget(&sg);
+		ret = err;
+		goto out;
+	}
+
+	if (ret == USBG_SUCCESS) {
+		site = usbg_stats_enter(s, USBG_STATS_SITE_IMPORT);
+		ret = usbg_scheme_create_gadget(s, &sg, name, &newg);
+		usbg_stats_leave(s, site);
+		usbg_scheme_free_gadget(&sg);
+	}
+	usbg_set_failed_import(&s->last_failed_import, ret, line);
+	usbg_unlock(s);
+
+	if (ret == USBG_SUCCESS && g)
+		*g = newg;
+
+out:
+	USBG_PROBE2(import_gadget_done, name, ret);
+	return ret;
+}
+
+const char *usbg_get_func_import_error_text(usbg_gadget *g)
+{
+	if (!g || !g->last_failed_import)
+		return NULL;
+
+	return g->last_failed_import->text;
+}
+
+int usbg_get_func_import_error_line(usbg_gadget *g)
+{
+	if (!g || !g->last_failed_import)
+		return -1;
+
+	return g->last_failed_import->line;
+}
+
+const char *usbg_get_config_import_error_text(usbg_gadget *g)
+{
+	if (!g || !g->last_failed_import)
+		return NULL;
+
+	return g->last_failed_import->text;
+}
+
+int usbg_get_config_import_error_line(usbg_gadget *g)
+{
+	if (!g || !g->last_failed_import)
+		return -1;
+
+	return g->last_failed_import->line;
+}
+
+const char *usbg_get_gadget_import_error_text(usbg_state *s)
+{
+	if (!s || !s->last_failed_import)
+		return NULL;
+
+	return s->last_failed_import->text;
+}
+
+int usbg_get_gadget_import_error_line(usbg_state *s)
+{
+	if (!s || !s->last_failed_import)
+		return -1;
+
+	return s->last_failed_import->line;
+}
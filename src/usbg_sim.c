@@ -0,0 +1,1273 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include "usbg/usbg_internal.h"
+
+/**
+ * @file usbg_sim.c
+ * @brief In-memory I/O backend which emulates usb_gadget configfs
+ * @details Only the semantics on which libusbg depends are emulated:
+ * default attributes created by mkdir, default groups which cannot be
+ * removed, symlink based bindings, UDC attribute and UDC class in sysfs.
+ */
+
+enum sim_node_type {
+	SIM_DIR,
+	SIM_ATTR,
+	SIM_LINK,
+};
+
+enum sim_dir_kind {
+	SIM_PLAIN,
+	SIM_GADGETS,
+	SIM_GADGET,
+	SIM_FUNCTIONS,
+	SIM_FUNCTION,
+	SIM_LUN,
+	SIM_CONFIGS,
+	SIM_CONFIG,
+	SIM_STRINGS,
+	SIM_LANG,
+	SIM_UDC,
+};
+
+/* Directory is a default group and cannot be removed */
+#define SIM_DEFAULT	(1 << 0)
+/* Attribute cannot be written */
+#define SIM_RO		(1 << 1)
+/* Attribute cannot be read */
+#define SIM_WO		(1 << 2)
+/* Attribute accepts only numbers */
+#define SIM_NUM		(1 << 3)
+
+/* FSG_MAX_LUNS of kernel mass storage function */
+#define SIM_MAX_LUNS	16
+
+struct sim_node {
+	char *name;
+	enum sim_node_type type;
+	enum sim_dir_kind kind;
+	int flags;
+
+	/* SIM_ATTR */
+	char *value;
+	/* SIM_LINK */
+	char *target_path;
+	struct sim_node *target;
+	/* number of links which point to this node */
+	int nlinks;
+	/* gadget <-> udc binding */
+	struct sim_node *peer;
+	/* function type for SIM_FUNCTION */
+	int ftype;
+
+	struct sim_node *parent;
+	TAILQ_HEAD(sim_nhead, sim_node) children;
+	TAILQ_ENTRY(sim_node) snode;
+};
+
+struct usbg_sim
+{
+	/* Serializes backend operations of thread safe states */
+	pthread_mutex_t lock;
+	struct sim_node *root;
+	struct sim_node *udc_class;
+	int next_port;
+	int next_net;
+	int next_ino;
+};
+
+struct sim_attr_default {
+	const char *name;
+	const char *value;
+	int flags;
+};
+
+static const struct sim_attr_default sim_gadget_attrs[] = {
+	{ "bDeviceClass", "0x00\n", SIM_NUM },
+	{ "bDeviceSubClass", "0x00\n", SIM_NUM },
+	{ "bDeviceProtocol", "0x00\n", SIM_NUM },
+	{ "bMaxPacketSize0", "0x40\n", SIM_NUM },
+	{ "idVendor", "0x0000\n", SIM_NUM },
+	{ "idProduct", "0x0000\n", SIM_NUM },
+	{ "bcdDevice", "0x0000\n", SIM_NUM },
+	{ "bcdUSB", "0x0200\n", SIM_NUM },
+	{ "UDC", "\n", 0 },
+	{ NULL, },
+};
+
+static const struct sim_attr_default sim_gadget_strs[] = {
+	{ "manufacturer", "\n", 0 },
+	{ "product", "\n", 0 },
+	{ "serialnumber", "\n", 0 },
+	{ NULL, },
+};
+
+static const struct sim_attr_default sim_config_attrs[] = {
+	{ "MaxPower", "2\n", SIM_NUM },
+	{ "bmAttributes", "0x80\n", SIM_NUM },
+	{ NULL, },
+};
+
+static const struct sim_attr_default sim_config_strs[] = {
+	{ "configuration", "\n", 0 },
+	{ NULL, },
+};
+
+static const struct sim_attr_default sim_ms_attrs[] = {
+	{ "stall", "1\n", SIM_NUM },
+	{ NULL, },
+};
+
+static const struct sim_attr_default sim_lun_attrs[] = {
+	{ "cdrom", "0\n", SIM_NUM },
+	{ "ro", "0\n", SIM_NUM },
+	{ "nofua", "0\n", SIM_NUM },
+	{ "removable", "1\n", SIM_NUM },
+	{ "file", "\n", 0 },
+	{ "forced_eject", "", SIM_WO },
+	{ NULL, },
+};
+
+static const struct sim_attr_default sim_midi_attrs[] = {
+	{ "index", "-1\n", SIM_NUM },
+	{ "id", "\n", 0 },
+	{ "in_ports", "1\n", SIM_NUM },
+	{ "out_ports", "1\n", SIM_NUM },
+	{ "buflen", "512\n", SIM_NUM },
+	{ "qlen", "32\n", SIM_NUM },
+	{ NULL, },
+};
+
+/*
+ * Links and peers are detached only when part of the tree is removed,
+ * their nodes may be already released when the whole tree is.
+ */
+static void sim_node_free(struct sim_node *n, bool detach)
+{
+	struct sim_node *child;
+
+	while (!TAILQ_EMPTY(&n->children)) {
+		child = TAILQ_FIRST(&n->children);
+		TAILQ_REMOVE(&n->children, child, snode);
+		sim_node_free(child, detach);
+	}
+
+	if (detach && n->target)
+		n->target->nlinks--;
+	if (detach && n->peer)
+		n->peer->peer = NULL;
+
+	free(n->name);
+	free(n->value);
+	free(n->target_path);
+	free(n);
+}
+
+static struct sim_node *sim_node_add(struct sim_node *parent,
+				     const char *name, enum sim_node_type type)
+{
+	struct sim_node *n;
+
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return NULL;
+
+	n->name = strdup(name);
+	if (!n->name) {
+		free(n);
+		return NULL;
+	}
+
+	n->type = type;
+	TAILQ_INIT(&n->children);
+	n->parent = parent ? parent : n;
+	if (parent)
+		TAILQ_INSERT_TAIL(&parent->children, n, snode);
+
+	return n;
+}
+
+static void sim_node_del(struct sim_node *n)
+{
+	TAILQ_REMOVE(&n->parent->children, n, snode);
+	sim_node_free(n, true);
+}
+
+static struct sim_node *sim_child(struct sim_node *dir, const char *name)
+{
+	struct sim_node *n;
+
+	TAILQ_FOREACH(n, &dir->children, snode)
+		if (!strcmp(n->name, name))
+			return n;
+
+	return NULL;
+}
+
+static struct sim_node *sim_add_dir(struct sim_node *parent, const char *name,
+				    enum sim_dir_kind kind, int flags)
+{
+	struct sim_node *n;
+
+	n = sim_node_add(parent, name, SIM_DIR);
+	if (n) {
+		n->kind = kind;
+		n->flags = flags;
+	}
+
+	return n;
+}
+
+static struct sim_node *sim_add_attr(struct sim_node *parent, const char *name,
+				     const char *value, int flags)
+{
+	struct sim_node *n;
+
+	n = sim_node_add(parent, name, SIM_ATTR);
+	if (!n)
+		return NULL;
+
+	n->flags = flags;
+	n->value = strdup(value);
+	if (!n->value) {
+		sim_node_del(n);
+		return NULL;
+	}
+
+	return n;
+}
+
+static int sim_add_attrs(struct sim_node *parent,
+			 const struct sim_attr_default *attrs)
+{
+	for (; attrs->name; ++attrs)
+		if (!sim_add_attr(parent, attrs->name, attrs->value,
+				  attrs->flags))
+			return -ENOMEM;
+
+	return 0;
+}
+
+static int sim_set_value(struct sim_node *attr, const char *value)
+{
+	size_t len = strlen(value);
+	char *v;
+
+	/* configfs always shows values terminated with new line */
+	v = malloc(len + 2);
+	if (!v)
+		return -ENOMEM;
+
+	strcpy(v, value);
+	if (len == 0 || v[len - 1] != '\n')
+		strcpy(v + len, "\n");
+
+	free(attr->value);
+	attr->value = v;
+	return 0;
+}
+
+/*
+ * Walk the tree. Links are followed in all components but the last one
+ * which is followed only if follow is set. Relative paths are resolved
+ * from root as simulator has no working directory.
+ */
+static int sim_walk(struct usbg_sim *sim, const char *path, bool follow,
+		    struct sim_node **node)
+{
+	char buf[PATH_MAX];
+	char *tok, *save;
+	struct sim_node *n = sim->root;
+	struct sim_node *next;
+
+	if (strlen(path) >= sizeof(buf))
+		return -ENAMETOOLONG;
+
+	strcpy(buf, path);
+	for (tok = strtok_r(buf, "/", &save); tok;
+	     tok = strtok_r(NULL, "/", &save)) {
+		if (n->type != SIM_DIR)
+			return -ENOTDIR;
+
+		if (!strcmp(tok, "."))
+			continue;
+
+		if (!strcmp(tok, "..")) {
+			n = n->parent;
+			continue;
+		}
+
+		next = sim_child(n, tok);
+		if (!next)
+			return -ENOENT;
+
+		if (next->type == SIM_LINK && (follow || save[0] != '\0'))
+			next = next->target;
+
+		n = next;
+	}
+
+	*node = n;
+	return 0;
+}
+
+/* Find directory in which last component of path should be placed */
+static int sim_walk_parent(struct usbg_sim *sim, const char *path,
+			   struct sim_node **parent, char *name, size_t len)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	size_t n;
+	int ret;
+
+	n = strlen(path);
+	while (n > 1 && path[n - 1] == '/')
+		--n;
+
+	if (n >= sizeof(dir))
+		return -ENAMETOOLONG;
+
+	memcpy(dir, path, n);
+	dir[n] = '\0';
+
+	slash = strrchr(dir, '/');
+	if (slash)
+		*slash++ = '\0';
+	else
+		slash = dir;
+
+	if (*slash == '\0' || !strcmp(slash, ".") || !strcmp(slash, ".."))
+		return -EINVAL;
+
+	if (strlen(slash) >= len)
+		return -ENAMETOOLONG;
+
+	strcpy(name, slash);
+	ret = sim_walk(sim, slash == dir ? "" : dir, true, parent);
+	if (ret)
+		return ret;
+
+	return (*parent)->type == SIM_DIR ? 0 : -ENOTDIR;
+}
+
+static struct sim_node *sim_gadget_of(struct sim_node *n)
+{
+	while (n->kind != SIM_GADGET && n != n->parent)
+		n = n->parent;
+
+	return n->kind == SIM_GADGET ? n : NULL;
+}
+
+static void sim_set_udc_state(struct sim_node *udc, int state)
+{
+	struct sim_node *attr = sim_child(udc, "state");
+
+	if (attr)
+		sim_set_value(attr, usbg_get_udc_state_str(state));
+}
+
+static void sim_unbind(struct sim_node *gadget)
+{
+	struct sim_node *udc = gadget->peer;
+
+	if (!udc)
+		return;
+
+	sim_set_udc_state(udc, USBG_UDC_STATE_NOT_ATTACHED);
+	udc->peer = NULL;
+	gadget->peer = NULL;
+}
+
+/* Composite device is created only if each config has some function */
+static bool sim_gadget_complete(struct sim_node *gadget)
+{
+	struct sim_node *configs, *c, *n;
+	bool any = false;
+
+	configs = sim_child(gadget, CONFIGS_DIR);
+	TAILQ_FOREACH(c, &configs->children, snode) {
+		bool has_func = false;
+
+		TAILQ_FOREACH(n, &c->children, snode)
+			if (n->type == SIM_LINK)
+				has_func = true;
+
+		if (!has_func)
+			return false;
+		any = true;
+	}
+
+	return any;
+}
+
+static int sim_write_udc(struct usbg_sim *sim, struct sim_node *gadget,
+			 struct sim_node *attr, const char *buf)
+{
+	char name[USBG_MAX_NAME_LENGTH];
+	struct sim_node *udc;
+
+	snprintf(name, sizeof(name), "%s", buf);
+	name[strcspn(name, "\n")] = '\0';
+
+	if (name[0] == '\0') {
+		sim_unbind(gadget);
+		return sim_set_value(attr, "");
+	}
+
+	if (gadget->peer)
+		return -EBUSY;
+
+	udc = sim_child(sim->udc_class, name);
+	if (!udc)
+		return -ENODEV;
+
+	if (udc->peer)
+		return -EBUSY;
+
+	if (!sim_gadget_complete(gadget))
+		return -EINVAL;
+
+	gadget->peer = udc;
+	udc->peer = gadget;
+	/* Host is always there and enumerates device immediately */
+	sim_set_udc_state(udc, USBG_UDC_STATE_CONFIGURED);
+
+	return sim_set_value(attr, name);
+}
+
+static bool sim_valid_num(const char *buf)
+{
+	char *end;
+
+	errno = 0;
+	strtol(buf, &end, 0);
+	if (errno || end == buf)
+		return false;
+
+	return *end == '\0' || !strcmp(end, "\n");
+}
+
+static int sim_mkdir_gadget(struct sim_node *d)
+{
+	struct sim_node *n;
+	int ret;
+
+	ret = sim_add_attrs(d, sim_gadget_attrs);
+	if (ret)
+		return ret;
+
+	n = sim_add_dir(d, FUNCTIONS_DIR, SIM_FUNCTIONS, SIM_DEFAULT);
+	if (!n)
+		return -ENOMEM;
+
+	n = sim_add_dir(d, CONFIGS_DIR, SIM_CONFIGS, SIM_DEFAULT);
+	if (!n)
+		return -ENOMEM;
+
+	n = sim_add_dir(d, STRINGS_DIR, SIM_STRINGS, SIM_DEFAULT);
+	if (!n)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int sim_mkdir_lun(struct sim_node *d)
+{
+	return sim_add_attrs(d, sim_lun_attrs);
+}
+
+static int sim_mkdir_function(struct usbg_sim *sim, struct sim_node *d)
+{
+	char buf[USBG_MAX_STR_LENGTH];
+	struct sim_node *lun;
+	int ret = 0;
+
+	switch (d->ftype) {
+	case F_SERIAL:
+	case F_ACM:
+	case F_OBEX:
+		sprintf(buf, "%d\n", sim->next_port++);
+		if (!sim_add_attr(d, "port_num", buf, SIM_RO))
+			ret = -ENOMEM;
+		break;
+
+	case F_ECM:
+	case F_SUBSET:
+	case F_NCM:
+	case F_EEM:
+	case F_RNDIS:
+		sprintf(buf, "02:00:00:00:%02x:%02x\n",
+			(sim->next_net >> 8) & 0xff, sim->next_net & 0xff);
+		if (!sim_add_attr(d, "dev_addr", buf, 0))
+			return -ENOMEM;
+
+		buf[1] = '6';
+		if (!sim_add_attr(d, "host_addr", buf, 0))
+			return -ENOMEM;
+
+		sprintf(buf, "usb%d\n", sim->next_net++);
+		if (!sim_add_attr(d, "ifname", buf, SIM_RO) ||
+		    !sim_add_attr(d, "qmult", "5\n", SIM_NUM))
+			ret = -ENOMEM;
+		break;
+
+	case F_PHONET:
+		sprintf(buf, "upnlink%d\n", sim->next_net++);
+		if (!sim_add_attr(d, "ifname", buf, SIM_RO))
+			ret = -ENOMEM;
+		break;
+
+	case F_MASS_STORAGE:
+		ret = sim_add_attrs(d, sim_ms_attrs);
+		if (ret)
+			break;
+
+		lun = sim_add_dir(d, "lun.0", SIM_LUN, SIM_DEFAULT);
+		ret = lun ? sim_mkdir_lun(lun) : -ENOMEM;
+		break;
+
+	case F_MIDI:
+		ret = sim_add_attrs(d, sim_midi_attrs);
+		break;
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+static int sim_mkdir_config(struct sim_node *d)
+{
+	int ret;
+
+	ret = sim_add_attrs(d, sim_config_attrs);
+	if (ret)
+		return ret;
+
+	if (!sim_add_dir(d, STRINGS_DIR, SIM_STRINGS, SIM_DEFAULT))
+		return -ENOMEM;
+
+	return 0;
+}
+
+static int sim_parse_id(const char *s, int base, int min, int max)
+{
+	char *end;
+	long id;
+
+	if (!*s || isspace(*s))
+		return -EINVAL;
+
+	errno = 0;
+	id = strtol(s, &end, base);
+	if (errno || *end != '\0' || id < min || id > max)
+		return -EINVAL;
+
+	return id;
+}
+
+/*
+ * Each configfs group decides by itself what can be created in it,
+ * so check the name and choose what the new directory will be.
+ */
+static int sim_mkdir_kind(struct sim_node *parent, const char *name,
+			  enum sim_dir_kind *kind, int *ftype)
+{
+	char *dot;
+	char type[USBG_MAX_NAME_LENGTH];
+	int ret;
+
+	switch (parent->kind) {
+	case SIM_GADGETS:
+		*kind = SIM_GADGET;
+		return 0;
+
+	case SIM_FUNCTIONS:
+		dot = strchr(name, '.');
+		if (!dot || dot == name || dot[1] == '\0' ||
+		    dot - name >= sizeof(type))
+			return -EINVAL;
+
+		memcpy(type, name, dot - name);
+		type[dot - name] = '\0';
+		ret = usbg_lookup_function_type(type);
+		if (ret < 0)
+			return -ENOENT;
+
+		*kind = SIM_FUNCTION;
+		*ftype = ret;
+		return 0;
+
+	case SIM_FUNCTION:
+		if (parent->ftype != F_MASS_STORAGE)
+			break;
+
+		if (strncmp(name, "lun.", 4) ||
+		    sim_parse_id(name + 4, 10, 0, SIM_MAX_LUNS - 1) < 0)
+			return -EINVAL;
+
+		*kind = SIM_LUN;
+		return 0;
+
+	case SIM_CONFIGS:
+		dot = strrchr(name, '.');
+		if (!dot || dot == name || sim_parse_id(dot + 1, 10, 1, 255) < 0)
+			return -EINVAL;
+
+		*kind = SIM_CONFIG;
+		return 0;
+
+	case SIM_STRINGS:
+		if (sim_parse_id(name, 16, 0, 0xffff) < 0)
+			return -EINVAL;
+
+		*kind = SIM_LANG;
+		return 0;
+
+	default:
+		break;
+	}
+
+	return -EPERM;
+}
+
+/* Some user created item still lives below this node */
+static bool sim_has_user_items(struct sim_node *d)
+{
+	struct sim_node *n;
+
+	TAILQ_FOREACH(n, &d->children, snode) {
+		if (n->type == SIM_LINK)
+			return true;
+		if (n->type != SIM_DIR)
+			continue;
+		if (!(n->flags & SIM_DEFAULT) || sim_has_user_items(n))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Backend operations
+ */
+
+static int sim_do_read_attr(void *ctx, const char *path, char *buf,
+			    size_t len)
+{
+	struct sim_node *n;
+	size_t nl;
+	int ret;
+
+	ret = sim_walk(ctx, path, true, &n);
+	if (ret)
+		return ret;
+
+	if (n->type == SIM_DIR)
+		return -EISDIR;
+
+	if (n->flags & SIM_WO)
+		return -EACCES;
+
+	/* Behave like fgets() */
+	nl = strcspn(n->value, "\n");
+	if (n->value[nl] == '\n')
+		nl++;
+	if (nl > len - 1)
+		nl = len - 1;
+
+	memcpy(buf, n->value, nl);
+	buf[nl] = '\0';
+
+	return 0;
+}
+
+static int sim_do_write_attr(void *ctx, const char *path, const char *buf)
+{
+	struct usbg_sim *sim = ctx;
+	struct sim_node *n;
+	int ret;
+
+	ret = sim_walk(sim, path, true, &n);
+	if (ret)
+		return ret;
+
+	if (n->type == SIM_DIR)
+		return -EISDIR;
+
+	if (n->flags & SIM_RO)
+		return -EACCES;
+
+	if ((n->flags & SIM_NUM) && !sim_valid_num(buf))
+		return -EINVAL;
+
+	if (n->parent->kind == SIM_GADGET && !strcmp(n->name, "UDC"))
+		return sim_write_udc(sim, n->parent, n, buf);
+
+	if (n->parent->kind == SIM_LUN && !strcmp(n->name, "forced_eject")) {
+		struct sim_node *file = sim_child(n->parent, "file");
+
+		return file ? sim_set_value(file, "") : 0;
+	}
+
+	return sim_set_value(n, buf);
+}
+
+static int sim_do_mkdir(void *ctx, const char *path, mode_t mode)
+{
+	struct usbg_sim *sim = ctx;
+	struct sim_node *parent, *d;
+	char name[USBG_MAX_NAME_LENGTH];
+	enum sim_dir_kind kind = SIM_PLAIN;
+	int ftype = -1;
+	int ret;
+
+	ret = sim_walk_parent(sim, path, &parent, name, sizeof(name));
+	if (ret)
+		return ret;
+
+	if (sim_child(parent, name))
+		return -EEXIST;
+
+	ret = sim_mkdir_kind(parent, name, &kind, &ftype);
+	if (ret)
+		return ret;
+
+	d = sim_add_dir(parent, name, kind, 0);
+	if (!d)
+		return -ENOMEM;
+	d->ftype = ftype;
+
+	switch (kind) {
+	case SIM_GADGET:
+		ret = sim_mkdir_gadget(d);
+		break;
+	case SIM_FUNCTION:
+		ret = sim_mkdir_function(sim, d);
+		break;
+	case SIM_LUN:
+		ret = sim_mkdir_lun(d);
+		break;
+	case SIM_CONFIG:
+		ret = sim_mkdir_config(d);
+		break;
+	case SIM_LANG:
+		ret = sim_add_attrs(d, parent->parent->kind == SIM_GADGET ?
+				    sim_gadget_strs : sim_config_strs);
+		break;
+	default:
+		break;
+	}
+
+	if (ret)
+		sim_node_del(d);
+
+	return ret;
+}
+
+static int sim_do_rmdir(void *ctx, const char *path)
+{
+	struct sim_node *n;
+	int ret;
+
+	ret = sim_walk(ctx, path, false, &n);
+	if (ret)
+		return ret;
+
+	if (n->type != SIM_DIR)
+		return -ENOTDIR;
+
+	if (n->flags & SIM_DEFAULT || n->kind == SIM_PLAIN ||
+	    n->kind == SIM_UDC)
+		return -EPERM;
+
+	if (sim_has_user_items(n))
+		return -ENOTEMPTY;
+
+	if (n->nlinks)
+		return -EBUSY;
+
+	if (n->kind == SIM_GADGET)
+		sim_unbind(n);
+
+	sim_node_del(n);
+	return 0;
+}
+
+static int sim_do_unlink(void *ctx, const char *path)
+{
+	struct sim_node *n;
+	int ret;
+
+	ret = sim_walk(ctx, path, false, &n);
+	if (ret)
+		return ret;
+
+	if (n->type == SIM_DIR)
+		return -EISDIR;
+
+	/* Attributes are owned by kernel */
+	if (n->type != SIM_LINK)
+		return -EPERM;
+
+	sim_node_del(n);
+	return 0;
+}
+
+static int sim_do_symlink(void *ctx, const char *target, const char *path)
+{
+	struct usbg_sim *sim = ctx;
+	struct sim_node *parent, *t, *l;
+	char name[USBG_MAX_NAME_LENGTH];
+	int ret;
+
+	ret = sim_walk_parent(sim, path, &parent, name, sizeof(name));
+	if (ret)
+		return ret;
+
+	if (sim_child(parent, name))
+		return -EEXIST;
+
+	if (parent->kind != SIM_CONFIG)
+		return -EPERM;
+
+	ret = sim_walk(sim, target, true, &t);
+	if (ret)
+		return ret;
+
+	if (t->kind != SIM_FUNCTION ||
+	    sim_gadget_of(t) != sim_gadget_of(parent))
+		return -EINVAL;
+
+	/* The same function cannot be added twice to one config */
+	TAILQ_FOREACH(l, &parent->children, snode)
+		if (l->type == SIM_LINK && l->target == t)
+			return -EEXIST;
+
+	l = sim_node_add(parent, name, SIM_LINK);
+	if (!l)
+		return -ENOMEM;
+
+	l->target_path = strdup(target);
+	if (!l->target_path) {
+		sim_node_del(l);
+		return -ENOMEM;
+	}
+
+	l->target = t;
+	t->nlinks++;
+	return 0;
+}
+
+static ssize_t sim_do_readlink(void *ctx, const char *path, char *buf,
+			       size_t len)
+{
+	struct sim_node *n;
+	size_t tlen;
+	int ret;
+
+	ret = sim_walk(ctx, path, false, &n);
+	if (ret)
+		return ret;
+
+	if (n->type != SIM_LINK)
+		return -EINVAL;
+
+	tlen = strlen(n->target_path);
+	if (tlen > len)
+		tlen = len;
+
+	memcpy(buf, n->target_path, tlen);
+	return tlen;
+}
+
+static struct dirent *sim_dirent(struct usbg_sim *sim, const char *name,
+				 enum sim_node_type type)
+{
+	struct dirent *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+
+	d->d_ino = ++sim->next_ino;
+	d->d_type = type == SIM_DIR ? DT_DIR :
+		type == SIM_LINK ? DT_LNK : DT_REG;
+	snprintf(d->d_name, sizeof(d->d_name), "%s", name);
+
+	return d;
+}
+
+static int sim_do_list_dir(void *ctx, const char *path,
+			   struct dirent ***namelist, usbg_dir_filter filter,
+			   usbg_dir_compar compar)
+{
+	struct usbg_sim *sim = ctx;
+	struct sim_node *dir, *n;
+	struct dirent **list;
+	struct dirent *d;
+	int i, count = 2;
+	int ret;
+
+	ret = sim_walk(sim, path, true, &dir);
+	if (ret)
+		return ret;
+
+	if (dir->type != SIM_DIR)
+		return -ENOTDIR;
+
+	TAILQ_FOREACH(n, &dir->children, snode)
+		count++;
+
+	list = calloc(count, sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	count = 0;
+	n = NULL;
+	/* ".", ".." and then all children */
+	for (i = 0; ; ++i) {
+		if (i == 0) {
+			d = sim_dirent(sim, ".", SIM_DIR);
+		} else if (i == 1) {
+			d = sim_dirent(sim, "..", SIM_DIR);
+		} else {
+			n = n ? TAILQ_NEXT(n, snode) :
+				TAILQ_FIRST(&dir->children);
+			if (!n)
+				break;
+			d = sim_dirent(sim, n->name, n->type);
+		}
+
+		if (!d) {
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		if (filter && !filter(d)) {
+			free(d);
+			continue;
+		}
+
+		list[count++] = d;
+	}
+
+	if (compar)
+		qsort(list, count, sizeof(*list),
+		      (int (*)(const void *, const void *))compar);
+
+	*namelist = list;
+	return count;
+
+err:
+	while (count--)
+		free(list[count]);
+	free(list);
+	return ret;
+}
+
+static int sim_do_check_dir(void *ctx, const char *path)
+{
+	struct sim_node *n;
+	int ret;
+
+	ret = sim_walk(ctx, path, true, &n);
+	if (ret)
+		return ret;
+
+	return n->type == SIM_DIR ? 0 : -ENOTDIR;
+}
+
+/*
+ * Thread safe states issue lookups concurrently, so each operation
+ * on the tree is done with simulator lock held.
+ */
+
+static int sim_read_attr(void *ctx, const char *path, char *buf, size_t len)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_read_attr(ctx, path, buf, len);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_write_attr(void *ctx, const char *path, const char *buf)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_write_attr(ctx, path, buf);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_mkdir(void *ctx, const char *path, mode_t mode)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_mkdir(ctx, path, mode);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_rmdir(void *ctx, const char *path)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_rmdir(ctx, path);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_unlink(void *ctx, const char *path)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_unlink(ctx, path);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_symlink(void *ctx, const char *target, const char *path)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_symlink(ctx, target, path);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static ssize_t sim_readlink(void *ctx, const char *path, char *buf,
+			    size_t len)
+{
+	struct usbg_sim *sim = ctx;
+	ssize_t ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_readlink(ctx, path, buf, len);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_list_dir(void *ctx, const char *path,
+			struct dirent ***namelist, usbg_dir_filter filter,
+			usbg_dir_compar compar)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_list_dir(ctx, path, namelist, filter, compar);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static int sim_check_dir(void *ctx, const char *path)
+{
+	struct usbg_sim *sim = ctx;
+	int ret;
+
+	pthread_mutex_lock(&sim->lock);
+	ret = sim_do_check_dir(ctx, path);
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+static const usbg_io_backend usbg_sim_io = {
+	.read_attr = sim_read_attr,
+	.write_attr = sim_write_attr,
+	.mkdir = sim_mkdir,
+	.rmdir = sim_rmdir,
+	.unlink = sim_unlink,
+	.symlink = sim_symlink,
+	.readlink = sim_readlink,
+	.list_dir = sim_list_dir,
+	.check_dir = sim_check_dir,
+	/* no descriptor to poll, library re-reads attributes after sleep */
+	.open_attr = NULL,
+};
+
+/* Create all missing directories on path */
+static int sim_mkdir_p(struct usbg_sim *sim, const char *path,
+		       struct sim_node **dir)
+{
+	char buf[PATH_MAX];
+	char *tok, *save;
+	struct sim_node *n = sim->root;
+	struct sim_node *next;
+
+	if (strlen(path) >= sizeof(buf))
+		return -ENAMETOOLONG;
+
+	strcpy(buf, path);
+	for (tok = strtok_r(buf, "/", &save); tok;
+	     tok = strtok_r(NULL, "/", &save)) {
+		if (!strcmp(tok, "."))
+			continue;
+
+		next = sim_child(n, tok);
+		if (!next)
+			next = sim_add_dir(n, tok, SIM_PLAIN, 0);
+		if (!next)
+			return -ENOMEM;
+		if (next->type != SIM_DIR)
+			return -ENOTDIR;
+
+		n = next;
+	}
+
+	*dir = n;
+	return 0;
+}
+
+/*
+ * Simulator API
+ */
+
+int usbg_sim_create(const char *configfs_path, usbg_sim **sim)
+{
+	struct usbg_sim *s;
+	struct sim_node *cfs;
+	int ret;
+
+	if (!configfs_path || !sim)
+		return USBG_ERROR_INVALID_PARAM;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return USBG_ERROR_NO_MEM;
+
+	ret = pthread_mutex_init(&s->lock, NULL);
+	if (ret) {
+		free(s);
+		return usbg_translate_error(ret);
+	}
+
+	s->root = sim_node_add(NULL, "", SIM_DIR);
+	if (!s->root) {
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return USBG_ERROR_NO_MEM;
+	}
+
+	ret = sim_mkdir_p(s, configfs_path, &cfs);
+	if (ret)
+		goto err;
+
+	if (!sim_add_dir(cfs, GADGETS_DIR, SIM_GADGETS, SIM_DEFAULT)) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = sim_mkdir_p(s, SYSFS_DIR "/" UDC_CLASS_DIR, &s->udc_class);
+	if (ret)
+		goto err;
+
+	*sim = s;
+	return USBG_SUCCESS;
+
+err:
+	usbg_sim_destroy(s);
+	return usbg_translate_error(-ret);
+}
+
+void usbg_sim_destroy(usbg_sim *sim)
+{
+	if (!sim)
+		return;
+
+	sim_node_free(sim->root, false);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+void usbg_sim_get_init_opts(usbg_sim *sim, usbg_init_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->io = &usbg_sim_io;
+	opts->io_ctx = sim;
+}
+
+int usbg_sim_add_udc(usbg_sim *sim, const char *name)
+{
+	struct sim_node *udc;
+	int ret;
+
+	if (!sim || !name || !*name || strchr(name, '/'))
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&sim->lock);
+	if (sim_child(sim->udc_class, name)) {
+		ret = USBG_ERROR_EXIST;
+		goto out;
+	}
+
+	udc = sim_add_dir(sim->udc_class, name, SIM_UDC, SIM_DEFAULT);
+	if (!udc) {
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	if (!sim_add_attr(udc, "state", "not attached\n", SIM_RO)) {
+		sim_node_del(udc);
+		ret = USBG_ERROR_NO_MEM;
+		goto out;
+	}
+
+	ret = USBG_SUCCESS;
+out:
+	pthread_mutex_unlock(&sim->lock);
+	return ret;
+}
+
+int usbg_sim_set_udc_state(usbg_sim *sim, const char *name,
+			   usbg_udc_state state)
+{
+	struct sim_node *udc;
+
+	if (!sim || !name || state < USBG_UDC_STATE_MIN ||
+	    state >= USBG_UDC_STATE_MAX)
+		return USBG_ERROR_INVALID_PARAM;
+
+	pthread_mutex_lock(&sim->lock);
+	udc = sim_child(sim->udc_class, name);
+	if (udc)
+		sim_set_udc_state(udc, state);
+	pthread_mutex_unlock(&sim->lock);
+
+	return udc ? USBG_SUCCESS : USBG_ERROR_NOT_FOUND;
+}
@@ -9,6 +9,11 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <poll.h>
 
 #ifdef HAS_LIBCONFIG
 #include <libconfig.h>
@@ -159,6 +164,18 @@ static struct test_function same_type_funcs[] = {
 	TEST_FUNCTION_LIST_END
 };
 
+/**
+ * @brief Single mass storage function
+ */
+static struct test_function ms_funcs[] = {
+	{
+		.type = F_MASS_STORAGE,
+		.instance = "ms0"
+	},
+
+	TEST_FUNCTION_LIST_END
+};
+
 /**
  * @brief No functions at all
  * @details Check if gadget with no functions (or config with no bindings)
@@ -278,6 +295,16 @@ static struct test_state long_udc_state = {
 	.udcs = long_udcs
 };
 
+/**
+ * @brief Simple state with sysfs mounted in non-default place
+ */
+static struct test_state relocated_sysfs_state = {
+	.configfs_path = "config",
+	.sysfs_path = "/container/sys",
+	.gadgets = simple_gadgets,
+	.udcs = simple_udcs
+};
+
 static usbg_config_attrs *get_random_config_attrs()
 {
 	usbg_config_attrs *ret;
@@ -439,6 +466,14 @@ static void setup_same_type_funcs_state(void **state)
 	*state = put_func_in_state(same_type_funcs);
 }
 
+/**
+ * @brief Setup state with single mass storage function
+ */
+static void setup_ms_funcs_state(void **state)
+{
+	*state = put_func_in_state(ms_funcs);
+}
+
 /**
  * @brief Setup state with very long path name
  */
@@ -455,6 +490,14 @@ static void setup_long_udc_state(void **state)
 	*state = prepare_state(&long_udc_state);
 }
 
+/**
+ * @brief Setup simple state with relocated sysfs
+ */
+static void setup_relocated_sysfs_state(void **state)
+{
+	*state = prepare_state(&relocated_sysfs_state);
+}
+
 /**
  * @brief Setup state with gadget strings of random length
  * @param[out] state Pointer to pointer to test_gadget_strs_data structure
@@ -717,6 +760,72 @@ static void test_init(void **state)
 	assert_state_equal(s, st);
 }
 
+struct counting_io {
+	const usbg_io_backend *def;
+	int reads;
+	int lists;
+};
+
+static int counting_read_attr(void *ctx, const char *path,
+			      char *buf, size_t len)
+{
+	struct counting_io *c = ctx;
+
+	c->reads++;
+	return c->def->read_attr(NULL, path, buf, len);
+}
+
+static int counting_list_dir(void *ctx, const char *path,
+			     struct dirent ***namelist, usbg_dir_filter filter,
+			     usbg_dir_compar compar)
+{
+	struct counting_io *c = ctx;
+
+	c->lists++;
+	return c->def->list_dir(NULL, path, namelist, filter, compar);
+}
+
+/**
+ * @brief Tests init with user provided I/O backend
+ * @details Check if all configfs access goes through given backend
+ * and if state after init match given state
+ */
+static void test_init_with_io_backend(void **state)
+{
+	usbg_state *s = NULL;
+	struct test_state *st;
+	struct counting_io ctx = {
+		.def = usbg_get_default_io_backend(),
+	};
+	usbg_io_backend io = *ctx.def;
+	usbg_init_opts opts = {
+		.io = &io,
+		.io_ctx = &ctx,
+	};
+	int ret;
+
+	st = (struct test_state *)(*state);
+	*state = NULL;
+
+	/* Incomplete backend should be rejected before any access */
+	io.check_dir = NULL;
+	ret = usbg_init_with_opts(st->configfs_path, &opts, &s);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	io.check_dir = ctx.def->check_dir;
+	io.read_attr = counting_read_attr;
+	io.list_dir = counting_list_dir;
+
+	push_init(st);
+	ret = usbg_init_with_opts(st->configfs_path, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	*state = s;
+
+	assert_state_equal(s, st);
+	assert_true(ctx.reads > 0);
+	assert_true(ctx.lists > 0);
+}
+
 /**
  * @brief Test getting function by name
  * @param[in] state Pointer to pointer to correctly initialized test_state structure
@@ -1223,6 +1332,192 @@ static void test_set_specific_gadget_attr(void **state)
 	try_set_specific_gadget_attr(s, ts, get_random_gadget_attrs());
 }
 
+/**
+ * @brief Tests setting mass storage attributes after reading them
+ * @details Only changed attribute of existing lun and the new lun
+ * should be written, all other attributes are left untouched. Medium
+ * ejected by host should be inserted again.
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_set_function_ms_attrs_delta(void **state)
+{
+	struct test_state *ts;
+	struct test_function *tf;
+	usbg_state *s = NULL;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_function_attrs f_attrs;
+	usbg_f_ms_lun_attrs lun0 = {
+		.id = 0, .removable = true, .filename = "/a.img"
+	};
+	usbg_f_ms_lun_attrs lun1 = {
+		.id = 1, .removable = true, .filename = "/b.img"
+	};
+	usbg_f_ms_lun_attrs new_lun1 = lun1;
+	usbg_f_ms_lun_attrs new_lun2 = {
+		.id = 2, .cdrom = true, .ro = true, .removable = true,
+		.filename = "/c.iso"
+	};
+	usbg_f_ms_lun_attrs ejected_lun2 = {
+		.id = 2, .cdrom = true, .ro = true, .removable = true,
+		.filename = ""
+	};
+	usbg_f_ms_lun_attrs *old_luns[] = { &lun0, &lun1, NULL };
+	usbg_f_ms_lun_attrs *new_luns[] = { &lun0, &new_lun1, &new_lun2, NULL };
+	usbg_f_ms_lun_attrs *ejected_luns[] = {
+		&lun0, &new_lun1, &ejected_lun2, NULL
+	};
+	usbg_f_ms_attrs old_attrs = {
+		.stall = true, .nluns = 2, .luns = old_luns
+	};
+	usbg_function_attrs new_attrs = {
+		.header.attrs_type = USBG_F_ATTRS_MS,
+		.attrs.ms = { .stall = true, .nluns = 3, .luns = new_luns }
+	};
+	usbg_f_ms_attrs ejected_attrs = {
+		.stall = true, .nluns = 3, .luns = ejected_luns
+	};
+	int ret;
+
+	ts = (struct test_state *)(*state);
+	*state = NULL;
+
+	init_with_state(ts, &s);
+	*state = s;
+
+	tf = &ts->gadgets[0].functions[0];
+	g = usbg_get_first_gadget(s);
+	assert_non_null(g);
+	f = usbg_get_function(g, tf->type, tf->instance);
+	assert_non_null(f);
+
+	/* Getter must not be taken as knowledge of luns */
+	push_ms_attrs(tf, &old_attrs);
+	ret = usbg_get_function_attrs(f, &f_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_cleanup_function_attrs(&f_attrs);
+
+	new_lun1.filename = "/b2.img";
+	push_ms_lun_dirs(tf, old_attrs.nluns);
+	push_ms_current_attrs(tf, &old_attrs);
+	pull_function_attr(tf, "lun.1/file", "/b2.img");
+	pull_function_dir(tf, "lun.2");
+	pull_function_attr(tf, "lun.2/cdrom", "1\n");
+	pull_function_attr(tf, "lun.2/ro", "1\n");
+	pull_function_attr(tf, "lun.2/nofua", "0\n");
+	pull_function_attr(tf, "lun.2/removable", "1\n");
+	pull_function_attr(tf, "lun.2/file", "/c.iso");
+
+	ret = usbg_set_function_attrs(f, &new_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Nothing has changed so nothing should be written */
+	push_ms_current_attrs(tf, &new_attrs.attrs.ms);
+	ret = usbg_set_function_attrs(f, &new_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Kernel clears file when host ejects medium */
+	push_ms_current_attrs(tf, &ejected_attrs);
+	pull_function_attr(tf, "lun.2/file", "/c.iso");
+	ret = usbg_set_function_attrs(f, &new_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Empty write would not reach kernel, so new line ejects medium */
+	push_ms_current_attrs(tf, &new_attrs.attrs.ms);
+	pull_function_attr(tf, "lun.2/file", "\n");
+	new_attrs.attrs.ms = ejected_attrs;
+	ret = usbg_set_function_attrs(f, &new_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+}
+
+/**
+ * @brief Tests building index of mass storage luns
+ * @details Only lun directories should be indexed and sorted by id
+ **/
+static void test_lun_index_build(void **state)
+{
+	char *names[] = {
+		"lun.10", "stall", "lun.2", "lun.x", "lun.0", "lun.1", "lun.3a",
+		NULL
+	};
+	int selected[] = { 1, 0, 1, 0, 1, 1, 0 };
+	int ids[] = { 0, 1, 2, 10 };
+	struct usbg_lun_index idx;
+	char name[USBG_MAX_NAME_LENGTH];
+	usbg_state s = {
+		.io = usbg_get_default_io_backend(),
+	};
+	int i, ret;
+
+	push_dir_entries("config/usb_gadget/g1/functions/mass_storage.ms0",
+			 names, selected);
+	ret = usbg_lun_index_build(&s,
+		"config/usb_gadget/g1/functions/mass_storage.ms0", &idx);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(idx.nluns, ARRAY_SIZE(ids));
+
+	for (i = 0; i < idx.nluns; ++i) {
+		sprintf(name, "lun.%d", ids[i]);
+		assert_int_equal(idx.luns[i].id, ids[i]);
+		assert_string_equal(idx.luns[i].name, name);
+	}
+
+	usbg_lun_index_free(&idx);
+}
+
+/**
+ * @brief Tests swapping media of mass storage luns
+ * @details Only file attribute (and forced_eject if requested)
+ * should be written for each swap. Medium should be ejected by writing
+ * new line, as empty write doesn't reach kernel.
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_ms_lun_swap_media(void **state)
+{
+	struct test_state *ts;
+	struct test_function *tf;
+	usbg_state *s = NULL;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_ms_lun_swap swaps[] = {
+		{ .lun = 0, .path = "/a.img" },
+		{ .lun = 1, .path = NULL, .flags = USBG_MS_SWAP_FORCE_EJECT },
+	};
+	int ret;
+
+	ts = (struct test_state *)(*state);
+	*state = NULL;
+
+	init_with_state(ts, &s);
+	*state = s;
+
+	tf = &ts->gadgets[0].functions[0];
+	g = usbg_get_first_gadget(s);
+	assert_non_null(g);
+	f = usbg_get_function(g, tf->type, tf->instance);
+	assert_non_null(f);
+
+	pull_function_attr(tf, "lun.0/forced_eject", "1\n");
+	pull_function_attr(tf, "lun.0/file", "/b.img");
+	ret = usbg_ms_lun_swap_media(f, 0, "/b.img", USBG_MS_SWAP_FORCE_EJECT);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	pull_function_attr(tf, "lun.0/file", "/a.img");
+	pull_function_attr(tf, "lun.1/forced_eject", "1\n");
+	pull_function_attr(tf, "lun.1/file", "\n");
+	ret = usbg_ms_lun_swap_media_batch(f, swaps, ARRAY_SIZE(swaps));
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(swaps[0].ret, USBG_SUCCESS);
+	assert_int_equal(swaps[1].ret, USBG_SUCCESS);
+
+	pull_function_attr(tf, "lun.0/file", "\n");
+	ret = usbg_ms_lun_swap_media(f, 0, "", 0);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_ms_lun_swap_media(f, -1, "/b.img", 0);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+}
+
 /**
  * @brief Tests getting udc from state
  * @param[in] state Pointer to correctly initialized test_state structure
@@ -1256,6 +1551,78 @@ void test_get_udc(void **state)
 	}
 }
 
+/**
+ * @brief Tests getting state of each udc
+ * @details Every state known by library is reported once by each udc
+ * @param[in] state Pointer to correctly initialized test_state structure
+ **/
+static void test_get_udc_state(void **state)
+{
+	struct test_state *ts;
+	char **tu;
+	usbg_state *s = NULL;
+	usbg_udc *u = NULL;
+	int i, ret;
+
+	ts = (struct test_state *)(*state);
+	*state = NULL;
+
+	init_with_state(ts, &s);
+	*state = s;
+
+	for (tu = ts->udcs; *tu; tu++) {
+		u = usbg_get_udc(s, *tu);
+		assert_non_null(u);
+
+		for (i = USBG_UDC_STATE_MIN; i < USBG_UDC_STATE_MAX; ++i) {
+			push_udc_state(ts, *tu, usbg_get_udc_state_str(i));
+			ret = usbg_get_udc_state(u);
+			assert_int_equal(ret, i);
+		}
+
+		push_udc_state(ts, *tu, "unknown");
+		ret = usbg_get_udc_state(u);
+		assert_int_equal(ret, USBG_ERROR_NOT_FOUND);
+	}
+}
+
+/**
+ * @brief Tests bind latency histogram and its percentiles
+ **/
+static void test_bind_stats(void **state)
+{
+	usbg_bind_stats st;
+	usbg_bind_timings t;
+	int i;
+
+	usbg_bind_stats_reset(&st);
+
+	for (i = 1; i <= 100; ++i) {
+		memset(&t, 0, sizeof(t));
+		t.reached = (1 << USBG_BIND_PHASE_ENABLED) |
+			(1 << USBG_BIND_PHASE_ATTACHED);
+		t.ns[USBG_BIND_PHASE_ENABLED] = i;
+		t.ns[USBG_BIND_PHASE_ATTACHED] = i * 1000;
+		usbg_bind_stats_add(&st, &t);
+	}
+
+	assert_int_equal(st.cycles, 100);
+	assert_int_equal(st.incomplete, 100);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_CONFIGURED].count, 0);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_ENABLED].count, 100);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_ENABLED].min, 1);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_ENABLED].max, 100);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_ENABLED].sum, 5050);
+
+	/* 50th value is 50 which lays in bucket [32, 63] */
+	assert_int_equal(usbg_hist_percentile(
+			&st.phase[USBG_BIND_PHASE_ENABLED], 50), 63);
+	assert_int_equal(usbg_hist_percentile(
+			&st.phase[USBG_BIND_PHASE_ENABLED], 100), 100);
+	assert_int_equal(usbg_hist_percentile(
+			&st.phase[USBG_BIND_PHASE_CONFIGURED], 50), 0);
+}
+
 static void test_get_gadget_attr_str(void **state)
 {
 	struct {
@@ -1570,57 +1937,2391 @@ static void test_set_config_attrs(void **state)
  *
  * @brief cleanup usbg state
  */
-static void teardown_state(void **state)
-{
-	usbg_state *s = NULL;
+#define SIM_CONFIGFS "/sys/kernel/config"
+#define SIM_UDC "sim.udc.0"
 
-	s = (usbg_state *)(*state);
-	if (s != NULL)
-		usbg_cleanup(s);
+static void init_sim_state(usbg_sim *sim, usbg_state **s)
+{
+	usbg_init_opts opts;
+	int ret;
 
-	cleanup_stack();
+	usbg_sim_get_init_opts(sim, &opts);
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, s);
+	assert_int_equal(ret, USBG_SUCCESS);
 }
 
-/* Custom macro for defining test with given name and fixed teardown function */
-#define USBG_TEST_TS(name, test, setup) \
-	USBG_TEST(name, test, setup, teardown_state)
+/**
+ * @brief Tests creating gadget in simulator and parsing it back
+ * @details Gadget created using library should be found with the same
+ * attributes, functions and bindings by a new state. It should be also
+ * possible to remove it completely.
+ */
+static void test_sim_create_and_parse(void **state)
+{
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_function *f_acm, *f_ms;
+	usbg_config *c;
+	usbg_binding *b;
+	usbg_udc *u;
+	usbg_gadget_attrs g_attrs = {
+		.bcdUSB = 0x0200,
+		.bDeviceClass = 0xef,
+		.bDeviceSubClass = 0x02,
+		.bDeviceProtocol = 0x01,
+		.bMaxPacketSize0 = 64,
+		.idVendor = 0x1d6b,
+		.idProduct = 0x0104,
+		.bcdDevice = 0x0100,
+	};
+	usbg_gadget_strs g_strs = {"0123456789", "Foo Inc.", "Bar Gadget"};
+	usbg_config_strs c_strs = {"CDC ACM + MS"};
+	usbg_f_ms_lun_attrs lun0 = {0, false, false, false, true, "/a.img"};
+	usbg_f_ms_lun_attrs lun1 = {1, true, true, false, true, "/b.iso"};
+	usbg_f_ms_lun_attrs *luns[] = {&lun0, &lun1};
+	usbg_function_attrs f_attrs = {
+		.header.attrs_type = USBG_F_ATTRS_MS,
+		.attrs.ms = {
+			.stall = false,
+			.nluns = 2,
+			.luns = luns,
+		},
+	};
+	usbg_gadget_attrs got_attrs;
+	usbg_gadget_strs got_strs;
+	usbg_function_attrs got_f_attrs;
+	int ret, i;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	init_sim_state(sim, &s);
+	u = usbg_get_udc(s, SIM_UDC);
+	assert_non_null(u);
+
+	ret = usbg_create_gadget(s, "g1", &g_attrs, &g_strs, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ACM, "usb0", NULL, &f_acm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_MASS_STORAGE, "ms0", &f_attrs, &f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, &c_strs, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "acm.usb0", f_acm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "mass_storage.ms0", f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_enable_gadget(g, u);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(usbg_get_udc_state(u), USBG_UDC_STATE_CONFIGURED);
+
+	usbg_cleanup(s);
+	init_sim_state(sim, &s);
+
+	g = usbg_get_gadget(s, "g1");
+	assert_non_null(g);
+	assert_ptr_equal(usbg_get_gadget_udc(g), usbg_get_udc(s, SIM_UDC));
+
+	ret = usbg_get_gadget_attrs(g, &got_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_memory_equal(&got_attrs, &g_attrs, sizeof(g_attrs));
+
+	ret = usbg_get_gadget_strs(g, LANG_US_ENG, &got_strs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(got_strs.str_ser, g_strs.str_ser);
+	assert_string_equal(got_strs.str_mnf, g_strs.str_mnf);
+	assert_string_equal(got_strs.str_prd, g_strs.str_prd);
+
+	f_ms = usbg_get_function(g, F_MASS_STORAGE, "ms0");
+	assert_non_null(f_ms);
+	ret = usbg_get_function_attrs(f_ms, &got_f_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_false(got_f_attrs.attrs.ms.stall);
+	assert_int_equal(got_f_attrs.attrs.ms.nluns, 2);
+	for (i = 0; i < 2; ++i) {
+		usbg_f_ms_lun_attrs *got = got_f_attrs.attrs.ms.luns[i];
+
+		assert_int_equal(got->id, luns[i]->id);
+		assert_int_equal(got->cdrom, luns[i]->cdrom);
+		assert_int_equal(got->ro, luns[i]->ro);
+		assert_int_equal(got->nofua, luns[i]->nofua);
+		assert_int_equal(got->removable, luns[i]->removable);
+		assert_string_equal(got->filename, luns[i]->filename);
+	}
+	usbg_cleanup_function_attrs(&got_f_attrs);
+
+	c = usbg_get_config(g, 1, "c");
+	assert_non_null(c);
+	i = 0;
+	usbg_for_each_binding(b, c)
+		i++;
+	assert_int_equal(i, 2);
+
+	ret = usbg_rm_gadget(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(usbg_get_udc_state(usbg_get_udc(s, SIM_UDC)),
+			 USBG_UDC_STATE_NOT_ATTACHED);
+
+	usbg_cleanup(s);
+	init_sim_state(sim, &s);
+	assert_null(usbg_get_first_gadget(s));
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
 
 /**
- * @page usbg_tests Tests
- * @brief This is list of test cases
- * @tests_start
+ * @brief Tests configfs rules enforced by simulator
+ * @details Linked function, config with bindings, busy UDC and too many
+ * luns should be refused like kernel does. Functions created in any
+ * order should be kept sorted by name.
  */
+static void test_sim_rules(void **state)
+{
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g1, *g2;
+	usbg_function *f, *f2;
+	usbg_config *c1, *c2;
+	usbg_udc *u;
+	const char *instances[] = {"usb0", "usb2", "usb3", "usb1"};
+	const char *sorted[] = {"usb0", "usb1", "usb2", "usb3"};
+	usbg_f_ms_lun_attrs lun = {
+		.id = -1, .removable = true, .filename = ""
+	};
+	usbg_f_ms_lun_attrs *luns[18] = { NULL };
+	usbg_function_attrs ms_attrs = {
+		.header.attrs_type = USBG_F_ATTRS_MS,
+		.attrs.ms = { .nluns = 16, .luns = luns }
+	};
+	int ret, i;
 
-#ifndef DOXYGEN
-static UnitTest tests[] = {
-#endif
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
 
-	/**
-	 * @usbg_test
-	 * @test_desc{test_init_simple,
-	 * Check if init was successfull on simple configfs state,
-	 * usbg_init}
-	 */
-	USBG_TEST_TS("test_init_simple",
-		     test_init, setup_simple_state),
-	/**
-	 * @usbg_test
-	 * @test_desc{test_init_all_funcs,
-	 * Check if init was successfull when all avaible functions
-	 * are present in configfs,
-	 * usbg_init}
-	 */
-	USBG_TEST_TS("test_init_all_funcs",
-		     test_init, setup_all_funcs_state),
-	/**
-	 * @usbg_test
-	 * @test_desc{test_init_long_path,
-	 * Try to initialize libusbg with long configfs path,
-	 * usbg_init}
-	 */
-	USBG_TEST_TS("test_init_long_path",
-		     test_init, setup_long_path_state),
-	/**
+	init_sim_state(sim, &s);
+	u = usbg_get_udc(s, SIM_UDC);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_gadget(s, "g2", NULL, NULL, &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g1, F_ACM, "usb0", NULL, &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g1, 1, "c", NULL, NULL, &c1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g2, 1, "c", NULL, NULL, &c2);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Config without functions cannot be bound */
+	ret = usbg_enable_gadget(g1, u);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	ret = usbg_add_config_function(c1, "acm.usb0", f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_enable_gadget(g1, u);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_enable_gadget(g2, u);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+
+	ret = usbg_sim_set_udc_state(sim, SIM_UDC, USBG_UDC_STATE_SUSPENDED);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(usbg_get_udc_state(u), USBG_UDC_STATE_SUSPENDED);
+
+	/* Functions are kept sorted whatever the creation order is */
+	for (i = 0; i < ARRAY_SIZE(instances); ++i) {
+		ret = usbg_create_function(g2, F_ACM, instances[i], NULL,
+					   &f2);
+		assert_int_equal(ret, USBG_SUCCESS);
+	}
+	i = 0;
+	usbg_for_each_function(f2, g2)
+		assert_string_equal(usbg_get_function_instance(f2),
+				    sorted[i++]);
+	assert_int_equal(i, ARRAY_SIZE(sorted));
+
+	/* Mass storage function has at most 16 luns */
+	for (i = 0; i < ARRAY_SIZE(luns) - 1; ++i)
+		luns[i] = &lun;
+	ret = usbg_create_function(g2, F_MASS_STORAGE, "ms0", &ms_attrs, &f2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ms_attrs.attrs.ms.nluns = 17;
+	ret = usbg_set_function_attrs(f2, &ms_attrs);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	/* Function cannot be removed while it is linked */
+	ret = usbg_rm_function(f, 0);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	/* Config with bindings is not empty */
+	ret = usbg_rm_config(c1, 0);
+	assert_int_equal(ret, USBG_ERROR_OTHER_ERROR);
+
+	ret = usbg_rm_function(f, USBG_RM_RECURSE);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_rm_config(c1, 0);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+static const usbg_io_backend *old_kernel_sim_io;
+
+/* configfs refuses to create missing attribute with EACCES */
+static int old_kernel_write_attr(void *ctx, const char *path, const char *buf)
+{
+	const char *name = strrchr(path, '/');
+
+	if (name && !strcmp(name, "/forced_eject"))
+		return -EACCES;
+
+	return old_kernel_sim_io->write_attr(ctx, path, buf);
+}
+
+/**
+ * @brief Tests forced media swap on kernel without forced_eject
+ * @details Medium should be swapped without forced eject as configfs
+ * refuses to write missing attribute with EACCES, not ENOENT.
+ */
+static void test_sim_swap_media_old_kernel(void **state)
+{
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_init_opts opts;
+	usbg_io_backend io;
+	usbg_function_attrs f_attrs;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	usbg_sim_get_init_opts(sim, &opts);
+	old_kernel_sim_io = opts.io;
+	io = *opts.io;
+	io.write_attr = old_kernel_write_attr;
+	opts.io = &io;
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_MASS_STORAGE, "ms0", NULL, &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_ms_lun_swap_media(f, 0, "/a.img",
+				     USBG_MS_SWAP_FORCE_EJECT);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_get_function_attrs(f, &f_attrs);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(f_attrs.attrs.ms.luns[0]->filename, "/a.img");
+	usbg_cleanup_function_attrs(&f_attrs);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+struct bind_capture {
+	usbg_sim *sim;
+	/* state set by callback when phase is reached, 0 if none */
+	usbg_udc_state next[USBG_BIND_PHASE_MAX];
+	usbg_bind_phase phases[USBG_BIND_PHASE_MAX];
+	uint64_t ns[USBG_BIND_PHASE_MAX];
+	int n;
+};
+
+/* Steps simulated host through enumeration as phases are noticed */
+static void capture_bind(usbg_gadget *g, usbg_bind_phase phase, uint64_t ns,
+			 void *data)
+{
+	struct bind_capture *cap = data;
+
+	assert_true(cap->n < USBG_BIND_PHASE_MAX);
+	cap->phases[cap->n] = phase;
+	cap->ns[cap->n] = ns;
+	cap->n++;
+
+	if (cap->next[phase])
+		usbg_sim_set_udc_state(cap->sim, SIM_UDC, cap->next[phase]);
+}
+
+/* Gadget which simulator is able to bind */
+static usbg_gadget *create_bindable_gadget(usbg_state *s)
+{
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ACM, "usb0", NULL, &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "acm.usb0", f);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	return g;
+}
+
+/**
+ * @brief Tests waiting until host configures enabled gadget
+ * @details Each phase should be reported once, in order and with the
+ * same time as stored in timings. Phases skipped by host should get the
+ * same time. Gadget which is not configured in time should stay enabled
+ * and timings of all cycles should be aggregated in histograms.
+ */
+static void test_sim_enable_gadget_wait(void **state)
+{
+	struct bind_capture cap = { 0 };
+	usbg_bind_stats st;
+	usbg_bind_timings t;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_udc *u;
+	uint64_t sum;
+	int i, ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+	u = usbg_get_udc(s, SIM_UDC);
+	assert_non_null(u);
+	g = create_bindable_gadget(s);
+	usbg_bind_stats_reset(&st);
+
+	/* Host goes through each state after library has noticed previous */
+	cap.sim = sim;
+	cap.next[USBG_BIND_PHASE_ENABLED] = USBG_UDC_STATE_ATTACHED;
+	cap.next[USBG_BIND_PHASE_ATTACHED] = USBG_UDC_STATE_ADDRESSED;
+	cap.next[USBG_BIND_PHASE_ADDRESSED] = USBG_UDC_STATE_CONFIGURED;
+	ret = usbg_enable_gadget_wait(g, u, 5000, &t, capture_bind, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(t.reached, (1U << USBG_BIND_PHASE_MAX) - 1);
+	assert_int_equal(cap.n, USBG_BIND_PHASE_MAX);
+	for (i = 0; i < USBG_BIND_PHASE_MAX; ++i) {
+		assert_int_equal(cap.phases[i], i);
+		assert_int_equal(cap.ns[i], t.ns[i]);
+		if (i > 0)
+			assert_true(t.ns[i] > t.ns[i - 1]);
+	}
+	assert_int_equal(usbg_get_udc_state(u), USBG_UDC_STATE_CONFIGURED);
+	usbg_bind_stats_add(&st, &t);
+
+	/* Host configures device at once */
+	for (i = 0; i < 2; ++i) {
+		ret = usbg_disable_gadget(g);
+		assert_int_equal(ret, USBG_SUCCESS);
+		memset(&cap, 0, sizeof(cap));
+		ret = usbg_enable_gadget_wait(g, NULL, 5000, &t, capture_bind,
+					      &cap);
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_int_equal(cap.n, USBG_BIND_PHASE_MAX);
+		assert_int_equal(cap.phases[USBG_BIND_PHASE_MAX - 1],
+				 USBG_BIND_PHASE_CONFIGURED);
+		assert_int_equal(t.ns[USBG_BIND_PHASE_ATTACHED],
+				 t.ns[USBG_BIND_PHASE_CONFIGURED]);
+		usbg_bind_stats_add(&st, &t);
+	}
+
+	/* Host never finishes enumeration */
+	ret = usbg_disable_gadget(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	memset(&cap, 0, sizeof(cap));
+	cap.sim = sim;
+	cap.next[USBG_BIND_PHASE_ENABLED] = USBG_UDC_STATE_ATTACHED;
+	ret = usbg_enable_gadget_wait(g, u, 50, &t, capture_bind, &cap);
+	assert_int_equal(ret, USBG_ERROR_TIMEOUT);
+	assert_int_equal(t.reached, (1U << USBG_BIND_PHASE_ENABLED) |
+			 (1U << USBG_BIND_PHASE_ATTACHED));
+	assert_int_equal(cap.n, 2);
+	assert_ptr_equal(usbg_get_gadget_udc(g), u);
+	usbg_bind_stats_add(&st, &t);
+
+	assert_int_equal(st.cycles, 4);
+	assert_int_equal(st.incomplete, 1);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_ATTACHED].count, 4);
+	assert_int_equal(st.phase[USBG_BIND_PHASE_CONFIGURED].count, 3);
+	for (i = 0; i < USBG_BIND_PHASE_MAX; ++i) {
+		usbg_hist *h = &st.phase[i];
+		int j;
+
+		sum = 0;
+		for (j = 0; j < USBG_HIST_BUCKETS; ++j)
+			sum += h->buckets[j];
+		assert_int_equal(sum, h->count);
+		assert_true(h->min <= h->max);
+		assert_int_equal(usbg_hist_percentile(h, 100), h->max);
+		assert_int_equal(usbg_hist_percentile(h, 0), h->min);
+	}
+	/* The first cycle took at least two polling intervals */
+	assert_true(st.phase[USBG_BIND_PHASE_CONFIGURED].max >
+		    st.phase[USBG_BIND_PHASE_CONFIGURED].min);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+static const char *watch_state_path;
+static int watch_opens;
+
+/* UDC state is taken from regular file, which is never notified */
+static int watch_open_attr(void *ctx, const char *path)
+{
+	int fd;
+
+	watch_opens++;
+	fd = open(watch_state_path, O_RDONLY | O_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+/**
+ * @brief Tests waiting for UDC state using descriptor from backend
+ * @details State should be read from descriptor, which should stay
+ * open for the whole wait.
+ */
+static void test_sim_enable_gadget_wait_fd(void **state)
+{
+	char path[] = "/tmp/usbg-state-XXXXXX";
+	usbg_init_opts opts;
+	usbg_io_backend io;
+	usbg_bind_timings t;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, "attached\n", 9), 9);
+	watch_state_path = path;
+	watch_opens = 0;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	io = *opts.io;
+	io.open_attr = watch_open_attr;
+	opts.io = &io;
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	g = create_bindable_gadget(s);
+
+	/* Simulator says configured but the file doesn't */
+	ret = usbg_enable_gadget_wait(g, NULL, 50, &t, NULL, NULL);
+	assert_int_equal(ret, USBG_ERROR_TIMEOUT);
+	assert_int_equal(t.reached, (1U << USBG_BIND_PHASE_ENABLED) |
+			 (1U << USBG_BIND_PHASE_ATTACHED));
+	assert_int_equal(watch_opens, 1);
+
+	assert_int_equal(pwrite(fd, "configured\n", 11, 0), 11);
+	ret = usbg_disable_gadget(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_enable_gadget_wait(g, NULL, 5000, &t, NULL, NULL);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(t.reached, (1U << USBG_BIND_PHASE_MAX) - 1);
+	assert_int_equal(watch_opens, 2);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+	close(fd);
+	unlink(path);
+}
+
+/**
+ * @brief Tests operation statistics gathered by state
+ * @details Operations should be accounted to the outermost API call,
+ * modifications done outside of other calls belong to setters.
+ */
+static void test_stats(void **state)
+{
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_init_opts opts;
+	usbg_stats *st;
+	usbg_gadget *g1, *g2;
+	usbg_function *f;
+	usbg_config *c;
+	usbg_udc *u;
+	int ret;
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		fail();
+	free_later(st);
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	usbg_sim_get_init_opts(sim, &opts);
+	opts.stats = true;
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	u = usbg_get_udc(s, SIM_UDC);
+
+	ret = usbg_get_stats(s, st);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(st->op[USBG_STATS_SITE_PARSE]
+			 [USBG_IO_OP_CHECK_DIR].latency.count, 1);
+	/* udc class and gadgets directories */
+	assert_int_equal(st->op[USBG_STATS_SITE_PARSE]
+			 [USBG_IO_OP_LIST_DIR].latency.count, 2);
+
+	usbg_reset_stats(s);
+	ret = usbg_get_stats(s, st);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(st->op[USBG_STATS_SITE_PARSE]
+			 [USBG_IO_OP_LIST_DIR].latency.count, 0);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_gadget(s, "g2", NULL, NULL, &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g1, F_ACM, "usb0", NULL, &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g1, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "acm.usb0", f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g2, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_set_gadget_vendor_id(g1, 0x1d6b);
+	assert_int_equal(ret, USBG_SUCCESS);
+	/* Config without functions cannot be bound */
+	ret = usbg_enable_gadget(g2, u);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+	usbg_get_udc_state(u);
+
+	ret = usbg_rm_gadget(g1);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_get_stats(s, st);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(st->op[USBG_STATS_SITE_CREATE]
+			 [USBG_IO_OP_MKDIR].latency.count, 5);
+	assert_int_equal(st->op[USBG_STATS_SITE_CREATE]
+			 [USBG_IO_OP_SYMLINK].latency.count, 1);
+	assert_int_equal(st->op[USBG_STATS_SITE_SET]
+			 [USBG_IO_OP_WRITE_ATTR].latency.count, 2);
+	assert_int_equal(st->op[USBG_STATS_SITE_SET]
+			 [USBG_IO_OP_WRITE_ATTR].errors, 1);
+	assert_int_equal(st->op[USBG_STATS_SITE_OTHER]
+			 [USBG_IO_OP_READ_ATTR].latency.count, 1);
+	/* Nested removal of config and function is still rm */
+	assert_int_equal(st->op[USBG_STATS_SITE_RM]
+			 [USBG_IO_OP_UNLINK].latency.count, 1);
+	assert_int_equal(st->op[USBG_STATS_SITE_RM]
+			 [USBG_IO_OP_RMDIR].latency.count, 3);
+	assert_int_equal(st->op[USBG_STATS_SITE_SET]
+			 [USBG_IO_OP_RMDIR].latency.count, 0);
+
+	assert_string_equal(usbg_get_io_op_str(USBG_IO_OP_LIST_DIR),
+			    "list_dir");
+	assert_string_equal(usbg_get_stats_site_str(USBG_STATS_SITE_PARSE),
+			    "parse");
+	assert_null(usbg_get_io_op_str(USBG_IO_OP_MAX));
+
+	ret = usbg_enable_stats(s, false);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_get_stats(s, st);
+	assert_int_equal(ret, USBG_ERROR_NOT_FOUND);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+#ifndef USBG_LOG_COMPILE_LEVEL
+#define USBG_LOG_COMPILE_LEVEL USBG_LOG_DEBUG
+#endif
+
+struct log_capture {
+	int count;
+	usbg_log_level level;
+	char func[64];
+	char msg[128];
+	unsigned int suppressed;
+};
+
+static void capture_log(const usbg_log_record *rec, void *data)
+{
+	struct log_capture *cap = data;
+
+	cap->count++;
+	cap->level = rec->level;
+	snprintf(cap->func, sizeof(cap->func), "%s", rec->func);
+	snprintf(cap->msg, sizeof(cap->msg), "%s", rec->msg);
+	cap->suppressed = rec->suppressed;
+}
+
+/**
+ * @brief Tests routing of log messages to user callback
+ * @details Check level filtering and per call site rate limiting.
+ */
+static void test_log(void **state)
+{
+	struct log_capture cap = {0};
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g, *g2;
+	usbg_config *c;
+	int ret, i;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	usbg_set_log_callback(capture_log, &cap);
+	assert_int_equal(usbg_get_log_level(), USBG_LOG_ERR);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g2);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+	assert_int_equal(cap.count, 1);
+	assert_int_equal(cap.level, USBG_LOG_ERR);
+	assert_string_equal(cap.func, "usbg_create_gadget");
+	assert_string_equal(cap.msg, "duplicate gadget name");
+
+	/* Failed write is only a debug message */
+	ret = usbg_enable_gadget(g, usbg_get_udc(s, SIM_UDC));
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+	assert_int_equal(cap.count, 1);
+
+	/* Unless debug messages have been compiled out */
+	if (USBG_LOG_COMPILE_LEVEL >= USBG_LOG_DEBUG) {
+		usbg_set_log_level(USBG_LOG_DEBUG);
+		ret = usbg_enable_gadget(g, usbg_get_udc(s, SIM_UDC));
+		assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+		assert_int_equal(cap.count, 2);
+		assert_int_equal(cap.level, USBG_LOG_DEBUG);
+		usbg_set_log_level(USBG_LOG_ERR);
+	}
+
+	cap.count = 0;
+	usbg_set_log_rate_limit(2, 60000);
+	for (i = 0; i < 5; ++i) {
+		ret = usbg_create_gadget(s, "g1", NULL, NULL, &g2);
+		assert_int_equal(ret, USBG_ERROR_EXIST);
+	}
+	assert_int_equal(cap.count, 2);
+
+	usbg_set_log_rate_limit(0, 0);
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g2);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+	assert_int_equal(cap.count, 3);
+	assert_int_equal(cap.suppressed, 3);
+
+	usbg_set_log_callback(NULL, NULL);
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+struct trace_capture {
+	int begin;
+	int end;
+	usbg_io_op op;
+	usbg_stats_site site;
+	char path[128];
+	char value[128];
+	int ret;
+};
+
+static void capture_trace(usbg_state *s, const usbg_trace_event *ev,
+			  void *ctx)
+{
+	struct trace_capture *cap = ctx;
+
+	if (ev->point == USBG_TRACE_BEGIN) {
+		cap->begin++;
+		return;
+	}
+
+	cap->end++;
+	cap->op = ev->op;
+	cap->site = ev->site;
+	snprintf(cap->path, sizeof(cap->path), "%s", ev->path);
+	snprintf(cap->value, sizeof(cap->value), "%s",
+		 ev->value ? ev->value : "");
+	cap->ret = ev->ret;
+}
+
+/**
+ * @brief Tests tracing of configfs modifications
+ * @details Each modification should be reported before and after it
+ * with path relative to configfs, reads should not be reported at all.
+ */
+static void test_trace(void **state)
+{
+	struct trace_capture cap = {0};
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+
+	ret = usbg_set_trace_callback(s, capture_trace, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(cap.begin, 1);
+	assert_int_equal(cap.end, 1);
+	assert_int_equal(cap.op, USBG_IO_OP_MKDIR);
+	assert_int_equal(cap.site, USBG_STATS_SITE_CREATE);
+	assert_string_equal(cap.path, "usb_gadget/g1");
+
+	ret = usbg_set_gadget_vendor_id(g, 0x1d6b);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(cap.op, USBG_IO_OP_WRITE_ATTR);
+	assert_int_equal(cap.site, USBG_STATS_SITE_SET);
+	assert_string_equal(cap.path, "usb_gadget/g1/idVendor");
+	assert_string_equal(cap.value, "0x1d6b\n");
+
+	ret = usbg_create_function(g, F_ACM, "usb0", NULL, &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "acm.usb0", f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(cap.op, USBG_IO_OP_SYMLINK);
+	assert_string_equal(cap.path, "usb_gadget/g1/configs/c.1/acm.usb0");
+	assert_string_equal(cap.value, "usb_gadget/g1/functions/acm.usb0");
+
+	/* Failed modification is reported with error */
+	ret = usbg_rm_function(f, 0);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	assert_int_equal(cap.op, USBG_IO_OP_RMDIR);
+	assert_int_equal(cap.ret, -EBUSY);
+	assert_int_equal(cap.begin, cap.end);
+
+	/* Reads are not traced */
+	cap.begin = cap.end = 0;
+	usbg_get_udc_state(usbg_get_udc(s, SIM_UDC));
+	assert_int_equal(cap.begin + cap.end, 0);
+
+	ret = usbg_set_trace_callback(s, NULL, NULL);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_rm_gadget(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(cap.begin + cap.end, 0);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+struct thread_safe_writer {
+	usbg_state *s;
+	int loops;
+	int ret;
+	volatile int done;
+};
+
+static void *thread_safe_write(void *data)
+{
+	struct thread_safe_writer *w = data;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	int i;
+
+	for (i = 0; i < w->loops; ++i) {
+		w->ret = usbg_create_gadget(w->s, "g2", NULL, NULL, &g);
+		if (w->ret != USBG_SUCCESS)
+			break;
+		w->ret = usbg_create_function(g, F_ACM, "usb0", NULL, &f);
+		if (w->ret != USBG_SUCCESS)
+			break;
+		w->ret = usbg_create_config(g, 1, "c", NULL, NULL, &c);
+		if (w->ret != USBG_SUCCESS)
+			break;
+		w->ret = usbg_add_config_function(c, "acm.usb0", f);
+		if (w->ret != USBG_SUCCESS)
+			break;
+		w->ret = usbg_rm_gadget(g);
+		if (w->ret != USBG_SUCCESS)
+			break;
+	}
+
+	w->done = 1;
+	return NULL;
+}
+
+/**
+ * @brief Tests state shared between threads
+ * @details Reader which holds read lock should see consistent lists of
+ * objects while another thread creates and removes gadgets. Read lock
+ * may be taken recursively and lookups may be done while holding it.
+ */
+static void test_thread_safe(void **state)
+{
+	struct thread_safe_writer w = { .loops = 200 };
+	usbg_init_opts opts;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_function *f;
+	usbg_config *c;
+	usbg_binding *b;
+	usbg_gadget *g2;
+	pthread_t writer;
+	char *buf;
+	size_t len;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	opts.thread_safe = true;
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Unbalanced unlock is refused */
+	assert_int_equal(usbg_read_unlock(s), USBG_ERROR_INVALID_PARAM);
+
+	ret = usbg_read_lock(s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_read_lock(s);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_ptr_equal(usbg_get_gadget(s, "g1"), g);
+
+	/* Shared lock is never upgraded but export needs only shared one */
+	ret = usbg_create_gadget(s, "g2", NULL, NULL, &g2);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	assert_null(usbg_get_gadget(s, "g2"));
+	assert_null(usbg_get_gadget_udc(g));
+	ret = usbg_export_gadget_buf(g, &buf, &len, USBG_SCHEME_JSON);
+	assert_int_equal(ret, USBG_SUCCESS);
+	free(buf);
+
+	assert_int_equal(usbg_read_unlock(s), USBG_SUCCESS);
+	assert_int_equal(usbg_read_unlock(s), USBG_SUCCESS);
+	assert_int_equal(usbg_read_unlock(s), USBG_ERROR_INVALID_PARAM);
+
+	w.s = s;
+	ret = pthread_create(&writer, NULL, thread_safe_write, &w);
+	assert_int_equal(ret, 0);
+
+	while (!w.done) {
+		ret = usbg_read_lock(s);
+		assert_int_equal(ret, USBG_SUCCESS);
+
+		usbg_for_each_gadget(g, s) {
+			assert_non_null(usbg_get_gadget_name(g));
+			usbg_for_each_function(f, g)
+				assert_int_equal(usbg_get_function_type(f),
+						 F_ACM);
+			usbg_for_each_config(c, g)
+				usbg_for_each_binding(b, c)
+					assert_ptr_equal(
+						usbg_get_binding_target(b),
+						usbg_get_first_function(g));
+		}
+
+		ret = usbg_read_unlock(s);
+		assert_int_equal(ret, USBG_SUCCESS);
+	}
+
+	pthread_join(writer, NULL);
+	assert_int_equal(w.ret, USBG_SUCCESS);
+	assert_non_null(usbg_get_gadget(s, "g1"));
+	assert_null(usbg_get_gadget(s, "g2"));
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+struct log_thread {
+	usbg_state *s;
+	int loops;
+	int ret;
+};
+
+static void count_log(const usbg_log_record *rec, void *data)
+{
+	struct log_capture *cap = data;
+
+	__atomic_add_fetch(&cap->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cap->suppressed, rec->suppressed,
+			   __ATOMIC_RELAXED);
+}
+
+static void *log_thread_fail(void *data)
+{
+	struct log_thread *lt = data;
+	usbg_gadget *g;
+	int i;
+
+	for (i = 0; i < lt->loops; ++i) {
+		lt->ret = usbg_create_gadget(lt->s, "g1", NULL, NULL, &g);
+		if (lt->ret != USBG_ERROR_EXIST)
+			break;
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Tests logging from many threads at once
+ * @details Each message from the same call site should be either
+ * delivered or counted as suppressed, none of them should be lost.
+ */
+static void test_log_threads(void **state)
+{
+	struct log_capture cap = {0};
+	struct log_thread lt[4];
+	pthread_t threads[ARRAY_SIZE(lt)];
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	int ret, i;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Each thread has its own state, only log call site is shared */
+	for (i = 0; i < ARRAY_SIZE(lt); ++i) {
+		init_sim_state(sim, &lt[i].s);
+		lt[i].loops = 500;
+	}
+
+	usbg_set_log_callback(count_log, &cap);
+	usbg_set_log_rate_limit(3, 60000);
+	for (i = 0; i < ARRAY_SIZE(lt); ++i) {
+		ret = pthread_create(&threads[i], NULL, log_thread_fail,
+				     &lt[i]);
+		assert_int_equal(ret, 0);
+	}
+	for (i = 0; i < ARRAY_SIZE(lt); ++i) {
+		pthread_join(threads[i], NULL);
+		assert_int_equal(lt[i].ret, USBG_ERROR_EXIST);
+	}
+	assert_int_equal(cap.count, 3);
+
+	usbg_set_log_rate_limit(0, 0);
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+	assert_int_equal(cap.count, 4);
+	assert_int_equal(cap.suppressed, ARRAY_SIZE(lt) * 500 - 3);
+
+	usbg_set_log_callback(NULL, NULL);
+	for (i = 0; i < ARRAY_SIZE(lt); ++i)
+		usbg_cleanup(lt[i].s);
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+struct snapshot_reader {
+	struct thread_safe_writer *w;
+	pthread_t thread;
+	int ret;
+};
+
+/* cmocka asserts are not thread safe so only result is stored */
+static void *snapshot_read(void *data)
+{
+	struct snapshot_reader *r = data;
+	usbg_state *snap;
+	usbg_gadget *g;
+	usbg_config *c;
+	usbg_binding *b;
+	int count;
+
+	while (!r->w->done && r->ret == USBG_SUCCESS) {
+		r->ret = usbg_snapshot_acquire(r->w->s, &snap);
+		if (r->ret != USBG_SUCCESS)
+			break;
+
+		count = 0;
+		usbg_for_each_gadget(g, snap) {
+			usbg_for_each_config(c, g)
+				usbg_for_each_binding(b, c)
+					if (usbg_get_binding_target(b) !=
+					    usbg_get_first_function(g))
+						r->ret = USBG_ERROR_OTHER_ERROR;
+			count++;
+		}
+		if (count != 1 && count != 2)
+			r->ret = USBG_ERROR_OTHER_ERROR;
+
+		usbg_snapshot_release(snap);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Tests snapshots of state
+ * @details Snapshot should not change when state is modified, should be
+ * shared until state changes and should be iterable without locks while
+ * other thread modifies the state and other readers acquire it.
+ */
+static void test_snapshot(void **state)
+{
+	struct thread_safe_writer w = { .loops = 200 };
+	struct snapshot_reader readers[3] = { { 0 } };
+	usbg_init_opts opts;
+	usbg_sim *sim;
+	usbg_state *s, *snap1, *snap2;
+	usbg_gadget *g, *sg;
+	usbg_function *f;
+	usbg_config *c;
+	usbg_binding *b;
+	pthread_t writer;
+	int i;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	opts.thread_safe = true;
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ACM, "usb0", NULL, &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "acm.usb0", f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_gadget_vendor_id(g, 0x1d6b);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_snapshot_acquire(s, &snap1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_snapshot_acquire(s, &snap2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_ptr_equal(snap1, snap2);
+	usbg_snapshot_release(snap2);
+
+	/* Snapshot has its own objects which point to each other */
+	sg = usbg_get_gadget(snap1, "g1");
+	assert_non_null(sg);
+	assert_true(sg != g);
+	b = usbg_get_first_binding(usbg_get_first_config(sg));
+	assert_non_null(b);
+	assert_ptr_equal(usbg_get_binding_target(b),
+			 usbg_get_first_function(sg));
+	assert_int_equal(usbg_get_gadget_attr(sg, ID_VENDOR), 0x1d6b);
+
+	ret = usbg_create_gadget(snap1, "g3", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_ERROR_NO_ACCESS);
+	assert_null(usbg_get_gadget(snap1, "g3"));
+
+	ret = usbg_create_gadget(s, "g2", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_snapshot_acquire(s, &snap2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(snap1 != snap2);
+	assert_null(usbg_get_gadget(snap1, "g2"));
+	assert_non_null(usbg_get_gadget(snap2, "g2"));
+	usbg_snapshot_release(snap2);
+
+	ret = usbg_rm_gadget(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	w.s = s;
+	ret = pthread_create(&writer, NULL, thread_safe_write, &w);
+	assert_int_equal(ret, 0);
+
+	/* Readers race to build snapshot after each change */
+	for (i = 0; i < ARRAY_SIZE(readers); ++i) {
+		readers[i].w = &w;
+		ret = pthread_create(&readers[i].thread, NULL, snapshot_read,
+				     &readers[i]);
+		assert_int_equal(ret, 0);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(readers); ++i) {
+		pthread_join(readers[i].thread, NULL);
+		assert_int_equal(readers[i].ret, USBG_SUCCESS);
+	}
+
+	pthread_join(writer, NULL);
+	assert_int_equal(w.ret, USBG_SUCCESS);
+
+	/* Snapshot outlives its state */
+	usbg_cleanup(s);
+	assert_non_null(usbg_get_gadget(snap1, "g1"));
+	usbg_snapshot_release(snap1);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests advisory locks shared with other processes
+ * @details Gadget lock should be taken by calls which modify gadget and
+ * should exclude other holders of its lock file, also holder of the
+ * whole state lock. Lock taken again by the same state is shared.
+ * State lock held shared is never upgraded and exclusive one is
+ * downgraded when only gadget locks still hold it.
+ */
+static void test_process_lock(void **state)
+{
+	char dir[] = "/tmp/usbg-lock-XXXXXX";
+	char gpath[PATH_MAX], spath[PATH_MAX];
+	usbg_init_opts opts;
+	usbg_process_lock *l1, *l2;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	int gfd, sfd;
+	int ret;
+
+	assert_non_null(mkdtemp(dir));
+	snprintf(gpath, sizeof(gpath), "%s/gadget.g1.lock", dir);
+	snprintf(spath, sizeof(spath), "%s/state.lock", dir);
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	opts.process_lock = true;
+	opts.lock_dir = dir;
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Lock files are created on the first use */
+	gfd = open(gpath, O_RDWR);
+	assert_true(gfd >= 0);
+	sfd = open(spath, O_RDWR);
+	assert_true(sfd >= 0);
+
+	ret = usbg_process_lock_gadget(s, "g1", 0, &l1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_process_lock_gadget(s, "g1", 0, &l2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_ptr_equal(l1, l2);
+	/* Other holders are excluded */
+	assert_int_equal(flock(gfd, LOCK_EX | LOCK_NB), -1);
+	assert_int_equal(flock(sfd, LOCK_EX | LOCK_NB), -1);
+	assert_int_equal(flock(sfd, LOCK_SH | LOCK_NB), 0);
+	assert_int_equal(flock(sfd, LOCK_UN), 0);
+	usbg_process_unlock(l2);
+	usbg_process_unlock(l1);
+
+	/* Gadget held by other process */
+	assert_int_equal(flock(gfd, LOCK_EX | LOCK_NB), 0);
+	ret = usbg_process_lock_gadget(s, "g1", USBG_PROCESS_LOCK_NONBLOCK,
+				       &l1);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	ret = usbg_process_lock_gadget(s, "g2", USBG_PROCESS_LOCK_NONBLOCK,
+				       &l1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_process_unlock(l1);
+	assert_int_equal(flock(gfd, LOCK_UN), 0);
+
+	/* Whole state held by other process */
+	assert_int_equal(flock(sfd, LOCK_EX | LOCK_NB), 0);
+	ret = usbg_process_lock_gadget(s, "g1", USBG_PROCESS_LOCK_NONBLOCK,
+				       &l1);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	assert_int_equal(flock(sfd, LOCK_UN), 0);
+
+	/* Shared state lock held by gadget lock is not upgraded */
+	ret = usbg_process_lock_gadget(s, "g1", 0, &l2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_process_lock_state(s, USBG_PROCESS_LOCK_NONBLOCK, &l1);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	assert_int_equal(flock(sfd, LOCK_EX | LOCK_NB), -1);
+	usbg_process_unlock(l2);
+
+	ret = usbg_process_lock_state(s, USBG_PROCESS_LOCK_NONBLOCK, &l1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(flock(sfd, LOCK_SH | LOCK_NB), -1);
+	/* Gadget operations may be done while holding state lock */
+	ret = usbg_rm_gadget(g);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* State lock is downgraded when only gadget lock needs it */
+	ret = usbg_process_lock_gadget(s, "g1", 0, &l2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_process_unlock(l1);
+	assert_int_equal(flock(sfd, LOCK_SH | LOCK_NB), 0);
+	assert_int_equal(flock(sfd, LOCK_UN), 0);
+	assert_int_equal(flock(sfd, LOCK_EX | LOCK_NB), -1);
+	usbg_process_unlock(l2);
+	assert_int_equal(flock(sfd, LOCK_EX | LOCK_NB), 0);
+
+	close(gfd);
+	close(sfd);
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+	unlink(gpath);
+	unlink(spath);
+	snprintf(gpath, sizeof(gpath), "%s/gadget.g2.lock", dir);
+	unlink(gpath);
+	rmdir(dir);
+}
+
+struct async_capture {
+	int completed;
+	usbg_async_result res;
+};
+
+static void capture_async(const usbg_async_result *res, void *data)
+{
+	struct async_capture *cap = data;
+
+	cap->completed++;
+	cap->res = *res;
+}
+
+/* Wait for completion fd and dispatch, as event loop would do */
+static void async_wait(usbg_async *a, struct async_capture *cap)
+{
+	struct pollfd pfd = {
+		.fd = usbg_async_get_fd(a),
+		.events = POLLIN,
+	};
+	int completed = cap->completed;
+
+	while (cap->completed == completed) {
+		assert_int_equal(poll(&pfd, 1, 5000), 1);
+		assert_true(usbg_async_dispatch(a) >= 0);
+	}
+}
+
+/**
+ * @brief Tests asynchronous requests
+ * @details Each request should be completed by callback called from
+ * usbg_async_dispatch() after completion fd becomes readable, with the
+ * same result as synchronous call would return.
+ */
+static void test_async(void **state)
+{
+	struct async_capture cap = {0};
+	usbg_gadget_attrs g_attrs = {0};
+	usbg_init_opts opts;
+	usbg_async *a;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	usbg_udc *u;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+
+	ret = usbg_async_create(&a);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(usbg_async_get_fd(a) >= 0);
+	/* Nothing completed yet */
+	assert_int_equal(usbg_async_dispatch(a), 0);
+
+	ret = usbg_async_init(a, SIM_CONFIGFS, &opts, capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	async_wait(a, &cap);
+	assert_int_equal(cap.res.op, USBG_ASYNC_INIT);
+	assert_int_equal(cap.res.ret, USBG_SUCCESS);
+	s = cap.res.state;
+	assert_non_null(s);
+
+	g_attrs.idVendor = 0x1d6b;
+	ret = usbg_async_create_gadget(a, s, "g1", &g_attrs, NULL,
+				       capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	async_wait(a, &cap);
+	assert_int_equal(cap.res.op, USBG_ASYNC_CREATE_GADGET);
+	assert_int_equal(cap.res.ret, USBG_SUCCESS);
+	g = cap.res.gadget;
+	assert_ptr_equal(usbg_get_gadget(s, "g1"), g);
+	assert_int_equal(usbg_get_gadget_attr(g, ID_VENDOR), 0x1d6b);
+
+	/* Requests are executed in order */
+	u = usbg_get_udc(s, SIM_UDC);
+	ret = usbg_async_enable_gadget(a, g, u, capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_async_disable_gadget(a, g, capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_async_rm_gadget(a, g, capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	while (cap.completed < 5)
+		async_wait(a, &cap);
+	assert_int_equal(cap.res.op, USBG_ASYNC_RM_GADGET);
+	assert_int_equal(cap.res.ret, USBG_SUCCESS);
+	assert_null(usbg_get_gadget(s, "g1"));
+
+	ret = usbg_async_rm_gadget(a, NULL, capture_async, &cap);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	/*
+	 * Pending requests are completed on destroy, error of synchronous
+	 * call is passed to callback
+	 */
+	ret = usbg_async_create_gadget(a, s, "g2", NULL, NULL,
+				       capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_async_create_gadget(a, s, "g2", NULL, NULL,
+				       capture_async, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_async_destroy(a);
+	assert_int_equal(cap.completed, 7);
+	assert_int_equal(cap.res.ret, USBG_ERROR_EXIST);
+	assert_non_null(usbg_get_gadget(s, "g2"));
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests streaming export of gadget
+ * @details Text should have the same format as written by libconfig for
+ * tree based export, with strings escaped. When library is built with
+ * libconfig both exporters should produce exactly the same output.
+ */
+static void test_export_streaming(void **state)
+{
+	static const char expected[] =
+		"attrs : \n"
+		"{\n"
+		"    bcdUSB = 0x200;\n"
+		"    bDeviceClass = 0x0;\n"
+		"    bDeviceSubClass = 0x0;\n"
+		"    bDeviceProtocol = 0x0;\n"
+		"    bMaxPacketSize0 = 0x40;\n"
+		"    idVendor = 0x1D6B;\n"
+		"    idProduct = 0x104;\n"
+		"    bcdDevice = 0x1;\n"
+		"};\n"
+		"strings = ( \n"
+		"    {\n"
+		"        lang = 0x409;\n"
+		"        manufacturer = \"Foo \\\"Inc\\\"\\tLtd\";\n"
+		"        product = \"C:\\\\bar\";\n"
+		"        serialnumber = \"0123\";\n"
+		"    } );\n"
+		"functions : \n"
+		"{\n"
+		"    acm_usb0 : \n"
+		"    {\n"
+		"        instance = \"usb0\";\n"
+		"        type = \"acm\";\n"
+		"        attrs : \n"
+		"        {\n"
+		"            port_num = 0;\n"
+		"        };\n"
+		"    };\n"
+		"    ecm_usb0 : \n"
+		"    {\n"
+		"        instance = \"usb0\";\n"
+		"        type = \"ecm\";\n"
+		"        attrs : \n"
+		"        {\n"
+		"            dev_addr = \"02:00:00:00:00:00\";\n"
+		"            host_addr = \"06:00:00:00:00:00\";\n"
+		"            qmult = 5;\n"
+		"        };\n"
+		"    };\n"
+		"    mass_storage_ms0 : \n"
+		"    {\n"
+		"        instance = \"ms0\";\n"
+		"        type = \"mass_storage\";\n"
+		"        attrs : \n"
+		"        {\n"
+		"            stall = true;\n"
+		"            luns = ( \n"
+		"                {\n"
+		"                    cdrom = false;\n"
+		"                    ro = false;\n"
+		"                    nofua = false;\n"
+		"                    removable = true;\n"
+		"                    filename = \"\";\n"
+		"                } );\n"
+		"        };\n"
+		"    };\n"
+		"};\n"
+		"configs = ( \n"
+		"    {\n"
+		"        id = 1;\n"
+		"        name = \"c\";\n"
+		"        attrs : \n"
+		"        {\n"
+		"            bmAttributes = 0x80;\n"
+		"            bMaxPower = 0x2;\n"
+		"        };\n"
+		"        strings = ( );\n"
+		"        functions = ( \n"
+		"            {\n"
+		"                name = \"acm.usb0\";\n"
+		"                function = \"acm_usb0\";\n"
+		"            }, \n"
+		"            {\n"
+		"                name = \"ecm.usb0\";\n"
+		"                function = \"ecm_usb0\";\n"
+		"            } );\n"
+		"    } );\n";
+	usbg_gadget_attrs g_attrs = {
+		.bcdUSB = 0x0200,
+		.bMaxPacketSize0 = 64,
+		.idVendor = 0x1d6b,
+		.idProduct = 0x0104,
+		.bcdDevice = 0x0001,
+	};
+	usbg_gadget_strs g_strs = {
+		.str_ser = "0123",
+		.str_mnf = "Foo \"Inc\"\tLtd",
+		.str_prd = "C:\\bar",
+	};
+	char buf[4096], ref[4096];
+	usbg_init_opts opts;
+	usbg_function *f_acm, *f_ecm, *f_ms;
+	usbg_config *c;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	FILE *stream;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", &g_attrs, &g_strs, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ACM, "usb0", NULL, &f_acm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ECM, "usb0", NULL, &f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_MASS_STORAGE, "ms0", NULL, &f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, NULL, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "ecm.usb0", f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "acm.usb0", f_acm);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* fclose() is replaced in this suite, so a single stream is reused */
+	memset(buf, 0, sizeof(buf));
+	stream = fmemopen(buf, sizeof(buf) - 1, "w");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+	ret = usbg_export_gadget_streaming(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, expected);
+
+	/* Compare with reference exporter if schemes are available */
+	strcpy(ref, buf);
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget(g, stream);
+	if (ret != USBG_ERROR_NOT_SUPPORTED) {
+		assert_int_equal(ret, USBG_SUCCESS);
+		assert_string_equal(buf, ref);
+	}
+
+	/* Output which does not fit is reported */
+	fseek(stream, sizeof(buf) - 64, SEEK_SET);
+	ret = usbg_export_gadget_streaming(g, stream);
+	assert_int_equal(ret, USBG_ERROR_IO);
+
+	ret = usbg_export_gadget_streaming(NULL, stream);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests binary export and import of gadget
+ * @details Gadget imported from binary scheme should be exported with
+ * the same text as the original one. Serial functions are not used as
+ * their port number is assigned by kernel. Binary scheme converted to text
+ * format should also give the same text.
+ */
+static void test_scheme_bin(void **state)
+{
+	usbg_gadget_attrs g_attrs = {
+		.bcdUSB = 0x0200,
+		.bMaxPacketSize0 = 64,
+		.idVendor = 0x1d6b,
+		.idProduct = 0x0104,
+		.bcdDevice = 0x0001,
+	};
+	usbg_gadget_strs g_strs = {
+		.str_ser = "0123",
+		.str_mnf = "Foo Inc.",
+		.str_prd = "Bar",
+	};
+	usbg_config_strs c_strs = {
+		.configuration = "CDC",
+	};
+	char bin[4096], buf[4096], ref[4096];
+	usbg_init_opts opts;
+	usbg_function *f_ecm, *f_ms;
+	usbg_config *c;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g, *g2;
+	FILE *bstream, *stream;
+	long len;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", &g_attrs, &g_strs, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ECM, "usb0", NULL, &f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_net_qmult(f_ecm, 10);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_MASS_STORAGE, "ms0", NULL, &f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, &c_strs, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "ecm.usb0", f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "ms", f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* fclose() is replaced in this suite, so streams are reused */
+	bstream = fmemopen(bin, sizeof(bin), "w+");
+	assert_non_null(bstream);
+	setvbuf(bstream, NULL, _IONBF, 0);
+	memset(buf, 0, sizeof(buf));
+	stream = fmemopen(buf, sizeof(buf) - 1, "w");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+
+	ret = usbg_export_gadget_bin(g, bstream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	len = ftell(bstream);
+	assert_true(len > 8);
+	assert_memory_equal(bin, "USBG\1\0", 6);
+
+	rewind(bstream);
+	ret = usbg_import_gadget_bin(s, bstream, "g2", &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(g2 == usbg_get_gadget(s, "g2"));
+
+	ret = usbg_export_gadget_streaming(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	strcpy(ref, buf);
+	assert_non_null(strstr(ref, "qmult = 10;"));
+
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g2, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref);
+
+	/* Conversion doesn't need any gadget */
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	rewind(bstream);
+	ret = usbg_convert_gadget_scheme(bstream, USBG_SCHEME_BIN,
+					 stream, USBG_SCHEME_LIBCONFIG);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref);
+
+	/* Truncated scheme and unknown major version are rejected */
+	rewind(bstream);
+	ret = usbg_import_gadget_bin(s, fmemopen(bin, len - 1, "r"), "g3",
+				     NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+	bin[4] = 2;
+	rewind(bstream);
+	ret = usbg_import_gadget_bin(s, bstream, "g3", NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+	assert_null(usbg_get_gadget(s, "g3"));
+
+	ret = usbg_convert_gadget_scheme(bstream, USBG_SCHEME_FORMAT_MAX,
+					 stream, USBG_SCHEME_LIBCONFIG);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests JSON export and import of gadget
+ * @details Gadget imported from JSON scheme should be exported with the
+ * same text as the original one. Handwritten document with members in
+ * different order, inline function and unknown members should be also
+ * accepted. Malformed documents and numbers should be rejected without
+ * creating any gadget.
+ */
+static void test_json_scheme(void **state)
+{
+	usbg_gadget_attrs g_attrs = {
+		.bcdUSB = 0x0200,
+		.idVendor = 0x1d6b,
+		.idProduct = 0x0104,
+	};
+	usbg_gadget_strs g_strs = {
+		.str_ser = "0123",
+		.str_mnf = "Foo \"Inc.\"",
+		.str_prd = "Bar",
+	};
+	usbg_config_strs c_strs = {
+		.configuration = "CDC",
+	};
+	const char *doc =
+		"{\"configs\": [{\"functions\": [\"net\", {\"name\": \"ms\","
+		" \"function\": {\"type\": \"mass_storage\", \"instance\":"
+		" \"ms1\", \"attrs\": {\"luns\": [{\"removable\": 0}]}}}],"
+		" \"name\": \"cfg\", \"id\": 2, \"unknown\": [1.5, null]}],"
+		" \"functions\": {\"net\": {\"attrs\": {\"qmult\": 5},"
+		" \"type\": \"ecm\", \"instance\": \"usb1\"}},"
+		" \"attrs\": {\"idVendor\": 7331}}\n";
+	const char *bad_syntax = "{\"attrs\": {\"idVendor\": 1,}}";
+	const char *no_type = "{\"functions\": {\"f\": {\"instance\": \"x\"}}}";
+	const char *bad_numbers[] = {
+		"{\"attrs\": {\"idVendor\": 1-2}}",
+		"{\"attrs\": {\"idVendor\": -}}",
+		"{\"attrs\": {\"idVendor\": --1}}",
+		"{\"attrs\": {\"idVendor\": 01}}",
+	};
+	char json[4096], buf[4096], ref[4096];
+	usbg_init_opts opts;
+	usbg_function *f_ecm, *f_ms;
+	usbg_config *c;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g, *g2, *g3;
+	FILE *jstream, *stream;
+	int i, ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	usbg_sim_get_init_opts(sim, &opts);
+	ret = usbg_init_with_opts(SIM_CONFIGFS, &opts, &s);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g1", &g_attrs, &g_strs, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_ECM, "usb0", NULL, &f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g, F_MASS_STORAGE, "ms0", NULL, &f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g, 1, "c", NULL, &c_strs, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "ecm.usb0", f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "ms", f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* fclose() is replaced in this suite, so streams are reused */
+	memset(json, 0, sizeof(json));
+	jstream = fmemopen(json, sizeof(json) - 1, "w+");
+	assert_non_null(jstream);
+	setvbuf(jstream, NULL, _IONBF, 0);
+	memset(buf, 0, sizeof(buf));
+	stream = fmemopen(buf, sizeof(buf) - 1, "w");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+
+	ret = usbg_export_gadget_json(g, jstream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(strstr(json, "\"manufacturer\": \"Foo \\\"Inc.\\\"\""));
+
+	rewind(jstream);
+	ret = usbg_import_gadget_json(s, jstream, "g2", &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(g2 == usbg_get_gadget(s, "g2"));
+
+	ret = usbg_export_gadget_streaming(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	strcpy(ref, buf);
+
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g2, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref);
+
+	/* Conversion through binary format gives the same document */
+	strcpy(ref, json);
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	rewind(jstream);
+	ret = usbg_convert_gadget_scheme(jstream, USBG_SCHEME_JSON,
+					 stream, USBG_SCHEME_BIN);
+	assert_int_equal(ret, USBG_SUCCESS);
+	memset(json, 0, sizeof(json));
+	rewind(jstream);
+	ret = usbg_convert_gadget_scheme(fmemopen(buf, sizeof(buf), "r"),
+					 USBG_SCHEME_BIN, jstream,
+					 USBG_SCHEME_JSON);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(json, ref);
+
+	ret = usbg_import_gadget_json(s, fmemopen((void *)doc, strlen(doc),
+						  "r"), "g3", &g3);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(usbg_get_function(g3, F_ECM, "usb1"));
+	assert_non_null(usbg_get_function(g3, F_MASS_STORAGE, "ms1"));
+	assert_non_null(usbg_get_config(g3, 2, "cfg"));
+
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g3, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(strstr(buf, "idVendor = 0x1CA3;"));
+	assert_non_null(strstr(buf, "qmult = 5;"));
+	assert_non_null(strstr(buf, "removable = false;"));
+
+	ret = usbg_import_gadget_json(s, fmemopen((void *)bad_syntax,
+						  strlen(bad_syntax), "r"),
+				      "g4", NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+	ret = usbg_import_gadget_json(s, fmemopen((void *)no_type,
+						  strlen(no_type), "r"),
+				      "g4", NULL);
+	assert_int_equal(ret, USBG_ERROR_MISSING_TAG);
+	for (i = 0; i < ARRAY_SIZE(bad_numbers); ++i) {
+		ret = usbg_import_gadget_json(s,
+				fmemopen((void *)bad_numbers[i],
+					 strlen(bad_numbers[i]), "r"),
+				"g4", NULL);
+		assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+	}
+	assert_null(usbg_get_gadget(s, "g4"));
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Export whole state and check that it is restored by import
+ * @details Exported document is imported after gadgets have been removed
+ * and both gadgets should be restored with the same schemes. Gadget
+ * which has been enabled should be enabled on the same UDC.
+ */
+static void check_state_round_trip(usbg_state *s, usbg_udc *u,
+				   usbg_scheme_format format)
+{
+	char doc[8192], buf[4096], ref1[4096], ref2[4096];
+	usbg_gadget *g1, *g2;
+	FILE *dstream, *stream;
+	int ret;
+
+	memset(doc, 0, sizeof(doc));
+	dstream = fmemopen(doc, sizeof(doc) - 1, "w+");
+	assert_non_null(dstream);
+	setvbuf(dstream, NULL, _IONBF, 0);
+	memset(buf, 0, sizeof(buf));
+	stream = fmemopen(buf, sizeof(buf) - 1, "w");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+
+	g1 = usbg_get_gadget(s, "g1");
+	g2 = usbg_get_gadget(s, "g2");
+	ret = usbg_export_gadget_streaming(g1, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	strcpy(ref1, buf);
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g2, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	strcpy(ref2, buf);
+
+	ret = usbg_export_state(s, dstream, format);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	/* Nothing is imported if any gadget already exists */
+	rewind(dstream);
+	ret = usbg_import_state(s, dstream, format, USBG_IMPORT_STATE_ENABLE);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+
+	ret = usbg_disable_gadget(g1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_rm_gadget(g1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	rewind(dstream);
+	ret = usbg_import_state(s, dstream, format, USBG_IMPORT_STATE_ENABLE);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+	assert_null(usbg_get_gadget(s, "g1"));
+
+	ret = usbg_rm_gadget(g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	rewind(dstream);
+	ret = usbg_import_state(s, dstream, format, USBG_IMPORT_STATE_ENABLE);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	g1 = usbg_get_gadget(s, "g1");
+	g2 = usbg_get_gadget(s, "g2");
+	assert_non_null(g1);
+	assert_non_null(g2);
+	assert_true(usbg_get_gadget_udc(g1) == u);
+	assert_null(usbg_get_gadget_udc(g2));
+
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g1, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref1);
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g2, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref2);
+}
+
+/**
+ * @brief Tests export and import of whole state
+ * @details State with one enabled and one disabled gadget is restored
+ * from JSON and binary documents. Document with two gadgets on the same
+ * UDC should be rejected.
+ */
+static void test_state_scheme(void **state)
+{
+	usbg_config_strs c_strs = {
+		.configuration = "ECM",
+	};
+	const char *same_udc =
+		"{\"gadgets\": [{\"name\": \"g3\", \"udc\": \"" SIM_UDC "\"},"
+		" {\"name\": \"g4\", \"udc\": \"" SIM_UDC "\"}]}";
+	usbg_function *f_ecm, *f_ms;
+	usbg_config *c;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g1, *g2;
+	usbg_udc *u;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	init_sim_state(sim, &s);
+	u = usbg_get_udc(s, SIM_UDC);
+	assert_non_null(u);
+
+	ret = usbg_create_gadget(s, "g1", NULL, NULL, &g1);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_set_gadget_vendor_id(g1, 0x1d6b);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g1, F_ECM, "usb0", NULL, &f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_config(g1, 1, "c", NULL, &c_strs, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_add_config_function(c, "ecm.usb0", f_ecm);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_enable_gadget(g1, u);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	ret = usbg_create_gadget(s, "g2", NULL, NULL, &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_create_function(g2, F_MASS_STORAGE, "ms0", NULL, &f_ms);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	check_state_round_trip(s, u, USBG_SCHEME_JSON);
+	check_state_round_trip(s, u, USBG_SCHEME_BIN);
+
+	/* Nothing is created if two gadgets would be bound to one udc */
+	ret = usbg_disable_gadget(usbg_get_gadget(s, "g1"));
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_import_state(s, fmemopen((void *)same_udc, strlen(same_udc),
+					    "r"),
+				USBG_SCHEME_JSON, USBG_IMPORT_STATE_ENABLE);
+	assert_int_equal(ret, USBG_ERROR_BUSY);
+	assert_null(usbg_get_gadget(s, "g3"));
+	assert_null(usbg_get_gadget(s, "g4"));
+
+	ret = usbg_export_state(s, stdout, USBG_SCHEME_FORMAT_MAX);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests compilation of gadget scheme and its replay
+ * @details Gadget created by replaying compiled scheme should be the same
+ * as the one imported from the scheme and enabled on given UDC. If
+ * any operation fails, everything created so far should be removed.
+ * Network functions are not used as their addresses are assigned by
+ * kernel.
+ */
+static void test_scheme_compile(void **state)
+{
+	const char *doc =
+		"{\"attrs\": {\"idVendor\": 7531, \"idProduct\": 260},"
+		" \"strings\": [{\"lang\": 1033, \"product\": \"Bar\"}],"
+		" \"functions\": {\"mass_storage_0\": {\"instance\": \"0\","
+		" \"type\": \"mass_storage\", \"attrs\": {\"stall\": true,"
+		" \"luns\": [{\"removable\": false}, {\"cdrom\": true}]}}},"
+		" \"configs\": [{\"id\": 1, \"name\": \"c\","
+		" \"functions\": [\"mass_storage_0\"]}]}";
+	char ops[4096], bad_ops[4096], buf[4096], ref[4096];
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g, *g2;
+	usbg_udc *u;
+	FILE *ostream, *stream;
+	long len, bad_len;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_sim_add_udc(sim, SIM_UDC);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+	u = usbg_get_udc(s, SIM_UDC);
+	assert_non_null(u);
+
+	/* fclose() is replaced in this suite, so streams are reused */
+	ostream = fmemopen(ops, sizeof(ops), "w+");
+	assert_non_null(ostream);
+	setvbuf(ostream, NULL, _IONBF, 0);
+	memset(buf, 0, sizeof(buf));
+	stream = fmemopen(buf, sizeof(buf) - 1, "w");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+
+	/* List which enables gadget on UDC which is not available */
+	ret = usbg_compile_gadget_scheme(fmemopen((void *)doc, strlen(doc),
+						  "r"), USBG_SCHEME_JSON,
+					 "g1", "sim.udc.1", ostream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	bad_len = ftell(ostream);
+	memcpy(bad_ops, ops, bad_len);
+
+	rewind(ostream);
+	ret = usbg_compile_gadget_scheme(fmemopen((void *)doc, strlen(doc),
+						  "r"), USBG_SCHEME_JSON,
+					 "g1", SIM_UDC, ostream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	len = ftell(ostream);
+	assert_memory_equal(ops, "USBO\1\0", 6);
+	/* Nothing has been created by compilation */
+	assert_null(usbg_get_gadget(s, "g1"));
+
+	ret = usbg_replay_gadget(s, fmemopen(bad_ops, bad_len, "r"), &g);
+	assert_int_not_equal(ret, USBG_SUCCESS);
+	assert_null(usbg_get_gadget(s, "g1"));
+
+	rewind(ostream);
+	ret = usbg_replay_gadget(s, ostream, &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(g == usbg_get_gadget(s, "g1"));
+	assert_true(usbg_get_gadget_udc(g) == u);
+
+	ret = usbg_import_gadget_json(s, fmemopen((void *)doc, strlen(doc),
+						  "r"), "g2", &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_export_gadget_streaming(g2, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	strcpy(ref, buf);
+	assert_non_null(strstr(ref, "cdrom = true;"));
+
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref);
+
+	rewind(ostream);
+	ret = usbg_replay_gadget(s, ostream, NULL);
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+
+	ret = usbg_replay_gadget(s, fmemopen(ops, len - 1, "r"), NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests validation of gadget scheme before import
+ * @details Invalid scheme should be rejected without any modification
+ * of configfs, also when the error is in the last configuration.
+ */
+static void test_validate_gadget_scheme(void **state)
+{
+	const char *head =
+		"{\"attrs\": {\"idVendor\": %d},"
+		" \"functions\": {\"mass_storage_0\": {\"instance\": \"0\","
+		" \"type\": \"mass_storage\"}},"
+		" \"configs\": [{\"id\": 1, \"name\": \"c\","
+		" \"functions\": [\"mass_storage_0\"]}, %s]}";
+	const struct {
+		int vid;
+		const char *config;
+		int ret;
+	} cases[] = {
+		{ 0x1d6b, "{\"id\": 2, \"name\": \"c\","
+		  " \"functions\": [\"mass_storage_0\"]}", USBG_SUCCESS },
+		{ 0x1d6b, "{\"id\": 2, \"name\": \"c\","
+		  " \"functions\": [\"acm_0\"]}", USBG_ERROR_NOT_FOUND },
+		{ 0x1d6b, "{\"id\": 1, \"name\": \"d\"}", USBG_ERROR_EXIST },
+		{ 0x1d6b, "{\"id\": 2, \"name\": \"c\", \"functions\":"
+		  " [\"mass_storage_0\", \"mass_storage_0\"]}",
+		  USBG_ERROR_EXIST },
+		{ 0x1d6b, "{\"id\": 2, \"name\": \"c\", \"functions\":"
+		  " [{\"name\": \"acm.x\", \"function\": \"mass_storage_0\"},"
+		  " {\"function\": {\"instance\": \"x\", \"type\": \"acm\"}}]}",
+		  USBG_ERROR_EXIST },
+		{ 0x1d6b, "{\"id\": 256, \"name\": \"c\"}",
+		  USBG_ERROR_INVALID_VALUE },
+		{ 0x10000, "{\"id\": 2, \"name\": \"c\"}",
+		  USBG_ERROR_INVALID_VALUE },
+	};
+	struct trace_capture cap = {0};
+	char doc[1024];
+	char *long_name;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g;
+	int i, ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+	ret = usbg_set_trace_callback(s, capture_trace, &cap);
+	assert_int_equal(ret, USBG_SUCCESS);
+
+	for (i = 0; i < ARRAY_SIZE(cases); ++i) {
+		snprintf(doc, sizeof(doc), head, cases[i].vid, cases[i].config);
+
+		ret = usbg_validate_gadget_scheme(s, fmemopen(doc, strlen(doc),
+							      "r"),
+						  USBG_SCHEME_JSON, "g1");
+		assert_int_equal(ret, cases[i].ret);
+		assert_int_equal(cap.begin, 0);
+
+		if (cases[i].ret == USBG_SUCCESS)
+			continue;
+
+		ret = usbg_import_gadget_json(s, fmemopen(doc, strlen(doc),
+							  "r"), "g1", NULL);
+		assert_int_equal(ret, cases[i].ret);
+		assert_int_equal(cap.begin, 0);
+		assert_null(usbg_get_gadget(s, "g1"));
+	}
+
+	long_name = malloc(USBG_MAX_PATH_LENGTH + 1);
+	assert_non_null(long_name);
+	memset(long_name, 'g', USBG_MAX_PATH_LENGTH);
+	long_name[USBG_MAX_PATH_LENGTH] = '\0';
+	snprintf(doc, sizeof(doc), head, 1, "{\"id\": 2, \"name\": \"c\"}");
+	ret = usbg_validate_gadget_scheme(s, fmemopen(doc, strlen(doc), "r"),
+					  USBG_SCHEME_JSON, long_name);
+	assert_int_equal(ret, USBG_ERROR_PATH_TOO_LONG);
+	ret = usbg_validate_gadget_scheme(s, fmemopen(doc, strlen(doc), "r"),
+					  USBG_SCHEME_JSON, "../g1");
+	assert_int_equal(ret, USBG_ERROR_INVALID_VALUE);
+	free(long_name);
+
+	ret = usbg_import_gadget_json(s, fmemopen(doc, strlen(doc), "r"),
+				      "g1", &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_not_equal(cap.begin, 0);
+
+	ret = usbg_validate_gadget_scheme(s, fmemopen(doc, strlen(doc), "r"),
+					  USBG_SCHEME_JSON, "g1");
+	assert_int_equal(ret, USBG_ERROR_EXIST);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests export and import of schemes in memory buffers
+ * @details Exported buffer should contain the same document as the one
+ * written to file and it should be imported without any stream.
+ */
+static void test_scheme_buf(void **state)
+{
+	const char *doc =
+		"{\"attrs\": {\"idVendor\": 7531, \"idProduct\": 260},"
+		" \"strings\": [{\"lang\": 1033, \"product\": \"Bar\"}],"
+		" \"functions\": {\"mass_storage_0\": {\"instance\": \"0\","
+		" \"type\": \"mass_storage\", \"attrs\": {\"stall\": true,"
+		" \"luns\": [{\"removable\": false}, {\"cdrom\": true}]}}},"
+		" \"configs\": [{\"id\": 1, \"name\": \"c\","
+		" \"functions\": [\"mass_storage_0\"]}]}";
+	char ref[4096];
+	char *buf, *buf2;
+	size_t len, len2;
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g, *g2;
+	usbg_function *f;
+	usbg_config *c;
+	FILE *stream;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+
+	ret = usbg_import_gadget_buf(s, doc, strlen(doc) - 1, USBG_SCHEME_JSON,
+				     "g1", NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+	ret = usbg_import_gadget_buf(s, doc, strlen(doc),
+				     USBG_SCHEME_FORMAT_MAX, "g1", NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_PARAM);
+
+	ret = usbg_import_gadget_buf(s, doc, strlen(doc), USBG_SCHEME_JSON,
+				     "g1", &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(g == usbg_get_gadget(s, "g1"));
+
+	/* fclose() is replaced in this suite, so stream is reused */
+	memset(ref, 0, sizeof(ref));
+	stream = fmemopen(ref, sizeof(ref) - 1, "w");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+
+	ret = usbg_export_gadget_json(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_export_gadget_buf(g, &buf, &len, USBG_SCHEME_JSON);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(len, strlen(ref));
+	assert_string_equal(buf, ref);
+
+	memset(ref, 0, sizeof(ref));
+	rewind(stream);
+	ret = usbg_export_gadget_streaming(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_export_gadget_buf(g, &buf2, &len2, USBG_SCHEME_LIBCONFIG);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf2, ref);
+	free(buf2);
+
+	/* Gadget imported from binary buffer is exported the same way */
+	ret = usbg_export_gadget_buf(g, &buf2, &len2, USBG_SCHEME_BIN);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_memory_equal(buf2, "USBG", 4);
+	ret = usbg_import_gadget_buf(s, buf2, len2, USBG_SCHEME_BIN, "g2", &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_import_gadget_buf(s, buf2, len2 - 1, USBG_SCHEME_BIN, "g3",
+				     NULL);
+	assert_int_equal(ret, USBG_ERROR_INVALID_FORMAT);
+	free(buf2);
+
+	ret = usbg_export_gadget_buf(g2, &buf2, &len2, USBG_SCHEME_JSON);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_int_equal(len2, len);
+	assert_string_equal(buf2, buf);
+	free(buf2);
+	free(buf);
+
+	f = usbg_get_function(g, F_MASS_STORAGE, "0");
+	assert_non_null(f);
+	ret = usbg_export_function_buf(f, &buf, &len, USBG_SCHEME_BIN);
+	assert_int_equal(ret, USBG_ERROR_NOT_SUPPORTED);
+	ret = usbg_export_function_buf(f, &buf, &len, USBG_SCHEME_JSON);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(strstr(buf, "\"cdrom\": true"));
+	ret = usbg_import_function_buf(g, buf, len, USBG_SCHEME_JSON, "1", &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(f == usbg_get_function(g, F_MASS_STORAGE, "1"));
+	free(buf);
+
+	c = usbg_get_config(g, 1, NULL);
+	assert_non_null(c);
+	ret = usbg_export_config_buf(c, &buf, &len, USBG_SCHEME_JSON);
+	assert_int_equal(ret, USBG_SUCCESS);
+	ret = usbg_import_config_buf(g, buf, len, USBG_SCHEME_BIN, 2, NULL);
+	assert_int_equal(ret, USBG_ERROR_NOT_SUPPORTED);
+	ret = usbg_import_config_buf(g, buf, len, USBG_SCHEME_JSON, 2, &c);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(c == usbg_get_config(g, 2, NULL));
+	free(buf);
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+/**
+ * @brief Tests import of text scheme
+ * @details Exported text scheme should be imported back to the same
+ * gadget. Handwritten scheme with comments, hexadecimal numbers,
+ * concatenated strings and both kinds of separators should be also
+ * accepted. Line of syntax error should be reported.
+ */
+static void test_text_scheme(void **state)
+{
+	const char *doc =
+		"# gadget\n"
+		"attrs : { idVendor = 0x1D6BL; idProduct = 260, };\n"
+		"strings = ( { lang = 0x409; product = \"Bar \" /* x */\n"
+		"  \"Gadget\"; } );\n"
+		"functions = {\n"
+		"  // network\n"
+		"  ecm_usb0 = { instance = \"usb0\"; type = \"ecm\";\n"
+		"    attrs = { qmult = 5; } };\n"
+		"};\n"
+		"configs = ( { id = 2; name = \"c\"; functions = ( \"ecm_usb0\",\n"
+		"  { name = \"ms\"; function = { type = \"mass_storage\";\n"
+		"    instance = \"ms1\"; attrs = { stall = TRUE;\n"
+		"    luns = ( { removable = false; } ); } } } ); } );\n";
+	const char *bad_syntax = "attrs = {\n  idVendor = 1;\n  idProduct = ;\n}";
+	const char *function = "type = \"acm\";\n";
+	char buf[4096], ref[4096];
+	usbg_sim *sim;
+	usbg_state *s;
+	usbg_gadget *g, *g2;
+	usbg_function *f;
+	FILE *stream;
+	int ret;
+
+	ret = usbg_sim_create(SIM_CONFIGFS, &sim);
+	assert_int_equal(ret, USBG_SUCCESS);
+	init_sim_state(sim, &s);
+
+	ret = usbg_import_gadget(s, fmemopen((void *)doc, strlen(doc), "r"),
+				 "g1", &g);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(usbg_get_function(g, F_ECM, "usb0"));
+	assert_non_null(usbg_get_function(g, F_MASS_STORAGE, "ms1"));
+	assert_non_null(usbg_get_config(g, 2, "c"));
+
+	/* fclose() is replaced in this suite, so stream is reused */
+	memset(buf, 0, sizeof(buf));
+	stream = fmemopen(buf, sizeof(buf) - 1, "w+");
+	assert_non_null(stream);
+	setvbuf(stream, NULL, _IONBF, 0);
+
+	ret = usbg_export_gadget(g, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_non_null(strstr(buf, "idVendor = 0x1D6B;"));
+	assert_non_null(strstr(buf, "product = \"Bar Gadget\";"));
+	assert_non_null(strstr(buf, "qmult = 5;"));
+	assert_non_null(strstr(buf, "stall = true;"));
+	strcpy(ref, buf);
+
+	rewind(stream);
+	ret = usbg_import_gadget(s, stream, "g2", &g2);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_null(usbg_get_gadget_import_error_text(s));
+
+	memset(buf, 0, sizeof(buf));
+	rewind(stream);
+	ret = usbg_export_gadget(g2, stream);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_string_equal(buf, ref);
+
+	ret = usbg_import_gadget(s, fmemopen((void *)bad_syntax,
+					     strlen(bad_syntax), "r"),
+				 "g3", NULL);
+	assert_int_not_equal(ret, USBG_SUCCESS);
+	assert_null(usbg_get_gadget(s, "g3"));
+	assert_non_null(usbg_get_gadget_import_error_text(s));
+	assert_int_equal(usbg_get_gadget_import_error_line(s), 3);
+
+	/* Buffer does not have to be terminated */
+	ret = usbg_import_function_buf(g, function, strlen(function),
+				       USBG_SCHEME_LIBCONFIG, "usb1", &f);
+	assert_int_equal(ret, USBG_SUCCESS);
+	assert_true(f == usbg_get_function(g, F_ACM, "usb1"));
+
+	usbg_cleanup(s);
+	usbg_sim_destroy(sim);
+}
+
+static void teardown_state(void **state)
+{
+	usbg_state *s = NULL;
+
+	s = (usbg_state *)(*state);
+	if (s != NULL)
+		usbg_cleanup(s);
+
+	cleanup_stack();
+}
+
+/* Custom macro for defining test with given name and fixed teardown function */
+#define USBG_TEST_TS(name, test, setup) \
+	USBG_TEST(name, test, setup, teardown_state)
+
+/**
+ * @page usbg_tests Tests
+ * @brief This is list of test cases
+ * @tests_start
+ */
+
+#ifndef DOXYGEN
+static UnitTest tests[] = {
+#endif
+
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_simple,
+	 * Check if init was successfull on simple configfs state,
+	 * usbg_init}
+	 */
+	USBG_TEST_TS("test_init_simple",
+		     test_init, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_all_funcs,
+	 * Check if init was successfull when all avaible functions
+	 * are present in configfs,
+	 * usbg_init}
+	 */
+	USBG_TEST_TS("test_init_all_funcs",
+		     test_init, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_with_io_backend,
+	 * Check if init goes through user provided I/O backend,
+	 * usbg_init_with_opts}
+	 */
+	USBG_TEST_TS("test_init_with_io_backend",
+		     test_init_with_io_backend, setup_all_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_long_path,
+	 * Try to initialize libusbg with long configfs path,
+	 * usbg_init}
+	 */
+	USBG_TEST_TS("test_init_long_path",
+		     test_init, setup_long_path_state),
+	/**
 	 * @usbg_test
 	 * @test_desc{test_init_long_udc,
 	 * Try to initialize libusbg with long udc name,
@@ -1628,6 +4329,14 @@ static UnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_init_long_udc",
 		     test_init, setup_long_udc_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_init_relocated_sysfs,
+	 * Check if udcs are found in sysfs given in init options,
+	 * usbg_init_with_opts}
+	 */
+	USBG_TEST_TS("test_init_relocated_sysfs",
+		     test_init, setup_relocated_sysfs_state),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_get_gadget_simple,
@@ -1896,6 +4605,200 @@ static UnitTest tests[] = {
 	 */
 	USBG_TEST_TS("test_get_udc_long",
 		     test_get_udc, setup_long_udc_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_set_function_ms_attrs_delta,
+	 * Check if only changed luns and attributes are written,
+	 * usbg_set_function_attrs}
+	 */
+	USBG_TEST_TS("test_set_function_ms_attrs_delta",
+		     test_set_function_ms_attrs_delta, setup_ms_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_lun_index_build,
+	 * Check if luns are filtered and sorted by their id,
+	 * usbg_lun_index_build}
+	 */
+	unit_test(test_lun_index_build),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_ms_lun_swap_media,
+	 * Check if only file attribute is written when swapping media,
+	 * usbg_ms_lun_swap_media}
+	 */
+	USBG_TEST_TS("test_ms_lun_swap_media",
+		     test_ms_lun_swap_media, setup_ms_funcs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_get_udc_state_simple,
+	 * Check if each state reported by udc is recognized,
+	 * usbg_get_udc_state}
+	 */
+	USBG_TEST_TS("test_get_udc_state_simple",
+		     test_get_udc_state, setup_simple_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_get_udc_state_relocated_sysfs,
+	 * Check if udc state is read from sysfs given in init options,
+	 * usbg_get_udc_state}
+	 */
+	USBG_TEST_TS("test_get_udc_state_relocated_sysfs",
+		     test_get_udc_state, setup_relocated_sysfs_state),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_bind_stats,
+	 * Aggregate bind timings and check histogram percentiles,
+	 * usbg_bind_stats_add}
+	 */
+	unit_test(test_bind_stats),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_sim_create_and_parse,
+	 * Create gadget in configfs simulator and parse it back,
+	 * usbg_sim_create}
+	 */
+	unit_test(test_sim_create_and_parse),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_sim_rules,
+	 * Check if simulator refuses operations refused by configfs,
+	 * usbg_sim_create}
+	 */
+	unit_test(test_sim_rules),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_sim_swap_media_old_kernel,
+	 * Check if forced media swap works without forced_eject attribute,
+	 * usbg_ms_lun_swap_media}
+	 */
+	unit_test(test_sim_swap_media_old_kernel),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_sim_enable_gadget_wait,
+	 * Check if bind phases are reported in order and aggregated,
+	 * usbg_enable_gadget_wait}
+	 */
+	unit_test(test_sim_enable_gadget_wait),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_sim_enable_gadget_wait_fd,
+	 * Check if UDC state is read from descriptor kept open during wait,
+	 * usbg_enable_gadget_wait}
+	 */
+	unit_test(test_sim_enable_gadget_wait_fd),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_stats,
+	 * Check if operations are counted by kind and call site,
+	 * usbg_get_stats}
+	 */
+	unit_test(test_stats),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_log,
+	 * Check if log messages are filtered and passed to callback,
+	 * usbg_set_log_callback}
+	 */
+	unit_test(test_log),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_trace,
+	 * Check if each configfs modification is passed to trace callback,
+	 * usbg_set_trace_callback}
+	 */
+	unit_test(test_trace),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_thread_safe,
+	 * Check if state can be iterated while other thread modifies it
+	 * and if modification under shared lock is refused,
+	 * usbg_read_lock}
+	 */
+	unit_test(test_thread_safe),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_log_threads,
+	 * Check if messages logged from many threads are not lost,
+	 * usbg_set_log_rate_limit}
+	 */
+	unit_test(test_log_threads),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_snapshot,
+	 * Check if snapshot stays unchanged and can be iterated without locks,
+	 * usbg_snapshot_acquire}
+	 */
+	unit_test(test_snapshot),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_process_lock,
+	 * Check if gadget lock excludes other processes,
+	 * usbg_process_lock_gadget}
+	 */
+	unit_test(test_process_lock),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_async,
+	 * Check if asynchronous requests are completed in order by callbacks,
+	 * usbg_async_dispatch}
+	 */
+	unit_test(test_async),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_export_streaming,
+	 * Check if streaming export writes the same text as libconfig,
+	 * usbg_export_gadget_streaming}
+	 */
+	unit_test(test_export_streaming),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_scheme_bin,
+	 * Check if gadget imported from binary scheme matches exported one,
+	 * usbg_export_gadget_bin}
+	 */
+	unit_test(test_scheme_bin),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_json_scheme,
+	 * Check JSON export and import of gadget,
+	 * usbg_import_gadget_json}
+	 */
+	unit_test(test_json_scheme),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_state_scheme,
+	 * Check if all gadgets are restored from exported state,
+	 * usbg_import_state}
+	 */
+	unit_test(test_state_scheme),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_scheme_compile,
+	 * Check if replayed compiled scheme gives the same gadget as import,
+	 * usbg_replay_gadget}
+	 */
+	unit_test(test_scheme_compile),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_validate_gadget_scheme,
+	 * Check if invalid scheme is rejected before configfs is modified,
+	 * usbg_validate_gadget_scheme}
+	 */
+	unit_test(test_validate_gadget_scheme),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_scheme_buf,
+	 * Check if schemes in memory buffers match the ones in files,
+	 * usbg_export_gadget_buf}
+	 */
+	unit_test(test_scheme_buf),
+	/**
+	 * @usbg_test
+	 * @test_desc{test_text_scheme,
+	 * Check if text scheme is imported without any external parser,
+	 * usbg_import_gadget}
+	 */
+	unit_test(test_text_scheme),
 	/**
 	 * @usbg_test
 	 * @test_desc{test_get_gadget_attr_str,
@@ -543,6 +543,7 @@ static struct test_state *dup_test_state(struct test_state *state)
 	 if you would like to free it before test end replace
 	 this code with strdup */
 	new_state->configfs_path = state->configfs_path;
+	new_state->sysfs_path = state->sysfs_path;
 
 	/* path is not being copied because it has not been allocated */
 
@@ -672,18 +673,30 @@ static void push_gadget(struct test_gadget *g)
 		push_config(c);
 }
 
+static const char *test_sysfs_path(struct test_state *state)
+{
+	return state->sysfs_path ? state->sysfs_path : "/sys";
+}
+
 void push_init(struct test_state *state)
 {
 	char **udc;
 	struct test_gadget *g;
+	char *udc_path;
 	int count = 0;
+	int tmp;
 
 	EXPECT_OPENDIR(state->path);
 
+	tmp = asprintf(&udc_path, "%s/class/udc", test_sysfs_path(state));
+	if (tmp < 0)
+		fail();
+	free_later(udc_path);
+
 	for (udc = state->udcs; *udc; udc++)
 		count++;
 
-	PUSH_DIR("/sys/class/udc", count);
+	PUSH_DIR(udc_path, count);
 	for (udc = state->udcs; *udc; udc++)
 		PUSH_DIR_ENTRY(*udc, DT_REG);
 
@@ -779,6 +792,155 @@ void push_gadget_attribute(struct test_gadget *gadget,
 	PUSH_FILE(path, content);
 }
 
+void push_udc_state(struct test_state *ts, const char *udc,
+		const char *state)
+{
+	char *path;
+	char *content;
+	int tmp;
+
+	tmp = asprintf(&path, "%s/class/udc/%s/state", test_sysfs_path(ts),
+		       udc);
+	if (tmp < 0)
+		fail();
+	free_later(path);
+
+	tmp = asprintf(&content, "%s\n", state);
+	if (tmp < 0)
+		fail();
+	free_later(content);
+
+	PUSH_FILE(path, content);
+}
+
+static void push_function_attr(struct test_function *func, const char *attr,
+		const char *content)
+{
+	char *path;
+	int tmp;
+
+	tmp = asprintf(&path, "%s/%s/%s", func->path, func->name, attr);
+	if (tmp < 0)
+		fail();
+	free_later(path);
+
+	PUSH_FILE(path, content);
+}
+
+static void push_ms_lun_attr(struct test_function *func, int lun,
+		const char *attr, const char *value)
+{
+	char *name;
+	char *content;
+	int tmp;
+
+	tmp = asprintf(&name, "lun.%d/%s", lun, attr);
+	if (tmp < 0)
+		fail();
+	free_later(name);
+
+	tmp = asprintf(&content, "%s\n", value);
+	if (tmp < 0)
+		fail();
+	free_later(content);
+
+	push_function_attr(func, name, content);
+}
+
+static void push_ms_luns(struct test_function *func, usbg_f_ms_attrs *attrs)
+{
+	usbg_f_ms_lun_attrs *lun;
+	int i;
+
+	for (i = 0; i < attrs->nluns; ++i) {
+		lun = attrs->luns[i];
+
+		push_ms_lun_attr(func, i, "cdrom", lun->cdrom ? "1" : "0");
+		push_ms_lun_attr(func, i, "ro", lun->ro ? "1" : "0");
+		push_ms_lun_attr(func, i, "nofua", lun->nofua ? "1" : "0");
+		push_ms_lun_attr(func, i, "removable", lun->removable ? "1" : "0");
+		push_ms_lun_attr(func, i, "file", lun->filename);
+	}
+}
+
+void push_ms_lun_dirs(struct test_function *func, int nluns)
+{
+	char *path;
+	char *name;
+	int tmp;
+	int i;
+
+	tmp = asprintf(&path, "%s/%s", func->path, func->name);
+	if (tmp < 0)
+		fail();
+	free_later(path);
+
+	PUSH_DIR(path, nluns);
+	for (i = 0; i < nluns; ++i) {
+		tmp = asprintf(&name, "lun.%d", i);
+		if (tmp < 0)
+			fail();
+		free_later(name);
+		PUSH_DIR_ENTRY(name, DT_DIR);
+	}
+}
+
+void push_ms_attrs(struct test_function *func, usbg_f_ms_attrs *attrs)
+{
+	push_function_attr(func, "stall", attrs->stall ? "1\n" : "0\n");
+	push_ms_lun_dirs(func, attrs->nluns);
+	push_ms_luns(func, attrs);
+}
+
+void push_ms_current_attrs(struct test_function *func, usbg_f_ms_attrs *attrs)
+{
+	push_function_attr(func, "stall", attrs->stall ? "1\n" : "0\n");
+	push_ms_luns(func, attrs);
+}
+
+void push_dir_entries(const char *path, char **names, int *selected)
+{
+	int count = 0;
+	int i;
+
+	while (names[count])
+		count++;
+
+	PUSH_DIR(path, count);
+	for (i = 0; i < count; ++i) {
+		will_return(scandir, names[i]);
+		will_return(scandir, DT_DIR);
+		will_return(scandir, selected[i]);
+	}
+}
+
+void pull_function_attr(struct test_function *func, const char *attr,
+		const char *content)
+{
+	char *path;
+	int tmp;
+
+	tmp = asprintf(&path, "%s/%s/%s", func->path, func->name, attr);
+	if (tmp < 0)
+		fail();
+	free_later(path);
+
+	EXPECT_WRITE(path, content);
+}
+
+void pull_function_dir(struct test_function *func, const char *dir)
+{
+	char *path;
+	int tmp;
+
+	tmp = asprintf(&path, "%s/%s/%s", func->path, func->name, dir);
+	if (tmp < 0)
+		fail();
+	free_later(path);
+
+	EXPECT_MKDIR(path);
+}
+
 void push_gadget_attrs(struct test_gadget *gadget, usbg_gadget_attrs *attrs)
 {
 	int i;
@@ -800,7 +962,13 @@ void init_with_state(struct test_state *in, usbg_state **out)
 	int usbg_ret;
 
 	push_init(in);
-	usbg_ret = usbg_init(in->configfs_path, out);
+	if (in->sysfs_path) {
+		usbg_init_opts opts = {.sysfs_path = in->sysfs_path};
+
+		usbg_ret = usbg_init_with_opts(in->configfs_path, &opts, out);
+	} else {
+		usbg_ret = usbg_init(in->configfs_path, out);
+	}
 	assert_int_equal(usbg_ret, USBG_SUCCESS);
 }
 
@@ -56,6 +56,8 @@ struct test_gadget
 struct test_state
 {
 	char *configfs_path;
+	/* NULL means default "/sys" */
+	char *sysfs_path;
 	/* filled by prepare_state() */
 	char *path;
 	struct test_gadget *gadgets;
@@ -201,6 +203,61 @@ void push_gadget_attribute(struct test_gadget *gadget,
 void pull_gadget_attribute(struct test_gadget *gadget,
 		usbg_gadget_attr attr, int value);
 
+/**
+ * @brief Prepare to read state of given udc by libusbg
+ * @param[in] ts Test state which provides sysfs path
+ * @param[in] udc Name of udc
+ * @param[in] state State string as reported by kernel
+ **/
+void push_udc_state(struct test_state *ts, const char *udc,
+		const char *state);
+
+/**
+ * @brief Prepare fake filesystem to get given mass storage attributes
+ * @param[in] func Test function of mass storage type
+ * @param[in] attrs Attributes which function should have
+ **/
+void push_ms_attrs(struct test_function *func, usbg_f_ms_attrs *attrs);
+
+/**
+ * @brief Prepare fake directory with given entries
+ * @param[in] path Path to directory
+ * @param[in] names Null-terminated list of entries names
+ * @param[in] selected Expected results of scandir filter for each entry
+ **/
+void push_dir_entries(const char *path, char **names, int *selected);
+
+/**
+ * @brief Prepare fake filesystem to compare current mass storage attributes
+ * @details Only stall and attributes of luns are read, luns are not listed.
+ * @param[in] func Test function of mass storage type
+ * @param[in] attrs Attributes which function currently has
+ **/
+void push_ms_current_attrs(struct test_function *func, usbg_f_ms_attrs *attrs);
+
+/**
+ * @brief Prepare fake directory of mass storage function with given luns
+ * @param[in] func Test function of mass storage type
+ * @param[in] nluns Number of luns, named lun.0 to lun.<nluns - 1>
+ **/
+void push_ms_lun_dirs(struct test_function *func, int nluns);
+
+/**
+ * @brief Prepare to write given function attribute by libusbg
+ * @param[in] func Test function related to given attribute
+ * @param[in] attr Attribute path relative to function directory
+ * @param[in] content Expected content written to attribute
+ **/
+void pull_function_attr(struct test_function *func, const char *attr,
+		const char *content);
+
+/**
+ * @brief Prepare to create given directory in function by libusbg
+ * @param[in] func Test function in which directory should be created
+ * @param[in] dir Directory name relative to function directory
+ **/
+void pull_function_dir(struct test_function *func, const char *dir);
+
 /**
  * @brief Prepare fake filesystem to get given gadget attributes
  * @details Prepare queue of values passed to wrapped i/o functions,